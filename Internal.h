@@ -38,10 +38,14 @@
 #import	<Performance/GSLinkedList.h>
 
 @class	WebServer;
+@class	WebServerBodyReader;
+@class	WebServerCompressor;
 @class	WebServerConfig;
 @class	WebServerConnection;
+@class	WebServerHTTP2;
 @class	WebServerRequest;
 @class	WebServerResponse;
+@class	WebServerWebSocket;
 
 /* Class to manage an I/O thread and the connections running on it.
  *
@@ -82,6 +86,55 @@
 @end
 
 
+/* The values of a field in a URL encoded form.  Rather than decoding
+ * every value when the form is parsed, we store the range of each value
+ * in the (immutable) form data and decode it when it is first accessed.
+ * Values added from anywhere else are stored as they are.
+ * This is a concrete NSMutableArray subclass implementing all the
+ * primitive methods (and -initWithCapacity:, without calling the
+ * superclass version) so that every other array method works through
+ * those, decoding only the values it uses.
+ */
+@interface	WebServerFormValues : NSMutableArray
+{
+  NSData	*source;	// The form data
+  NSUInteger	count;
+  NSUInteger	capacity;
+  NSRange	*ranges;	// Encoded values in source
+  id		*values;	// Decoded values (nil until needed)
+}
+- (void) addRange: (NSRange)r;
+- (id) initWithSource: (NSData*)data;
+- (NSData*) source;
+@end
+
+/* The dictionary of handlers in a WebServerBundles instance.  As the
+ * -handlers method returns it for the caller to modify, it notes when a
+ * path is added or removed so that the router can be rebuilt before it
+ * is next used.  The entries are kept in an ordinary dictionary.
+ */
+@interface	WebServerHandlers : NSMutableDictionary
+{
+@public
+  NSMutableDictionary	*dict;
+  BOOL			changed;	// Paths added/removed since routing
+}
+@end
+
+/* An item of work queued in the thread pool when the pool is elastic.
+ * The items are kept in a list in the order they were queued, so the
+ * age of the oldest item still waiting is easily found.
+ */
+@interface	WebServerPoolItem : GSListLink
+{
+@public
+  id			receiver;
+  SEL			selector;
+  id			object;
+  NSTimeInterval	queued;
+}
+@end
+
 /* This class is used to hold configuration information needed by a single
  * connection ... once set up an instance is never modified so it can be
  * shared between threads.  When configuration is modified, it is replaced
@@ -96,14 +149,56 @@
   BOOL			secureProxy;	// using a secure proxy
   BOOL			logRawIO;	// log raw I/O on connection
   BOOL                  foldHeaders;    // Whether long headers are folded
+  BOOL			http2;		// Accept HTTP/2 connections
   NSUInteger		maxBodySize;
   NSUInteger		maxRequestSize;
   NSUInteger		maxConnectionRequests;
   NSTimeInterval	maxConnectionDuration;
   NSSet			*permittedMethods;
+  NSTimeInterval	admissionTarget;	// Zero if not shedding load
+  NSTimeInterval	admissionInterval;
+  NSArray		*admissionExempt;	// Path prefixes never shed
+  NSString		*uploadDirectory;	// Nil unless spooling uploads
+  unsigned long long	maxUploadPartSize;
+  unsigned long long	maxUploadSize;
+  NSUInteger		spoolThreshold;		// Zero unless spooling bodies
+  NSUInteger		maxPipeline;	// Requests processed at once
+  NSUInteger		compressMin;	// Zero unless compressing
+  NSArray		*compressTypes;	// Content types (nil for defaults)
+  BOOL			staticGzip;	// Serve .gz variants of static pages
+  NSString		*gzipCache;	// Directory for built .gz variants
+  BOOL			autoETag;	// Tag delegate responses for 304s
+  NSUInteger		streamBatch;	// Streamed bytes written at once
+  NSTimeInterval	streamDelay;	// Maximum wait for a batch
 }
 @end
 
+/* A processing lane.  Requests are mapped to lanes by path prefix and/or
+ * method, and each lane limits the number of its requests which may be
+ * processed at once and the number which may be waiting to be processed.
+ * The variable state of a lane is protected by the server lock.
+ */
+@interface	WebServerLane : NSObject
+{
+@public
+  NSString		*name;
+  NSArray		*paths;		// Path prefixes (or nil)
+  NSSet			*methods;	// Methods (or nil)
+  NSUInteger		workers;	// Maximum number being processed
+  NSUInteger		queueLimit;	// Maximum number waiting
+  NSUInteger		active;		// Number being processed
+  NSUInteger		reserved;	// Queue places claimed, not yet used
+  NSMutableArray	*waiting;	// Connections waiting in the lane
+  NSUInteger		maxWaiting;
+  NSUInteger		handled;
+  NSUInteger		rejected;
+  NSTimeInterval	totalLatency;
+  NSTimeInterval	maxLatency;
+}
+- (id) initWithName: (NSString*)n config: (NSDictionary*)d;
+- (NSUInteger) match: (NSString*)path method: (NSString*)method;
+@end
+
 @interface	WebServerRequest : GSMimeDocument
 - (NSString*) address;
 @end
@@ -121,11 +216,16 @@
   BOOL                  prepared;	// request/response pair is set up
   BOOL                  foldHeaders;
   BOOL                  completing;
+  WebServerLane		*lane;		// Processing lane (if any)
+  NSTimeInterval	laneStart;	// When lane was assigned
 }
 - (BOOL) completing;
 - (BOOL) foldHeaders;
+- (WebServerLane*) lane;
+- (NSTimeInterval) laneStart;
 - (BOOL) prepared;
 - (void) setFoldHeaders: (BOOL)aFlag;
+- (void) setLane: (WebServerLane*)l;
 - (void) setCompleting;
 - (void) setPrepared;
 - (void) setUserInfo: (NSObject*)info;
@@ -150,30 +250,452 @@ typedef	enum {
 - (id) initWithType: (WSHType)t andObject: (NSObject*)o;
 @end
 
-@interface  WebServerAuthenticationFailure : NSObject
+/* A binary form of a client address for use as a hash table key.
+ * Numeric IPv4 and IPv6 addresses are stored in network byte order,
+ * other text is stored as it is (or as a hash if it is too long).
+ */
+typedef struct	{
+  uint8_t	family;		// AF_INET, AF_INET6, 0 for text, 0xff for hash
+  uint8_t	length;		// Number of bytes used
+  uint8_t	bytes[16];
+} WebServerAddressKey;
+
+extern BOOL
+WebServerAddressKeyFromString(NSString *address, WebServerAddressKey *key);
+
+extern NSUInteger
+WebServerAddressKeyHash(const WebServerAddressKey *key);
+
+/* Returns the (pre-rendered) 429 response sent to a banned client.
+ */
+extern NSData *
+WebServerTooManyRequests(int seconds);
+
+/* Returns the (pre-rendered) 429 response sent to a rate limited client.
+ */
+extern NSData *
+WebServerRateLimited(int seconds);
+
+/* Creates a temporary file in directory (or the default temporary
+ * directory if that is nil) returning the descriptor (-1 on failure)
+ * and setting *path to the path of the new file.
+ */
+extern int
+WebServerTemporaryFile(NSString *directory, NSString **path);
+
+/* Removes any headers whose names are reserved for the server (those
+ * beginning 'x-webserver-') from the parts of a multipart document, as
+ * they can only have come from the client.
+ */
+extern void
+WebServerUntrustedParts(GSMimeDocument *doc);
+
+/* Reads the body of a request (decoding any chunked transfer encoding)
+ * as it arrives, passing the content to a subclass rather than to the
+ * mime parser.  This is used where a body is too large to hold in memory.
+ * The -read:length: method returns the number of bytes used, so any
+ * bytes following the end of the body belong to the next request.
+ * If reading fails, -error returns the HTTP status line to send.
+ * A subclass may limit the amount of content it will accept at a time
+ * (-space), in which case the connection calls -pause and stops reading
+ * until the content has been consumed.
+ */
+@interface	WebServerBodyReader : NSObject
+{
+  WebServerRequest	*request;
+  unsigned long long	remaining;	// Bytes left in body or chunk
+  unsigned long long	total;		// Content bytes read so far
+  int			state;
+  BOOL			complete;
+  NSString		*error;
+}
+- (void) bodyData: (const uint8_t*)bytes length: (NSUInteger)length;
+- (void) bodyEnd;
+- (BOOL) complete;
+/* Called by the connection when it no longer uses the reader.
+ */
+- (void) detach;
+- (NSString*) error;
+- (void) fail: (NSString*)status;
+/* Returns nil if the request has no body.
+ */
+- (id) initWithRequest: (WebServerRequest*)r;
+/* Returns YES if reading should stop until the content is consumed.
+ */
+- (BOOL) pause;
+- (NSUInteger) read: (const uint8_t*)bytes length: (NSUInteger)length;
+/* Returns the number of content bytes which may be passed to -bodyData:
+ */
+- (NSUInteger) space;
+- (unsigned long long) total;
+@end
+
+/* Collects the body of a request for incremental processing in slices
+ * of up to limit bytes.  The delegate takes each slice by calling the
+ * -incrementalDataForRequest: method, and the connection does not read
+ * from the client while a full slice is waiting to be taken.
+ */
+@interface	WebServerIncrementalReader : WebServerBodyReader
+{
+  NSLock		*lock;
+  NSMutableData		*slice;
+  NSUInteger		limit;
+  WebServerConnection	*connection;	// Not retained
+  BOOL			paused;
+}
+- (id) initWithRequest: (WebServerRequest*)r
+	    connection: (WebServerConnection*)c
+		 limit: (NSUInteger)l;
+/* Returns the current slice (nil if it is empty), and resumes reading
+ * if the connection is paused.
+ */
+- (NSData*) take;
+@end
+
+/* Parses a multipart/form-data body as it arrives.  Small parts are kept
+ * in memory, larger ones are written to files in the upload directory
+ * (which are removed when the reader is deallocated).  When the body is
+ * complete the parts are set as the content of the request.
+ */
+@interface	WebServerMultipartReader : WebServerBodyReader
+{
+  NSData		*delimiter;	// CRLF--boundary
+  NSMutableData		*pending;	// Data not yet parsed
+  NSMutableArray	*parts;		// Completed parts
+  NSMutableArray	*files;		// Paths of spool files
+  NSMutableArray	*spooled;	// Parts stored in the files
+  NSString		*directory;
+  GSMimeDocument	*part;		// Part being read
+  NSMutableData		*partData;	// Content held in memory
+  int			partFile;	// Spool file (or -1)
+  unsigned long long	partSize;
+  unsigned long long	maxPartSize;
+  unsigned long long	maxSize;
+  int			mstate;
+}
+- (id) initWithRequest: (WebServerRequest*)r
+	      boundary: (NSString*)b
+	     directory: (NSString*)d
+	   maxPartSize: (unsigned long long)p
+	       maxSize: (unsigned long long)t;
+/* Returns the path of the file a part was stored in (or nil).
+ */
+- (NSString*) fileForPart: (GSMimeDocument*)p;
+@end
+
+/* Writes the body of a request to an unlinked temporary file once it is
+ * larger than the threshold, so that large bodies need not be held in
+ * memory.  When the body is complete it is set as the request content
+ * (as a WebServerMappedData if it was written to file).
+ */
+@interface	WebServerSpoolReader : WebServerBodyReader
+{
+  NSMutableData		*data;		// Content held in memory
+  NSString		*directory;
+  NSUInteger		threshold;
+  unsigned long long	maxSize;
+  int			fd;		// Spool file (or -1)
+}
+- (id) initWithRequest: (WebServerRequest*)r
+	     directory: (NSString*)d
+	     threshold: (NSUInteger)t
+	       maxSize: (unsigned long long)m;
+@end
+
+/* The contents of a file mapped into memory.  The mapping remains valid
+ * after the file is closed (or unlinked).
+ */
+@interface	WebServerMappedData : NSData
+{
+  void			*bytes;
+  NSUInteger		length;
+}
+/* Returns nil if the file can not be mapped, including when it is too
+ * large for the address space (files of 4GB or more on 32-bit systems).
+ */
+- (id) initWithFileDescriptor: (int)fd length: (unsigned long long)l;
+@end
+
+/* Returns YES if the bytes are (or may be the start of) the HTTP/2
+ * client connection preface, which is 24 bytes long.
+ */
+extern BOOL
+WebServerHTTP2Preface(const uint8_t *bytes, NSUInteger length);
+
+/* An HTTP/2 session on a connection (see WebServerHTTP2.m).  The request
+ * on each stream is handled by a follower of the connection, and the
+ * responses are translated into frames for the connection to write.
+ * All methods must be called in the I/O thread of the connection.
+ */
+@interface	WebServerHTTP2 : NSObject
+{
+  WebServerConnection	*connection;	// Not retained
+  WebServer		*server;	// Not retained
+  WebServerConfig	*conf;
+  NSMutableData		*input;		// Data not yet handled
+  NSMutableData		*output;	// Frames waiting to be written
+  NSMutableArray	*streams;	// Open streams in order of creation
+  NSMutableArray	*table;		// HPACK dynamic table
+  NSUInteger		tableSize;
+  NSUInteger		tableMax;
+  NSMutableData		*block;		// Header block being read
+  uint32_t		blockStream;	// Stream of header block (or 0)
+  uint8_t		blockFlags;
+  uint32_t		lastStream;	// Highest stream started by client
+  int64_t		window;		// Connection send window
+  int64_t		initialWindow;	// Initial stream send window
+  uint32_t		frameMax;	// Largest frame the client accepts
+  NSUInteger		buffered;	// Request content held for streams
+  NSTimeInterval	rapidStart;	// Start of period for counts below
+  NSUInteger		opened;		// Streams started by client
+  NSUInteger		resets;		// Streams reset by client
+  BOOL			hadPreface;
+  BOOL			hadSettings;
+  BOOL			oversized;	// Decoded headers were too large
+  BOOL			closing;	// GOAWAY sent or received
+  BOOL			finished;	// No more frames to be handled
+}
+/* Ends the requests on all streams when the connection ends.
+ */
+- (void) abandon;
+- (NSUInteger) active;
+/* Decodes an HPACK header block into an array of name/value pairs,
+ * returning nil if it is not valid.
+ */
+- (NSMutableArray*) decode: (NSData*)data;
+- (BOOL) finished;
+/* Sends whatever the followers have ready.
+ */
+- (void) flush;
+- (id) initWithConnection: (WebServerConnection*)c
+		   server: (WebServer*)svr
+		   config: (WebServerConfig*)config;
+/* Returns the frames waiting to be written (nil if there are none).
+ */
+- (NSData*) output;
+- (void) read: (NSData*)d;
+@end
+
+/* Returns the Sec-WebSocket-Accept value for the Sec-WebSocket-Key sent
+ * by a client.
+ */
+extern NSString *
+WebServerWebSocketAccept(NSString *key);
+
+/* Returns a WebSocket frame holding a message (an NSString is sent as a
+ * text message and NSData as a binary one), or nil if the message is
+ * neither.
+ */
+extern NSData *
+WebServerWebSocketFrame(id message);
+
+/* Returns the content coding (gzip or deflate) to use for a response
+ * given the Accept-Encoding header of the request, or nil if the client
+ * accepts neither.
+ */
+extern NSString *
+WebServerAcceptedEncoding(NSString *accept);
+
+/* A range of bytes (inclusive) requested by a Range header.
+ */
+typedef struct {
+  unsigned long long	from;
+  unsigned long long	to;
+} WebServerByteRange;
+
+#define	WEBSERVER_MAXRANGES	16	// Most ranges sent in one response
+
+/* Parses a Range header for a resource of the given size, storing the
+ * satisfiable ranges (at most WEBSERVER_MAXRANGES) in the array, in
+ * ascending order with any that overlap or are adjacent merged.
+ * Returns the number of ranges stored (zero if none can be satisfied),
+ * or -1 if the header must be ignored because it is invalid, asks for
+ * too many ranges, or has several ranges covering the whole resource.
+ */
+extern int
+WebServerParseRanges(NSString *spec, unsigned long long size,
+  WebServerByteRange *ranges);
+
+/* Returns YES if a content type starts with any of the (lowercase)
+ * prefixes in types, or with one of the default compressible types if
+ * types is nil.
+ */
+extern BOOL
+WebServerCompressibleType(NSString *type, NSArray *types);
+
+/* Adds Accept-Encoding to the Vary header of a response whose coding
+ * depends on what the client accepts.
+ */
+extern void
+WebServerVaryEncoding(GSMimeDocument *response);
+
+/* Returns a weak entity tag for a response body: a 64 bit FNV-1a hash
+ * of the content along with its length.
+ */
+extern NSString *
+WebServerETag(NSData *body);
+
+/* Returns YES if an If-None-Match header value (a comma separated list
+ * of entity tags, or '*') matches etag using the weak comparison.
+ */
+extern BOOL
+WebServerETagMatches(NSString *header, NSString *etag);
+
+/* A zlib deflate stream compressing response data (see
+ * WebServerCompress.m).  A compressor must only be used by one thread
+ * at a time.
+ */
+@interface	WebServerCompressor : NSObject
+{
+  void			*zs;		// The zlib stream
+  BOOL			gzip;		// gzip (rather than zlib) format
+  NSUInteger		bytesIn;	// Bytes compressed since last report
+  NSUInteger		bytesOut;	// Bytes produced since last report
+  NSTimeInterval	spent;		// Time taken since last report
+}
+/* Returns a compressor owned by the current thread, for compressing
+ * whole responses.
+ */
++ (WebServerCompressor*) compressorForThread: (BOOL)gzip;
+/* Compresses data, flushing the output so that the client can use all
+ * of it at once.  If finish is YES the compressed stream is ended and
+ * the compressor is reset ready to compress another response.
+ * Returns nil on failure.
+ */
+- (NSData*) compress: (NSData*)data finish: (BOOL)finish;
+- (id) initWithGzip: (BOOL)flag;
+- (BOOL) isGzip;
+/* Adds the sizes and time since the last report to the server's
+ * compression statistics.
+ */
+- (void) report: (WebServer*)server;
+@end
+
+/* The framing of a WebSocket on a connection (see WebServerWebSocket.m).
+ * All methods must be called in the I/O thread of the connection.
+ */
+@interface	WebServerWebSocket : NSObject
+{
+  NSMutableData		*input;		// Data not yet handled
+  NSMutableData		*output;	// Frames waiting to be written
+  NSMutableData		*message;	// Fragments of the current message
+  uint8_t		type;		// Opcode of the current message
+  NSUInteger		limit;		// Maximum message size
+  BOOL			open;		// Handshake response written
+  BOOL			pinged;		// Ping sent and nothing read since
+  BOOL			closing;	// Close frame sent
+  BOOL			finished;	// Nothing more to be read
+}
+/* Starts the closing handshake.
+ */
+- (void) close;
+- (BOOL) finished;
+- (id) initWithLimit: (NSUInteger)max;
+- (BOOL) open;
+/* Returns the frames waiting to be written (nil if there are none or
+ * the handshake response has not been written).
+ */
+- (NSData*) output;
+/* Queues a ping unless one is outstanding (nothing has been read since
+ * the last one), returning NO if it is.
+ */
+- (BOOL) ping;
+/* Handles data from the client, returning any complete messages.
+ */
+- (NSArray*) read: (NSData*)d;
+- (void) send: (NSData*)frame;
+- (void) setOpen;
+@end
+
+/* A template compiled for fast substitution (see WebServerTemplate.m).
+ * Templates loaded from files are cached by path (up to a limited number
+ * and total size), and the file is checked for changes at most once a
+ * second.
+ */
+@interface	WebServerTemplate : NSObject
+{
+@public
+  NSData		*_bytes;	// UTF-8 text of the template
+  void			*_occurrences;	// Possible substitutions
+  NSUInteger		_count;		// Number of occurrences
+  NSTimeInterval	_checked;	// When file was last checked
+  NSTimeInterval	_modified;	// Modification time of file
+  long			_modifiedNsec;	// Nanoseconds of modification time
+  unsigned long long	_size;		// Size of file
+  unsigned long long	_inode;		// Inode of file
+}
++ (WebServerTemplate*) templateAtPath: (NSString*)path;
+- (id) initWithString: (NSString*)aString;
+- (NSUInteger) length;
+- (BOOL) renderUsing: (NSDictionary*)map
+		into: (NSMutableData*)out
+	       depth: (NSUInteger)depth
+	       limit: (NSUInteger)limit;
+/* Renders into out, streaming the output to the client of the response
+ * whenever at least threshold bytes are ready.  Sets *started to say
+ * whether anything was streamed; if not, the whole output is left in out.
+ * Returns NO only if substitution failed (depth too great).
+ */
+- (BOOL) streamUsing: (NSDictionary*)map
+		into: (NSMutableData*)out
+	       limit: (NSUInteger)limit
+	   threshold: (NSUInteger)threshold
+	      server: (WebServer*)server
+	    response: (WebServerResponse*)response
+	     started: (BOOL*)started;
+@end
+
+/* Token bucket rate limits by client address, optionally restricted to
+ * requests whose path begins with a particular prefix.  The limits are
+ * fixed when the instance is created, so a new instance must be used
+ * when they are changed.
+ */
+@interface	WebServerRateLimiter : NSObject
 {
   @private
-    NSDate          *_date;
-    NSTimeInterval  _banTime;
+    NSDictionary	*_limits;
+    NSArray		*_prefixes;
+    BOOL		_global;
+    NSUInteger		_ruleCount;
+    void		*_rules;
+    void		*_shards;
+    NSTimeInterval	_base;
+    uint64_t		_idle;
+    NSUInteger		_limited;
+    NSUInteger		_overflows;
 }
-+ (id) failureWithBanTime: (NSTimeInterval)banTime;
-- (NSDate*) date;
-- (NSTimeInterval) banTime;
-- (NSDate*) blockUntil;
+- (NSTimeInterval) checkAddress: (NSString*)address path: (NSString*)path;
+- (id) initWithLimits: (NSDictionary*)limits;
+- (NSDictionary*) limits;
+- (NSUInteger) limited;
+- (NSUInteger) overflows;
 @end
 
+/* Records authentication failures and bans by client address.
+ * The most recent failures for each address are kept (up to the
+ * capacity) so the failure count saturates at the capacity; the
+ * capacity must therefore be greater than the maximum retry count.
+ * The -count method returns the number of addresses in the table,
+ * while -failuresRecordedForAddress: returns the number of failures
+ * held for an address (without expiring any).
+ */
 @interface  WebServerAuthenticationFailureLog : NSObject
 {
   @private
     NSTimeInterval       _findTime;
-    NSMutableDictionary  *_failuresByAddress;
-    NSMutableDictionary  *_banUntilByAddress;
-    NSLock               *_lock;
     NSTimeInterval       _cleanupInterval;
     NSTimer              *_cleanupTimer;
+    NSUInteger           _cleanupStripe;
+    NSUInteger           _capacity;
+    void                 *_stripes;
+    void                 *_filter;
+    NSLock               *_filterLock;
 }
+- (NSUInteger) capacity;
+- (NSUInteger) count;
 - (NSTimeInterval) findTime;
 - (NSTimeInterval) cleanupInterval;
+- (void) setCapacity: (NSUInteger)capacity;
 - (void) setFindTime: (NSTimeInterval)findTime;
 - (void) setCleanupInterval: (NSTimeInterval)interval;
 - (void) addFailureForAddress: (NSString*)address
@@ -181,9 +703,13 @@ typedef	enum {
 - (void) removeFailuresForAddress: (NSString*)address;
 - (NSUInteger) failureCountForAddress: (NSString*)address
                            blockUntil: (NSDate**)until;
+- (NSUInteger) failuresRecordedForAddress: (NSString*)address;
 - (void) banAddress: (NSString*)address
               until: (NSDate*)until;
+- (NSTimeInterval) bannedUntil: (NSString*)address;
 - (NSDate*) isBanned: (NSString*)address;
+- (NSTimeInterval) quickBannedUntil: (NSString*)address;
+- (void) cleanup;
 @end
 
 @interface	WebServerConnection : GSListLink
@@ -211,7 +737,7 @@ typedef	enum {
   NSTimeInterval	handshakeRetry;
   NSTimer		*handshakeTimer;
   NSUInteger		requests;
-  NSUInteger		bodyLength;
+  NSData		*unread;	// Body data the reader can't take yet
   BOOL			shouldClose;
   BOOL			hasReset;
   BOOL			simple;
@@ -223,8 +749,29 @@ typedef	enum {
   BOOL			responding;	// Writing to remote system
   BOOL			streaming;	// Need to write more data?
   BOOL                  chunked;        // Stream in chunks?
+  BOOL			streamAbort;	// End stream without terminating it?
   uint32_t              incremental;    // Incremental parsing of request?
+  BOOL			hdrMidLine;	// Header data ends within a line?
+  WebServerBodyReader	*reader;	// Reads body instead of parser
+  BOOL			dispatched;	// Request passed to delegate?
+  BOOL			sliceBusy;	// Delegate handling body slice?
+  BOOL			sliceReady;	// Next slice waiting for delegate?
+  WebServerConnection	*leader;	// Connection a follower belongs to
+  NSMutableArray	*pipeline;	// Followers with queued responses
+  NSMutableData		*pipeOut;	// Response data queued by follower
+  NSUInteger		pipeWritten;	// Followers in current write
+  BOOL			pipeOnly;	// Writing only followers' data?
+  WebServerHTTP2	*h2;		// HTTP/2 session (if any)
+  WebServerWebSocket	*ws;		// WebSocket (if accepted)
+  NSMutableArray	*shared;	// Broadcast data waiting to be written
+  NSUInteger		sharedBytes;	// Length of shared data
+  BOOL			subscribed;	// Response is on a broadcast channel
+  NSMutableArray	*channels;	// Channels the response is on
+  WebServerCompressor	*compressor;	// Compresses streamed response
   NSMutableData         *outBuffer;
+  NSMutableData		*outSpare;	// Written buffer for reuse
+  NSMutableData		*outWriting;	// Streamed buffer being written
+  BOOL			flushPending;	// Delayed stream flush scheduled?
   NSString              *frameOpts;
   NSString              *locAddr;       // local IP address
   NSString              *remAddr;       // remote IP address
@@ -235,7 +782,12 @@ typedef	enum {
 @public
   NSTimeInterval	ticked;
   NSTimeInterval	extended;
+  NSTimeInterval	queued;		// When queued for processing
 }
+/* Sets up a WebSocket to be used once the response to the current
+ * request has been written, returning NO if that's not possible.
+ */
+- (BOOL) acceptWebSocket;
 - (NSString*) address;
 - (NSString*) audit;
 - (void) block: (NSTimeInterval)ti;
@@ -250,6 +802,10 @@ typedef	enum {
 - (void) handshake;
 - (BOOL) hasReset;
 - (NSUInteger) identity;
+/* Initialises a follower of c, which handles a pipelined request
+ * read by c and passes its response to c to be written.
+ */
+- (id) initWithLeader: (WebServerConnection*)c;
 - (id) initWithHandle: (NSFileHandle*)hdl
 	     onThread: (IOThread*)t
 		  for: (WebServer*)svr
@@ -264,6 +820,7 @@ typedef	enum {
 - (GSMimeParser*) parser;
 - (BOOL) processing;
 - (BOOL) quiet;
+- (void) reject: (NSData*)data result: (NSString*)aString;
 - (NSString*) remoteAddress;
 - (NSString*) remotePort;
 - (WebServerRequest*) request;
@@ -288,12 +845,52 @@ typedef	enum {
 - (void) shutdown;
 - (void) start;
 - (BOOL) verbose;
+- (BOOL) webSocket;
 
+- (NSUInteger) _backlog;
+- (NSString*) _compressible: (NSUInteger)length;
+- (void) _compressResponse;
 - (void) _didData: (NSData*)d;
 - (void) _didRead: (NSNotification*)notification;
 - (void) _didWrite: (NSNotification*)notification;
+- (void) _doWrite: (NSData*)d;
+- (void) _etagResponse;
+- (void) _h2Data: (NSData*)d;
+- (void) _h2Write;
+- (NSUInteger) _headerBytes: (NSData*)d;
 - (void) _keepalive;
+- (BOOL) _mayReadBody: (NSString*)method;
+- (WebServerBodyReader*) _newBodyReader;
+- (void) _nextRequest;
+- (void) _pipeCollect: (NSMutableData*)out;
+- (void) _pipeDone: (WebServerConnection*)f;
+- (void) _pipeFlush;
+- (void) _pipelineRequests;
+- (BOOL) _pipeTake: (NSMutableData*)out;
+- (void) _pipeWritten;
+- (void) _readBody: (NSData*)d;
+- (void) _resumeBody;
+- (BOOL) _share: (NSData*)chunk raw: (NSData*)raw;
+- (void) _sliceDispatch;
+- (void) _sliceDone;
+- (void) _streamAbort;
+- (void) _streamAppend: (NSData*)d;
+- (void) _streamEnd: (NSData*)d;
+- (void) _streamFlush: (id)ignored;
+- (void) _streamLater;
+- (void) _streamTimer;
+- (void) _streamWrite;
+- (void) _subscribe: (WebServerChannel*)channel;
 - (void) _timeout: (NSTimer*)t;
+- (void) _unshare;
+- (void) _unsubscribe;
+- (void) _writeShared;
+- (void) _wsData: (NSData*)d;
+- (BOOL) _wsPing;
+- (void) _wsRead;
+- (void) _wsSend: (NSData*)frame;
+- (void) _wsStart;
+- (void) _wsWrite;
 @end
 
 @interface	WebServer (Internal)
@@ -302,24 +899,69 @@ typedef	enum {
 - (void) _blockAddress: (NSString*)address forInterval: (NSTimeInterval)ti;
 - (NSDate*) _blocked: (NSString*)address;
 - (void) _completedResponse: (WebServerResponse*)r duration: (NSTimeInterval)t;
+- (void) _compressed: (NSUInteger)bytesIn
+		  to: (NSUInteger)bytesOut
+	    duration: (NSTimeInterval)t;
 - (BOOL) _connection: (WebServerConnection*)conn
   changedAddressFrom: (NSString*)oldAddress;
+- (WebServerConnection*) _connectionForResponse: (WebServerResponse*)r;
 - (void) _didConnect: (NSNotification*)notification;
+- (void) _dispatch: (WebServerConnection*)connection;
 - (void) _endConnect: (WebServerConnection*)connection;
+- (NSString*) _gzipVariant: (NSString*)path
+		      root: (NSString*)root
+		      type: (NSString*)type
+		       for: (WebServerResponse*)response;
 - (NSString*) _ioThreadDescription;
+- (NSString*) _laneDescription;
+- (void) _laneDone: (WebServerResponse*)response;
+- (void) _laneDispatch: (WebServerConnection*)connection
+		 start: (BOOL)start;
+- (WebServerLane*) _laneFor: (WebServerConnection*)connection
+		       full: (BOOL*)full
+		      start: (BOOL*)start;
 - (uint32_t) _incremental: (WebServerConnection*)connection;
+- (BOOL) _incrementalDelegate;
 - (void) _listen;
 - (void) _log: (NSString*)fmt, ...;
+- (void) _poolCheck: (IOThread*)ioThread;
 - (NSString*) _poolDescription;
 - (void) _process1: (WebServerConnection*)connection;
 - (void) _process2: (WebServerConnection*)connection;
+- (BOOL) _produceRange: (WebServerResponse*)response
+	      fromFile: (NSString*)path
+		  type: (NSString*)type;
+- (void) _queued: (WebServerConnection*)connection;
+- (NSTimeInterval) _rateLimit: (NSString*)address path: (NSString*)path;
+- (void) _rejectBanned: (NSFileHandle*)hdl
+	       address: (NSString*)address
+		 until: (NSTimeInterval)until;
 - (void) _removeConnection: (WebServerConnection*)connection;
+- (void) _runPooled: (WebServerPoolItem*)item;
+- (void) _schedule: (SEL)aSelector
+	onReceiver: (id)receiver
+	withObject: (id)anObject;
+- (void) _setParameters: (NSMutableDictionary*)params
+	     forRequest: (WebServerRequest*)request;
+- (void) _setUploads: (WebServerMultipartReader*)reader
+	  forRequest: (WebServerRequest*)request;
 - (void) _setup;
-- (NSUInteger) _setIncrementalBytes: (const void*)bytes
-                             length: (NSUInteger)length
-                         forRequest: (WebServerRequest*)request;
+- (BOOL) _shed: (WebServerConnection*)connection;
+- (WebServerTemplate*) _templateAtPath: (NSString*)aPath;
+- (void) _webSocket: (WebServerConnection*)connection
+	   received: (NSArray*)messages;
+- (void) _webSocketClosed: (WebServerConnection*)connection;
+- (void) _webSocketDeliver: (NSArray*)a;
+- (void) _setIncrementalReader: (WebServerIncrementalReader*)reader
+		    forRequest: (WebServerRequest*)request;
 - (NSString*) _xCountRequests;
 - (NSString*) _xCountConnections;
 - (NSString*) _xCountConnectedHosts;
 @end
 
+@interface	WebServerChannel (Internal)
+/* Removes the connection from the subscribers (its response has ended).
+ */
+- (void) _unsubscribe: (WebServerConnection*)c;
+@end
+
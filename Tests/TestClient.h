@@ -0,0 +1,184 @@
+/** 
+   Copyright (C) 2026 Free Software Foundation, Inc.
+   
+   Written by:  agent <agent@local>
+   Date:	October 2026
+   
+   This file is part of the WebServer Library.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+   
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+   
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA.
+
+   $Date$ $Revision$
+   */ 
+
+/* Code shared by the tests which run a server and talk to it through a
+ * socket.  Each test is a program of its own, so everything here is
+ * static and the header is simply included by the tests needing it.
+ */
+
+#import	<Foundation/Foundation.h>
+
+#import "WebServer.h"
+
+/* Responds with the static page at the request path.
+ */
+@interface	StaticHandler: NSObject
+- (BOOL) processRequest: (WebServerRequest*)request
+	       response: (WebServerResponse*)response
+		    for: (WebServer*)http;
+@end
+
+@implementation	StaticHandler
+- (BOOL) processRequest: (WebServerRequest*)request
+	       response: (WebServerResponse*)response
+		    for: (WebServer*)http
+{
+  NSString	*path = [[request headerNamed: @"x-http-path"] value];
+
+  [http produceResponse: response fromStaticPage: path using: nil];
+  return YES;
+}
+@end
+
+/* Collects the data read from the server, noting when the server closes
+ * the connection.
+ */
+@interface	Reader: NSObject
+{
+@public
+  NSMutableData	*data;
+  BOOL		done;
+}
+- (void) didRead: (NSNotification*)n;
+@end
+
+@implementation	Reader
+- (void) dealloc
+{
+  RELEASE(data);
+  [super dealloc];
+}
+- (void) didRead: (NSNotification*)n
+{
+  NSData	*d;
+
+  d = [[n userInfo] objectForKey: NSFileHandleNotificationDataItem];
+  if ([d length] > 0)
+    {
+      [data appendData: d];
+      [[n object] readInBackgroundAndNotify];
+    }
+  else
+    {
+      done = YES;
+    }
+}
+- (id) init
+{
+  if (nil != (self = [super init]))
+    {
+      data = [NSMutableData new];
+    }
+  return self;
+}
+@end
+
+/* Runs the run loop (so that the reader gets data) for a while.
+ */
+static inline void
+runFor(NSTimeInterval interval)
+{
+  [[NSRunLoop currentRunLoop] runUntilDate:
+    [NSDate dateWithTimeIntervalSinceNow: interval]];
+}
+
+/* Connects to the server on the local host, sends the request text and
+ * has the reader collect whatever comes back.
+ */
+static inline NSFileHandle *
+connectTo(NSString *service, NSString *request, Reader *r)
+{
+  NSFileHandle	*h;
+
+  h = [NSFileHandle fileHandleAsClientAtAddress: @"127.0.0.1"
+					service: service
+				       protocol: @"tcp"];
+  if (nil == h)
+    {
+      return nil;
+    }
+  [[NSNotificationCenter defaultCenter] addObserver: r
+    selector: @selector(didRead:)
+    name: NSFileHandleReadCompletionNotification
+    object: h];
+  [h writeData: [request dataUsingEncoding: NSASCIIStringEncoding]];
+  [h readInBackgroundAndNotify];
+  return h;
+}
+
+static inline void
+disconnect(NSFileHandle *h, Reader *r)
+{
+  [[NSNotificationCenter defaultCenter] removeObserver: r];
+  [h closeFile];
+}
+
+/* Sends a request (which should ask for the connection to be closed)
+ * and returns the response (as Latin-1 text) once the server has closed
+ * the connection, or after five seconds.
+ */
+static inline NSString *
+exchange(NSString *service, NSString *request)
+{
+  Reader	*r = AUTORELEASE([Reader new]);
+  NSFileHandle	*h;
+  NSDate	*limit;
+
+  if (nil == (h = connectTo(service, request, r)))
+    {
+      return nil;
+    }
+  limit = [NSDate dateWithTimeIntervalSinceNow: 5.0];
+  while (NO == r->done && [limit timeIntervalSinceNow] > 0.0)
+    {
+      runFor(0.1);
+    }
+  disconnect(h, r);
+  return AUTORELEASE([[NSString alloc] initWithData: r->data
+    encoding: NSISOLatin1StringEncoding]);
+}
+
+/* Returns YES if the reader has received the text.
+ */
+static inline BOOL
+received(Reader *r, const char *text)
+{
+  NSData	*d = [NSData dataWithBytes: text length: strlen(text)];
+
+  return ([r->data rangeOfData: d
+		       options: 0
+			 range: NSMakeRange(0, [r->data length])].length > 0)
+    ? YES : NO;
+}
+
+/* Returns YES if the response contains the text (ignoring case).
+ */
+static inline BOOL
+has(NSString *response, NSString *text)
+{
+  return ([response rangeOfString: text
+			  options: NSCaseInsensitiveSearch].length > 0)
+    ? YES : NO;
+}
@@ -116,17 +116,6 @@
 
 @end
 
-@interface WebServerAuthenticationFailureLog (Test)
-- (NSMutableDictionary*) failuresByAddress;
-@end
-
-@implementation WebServerAuthenticationFailureLog (Test)
-- (NSMutableDictionary*) failuresByAddress
-{
-  return _failuresByAddress;
-}
-@end
-
 static NSHTTPURLResponse* post(NSString *user, NSString *password, NSDictionary *body)
 {
   NSURL                      *url;
@@ -223,9 +212,18 @@ main()
   wait(CLEANUP_INTERVAL);
   
   // check that the cleanup method removes the entries
-  count = [[[authFailureLog failuresByAddress] objectForKey: IP_ADDRESS] count];
+  count = [authFailureLog failuresRecordedForAddress: IP_ADDRESS];
   PASS(count == 0, "No entries for IP address");  
 
+  // check that the cleanup method expires failures nobody looked up
+  [authFailureLog addFailureForAddress: IP_ADDRESS banTime: BAN_TIME];
+  count = [authFailureLog failuresRecordedForAddress: IP_ADDRESS];
+  PASS(count == 1, "One entry for IP address");
+  wait(FIND_TIME + CLEANUP_INTERVAL + 0.5);
+  count = [authFailureLog failuresRecordedForAddress: IP_ADDRESS];
+  PASS(count == 0, "Cleanup removed entries for IP address");
+  PASS([authFailureLog count] == 0, "Cleanup removed the address");
+
   END_SET("Test WebServerAuthenticationFailureLog")
 
   START_SET("Set block on authentication failure")
@@ -0,0 +1,286 @@
+/** 
+   Copyright (C) 2026 Free Software Foundation, Inc.
+   
+   Written by:  agent <agent@local>
+   Date:	October 2026
+   
+   This file is part of the WebServer Library.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+   
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+   
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA.
+
+   $Date$ $Revision$
+   */ 
+
+#import	<Foundation/Foundation.h>
+
+#import "Testing.h"
+
+#define WEBSERVERINTERNAL       1
+
+#import "WebServer.h"
+#import "Internal.h"
+
+/* Create a request with the headers of a multipart form upload.
+ */
+static WebServerRequest *
+upload(NSData *body)
+{
+  WebServerRequest	*r = AUTORELEASE([WebServerRequest new]);
+
+  [r setHeader: @"content-type"
+	 value: @"multipart/form-data"
+    parameters: [NSDictionary dictionaryWithObject: @"XyZ"
+					    forKey: @"boundary"]];
+  [r setHeader: @"content-length"
+	 value: [NSString stringWithFormat: @"%lu",
+	   (unsigned long)[body length]]
+    parameters: nil];
+  return r;
+}
+
+/* Feed the body to a reader in pieces of the given size, returning the
+ * number of bytes used.
+ */
+static NSUInteger
+feed(WebServerBodyReader *reader, NSData *body, NSUInteger size)
+{
+  const uint8_t	*b = (const uint8_t*)[body bytes];
+  NSUInteger	length = [body length];
+  NSUInteger	used = 0;
+
+  while (used < length && NO == [reader complete] && nil == [reader error])
+    {
+      NSUInteger	n = length - used;
+
+      if (n > size)
+	{
+	  n = size;
+	}
+      n = [reader read: b + used length: n];
+      if (0 == n)
+	{
+	  break;
+	}
+      used += n;
+    }
+  return used;
+}
+
+int
+main()
+{
+  CREATE_AUTORELEASE_POOL(pool);
+  NSString			*dir = NSTemporaryDirectory();
+  NSMutableData			*body;
+  NSMutableData			*big;
+  WebServerRequest		*r;
+  WebServerMultipartReader	*reader;
+  WebServerIncrementalReader	*inc;
+  WebServerSpoolReader		*spool;
+  GSMimeParser			*parser;
+  NSData			*data;
+  NSArray			*parts;
+  NSString			*path;
+  NSUInteger			used;
+  WebServer			*server;
+
+  START_SET("Multipart uploads")
+
+  body = [NSMutableData data];
+  [body appendData: [@"--XyZ\r\n"
+    @"Content-Disposition: form-data; name=\"a\"\r\n\r\n"
+    @"one\r\n--XyZ\r\n"
+    @"Content-Disposition: form-data; name=\"b\"\r\n\r\n"
+    @"two\r\n--XyZ--\r\n"
+    dataUsingEncoding: NSASCIIStringEncoding]];
+  r = upload(body);
+  [body appendData: [@"GET / HTTP/1.1\r\n"
+    dataUsingEncoding: NSASCIIStringEncoding]];
+  reader = AUTORELEASE([[WebServerMultipartReader alloc]
+    initWithRequest: r boundary: @"XyZ" directory: dir
+    maxPartSize: 0 maxSize: 0]);
+  used = feed(reader, body, 3);
+  PASS(YES == [reader complete] && nil == [reader error],
+    "small form read a few bytes at a time");
+  PASS(used == [body length] - 16, "data after the body is not used");
+  parts = [r content];
+  PASS([parts count] == 2, "form has two parts");
+  PASS_EQUAL([[parts lastObject] content],
+    [@"two" dataUsingEncoding: NSASCIIStringEncoding], "part content ok");
+
+  big = [NSMutableData dataWithLength: 100000];
+  memset([big mutableBytes], 'x', [big length]);
+  body = [NSMutableData data];
+  [body appendData: [@"--XyZ\r\n"
+    @"Content-Disposition: form-data; name=\"f\"; filename=\"f.txt\"\r\n"
+    @"\r\n" dataUsingEncoding: NSASCIIStringEncoding]];
+  [body appendData: big];
+  [body appendData: [@"\r\n--XyZ--\r\n"
+    dataUsingEncoding: NSASCIIStringEncoding]];
+  r = upload(body);
+  reader = [[WebServerMultipartReader alloc]
+    initWithRequest: r boundary: @"XyZ" directory: dir
+    maxPartSize: 0 maxSize: 0];
+  feed(reader, body, 4096);
+  PASS(YES == [reader complete] && nil == [reader error],
+    "large form read");
+  parts = [r content];
+  path = [reader fileForPart: [parts lastObject]];
+  PASS(nil != path, "large part is spooled to a file");
+  PASS(nil == [[parts lastObject] headerNamed: @"x-webserver-file"],
+    "spool file is not named in a header");
+  PASS_EQUAL([NSData dataWithContentsOfFile: path], big,
+    "spooled content ok");
+  server = AUTORELEASE([WebServer new]);
+  [server _setUploads: reader forRequest: r];
+  PASS(nil == [[server parameters: r] objectForKey: @"f"],
+    "spooled part is left out of the parameters");
+  PASS_EQUAL([server fileForPart: [parts lastObject] ofRequest: r], path,
+    "spooled part is found by the server");
+  [server _setUploads: nil forRequest: r];
+  RELEASE(reader);
+  PASS(NO == [[NSFileManager defaultManager] fileExistsAtPath: path],
+    "spool file removed with reader");
+
+  r = upload(body);
+  reader = AUTORELEASE([[WebServerMultipartReader alloc]
+    initWithRequest: r boundary: @"XyZ" directory: dir
+    maxPartSize: 0 maxSize: 1000]);
+  PASS_EQUAL([reader error], @"HTTP/1.0 413 Upload too large",
+    "declared length over limit is rejected");
+
+  r = upload(body);
+  reader = AUTORELEASE([[WebServerMultipartReader alloc]
+    initWithRequest: r boundary: @"XyZ" directory: dir
+    maxPartSize: 50000 maxSize: 0]);
+  feed(reader, body, 4096);
+  PASS_EQUAL([reader error], @"HTTP/1.0 413 Upload part too large",
+    "part over limit is rejected");
+
+  /* With no declared length, the limit must be applied to the data as
+   * it is read (and written to the spool file).
+   */
+  r = upload(body);
+  [r deleteHeaderNamed: @"content-length"];
+  [r setHeader: @"transfer-encoding" value: @"chunked" parameters: nil];
+  big = [NSMutableData data];
+  [big appendData: [[NSString stringWithFormat: @"%lx\r\n",
+    (unsigned long)[body length]] dataUsingEncoding: NSASCIIStringEncoding]];
+  [big appendData: body];
+  [big appendData: [@"\r\n0\r\n\r\n"
+    dataUsingEncoding: NSASCIIStringEncoding]];
+  reader = AUTORELEASE([[WebServerMultipartReader alloc]
+    initWithRequest: r boundary: @"XyZ" directory: dir
+    maxPartSize: 0 maxSize: 70000]);
+  feed(reader, big, 4096);
+  PASS_EQUAL([reader error], @"HTTP/1.0 413 Upload too large",
+    "spooled body over limit is rejected");
+
+  body = [NSMutableData data];
+  [body appendData: [@"--XyZ\r\n"
+    @"Content-Disposition: form-data; name=\"a\"\r\n"
+    @"X-WebServer-File: /etc/passwd\r\n"
+    @"X-WebServer-Size: 1\r\n\r\n"
+    @"one\r\n--XyZ--\r\n"
+    dataUsingEncoding: NSASCIIStringEncoding]];
+  r = upload(body);
+  reader = AUTORELEASE([[WebServerMultipartReader alloc]
+    initWithRequest: r boundary: @"XyZ" directory: dir
+    maxPartSize: 0 maxSize: 0]);
+  feed(reader, body, 4096);
+  parts = [r content];
+  PASS(nil == [reader fileForPart: [parts lastObject]],
+    "forged part is not taken to be in a file");
+  PASS(nil == [[parts lastObject] headerNamed: @"x-webserver-file"],
+    "forged file header is removed");
+  PASS_EQUAL([[[parts lastObject] headerNamed: @"x-webserver-size"] value],
+    @"3", "size header is set by the server");
+  PASS_EQUAL([[parts lastObject] content],
+    [@"one" dataUsingEncoding: NSASCIIStringEncoding],
+    "forged part content is kept in memory");
+
+  END_SET("Multipart uploads")
+
+  START_SET("Multipart forms parsed in memory")
+
+  parser = AUTORELEASE([GSMimeParser new]);
+  [parser parse: [@"Content-Type: multipart/form-data; boundary=XyZ\r\n\r\n"
+    @"--XyZ\r\n"
+    @"Content-Disposition: form-data; name=\"a\"\r\n"
+    @"X-WebServer-File: /etc/passwd\r\n\r\n"
+    @"one\r\n--XyZ--\r\n"
+    dataUsingEncoding: NSASCIIStringEncoding]];
+  [parser parse: nil];
+  parts = [[parser mimeDocument] content];
+  PASS(nil != [[parts lastObject] headerNamed: @"x-webserver-file"],
+    "parser keeps the header sent by the client");
+  WebServerUntrustedParts([parser mimeDocument]);
+  PASS(nil == [[parts lastObject] headerNamed: @"x-webserver-file"],
+    "reserved part headers are removed");
+  PASS(nil != [[parts lastObject] headerNamed: @"content-disposition"],
+    "other part headers are kept");
+
+  END_SET("Multipart forms parsed in memory")
+
+  START_SET("Incremental bodies")
+
+  body = [NSMutableData dataWithLength: 25];
+  memset([body mutableBytes], 'y', [body length]);
+  r = upload(body);
+  inc = AUTORELEASE([[WebServerIncrementalReader alloc]
+    initWithRequest: r connection: nil limit: 10]);
+  PASS([inc read: [body bytes] length: [body length]] == 10,
+    "reader takes no more than one slice");
+  PASS(YES == [inc pause], "reader pauses with a full slice");
+  data = [inc take];
+  PASS([data length] == 10, "slice has the limit size");
+  PASS(nil == [inc take], "slice is empty once taken");
+  PASS([inc read: [body bytes] + 10 length: 15] == 10
+    && [[inc take] length] == 10, "next slice read after taking");
+  PASS([inc read: [body bytes] + 20 length: 5] == 5
+    && YES == [inc complete], "last slice completes the body");
+  PASS(NO == [inc pause] && [[inc take] length] == 5,
+    "last slice may be short");
+  END_SET("Incremental bodies")
+
+  START_SET("Spooled bodies")
+
+  body = [NSMutableData dataWithLength: 100];
+  memset([body mutableBytes], 'z', [body length]);
+  r = upload(body);
+  spool = AUTORELEASE([[WebServerSpoolReader alloc]
+    initWithRequest: r directory: dir threshold: 10 maxSize: 0]);
+  feed(spool, body, 7);
+  PASS(YES == [spool complete] && nil == [spool error], "spooled body read");
+  PASS([[r content] isKindOfClass: [WebServerMappedData class]],
+    "large body is mapped from file");
+  PASS_EQUAL([r content], body, "spooled body content ok");
+
+  r = upload(body);
+  spool = AUTORELEASE([[WebServerSpoolReader alloc]
+    initWithRequest: r directory: dir threshold: 1000 maxSize: 0]);
+  feed(spool, body, 7);
+  PASS_EQUAL([r content], body, "body under threshold kept in memory");
+
+  r = upload(body);
+  spool = AUTORELEASE([[WebServerSpoolReader alloc]
+    initWithRequest: r directory: dir threshold: 10 maxSize: 50]);
+  PASS_EQUAL([spool error], @"HTTP/1.0 413 Request body too long",
+    "body over maximum size is rejected");
+  END_SET("Spooled bodies")
+
+  RELEASE(pool);
+  return 0;
+}
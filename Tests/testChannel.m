@@ -0,0 +1,140 @@
+/** 
+   Copyright (C) 2026 Free Software Foundation, Inc.
+   
+   Written by:  agent <agent@local>
+   Date:	October 2026
+   
+   This file is part of the WebServer Library.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+   
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+   
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA.
+
+   $Date$ $Revision$
+   */ 
+#import	<Foundation/Foundation.h>
+
+#import "Testing.h"
+
+#define WEBSERVERINTERNAL       1
+
+#import "WebServer.h"
+#import "Internal.h"
+#import "TestClient.h"
+
+/* Subscribes every request to the channel, keeping the responses.
+ */
+@interface	Handler: NSObject
+{
+@public
+  WebServerChannel	*channel;
+  NSMutableArray	*responses;
+}
+- (BOOL) processRequest: (WebServerRequest*)request
+	       response: (WebServerResponse*)response
+		    for: (WebServer*)http;
+@end
+
+@implementation	Handler
+- (void) dealloc
+{
+  RELEASE(responses);
+  [super dealloc];
+}
+- (BOOL) processRequest: (WebServerRequest*)request
+	       response: (WebServerResponse*)response
+		    for: (WebServer*)http
+{
+  [responses addObject: response];
+  [channel subscribe: response];
+  return NO;
+}
+@end
+
+/* Connects to the server and requests the event stream.
+ */
+static NSFileHandle *
+openStream(Reader *r)
+{
+  return connectTo(@"8890",
+    @"GET /events HTTP/1.1\r\nHost: localhost\r\n\r\n", r);
+}
+
+int
+main()
+{
+  CREATE_AUTORELEASE_POOL(pool);
+  WebServer		*server;
+  WebServerChannel	*channel;
+  Handler		*handler;
+  Reader		*r1;
+  Reader		*r2;
+  NSFileHandle		*h1;
+  NSFileHandle		*h2;
+
+  server = AUTORELEASE([WebServer new]);
+  channel = AUTORELEASE([[WebServerChannel alloc] initWithServer: server]);
+  handler = AUTORELEASE([Handler new]);
+  handler->channel = channel;
+  handler->responses = [NSMutableArray new];
+  [server setDelegate: handler];
+  [server setPort: @"8890" secure: nil];
+  r1 = AUTORELEASE([Reader new]);
+  r2 = AUTORELEASE([Reader new]);
+
+  START_SET("Channel publish and subscribe")
+
+  PASS(0 == [channel count], "a new channel has no subscribers");
+  PASS(0 == [channel publish: @"nobody" event: nil identifier: nil],
+    "publishing with no subscribers sends to nobody");
+  PASS_EXCEPTION([channel publish: @"x" event: @"a\nb" identifier: nil];,
+    NSInvalidArgumentException, "an event name with a line break fails");
+
+  h1 = openStream(r1);
+  runFor(0.5);
+  h2 = openStream(r2);
+  runFor(0.5);
+  PASS(2 == [channel count], "each request is subscribed");
+  PASS(received(r1, "text/event-stream"), "the event stream is started");
+
+  PASS(2 == [channel publish: @"one\ntwo" event: @"greet" identifier: @"1"],
+    "an event is published to all subscribers");
+  runFor(0.5);
+  PASS(received(r1, "id: 1\nevent: greet\ndata: one\ndata: two\n\n")
+    && received(r2, "id: 1\nevent: greet\ndata: one\ndata: two\n\n"),
+    "the event is received by all subscribers");
+
+  [channel unsubscribe: [handler->responses lastObject]];
+  PASS(1 == [channel count], "an unsubscribed response is removed");
+  PASS(1 == [channel publish: @"three" event: nil identifier: nil],
+    "an event is not published to an unsubscribed response");
+  runFor(0.5);
+  PASS(received(r1, "data: three\n\n") && NO == received(r2, "three"),
+    "the event is received by the remaining subscriber only");
+  [server completedWithResponse: [handler->responses lastObject]];
+
+  [server completedWithResponse: [handler->responses objectAtIndex: 0]];
+  runFor(0.5);
+  PASS(0 == [channel count],
+    "a subscriber is removed when its response is completed");
+  PASS(0 == [channel publish: @"four" event: nil identifier: nil],
+    "an event is not published to a completed response");
+
+  END_SET("Channel publish and subscribe")
+
+  disconnect(h1, r1);
+  disconnect(h2, r2);
+  [server setPort: nil secure: nil];
+  RELEASE(pool);
+  return 0;
+}
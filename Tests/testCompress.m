@@ -0,0 +1,127 @@
+/** 
+   Copyright (C) 2026 Free Software Foundation, Inc.
+   
+   Written by:  agent <agent@local>
+   Date:	October 2026
+   
+   This file is part of the WebServer Library.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+   
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+   
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA.
+
+   $Date$ $Revision$
+   */ 
+
+#import	<Foundation/Foundation.h>
+
+#include <zlib.h>
+
+#import "Testing.h"
+
+#define WEBSERVERINTERNAL       1
+
+#import "WebServer.h"
+#import "Internal.h"
+
+/* Inflate gzip or zlib format data.
+ */
+static NSData *
+inflated(NSData *d, BOOL gzip)
+{
+  NSMutableData	*out = [NSMutableData dataWithLength: 65536];
+  z_stream	s;
+  int		err;
+
+  memset(&s, 0, sizeof(s));
+  inflateInit2(&s, gzip ? 31 : 15);
+  s.next_in = (Bytef*)[d bytes];
+  s.avail_in = [d length];
+  s.next_out = [out mutableBytes];
+  s.avail_out = [out length];
+  err = inflate(&s, Z_SYNC_FLUSH);
+  [out setLength: [out length] - s.avail_out];
+  inflateEnd(&s);
+  return (Z_OK == err || Z_STREAM_END == err) ? out : nil;
+}
+
+int
+main()
+{
+  NSAutoreleasePool	*pool = [NSAutoreleasePool new];
+  WebServerCompressor	*c;
+  NSMutableString	*m;
+  NSData		*d;
+  NSData		*z;
+  NSData		*z1;
+  NSData		*z2;
+  NSMutableData		*all;
+  int			i;
+
+  START_SET("Accept-Encoding")
+
+  PASS_EQUAL(WebServerAcceptedEncoding(@"gzip, deflate, br"), @"gzip",
+    "gzip is preferred");
+  PASS_EQUAL(WebServerAcceptedEncoding(@"deflate, gzip;q=0.5"), @"deflate",
+    "quality values are honoured");
+  PASS_EQUAL(WebServerAcceptedEncoding(@"gzip;q=0, identity"), nil,
+    "refused coding is not used");
+  PASS_EQUAL(WebServerAcceptedEncoding(@"*"), @"gzip",
+    "wildcard accepts gzip");
+  PASS_EQUAL(WebServerAcceptedEncoding(nil), nil,
+    "no header means no compression");
+  PASS(YES == WebServerCompressibleType(@"Text/HTML", nil)
+    && YES == WebServerCompressibleType(@"image/svg+xml", nil),
+    "default compressible types match any case");
+  PASS(NO == WebServerCompressibleType(@"image/png", nil),
+    "images are not compressed by default");
+  PASS(YES == WebServerCompressibleType(@"image/png",
+    [NSArray arrayWithObject: @"image/"]), "configured types are used");
+
+  END_SET("Accept-Encoding")
+
+  START_SET("compression")
+
+  m = [NSMutableString string];
+  for (i = 0; i < 200; i++)
+    {
+      [m appendFormat: @"{\"id\":%d,\"name\":\"item\"},", i];
+    }
+  d = [m dataUsingEncoding: NSUTF8StringEncoding];
+
+  c = [WebServerCompressor compressorForThread: YES];
+  PASS(c == [WebServerCompressor compressorForThread: YES],
+    "compressor is reused by the thread");
+  z = [c compress: d finish: YES];
+  PASS([z length] > 2 && 0x1f == ((uint8_t*)[z bytes])[0]
+    && 0x8b == ((uint8_t*)[z bytes])[1], "output is in gzip format");
+  PASS([z length] * 4 < [d length], "repetitive data is compressed");
+  PASS_EQUAL(inflated(z, YES), d, "gzip output inflates to the input");
+  PASS_EQUAL([c compress: d finish: YES], z, "compressor is reset on finish");
+
+  c = AUTORELEASE([[WebServerCompressor alloc] initWithGzip: NO]);
+  z1 = [c compress: [d subdataWithRange: NSMakeRange(0, 100)] finish: NO];
+  PASS_EQUAL(inflated(z1, NO), [d subdataWithRange: NSMakeRange(0, 100)],
+    "flushed piece of a stream can be inflated at once");
+  z2 = [c compress: [d subdataWithRange: NSMakeRange(100, [d length] - 100)]
+	    finish: NO];
+  all = [NSMutableData dataWithData: z1];
+  [all appendData: z2];
+  [all appendData: [c compress: nil finish: YES]];
+  PASS_EQUAL(inflated(all, NO), d, "streamed deflate output is complete");
+
+  END_SET("compression")
+
+  RELEASE(pool);
+  return 0;
+}
@@ -0,0 +1,77 @@
+/** 
+   Copyright (C) 2026 Free Software Foundation, Inc.
+   
+   Written by:  agent <agent@local>
+   Date:	October 2026
+   
+   This file is part of the WebServer Library.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+   
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+   
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA.
+
+   $Date$ $Revision$
+   */ 
+#import	<Foundation/Foundation.h>
+
+#import "Testing.h"
+
+#define WEBSERVERINTERNAL       1
+
+#import "WebServer.h"
+#import "Internal.h"
+
+int
+main()
+{
+  CREATE_AUTORELEASE_POOL(pool);
+  NSString	*etag;
+
+  START_SET("Entity tags")
+
+  PASS_EQUAL(WebServerETag([NSData data]), @"W/\"cbf29ce484222325-0\"",
+    "empty body has the FNV-1a offset basis");
+  PASS_EQUAL(WebServerETag([NSData dataWithBytes: "a" length: 1]),
+    @"W/\"af63dc4c8601ec8c-1\"", "tag holds the FNV-1a hash and length");
+  PASS(NO == [WebServerETag([NSData dataWithBytes: "ab" length: 2])
+    isEqual: WebServerETag([NSData dataWithBytes: "ba" length: 2])],
+    "different content has a different tag");
+
+  END_SET("Entity tags")
+
+  START_SET("If-None-Match")
+
+  etag = WebServerETag([NSData dataWithBytes: "a" length: 1]);
+  PASS(YES == WebServerETagMatches(@"W/\"af63dc4c8601ec8c-1\"", etag),
+    "identical weak tag matches");
+  PASS(YES == WebServerETagMatches(@"\"af63dc4c8601ec8c-1\"", etag),
+    "strong tag matches using the weak comparison");
+  PASS(YES == WebServerETagMatches(@"*", etag), "wildcard matches");
+  PASS(YES == WebServerETagMatches(
+    @"\"x\", W/\"y\",W/\"af63dc4c8601ec8c-1\"", etag),
+    "tag anywhere in a list matches");
+  PASS(YES == WebServerETagMatches(@"\"a,b\", \"af63dc4c8601ec8c-1\"", etag),
+    "quoted commas do not split the list");
+  PASS(NO == WebServerETagMatches(@"\"x\", W/\"y\"", etag),
+    "list without the tag does not match");
+  PASS(NO == WebServerETagMatches(@"\"af63dc4c8601ec8c-1", etag),
+    "unterminated tag does not match");
+  PASS(NO == WebServerETagMatches(@"af63dc4c8601ec8c-1", etag),
+    "unquoted tag does not match");
+  PASS(NO == WebServerETagMatches(nil, etag), "no header does not match");
+
+  END_SET("If-None-Match")
+
+  RELEASE(pool);
+  return 0;
+}
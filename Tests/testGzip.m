@@ -0,0 +1,142 @@
+/** 
+   Copyright (C) 2026 Free Software Foundation, Inc.
+   
+   Written by:  agent <agent@local>
+   Date:	October 2026
+   
+   This file is part of the WebServer Library.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+   
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+   
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA.
+
+   $Date$ $Revision$
+   */ 
+#import	<Foundation/Foundation.h>
+
+#import "Testing.h"
+
+#define WEBSERVERINTERNAL       1
+
+#import "WebServer.h"
+#import "Internal.h"
+#import "TestClient.h"
+
+/* Requests a page, returning the response.
+ */
+static NSString *
+get(NSString *path, BOOL gzip)
+{
+  return exchange(@"8892", [NSString stringWithFormat:
+    @"GET %@ HTTP/1.1\r\nHost: localhost\r\n%@Connection: close\r\n\r\n",
+    path, (YES == gzip) ? @"Accept-Encoding: gzip\r\n" : @""]);
+}
+
+/* Sets the modification time of a file to some seconds from now.
+ */
+static void
+touch(NSString *path, NSTimeInterval offset)
+{
+  NSDictionary	*a;
+
+  a = [NSDictionary dictionaryWithObject:
+    [NSDate dateWithTimeIntervalSinceNow: offset]
+    forKey: NSFileModificationDate];
+  [[NSFileManager defaultManager] setAttributes: a
+				   ofItemAtPath: path
+					  error: 0];
+}
+
+int
+main()
+{
+  CREATE_AUTORELEASE_POOL(pool);
+  NSFileManager		*mgr = [NSFileManager defaultManager];
+  WebServer		*server;
+  StaticHandler		*handler;
+  NSString		*root;
+  NSString		*cache;
+  NSString		*page;
+  NSString		*s;
+
+  root = [NSTemporaryDirectory()
+    stringByAppendingPathComponent: @"testGzipRoot"];
+  cache = [NSTemporaryDirectory()
+    stringByAppendingPathComponent: @"testGzipCache"];
+  [mgr removeItemAtPath: root error: 0];
+  [mgr removeItemAtPath: cache error: 0];
+  [mgr createDirectoryAtPath: root
+ withIntermediateDirectories: YES
+		  attributes: nil
+		       error: 0];
+  page = [root stringByAppendingPathComponent: @"page.txt"];
+  [@"plain page" writeToFile: page atomically: NO];
+  touch(page, -60.0);
+  /* The server doesn't look inside a variant, so any content will do.
+   */
+  [@"gzipped page" writeToFile: [page stringByAppendingPathExtension: @"gz"]
+		    atomically: NO];
+
+  server = AUTORELEASE([WebServer new]);
+  handler = AUTORELEASE([StaticHandler new]);
+  [server setDelegate: handler];
+  [server setRoot: root];
+  [server setPrecompressedStatic: YES cache: nil];
+  [server setPort: @"8892" secure: nil];
+
+  START_SET("Precompressed static pages")
+
+  s = get(@"/page.txt", YES);
+  PASS(has(s, @"Content-Encoding: gzip") && has(s, @"gzipped page"),
+    "an up to date variant is sent to a client accepting gzip");
+  PASS(has(s, @"Vary: Accept-Encoding"), "the response varies by encoding");
+
+  s = get(@"/page.txt", NO);
+  PASS(NO == has(s, @"Content-Encoding") && has(s, @"plain page"),
+    "the page is sent to a client not accepting gzip");
+  PASS(has(s, @"Vary: Accept-Encoding"),
+    "the response without the variant still varies by encoding");
+
+  touch(page, 0.0);
+  touch([page stringByAppendingPathExtension: @"gz"], -120.0);
+  s = get(@"/page.txt", YES);
+  PASS(NO == has(s, @"Content-Encoding") && has(s, @"plain page"),
+    "a variant older than the page is not used");
+
+  [mgr removeItemAtPath: [page stringByAppendingPathExtension: @"gz"]
+		  error: 0];
+  s = get(@"/page.txt", YES);
+  PASS(NO == has(s, @"Content-Encoding") && has(s, @"plain page"),
+    "the page is sent if there is no variant");
+
+  [server setPrecompressedStatic: YES cache: cache];
+  s = get(@"/page.txt", YES);
+  PASS(has(s, @"Content-Encoding: gzip") && NO == has(s, @"plain page"),
+    "a missing variant is built in the cache");
+  PASS(YES == [mgr fileExistsAtPath:
+    [cache stringByAppendingPathComponent: @"page.txt.gz"]],
+    "the built variant is kept in the cache");
+
+  [server setPrecompressedStatic: NO cache: nil];
+  s = get(@"/page.txt", YES);
+  PASS(NO == has(s, @"Content-Encoding") && NO == has(s, @"Vary"),
+    "variants are not used when turned off");
+
+  END_SET("Precompressed static pages")
+
+  [server setPort: nil secure: nil];
+  [mgr removeItemAtPath: root error: 0];
+  [mgr removeItemAtPath: cache error: 0];
+  RELEASE(pool);
+  return 0;
+}
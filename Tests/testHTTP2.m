@@ -0,0 +1,253 @@
+/** 
+   Copyright (C) 2026 Free Software Foundation, Inc.
+   
+   Written by:  agent <agent@local>
+   Date:	October 2026
+   
+   This file is part of the WebServer Library.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+   
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+   
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA.
+
+   $Date$ $Revision$
+   */ 
+
+#import	<Foundation/Foundation.h>
+
+#import "Testing.h"
+
+#define WEBSERVERINTERNAL       1
+
+#import "WebServer.h"
+#import "Internal.h"
+
+/* Convert a string of hexadecimal digits to data.
+ */
+static NSData *
+hex(const char *s)
+{
+  NSMutableData	*d = [NSMutableData data];
+
+  while (s[0] && s[1])
+    {
+      unsigned	v;
+      uint8_t	b;
+
+      sscanf(s, "%2x", &v);
+      b = (uint8_t)v;
+      [d appendBytes: &b length: 1];
+      s += 2;
+    }
+  return d;
+}
+
+/* Join the decoded header fields as text.
+ */
+static NSString *
+fields(NSArray *list)
+{
+  NSMutableString	*m = [NSMutableString string];
+  NSEnumerator		*e = [list objectEnumerator];
+  NSArray		*f;
+
+  while (nil != (f = [e nextObject]))
+    {
+      [m appendFormat: @"%@: %@\n", [f objectAtIndex: 0], [f objectAtIndex: 1]];
+    }
+  return m;
+}
+
+/* Returns a frame of the given type for a stream, with the payload given
+ * in hexadecimal.
+ */
+static NSData *
+frame(uint8_t type, uint8_t flags, uint32_t sid, const char *payload)
+{
+  NSData	*p = hex(payload);
+  NSMutableData	*d = [NSMutableData dataWithCapacity: 9 + [p length]];
+  uint8_t	b[9];
+
+  b[0] = (uint8_t)([p length] >> 16);
+  b[1] = (uint8_t)([p length] >> 8);
+  b[2] = (uint8_t)[p length];
+  b[3] = type;
+  b[4] = flags;
+  b[5] = (uint8_t)(sid >> 24);
+  b[6] = (uint8_t)(sid >> 16);
+  b[7] = (uint8_t)(sid >> 8);
+  b[8] = (uint8_t)sid;
+  [d appendBytes: b length: 9];
+  [d appendData: p];
+  return d;
+}
+
+/* Returns a session which has exchanged settings with the client.
+ */
+static WebServerHTTP2 *
+session(WebServerConfig *conf)
+{
+  WebServerHTTP2	*h2;
+
+  h2 = AUTORELEASE([[WebServerHTTP2 alloc] initWithConnection: nil
+						       server: nil
+						       config: conf]);
+  [h2 read: hex("505249202a20485454502f322e300d0a0d0a534d0d0a0d0a"
+    "000000040000000000")];
+  [h2 output];
+  return h2;
+}
+
+/* GET / from localhost (without using the dynamic table).
+ */
+#define	GET	"82868401096c6f63616c686f7374"
+
+static BOOL
+contains(NSData *d, NSData *part)
+{
+  return ([d rangeOfData: part options: 0 range: NSMakeRange(0, [d length])]
+    .length > 0) ? YES : NO;
+}
+
+int
+main()
+{
+  CREATE_AUTORELEASE_POOL(pool);
+  WebServerConfig	*conf = AUTORELEASE([WebServerConfig new]);
+  WebServerHTTP2	*h2;
+  NSMutableData		*d;
+  NSData		*o;
+  uint32_t		i;
+
+  START_SET("HTTP/2 header compression")
+
+  /* The requests with Huffman coding from RFC 7541 appendix C.4, which
+   * share the dynamic table.
+   */
+  h2 = AUTORELEASE([[WebServerHTTP2 alloc] initWithConnection: nil
+						       server: nil
+						       config: conf]);
+  PASS_EQUAL(fields([h2 decode: hex("828684418cf1e3c2e5f23a6ba0ab90f4ff")]),
+    @":method: GET\n:scheme: http\n:path: /\n"
+    @":authority: www.example.com\n",
+    "first request is decoded");
+  PASS_EQUAL(fields([h2 decode: hex("828684be5886a8eb10649cbf")]),
+    @":method: GET\n:scheme: http\n:path: /\n"
+    @":authority: www.example.com\ncache-control: no-cache\n",
+    "second request uses the dynamic table");
+  PASS_EQUAL(fields([h2 decode:
+    hex("828785bf408825a849e95ba97d7f8925a849e95bb8e8b4bf")]),
+    @":method: GET\n:scheme: https\n:path: /index.html\n"
+    @":authority: www.example.com\ncustom-key: custom-value\n",
+    "third request uses the dynamic table");
+
+  PASS(nil == [h2 decode: hex("80")], "index zero is an error");
+  PASS(nil == [h2 decode: hex("ff00")], "index beyond the table is an error");
+  PASS(nil == [h2 decode: hex("0082f1ff")], "bad Huffman padding is an error");
+  PASS(nil == [h2 decode: hex("3fe21f")], "table size above limit is an error");
+
+  END_SET("HTTP/2 header compression")
+
+  START_SET("HTTP/2 frames")
+
+  h2 = AUTORELEASE([[WebServerHTTP2 alloc] initWithConnection: nil
+						       server: nil
+						       config: conf]);
+  d = [NSMutableData dataWithBytes: "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+			    length: 24];
+  PASS(YES == WebServerHTTP2Preface([d bytes], 10), "partial preface");
+  PASS(NO == WebServerHTTP2Preface((const uint8_t*)"POST / HTTP/1.1", 15),
+    "request is not a preface");
+  [d appendData: hex("000000040000000000")];
+  [d appendData: hex("0000080600000000000102030405060708")];
+  [h2 read: [d subdataWithRange: NSMakeRange(0, 30)]];
+  [h2 read: [d subdataWithRange: NSMakeRange(30, [d length] - 30)]];
+  PASS_EQUAL([h2 output],
+    hex("000006040000000000000300000064"
+      "000000040100000000"
+      "0000080601000000000102030405060708"),
+    "settings are sent and acknowledged and ping is answered");
+  PASS(NO == [h2 finished], "session continues");
+
+  [h2 read: hex("00000408000000000000000000")];
+  PASS_EQUAL([h2 output], hex("0000080700000000000000000000000001"),
+    "bad window update is a connection error");
+  PASS(YES == [h2 finished], "session is finished");
+
+  h2 = AUTORELEASE([[WebServerHTTP2 alloc] initWithConnection: nil
+						       server: nil
+						       config: conf]);
+  [h2 output];
+  [h2 read: hex("505249202a20485454502f322e300d0a0d0a534d0d0a0d0a"
+    "0000080600000000000102030405060708")];
+  PASS_EQUAL([h2 output], hex("0000080700000000000000000000000001"),
+    "client must send settings first");
+
+  END_SET("HTTP/2 frames")
+
+  START_SET("HTTP/2 limits")
+
+  h2 = session(conf);
+  d = [NSMutableData data];
+  for (i = 1; i <= 2 * 100 + 1; i += 2)
+    {
+      [d appendData: frame(1, 0x04, i, GET)];
+      [d appendData: frame(3, 0, i, "00000008")];
+    }
+  [h2 read: d];
+  o = [h2 output];
+  PASS_EQUAL([o subdataWithRange: NSMakeRange([o length] - 17, 17)],
+    hex("000008070000000000000000c90000000b"),
+    "too many streams reset by the client is a connection error");
+  PASS(YES == [h2 finished], "session is finished");
+
+  h2 = session(conf);
+  d = [NSMutableData data];
+  for (i = 1; i <= 2 * 1000 + 1; i += 2)
+    {
+      [d appendData: frame(1, 0x04, i, GET)];
+    }
+  [h2 read: d];
+  o = [h2 output];
+  PASS(YES == contains(o, hex("0000040300000000c900000007")),
+    "streams over the concurrent limit are refused");
+  PASS_EQUAL([o subdataWithRange: NSMakeRange([o length] - 17, 17)],
+    hex("000008070000000000000007d10000000b"),
+    "too many streams started by the client is a connection error");
+
+  conf->maxBodySize = 16;
+  h2 = session(conf);
+  [h2 read: frame(1, 0x04, 1, GET)];
+  [h2 read: frame(0, 0, 1, "00010203040506070809")];
+  [h2 read: frame(1, 0x04, 3, GET)];
+  [h2 read: frame(0, 0, 3, "00010203040506070809")];
+  o = [h2 output];
+  PASS(YES == contains(o, hex("00000403000000000300000007")),
+    "content buffered for all streams is limited");
+  [h2 read: frame(0, 0, 1, "00010203040506070809")];
+  o = [h2 output];
+  PASS(YES == contains(o, hex("00000403000000000100000000")),
+    "content buffered for a stream is limited");
+  [h2 read: frame(1, 0x04, 5, GET)];
+  [h2 read: frame(0, 0, 5, "00010203040506070809")];
+  o = [h2 output];
+  PASS(NO == contains(o, hex("00000403000000000500000007")),
+    "content of a refused stream is no longer counted");
+  PASS(NO == [h2 finished], "session continues");
+  conf->maxBodySize = 0;
+
+  END_SET("HTTP/2 limits")
+
+  RELEASE(pool);
+  return 0;
+}
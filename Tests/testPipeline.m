@@ -0,0 +1,153 @@
+/** 
+   Copyright (C) 2026 Free Software Foundation, Inc.
+   
+   Written by:  agent <agent@local>
+   Date:	October 2026
+   
+   This file is part of the WebServer Library.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+   
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+   
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA.
+
+   $Date$ $Revision$
+   */ 
+#import	<Foundation/Foundation.h>
+
+#import "Testing.h"
+
+#define WEBSERVERINTERNAL       1
+
+#import "WebServer.h"
+#import "Internal.h"
+#import "TestClient.h"
+
+/* Responds with the request path, taking a while over any path starting
+ * with /slow so that requests complete out of order.
+ */
+@interface	Handler: NSObject
+- (BOOL) preProcessRequest: (WebServerRequest*)request
+		  response: (WebServerResponse*)response
+		       for: (WebServer*)http;
+@end
+
+@implementation	Handler
+- (BOOL) preProcessRequest: (WebServerRequest*)request
+		  response: (WebServerResponse*)response
+		       for: (WebServer*)http
+{
+  NSString	*path = [[request headerNamed: @"x-http-path"] value];
+
+  if ([path hasPrefix: @"/slow"])
+    {
+      [NSThread sleepForTimeInterval: 0.5];
+    }
+  [response setHeader: @"http"
+		value: @"HTTP/1.1 200 OK"
+	   parameters: nil];
+  [response setContent: [NSString stringWithFormat: @"<%@>", path]
+		  type: @"text/plain"];
+  return YES;
+}
+@end
+
+/* Sends the requests for the paths in a single write, then returns the
+ * paths in the order their responses were received.
+ */
+static NSArray *
+pipelined(NSArray *paths)
+{
+  NSMutableString	*out = [NSMutableString string];
+  NSMutableArray	*order = [NSMutableArray array];
+  Reader		*r = AUTORELEASE([Reader new]);
+  NSFileHandle		*h;
+  NSString		*s;
+  NSDate		*limit;
+  NSUInteger		i;
+
+  for (i = 0; i < [paths count]; i++)
+    {
+      [out appendFormat: @"GET %@ HTTP/1.1\r\nHost: localhost\r\n\r\n",
+	[paths objectAtIndex: i]];
+    }
+  if (nil == (h = connectTo(@"8889", out, r)))
+    {
+      return nil;
+    }
+
+  limit = [NSDate dateWithTimeIntervalSinceNow: 5.0];
+  s = nil;
+  while ([limit timeIntervalSinceNow] > 0.0)
+    {
+      runFor(0.1);
+      s = AUTORELEASE([[NSString alloc] initWithData: r->data
+	encoding: NSASCIIStringEncoding]);
+      if ([[s componentsSeparatedByString: @"HTTP/1.1 200"] count]
+	> [paths count])
+	{
+	  break;
+	}
+    }
+  disconnect(h, r);
+
+  while ([s length] > 0)
+    {
+      NSRange	o = [s rangeOfString: @"<"];
+      NSRange	c = [s rangeOfString: @">"];
+
+      if (0 == o.length || 0 == c.length || c.location < o.location)
+	{
+	  break;
+	}
+      [order addObject: [s substringWithRange:
+	NSMakeRange(NSMaxRange(o), c.location - NSMaxRange(o))]];
+      s = [s substringFromIndex: NSMaxRange(c)];
+    }
+  return order;
+}
+
+int
+main()
+{
+  CREATE_AUTORELEASE_POOL(pool);
+  WebServer		*server;
+  Handler		*handler;
+  NSArray		*paths;
+
+  server = AUTORELEASE([WebServer new]);
+  handler = AUTORELEASE([Handler new]);
+  [server setDelegate: handler];
+  [server setIOThreads: 1 andPool: 4];
+  [server setMaxPipeline: 4];
+  [server setPort: @"8889" secure: nil];
+
+  START_SET("Pipelined responses")
+
+  paths = [NSArray arrayWithObjects: @"/slow", @"/a", @"/b", nil];
+  PASS_EQUAL(pipelined(paths), paths,
+    "responses ready before the first are written after it in order");
+
+  paths = [NSArray arrayWithObjects: @"/a", @"/slow", @"/b", @"/c", nil];
+  PASS_EQUAL(pipelined(paths), paths,
+    "a slow pipelined request holds back the responses after it");
+
+  paths = [NSArray arrayWithObjects: @"/a", @"/b", @"/c", @"/d", @"/e", nil];
+  PASS_EQUAL(pipelined(paths), paths,
+    "requests beyond the pipeline limit are answered in order");
+
+  END_SET("Pipelined responses")
+
+  [server setPort: nil secure: nil];
+  RELEASE(pool);
+  return 0;
+}
@@ -0,0 +1,166 @@
+/** 
+   Copyright (C) 2026 Free Software Foundation, Inc.
+   
+   Written by:  agent <agent@local>
+   Date:	October 2026
+   
+   This file is part of the WebServer Library.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+   
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+   
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA.
+
+   $Date$ $Revision$
+   */ 
+
+#import	<Foundation/Foundation.h>
+
+#import "Testing.h"
+
+#define WEBSERVERINTERNAL       1
+
+#import "WebServer.h"
+#import "Internal.h"
+#import "TestClient.h"
+
+/* Requests the page with a Range header, returning the response.
+ */
+static NSString *
+get(NSString *range)
+{
+  return exchange(@"8893", [NSString stringWithFormat:
+    @"GET /page.txt HTTP/1.1\r\nHost: localhost\r\nRange: %@\r\n"
+    @"Connection: close\r\n\r\n", range]);
+}
+
+/* Returns the body of a response.
+ */
+static NSString *
+body(NSString *response)
+{
+  NSRange	r = [response rangeOfString: @"\r\n\r\n"];
+
+  if (0 == r.length)
+    {
+      return nil;
+    }
+  return [response substringFromIndex: NSMaxRange(r)];
+}
+
+int
+main()
+{
+  NSAutoreleasePool	*pool = [NSAutoreleasePool new];
+  NSFileManager		*mgr = [NSFileManager defaultManager];
+  WebServerByteRange	r[WEBSERVER_MAXRANGES];
+  NSMutableString	*m;
+  WebServer		*server;
+  StaticHandler		*handler;
+  NSString		*root;
+  NSString		*s;
+  int			i;
+
+  START_SET("Range header")
+
+  PASS(1 == WebServerParseRanges(@"bytes=0-499", 1000, r)
+    && 0 == r[0].from && 499 == r[0].to, "simple range is parsed");
+  PASS(1 == WebServerParseRanges(@"bytes=500-", 1000, r)
+    && 500 == r[0].from && 999 == r[0].to, "open range runs to the end");
+  PASS(1 == WebServerParseRanges(@"bytes=-200", 1000, r)
+    && 800 == r[0].from && 999 == r[0].to, "suffix range is the last bytes");
+  PASS(1 == WebServerParseRanges(@"bytes=990-5000", 1000, r)
+    && 999 == r[0].to, "range is clipped to the size");
+  PASS(3 == WebServerParseRanges(@"bytes=0-0, 10-20 ,-1", 1000, r)
+    && 10 == r[1].from && 20 == r[1].to && 999 == r[2].from,
+    "multiple ranges are parsed");
+  PASS(0 == WebServerParseRanges(@"bytes=1000-", 1000, r),
+    "range beyond the end is unsatisfiable");
+  PASS(-1 == WebServerParseRanges(@"bytes=5-2", 1000, r),
+    "reversed range is invalid");
+  PASS(-1 == WebServerParseRanges(@"items=0-1", 1000, r),
+    "unknown unit is ignored");
+
+  m = [NSMutableString stringWithString: @"bytes=0-0"];
+  for (i = 1; i <= WEBSERVER_MAXRANGES; i++)
+    {
+      [m appendFormat: @",%d-%d", i, i];
+    }
+  PASS(-1 == WebServerParseRanges(m, 1000, r), "too many ranges are ignored");
+
+  PASS(2 == WebServerParseRanges(@"bytes=500-599,0-9", 1000, r)
+    && 0 == r[0].from && 500 == r[1].from, "ranges are put in order");
+  PASS(1 == WebServerParseRanges(@"bytes=0-99,50-149,150-199", 1000, r)
+    && 0 == r[0].from && 199 == r[0].to,
+    "overlapping and adjacent ranges are merged");
+  PASS(2 == WebServerParseRanges(@"bytes=10-19,0-99,200-299,250-", 1000, r)
+    && 0 == r[0].from && 99 == r[0].to && 200 == r[1].from
+    && 999 == r[1].to, "contained ranges are merged");
+  PASS(-1 == WebServerParseRanges(@"bytes=0-,0-,0-,0-", 1000, r),
+    "ranges covering the whole resource are ignored");
+  PASS(1 == WebServerParseRanges(@"bytes=0-", 1000, r),
+    "a single range may cover the whole resource");
+
+  END_SET("Range header")
+
+  root = [NSTemporaryDirectory()
+    stringByAppendingPathComponent: @"testRangeRoot"];
+  [mgr createDirectoryAtPath: root
+ withIntermediateDirectories: YES
+		  attributes: nil
+		       error: 0];
+  [@"abcdefghijklmnopqrstuvwxyz"
+    writeToFile: [root stringByAppendingPathComponent: @"page.txt"]
+     atomically: NO];
+  server = AUTORELEASE([WebServer new]);
+  handler = AUTORELEASE([StaticHandler new]);
+  [server setDelegate: handler];
+  [server setRoot: root];
+  [server setPort: @"8893" secure: nil];
+
+  START_SET("Range responses")
+
+  s = get(@"bytes=2-5");
+  PASS(has(s, @"HTTP/1.1 206") && has(s, @"Content-Range: bytes 2-5/26")
+    && [body(s) isEqualToString: @"cdef"], "a single range is sent");
+
+  s = get(@"bytes=0-2,3-5");
+  PASS(has(s, @"HTTP/1.1 206") && has(s, @"Content-Range: bytes 0-5/26")
+    && [body(s) isEqualToString: @"abcdef"],
+    "adjacent ranges are sent as one");
+
+  s = get(@"bytes=0-1,-2");
+  PASS(has(s, @"HTTP/1.1 206") && has(s, @"multipart/byteranges"),
+    "several ranges are sent as multipart/byteranges");
+  PASS(has(s, @"Content-Range: bytes 0-1/26")
+    && has(s, @"Content-Range: bytes 24-25/26"),
+    "each part says which range it holds");
+  PASS(has(s, @"\r\n\r\nab\r\n") && has(s, @"\r\n\r\nyz\r\n"),
+    "each part holds its range");
+
+  s = get(@"bytes=0-20,10-,0-");
+  PASS(has(s, @"HTTP/1.1 200")
+    && [body(s) isEqualToString: @"abcdefghijklmnopqrstuvwxyz"],
+    "ranges covering the whole file get the whole file");
+
+  s = get(@"bytes=30-");
+  PASS(has(s, @"HTTP/1.1 416") && has(s, @"Content-Range: bytes */26"),
+    "an unsatisfiable range is refused");
+
+  END_SET("Range responses")
+
+  [server setPort: nil secure: nil];
+  [mgr removeItemAtPath: root error: 0];
+
+  RELEASE(pool);
+  return 0;
+}
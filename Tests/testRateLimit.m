@@ -0,0 +1,84 @@
+/** 
+   Copyright (C) 2026 Free Software Foundation, Inc.
+   
+   Written by:  agent <agent@local>
+   Date:	October 2026
+   
+   This file is part of the WebServer Library.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+   
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+   
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA.
+
+   $Date$ $Revision$
+   */ 
+
+#import	<Foundation/Foundation.h>
+
+#import "Testing.h"
+
+#define WEBSERVERINTERNAL       1
+
+#import "WebServer.h"
+#import "Internal.h"
+
+#define	LIMIT(R, B) [NSDictionary dictionaryWithObjectsAndKeys: \
+  [NSNumber numberWithDouble: (R)], @"Rate", \
+  [NSNumber numberWithInt: (B)], @"Burst", nil]
+
+int
+main()
+{
+  CREATE_AUTORELEASE_POOL(pool);
+  WebServerRateLimiter	*limiter;
+  NSDictionary		*limits;
+  NSTimeInterval	wait;
+  int			i;
+
+  START_SET("Token bucket rate limits")
+
+  limits = [NSDictionary dictionaryWithObjectsAndKeys:
+    LIMIT(1.0, 5), @"",
+    LIMIT(1.0, 2), @"/login",
+    nil];
+  limiter = AUTORELEASE([[WebServerRateLimiter alloc] initWithLimits: limits]);
+
+  PASS(0.0 == [limiter checkAddress: @"1.2.3.4" path: @"/login"]
+    && 0.0 == [limiter checkAddress: @"1.2.3.4" path: @"/login/x"],
+    "requests within the burst for a prefix are allowed");
+  wait = [limiter checkAddress: @"1.2.3.4" path: @"/login"];
+  PASS(wait > 0.0 && wait <= 1.0, "request over the prefix limit must wait");
+  PASS(0.0 == [limiter checkAddress: @"1.2.3.5" path: @"/login"],
+    "limits are kept separately for each address");
+
+  for (i = 0; i < 2; i++)
+    {
+      [limiter checkAddress: @"1.2.3.4" path: @"/other"];
+    }
+  PASS([limiter checkAddress: @"1.2.3.4" path: @"/other"] > 0.0,
+    "limit for the empty prefix applies to all paths");
+  PASS([limiter limited] == 2, "rejected requests are counted");
+
+  [NSThread sleepForTimeInterval: 1.1];
+  PASS(0.0 == [limiter checkAddress: @"1.2.3.4" path: @"/other"],
+    "tokens are refilled over time");
+
+  PASS_EXCEPTION([[WebServerRateLimiter alloc] initWithLimits:
+    [NSDictionary dictionaryWithObject: LIMIT(0.0, 1) forKey: @"/"]];,
+    NSInvalidArgumentException, "a zero rate is rejected");
+
+  END_SET("Token bucket rate limits")
+
+  RELEASE(pool);
+  return 0;
+}
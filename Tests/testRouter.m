@@ -0,0 +1,106 @@
+/** 
+   Copyright (C) 2026 Free Software Foundation, Inc.
+   
+   Written by:  agent <agent@local>
+   Date:	October 2026
+   
+   This file is part of the WebServer Library.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+   
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+   
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA.
+
+   $Date$ $Revision$
+   */ 
+
+#import	<Foundation/Foundation.h>
+
+#import	"WebServer.h"
+#import	"WebServerBundles.h"
+#import "Testing.h"
+
+int
+main()
+{
+  CREATE_AUTORELEASE_POOL(pool);
+  WebServerRouter	*router;
+  NSString		*base;
+  NSDictionary		*params;
+  NSString		*route;
+  WebServerBundles	*bundles;
+  id			handler;
+
+  START_SET("Route request paths")
+
+  router = [WebServerRouter routerWithRoutes:
+    [NSArray arrayWithObjects: @"", @"/a", @"/a/b", @"/users/{id}",
+    @"/users/{id}/posts", @"/users/me", @"/files/*", @"/docs/{path*}",
+    @"/a", nil]];
+  PASS([router count] == 8, "duplicate routes are ignored");
+
+  route = [router match: @"/a/b/c" base: &base parameters: &params];
+  PASS_EQUAL(route, @"/a/b", "longest literal prefix matches");
+  PASS_EQUAL(base, @"/a/b", "base is the matched prefix");
+  PASS(nil == params, "no parameters for literal route");
+
+  route = [router match: @"/x/y" base: &base parameters: &params];
+  PASS_EQUAL(route, @"", "empty route matches everything else");
+  PASS_EQUAL(base, @"", "empty route has empty base");
+
+  route = [router match: @"/users/42/posts" base: &base parameters: &params];
+  PASS_EQUAL(route, @"/users/{id}/posts", "parameter route matches");
+  PASS_EQUAL([params objectForKey: @"id"], @"42", "parameter is captured");
+  PASS_EQUAL(base, @"/users/42/posts", "base uses the request text");
+
+  route = [router match: @"/users/me" base: &base parameters: &params];
+  PASS_EQUAL(route, @"/users/me", "literal preferred to parameter");
+
+  route = [router match: @"/users/me/posts" base: &base parameters: &params];
+  PASS_EQUAL(route, @"/users/{id}/posts", "parameter used when literal fails");
+  PASS_EQUAL([params objectForKey: @"id"], @"me", "backtracked parameter");
+
+  route = [router match: @"/files/a/b.txt" base: &base parameters: &params];
+  PASS_EQUAL(route, @"/files/*", "wildcard route matches");
+  PASS_EQUAL(base, @"/files", "wildcard is not part of the base");
+  PASS_EQUAL([params objectForKey: @"*"], @"a/b.txt", "wildcard captured");
+
+  route = [router match: @"/docs/x/y" base: &base parameters: &params];
+  PASS_EQUAL([params objectForKey: @"path"], @"x/y", "named wildcard");
+
+  route = [router match: @"nonsense" base: &base parameters: &params];
+  PASS(nil == route, "path without leading slash does not match");
+
+  END_SET("Route request paths")
+
+  START_SET("Handlers dictionary")
+
+  bundles = AUTORELEASE([[WebServerBundles alloc]
+    initAsDelegateOf: AUTORELEASE([WebServer new])]);
+  handler = AUTORELEASE([NSObject new]);
+  PASS([[bundles handlers] isKindOfClass: [NSMutableDictionary class]],
+    "the handlers are a mutable dictionary");
+  [[bundles handlers] setObject: handler forKey: @"/direct"];
+  PASS([bundles handlerForPath: @"/direct/x" info: 0] == handler,
+    "a handler added to the dictionary is routed");
+  [[bundles handlers] removeObjectForKey: @"/direct"];
+  PASS(nil == [bundles handlerForPath: @"/direct/x" info: 0],
+    "a handler removed from the dictionary is no longer routed");
+  [bundles registerHandler: handler forPath: @"/registered"];
+  PASS([[bundles handlers] objectForKey: @"/registered"] == handler,
+    "a registered handler is in the dictionary");
+
+  END_SET("Handlers dictionary")
+
+  RELEASE(pool);
+  return 0;
+}
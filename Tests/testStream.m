@@ -0,0 +1,252 @@
+/** 
+   Copyright (C) 2026 Free Software Foundation, Inc.
+   
+   Written by:  agent <agent@local>
+   Date:	October 2026
+   
+   This file is part of the WebServer Library.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+   
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+   
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA.
+
+   $Date$ $Revision$
+   */ 
+#import	<Foundation/Foundation.h>
+
+#import "Testing.h"
+
+#define WEBSERVERINTERNAL       1
+
+#import "WebServer.h"
+#import "Internal.h"
+#import "TestClient.h"
+
+/* Starts streaming the response to every request, keeping the response
+ * so that the test can stream more and complete it.
+ */
+@interface	Handler: NSObject
+{
+@public
+  WebServerResponse	*response;
+}
+- (BOOL) processRequest: (WebServerRequest*)request
+	       response: (WebServerResponse*)r
+		    for: (WebServer*)http;
+@end
+
+@implementation	Handler
+- (void) dealloc
+{
+  RELEASE(response);
+  [super dealloc];
+}
+- (BOOL) processRequest: (WebServerRequest*)request
+	       response: (WebServerResponse*)r
+		    for: (WebServer*)http
+{
+  ASSIGN(response, r);
+  [r setHeader: @"http" value: @"HTTP/1.1 200 OK" parameters: nil];
+  [r setHeader: @"content-type" value: @"text/plain" parameters: nil];
+  [http streamData: [NSData dataWithBytes: "<first>" length: 7]
+      withResponse: r];
+  return NO;
+}
+@end
+
+/* Streams a template to every request, recording whether that worked
+ * and completing the response itself if it did not.
+ */
+@interface	TemplateHandler: NSObject
+{
+@public
+  NSString	*path;
+  NSDictionary	*map;
+  BOOL		result;
+}
+- (BOOL) processRequest: (WebServerRequest*)request
+	       response: (WebServerResponse*)r
+		    for: (WebServer*)http;
+@end
+
+@implementation	TemplateHandler
+- (void) dealloc
+{
+  RELEASE(path);
+  RELEASE(map);
+  [super dealloc];
+}
+- (BOOL) processRequest: (WebServerRequest*)request
+	       response: (WebServerResponse*)r
+		    for: (WebServer*)http
+{
+  result = [http streamResponse: r fromTemplate: path using: map];
+  if (YES == result)
+    {
+      return NO;
+    }
+  [r setHeader: @"http"
+	 value: @"HTTP/1.1 500 Internal Server Error"
+    parameters: nil];
+  [r setContent: @"<failed>" type: @"text/plain"];
+  return YES;
+}
+@end
+
+/* Returns YES if all the pieces have been received, in order.
+ */
+static BOOL
+ordered(Reader *r, NSArray *pieces)
+{
+  NSUInteger	pos = 0;
+  NSUInteger	i;
+
+  for (i = 0; i < [pieces count]; i++)
+    {
+      NSData	*d = [[pieces objectAtIndex: i]
+	dataUsingEncoding: NSASCIIStringEncoding];
+      NSRange	found;
+
+      found = [r->data rangeOfData: d
+			   options: 0
+			     range: NSMakeRange(pos, [r->data length] - pos)];
+      if (0 == found.length)
+	{
+	  return NO;
+	}
+      pos = NSMaxRange(found);
+    }
+  return YES;
+}
+
+static void
+stream(WebServer *server, Handler *handler, const char *text)
+{
+  [server streamData: [NSData dataWithBytes: text length: strlen(text)]
+	withResponse: handler->response];
+}
+
+int
+main()
+{
+  CREATE_AUTORELEASE_POOL(pool);
+  WebServer		*server;
+  Handler		*handler;
+  TemplateHandler	*th;
+  Reader		*r;
+  NSFileHandle		*h;
+  NSMutableArray	*pieces;
+  NSMutableData		*big;
+  int			i;
+
+  server = AUTORELEASE([WebServer new]);
+  handler = AUTORELEASE([Handler new]);
+  [server setDelegate: handler];
+  [server setIOThreads: 1 andPool: 1];
+  [server setStreamBatch: 1000 maxDelay: 1.0];
+  [server setPort: @"8891" secure: nil];
+  r = AUTORELEASE([Reader new]);
+  h = connectTo(@"8891",
+    @"GET /stream HTTP/1.1\r\nHost: localhost\r\n\r\n", r);
+
+  START_SET("Streamed response batching")
+
+  runFor(0.5);
+  PASS(received(r, "<first>"), "the start of the response is sent at once");
+
+  stream(server, handler, "<second>");
+  runFor(0.3);
+  PASS(NO == received(r, "<second>"), "a small piece is held back");
+  runFor(1.0);
+  PASS(received(r, "<second>"), "a small piece is sent after the delay");
+
+  stream(server, handler, "<third>");
+  runFor(0.3);
+  PASS(NO == received(r, "<third>"), "another small piece is held back");
+  [server streamFlushWithResponse: handler->response];
+  runFor(0.3);
+  PASS(received(r, "<third>"), "a flush sends held back data at once");
+
+  big = [NSMutableData dataWithLength: 1000];
+  memset([big mutableBytes], 'x', 1000);
+  memcpy([big mutableBytes], "<big>", 5);
+  [server streamData: big withResponse: handler->response];
+  runFor(0.3);
+  PASS(received(r, "<big>"), "a full batch is sent at once");
+
+  pieces = [NSMutableArray array];
+  for (i = 0; i < 50; i++)
+    {
+      char	buf[16];
+
+      snprintf(buf, sizeof(buf), "[%d]", i);
+      stream(server, handler, buf);
+      [pieces addObject: [NSString stringWithUTF8String: buf]];
+    }
+  [server completedWithResponse: handler->response];
+  runFor(0.5);
+  PASS(ordered(r, pieces),
+    "pieces streamed from another thread are all sent in order");
+  PASS(received(r, "\r\n0\r\n\r\n"),
+    "completing the response ends the stream at once");
+
+  END_SET("Streamed response batching")
+
+  disconnect(h, r);
+  [server setPort: nil secure: nil];
+
+  START_SET("Streamed template failure")
+
+  /* The first substitution is big enough to be streamed at once, the
+   * second recurses until it exceeds the substitution limit.
+   */
+  th = AUTORELEASE([TemplateHandler new]);
+  th->path = [[NSTemporaryDirectory()
+    stringByAppendingPathComponent: @"testStream.html"] retain];
+  [@"<html><!--big--><!--deep--></html>" writeToFile: th->path
+					   atomically: NO];
+  big = [NSMutableData dataWithLength: 40000];
+  memset([big mutableBytes], 'y', 40000);
+  th->map = [[NSDictionary alloc] initWithObjectsAndKeys:
+    AUTORELEASE([[NSString alloc] initWithData: big
+				      encoding: NSASCIIStringEncoding]),
+    @"big",
+    @"x<!--deep-->", @"deep",
+    nil];
+
+  server = AUTORELEASE([WebServer new]);
+  [server setDelegate: th];
+  [server setIOThreads: 1 andPool: 1];
+  [server setPort: @"8894" secure: nil];
+  r = AUTORELEASE([Reader new]);
+  h = connectTo(@"8894",
+    @"GET /page HTTP/1.1\r\nHost: localhost\r\n\r\n", r);
+  runFor(1.0);
+
+  PASS(NO == th->result, "a template failing part way through returns NO");
+  PASS(received(r, " 200 ") && received(r, "<html>yyyy"),
+    "the start of the page was streamed before the failure");
+  PASS(YES == r->done, "the connection is closed after the failure");
+  PASS(NO == received(r, "\r\n0\r\n\r\n"),
+    "the chunked response is not terminated");
+  PASS(NO == received(r, "<failed>") && NO == received(r, "</html>"),
+    "nothing more is sent after the failure");
+
+  END_SET("Streamed template failure")
+
+  disconnect(h, r);
+  [server setPort: nil secure: nil];
+  [[NSFileManager defaultManager] removeItemAtPath: th->path error: 0];
+  RELEASE(pool);
+  return 0;
+}
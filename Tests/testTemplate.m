@@ -0,0 +1,146 @@
+/** 
+   Copyright (C) 2026 Free Software Foundation, Inc.
+   
+   Written by:  agent <agent@local>
+   Date:	October 2026
+   
+   This file is part of the WebServer Library.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+   
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+   
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA.
+
+   $Date$ $Revision$
+   */ 
+
+#import	<Foundation/Foundation.h>
+
+#import "Testing.h"
+
+#define WEBSERVERINTERNAL       1
+
+#import "WebServer.h"
+#import "Internal.h"
+
+/* Render using a compiled template and return the result as a string.
+ */
+static NSString *
+render(NSString *text, NSDictionary *map, NSUInteger limit)
+{
+  WebServerTemplate	*t;
+  NSMutableData		*d = [NSMutableData data];
+
+  t = AUTORELEASE([[WebServerTemplate alloc] initWithString: text]);
+  if (NO == [t renderUsing: map into: d depth: 0 limit: limit])
+    {
+      return nil;
+    }
+  return AUTORELEASE([[NSString alloc] initWithData: d
+					   encoding: NSUTF8StringEncoding]);
+}
+
+/* Render using the original string substitution.
+ */
+static NSString *
+substitute(WebServer *server, NSString *text, NSDictionary *map)
+{
+  NSMutableString	*m = [NSMutableString string];
+
+  if (NO == [server substituteFrom: text using: map into: m depth: 0])
+    {
+      return nil;
+    }
+  return m;
+}
+
+int
+main()
+{
+  CREATE_AUTORELEASE_POOL(pool);
+  WebServer	*server = AUTORELEASE([WebServer new]);
+  NSDictionary	*map;
+  NSArray	*texts;
+  NSEnumerator	*e;
+  NSString	*text;
+  NSString	*path;
+  WebServerTemplate	*t1;
+  WebServerTemplate	*t2;
+
+  START_SET("Compiled templates")
+
+  map = [NSDictionary dictionaryWithObjectsAndKeys:
+    @"Fred", @"name",
+    @"<!-- a comment -->", @"comment",
+    @"Hello <!--name-->", @"greeting",
+    @"été", @"summer",
+    @"<!--loop-->", @"loop",
+    @"x<!--deep-->", @"deep",
+    nil];
+  texts = [NSArray arrayWithObjects:
+    @"",
+    @"no markers at all",
+    @"<!--name-->",
+    @"Dear <!--name-->, <!--greeting-->.",
+    @"<!--unknown--> and <!--name-->",
+    @"<!--a <!--name-->",
+    @"unterminated <!--name",
+    @"<!---->",
+    @"<!--comment-->",
+    @"café <!--summer--> <!--name-->",
+    @"<!--name--><!--name-->",
+    @"<!--<!--name-->-->",
+    nil];
+  e = [texts objectEnumerator];
+  while (nil != (text = [e nextObject]))
+    {
+      PASS_EQUAL(render(text, map, 4), substitute(server, text, map),
+	"compiled template matches substitution for '%s'", [text UTF8String]);
+    }
+
+  PASS(nil == render(@"<!--deep-->", map, 4),
+    "recursive substitution is limited");
+  PASS_EQUAL(render(@"<!--loop-->", map, 4), @"<!--loop-->",
+    "value which is a comment is not substituted into");
+
+  END_SET("Compiled templates")
+
+  START_SET("Cached templates")
+
+  path = [NSTemporaryDirectory()
+    stringByAppendingPathComponent: @"testTemplate.html"];
+  [@"first <!--name-->" writeToFile: path atomically: NO];
+  t1 = [WebServerTemplate templateAtPath: path];
+  PASS(nil != t1, "template is loaded from a file");
+  PASS([WebServerTemplate templateAtPath: path] == t1,
+    "template is cached");
+
+  /* A change of the same size made within the same second must still
+   * be seen once the file is checked again.
+   */
+  [@"other <!--name-->" writeToFile: path atomically: NO];
+  [NSThread sleepForTimeInterval: 1.1];
+  t2 = [WebServerTemplate templateAtPath: path];
+  PASS(nil != t2 && t2 != t1, "changed template is reloaded");
+  PASS_EQUAL(AUTORELEASE([[NSString alloc] initWithData: t2->_bytes
+    encoding: NSUTF8StringEncoding]), @"other <!--name-->",
+    "reloaded template has the new text");
+
+  [[NSFileManager defaultManager] removeItemAtPath: path error: 0];
+  [NSThread sleepForTimeInterval: 1.1];
+  PASS(nil == [WebServerTemplate templateAtPath: path],
+    "removed template is dropped from the cache");
+  END_SET("Cached templates")
+
+  RELEASE(pool);
+  return 0;
+}
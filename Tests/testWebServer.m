@@ -42,6 +42,92 @@ main()
 
   END_SET("Match IP addresses")
 
+  START_SET("Escape HTML")
+  NSString		*s;
+  NSMutableString	*m;
+  NSMutableData		*d;
+  unichar		u[3] = { 0x00e9, 0x0001, 0xd800 };
+
+  s = @"A plain string with nothing to escape, long enough for vectors.";
+  PASS([WebServer escapeHTML: s] == s, "unescaped string is returned as is");
+  PASS_EQUAL([WebServer escapeHTML: @"a<b>&\"c'd"],
+    @"a&lt;b&gt;&amp;&quot;c&apos;d", "special characters are escaped");
+  s = [NSString stringWithCharacters: u length: 3];
+  PASS_EQUAL([WebServer escapeHTML: s], @"&#233;",
+    "non-ascii is escaped and illegal characters removed");
+  s = [@"0123456789abcdef0123456789abcdef" stringByAppendingString: @"<"];
+  PASS_EQUAL([WebServer escapeHTML: s],
+    @"0123456789abcdef0123456789abcdef&lt;", "escape after a long safe run");
+  m = [NSMutableString stringWithString: @"x"];
+  [WebServer escapeHTML: @"1 < 2" into: m];
+  PASS_EQUAL(m, @"x1 &lt; 2", "escape into a string appends");
+  d = [NSMutableData data];
+  [WebServer escapeHTML: @"&" intoData: d];
+  PASS_EQUAL(d, [@"&amp;" dataUsingEncoding: NSUTF8StringEncoding],
+    "escape into data appends");
+  END_SET("Escape HTML")
+
+  START_SET("Decode URL encoded form")
+  NSMutableDictionary	*f = [NSMutableDictionary dictionary];
+  NSMutableData		*d;
+  NSArray		*a;
+  NSUInteger		i;
+  id			o;
+
+  d = [NSMutableData dataWithData:
+    [@"a=1&b=x+y%21&a=&c&d%3D=2" dataUsingEncoding: NSASCIIStringEncoding]];
+  PASS(5 == [WebServer decodeURLEncodedForm: d into: f], "five fields");
+  [d setLength: 0];
+  a = [f objectForKey: @"a"];
+  PASS(2 == [a count], "repeated field has two values");
+  PASS_EQUAL([WebServer parameterString: @"a" at: 0 from: f charset: nil],
+    @"1", "first value");
+  PASS_EQUAL([WebServer parameterString: @"a" at: 1 from: f charset: nil],
+    @"", "empty value");
+  PASS_EQUAL([WebServer parameterString: @"b" at: 0 from: f charset: nil],
+    @"x y!", "escaped value");
+  PASS_EQUAL([WebServer parameterString: @"c" at: 0 from: f charset: nil],
+    @"", "field without value");
+  PASS_EQUAL([WebServer parameterString: @"d=" at: 0 from: f charset: nil],
+    @"2", "escaped key");
+  [WebServer decodeURLEncodedForm:
+    [@"a=3" dataUsingEncoding: NSASCIIStringEncoding] into: f];
+  PASS(3 == [a count], "second form adds to existing values");
+  PASS_EQUAL([WebServer parameterString: @"a" at: 2 from: f charset: nil],
+    @"3", "value from second form");
+  PASS([a isKindOfClass: [NSMutableArray class]], "values are an array");
+  PASS([[a class] isSubclassOfClass: [NSMutableArray class]],
+    "the class of the values is an array class");
+  PASS_EQUAL([NSKeyedUnarchiver unarchiveObjectWithData:
+    [NSKeyedArchiver archivedDataWithRootObject: a]], a,
+    "values can be archived");
+  i = 0;
+  for (o in a)
+    {
+      if ([o isKindOfClass: [NSData class]])
+	{
+	  i++;
+	}
+    }
+  PASS(3 == i, "values can be enumerated");
+  PASS_EQUAL([a lastObject], [@"3" dataUsingEncoding: NSASCIIStringEncoding],
+    "other array methods work");
+  PASS_EQUAL([a copy], ([NSArray arrayWithObjects:
+    [@"1" dataUsingEncoding: NSASCIIStringEncoding], [NSData data],
+    [@"3" dataUsingEncoding: NSASCIIStringEncoding], nil]),
+    "values copy to an array");
+  [(NSMutableArray*)a removeObjectAtIndex: 0];
+  PASS(2 == [a count], "values can be removed");
+  PASS_EQUAL([WebServer parameterString: @"a" at: 0 from: f charset: nil],
+    @"", "values move down after removal");
+  [(NSMutableArray*)a insertObject: [NSData data] atIndex: 1];
+  [(NSMutableArray*)a replaceObjectAtIndex: 0 withObject: [NSData data]];
+  PASS(3 == [a count] && [[a objectAtIndex: 0] length] == 0
+    && [[a objectAtIndex: 2] isEqual:
+    [@"3" dataUsingEncoding: NSASCIIStringEncoding]],
+    "values can be inserted and replaced");
+  END_SET("Decode URL encoded form")
+
   RELEASE(pool);
   return 0;
 }
@@ -0,0 +1,135 @@
+/** 
+   Copyright (C) 2026 Free Software Foundation, Inc.
+   
+   Written by:  agent <agent@local>
+   Date:	October 2026
+   
+   This file is part of the WebServer Library.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+   
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+   
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA.
+
+   $Date$ $Revision$
+   */ 
+
+#import	<Foundation/Foundation.h>
+
+#import "Testing.h"
+
+#define WEBSERVERINTERNAL       1
+
+#import "WebServer.h"
+#import "Internal.h"
+
+/* Convert a string of hexadecimal digits to data.
+ */
+static NSData *
+hex(const char *s)
+{
+  NSMutableData	*d = [NSMutableData data];
+
+  while (s[0] && s[1])
+    {
+      unsigned	v;
+      uint8_t	b;
+
+      sscanf(s, "%2x", &v);
+      b = (uint8_t)v;
+      [d appendBytes: &b length: 1];
+      s += 2;
+    }
+  return d;
+}
+
+int
+main()
+{
+  CREATE_AUTORELEASE_POOL(pool);
+  WebServerWebSocket	*ws;
+  NSArray		*a;
+
+  START_SET("WebSocket handshake")
+
+  /* The example from RFC 6455 section 1.3.
+   */
+  PASS_EQUAL(WebServerWebSocketAccept(@"dGhlIHNhbXBsZSBub25jZQ=="),
+    @"s3pPLMBiTxaQ9kYGzzhZRbK+xOo=", "accept value is correct");
+
+  END_SET("WebSocket handshake")
+
+  START_SET("WebSocket frames")
+
+  PASS_EQUAL(WebServerWebSocketFrame(@"Hello"), hex("810548656c6c6f"),
+    "text message is framed without a mask");
+  PASS_EQUAL([WebServerWebSocketFrame([NSMutableData dataWithLength: 256])
+    subdataWithRange: NSMakeRange(0, 5)], hex("827e010000"),
+    "binary message has a 16 bit length");
+
+  ws = AUTORELEASE([[WebServerWebSocket alloc] initWithLimit: 1024]);
+  [ws send: WebServerWebSocketFrame(@"Hi")];
+  PASS(nil == [ws output], "nothing is written until open");
+  [ws setOpen];
+  PASS_EQUAL([ws output], hex("81024869"), "queued message is written");
+
+  /* The masked text message from RFC 6455 section 5.7, split across
+   * reads.
+   */
+  a = [ws read: hex("8185")];
+  PASS(0 == [a count], "partial frame gives no message");
+  a = [ws read: hex("37fa213d7f9f4d5158")];
+  PASS_EQUAL(a, [NSArray arrayWithObject: @"Hello"],
+    "masked text message is read");
+
+  a = [ws read: hex("01830000000048656c" "8a8000000000")];
+  PASS(0 == [a count], "first fragment gives no message");
+  a = [ws read: hex("8082000000006c6f")];
+  PASS_EQUAL(a, [NSArray arrayWithObject: @"Hello"],
+    "fragmented message is reassembled around a control frame");
+
+  a = [ws read: hex("898537fa213d7f9f4d5158")];
+  PASS(0 == [a count], "ping is not a message");
+  PASS_EQUAL([ws output], hex("8a0548656c6c6f"), "ping is answered");
+
+  a = [ws read: hex("828400000000" "01020304")];
+  PASS_EQUAL(a, [NSArray arrayWithObject: hex("01020304")],
+    "binary message is read");
+
+  a = [ws read: hex("8882" "00000000" "03e8")];
+  PASS_EQUAL([ws output], hex("880203e8"), "close is echoed");
+  PASS(YES == [ws finished], "nothing more is read after close");
+
+  ws = AUTORELEASE([[WebServerWebSocket alloc] initWithLimit: 1024]);
+  [ws setOpen];
+  [ws read: hex("810548656c6c6f")];
+  PASS_EQUAL([ws output], hex("880203ea"), "unmasked frame is an error");
+  PASS(YES == [ws finished], "nothing more is read after an error");
+
+  ws = AUTORELEASE([[WebServerWebSocket alloc] initWithLimit: 4]);
+  [ws setOpen];
+  [ws read: hex("8285")];
+  PASS_EQUAL([ws output], hex("880203f1"), "oversized message is refused");
+
+  ws = AUTORELEASE([[WebServerWebSocket alloc] initWithLimit: 1024]);
+  [ws setOpen];
+  PASS(YES == [ws ping], "idle socket is pinged");
+  PASS(NO == [ws ping], "unanswered ping is outstanding");
+  [ws read: hex("8a8000000000")];
+  PASS(YES == [ws ping], "any data answers a ping");
+  PASS_EQUAL([ws output], hex("89008900"), "pings are written");
+
+  END_SET("WebSocket frames")
+
+  RELEASE(pool);
+  return 0;
+}
@@ -131,6 +131,7 @@
 #include	<Foundation/NSObject.h>
 #include	<GNUstepBase/GSMime.h>
 
+@class	GSLinkedList;
 @class	GSThreadPool;
 @class	IOThread;
 @class	WebServer;
@@ -138,11 +139,13 @@
 @class	WebServerRequest;
 @class	WebServerResponse;
 @class  WebServerAuthenticationFailureLog;
+@class  WebServerRateLimiter;
 @class	NSArray;
 @class	NSCountedSet;
 @class	NSDictionary;
 @class	NSFileHandle;
 @class	NSLock;
+@class	NSMutableArray;
 @class	NSMutableSet;
 @class	NSNotification;
 @class	NSNotificationCenter;
@@ -290,20 +293,22 @@
  * or -processRequest:response:for:) to provide the delegate with the
  * request header information and allow it to decide whether the request
  * body should be processed incrementally (return value is non-zero) or not
- * (return value is zero).  The returned value is treated as a guide
- * to how much request data should be buffered at a time.<br />
+ * (return value is zero).  The returned value is the maximum amount of
+ * request body data (up to 1MB) buffered at a time.<br />
  * This method is called <em>before</em> any HTTP basic authentication
  * is done, and may (if threading is turned on) be called from a thread
  * other than the master one.<br />
- * If your delegate turns on incremental parsing for a request, then any
- * time that more incoming data is read, the web server class will look
- * at how much data it has and decide (based on the return value from this
- * method) to call your  -processRequest:response:for: method (preceded
- * by -preProcessRequest:response:for: if it is implemented) so that you 
- * can handle the new request data.<br />
+ * If your delegate turns on incremental parsing for a request, then
+ * whenever that much body data has been read (and when the request is
+ * complete) the web server class will call your -processRequest:response:for:
+ * method (preceded by -preProcessRequest:response:for: if it is
+ * implemented) so that you can handle the new request data.<br />
  * Your code can check to see if the request is complete by using the
- * -isCompletedRequest: method, and can check for the latest data added
- * to the request body using the * -incrementalDataForRequest: method.
+ * -isCompletedRequest: method, and must take the latest data added
+ * to the request body using the -incrementalDataForRequest: method.
+ * No more data is read from the client until you have done so, so your
+ * code controls the rate at which the body is received.  The body data
+ * is not added to the request content.
  */
 - (uint32_t) incrementalRequest: (WebServerRequest*)request
                             for: (WebServer*)http;
@@ -378,6 +383,25 @@
  */
 - (void) webLog: (NSString*)message for: (WebServer*)http;
 
+/** Called in the master thread with each message received on a
+ * WebSocket accepted using [WebServer-acceptWebSocket:response:].
+ * The response identifies the WebSocket, and the message is an
+ * NSString for a text message or NSData for a binary one.<br />
+ * The messages from a client are passed on in order, and no more are
+ * read from the client until earlier ones have been handled.
+ */
+- (void) webSocket: (WebServerResponse*)response
+	  received: (id)message
+	       for: (WebServer*)http;
+
+/** Called in the master thread when a WebSocket accepted using
+ * [WebServer-acceptWebSocket:response:] has closed, after any messages
+ * received on it have been passed to the delegate.  No more messages
+ * can be sent to the client.
+ */
+- (void) webSocketClosed: (WebServerResponse*)response
+		     for: (WebServer*)http;
+
 @end
 
 /*
@@ -471,8 +495,8 @@
   BOOL			_doPreProcess;
   BOOL			_doProcess;
   uint8_t		_reject;
-  BOOL			_pad1;
-  BOOL			_pad2;
+  BOOL			_dropBanned;
+  BOOL			_shedding;
   BOOL			_doAudit;
   BOOL			_doIncremental;
   NSUInteger		_substitutionLimit;
@@ -501,6 +525,27 @@
   NSTimeInterval        _authFailureBanTime;
   NSTimeInterval        _authFailureFindTime;
   NSUInteger            _authFailureMaxRetry;
+  NSUInteger		_bannedRejects;
+  WebServerRateLimiter	*_rateLimiter;
+  NSUInteger		_shedCount;
+  NSTimeInterval	_queueDelay;
+  NSTimeInterval	_aboveUntil;
+  NSTimeInterval	_lastSample;
+  NSArray		*_lanes;
+  GSLinkedList		*_poolQueue;
+  NSUInteger		_poolActive;
+  NSUInteger		_poolMinimum;
+  NSUInteger		_poolMaximum;
+  NSTimeInterval	_poolGrowWait;
+  NSTimeInterval	_poolIdleTime;
+  NSTimeInterval	_poolSpare;
+  NSTimeInterval	_poolResized;
+  NSUInteger		_compressCount;
+  unsigned long long	_compressIn;
+  unsigned long long	_compressOut;
+  NSTimeInterval	_compressTime;
+  NSMutableDictionary	*_parametersMap;
+  NSMutableDictionary	*_uploadsMap;
   void			*_reserved;
 }
 
@@ -533,6 +578,16 @@
  */
 + (NSString*) escapeHTML: (NSString*)str;
 
+/**
+ * Same as the instance method of the same name.
+ */
++ (void) escapeHTML: (NSString*)str into: (NSMutableString*)result;
+
+/**
+ * Same as the instance method of the same name.
+ */
++ (void) escapeHTML: (NSString*)str intoData: (NSMutableData*)result;
+
 /**
  * Returns a new URL formed by putting the newPath in the oldURL and
  * appending a query string containing the fields specified in the
@@ -616,6 +671,43 @@
 - (BOOL) accessRequest: (WebServerRequest*)request
 	      response: (WebServerResponse*)response;
 
+/** <p>Accepts a request to upgrade the connection to a WebSocket
+ * (RFC 6455), setting up the response to switch protocols.  The
+ * delegate calls this while handling the request, then completes the
+ * response as usual.
+ * </p>
+ * <p>Once the response has been written, messages from the client are
+ * passed to the delegate's
+ * [(WebServerDelegate)-webSocket:received:for:] method and messages may
+ * be sent to the client using -sendWebSocket:withResponse: (the
+ * response object identifies the WebSocket, so the delegate should
+ * retain it if it wants to send messages later).  When the WebSocket
+ * closes the delegate's [(WebServerDelegate)-webSocketClosed:for:]
+ * method is called.
+ * </p>
+ * <p>Frames are handled in the I/O thread: fragmented messages are
+ * reassembled, pings are answered, and a WebSocket with no traffic for
+ * the connection timeout (see -setConnectionTimeout:) is pinged and
+ * then closed if the client still sends nothing.  Messages larger than
+ * the maximum body size (see -setMaxBodySize:) close the WebSocket.
+ * </p>
+ * <p>Returns NO (having set the response status to 400 or 426) if the
+ * request is not a valid WebSocket upgrade, or if it is a pipelined
+ * request or one received over HTTP/2 (which can't be upgraded).
+ * </p>
+ */
+- (BOOL) acceptWebSocket: (WebServerRequest*)request
+		response: (WebServerResponse*)response;
+
+/** Returns a dictionary describing the state of admission control (see
+ * -setAdmissionTarget:interval:) containing the <em>Target</em> and
+ * <em>Interval</em> settings, the most recently measured
+ * <em>QueueDelay</em>, a boolean saying whether the server is currently
+ * <em>Shedding</em> load, the number of requests <em>Shed</em> so far,
+ * and the number of requests currently <em>Processing</em>.
+ */
+- (NSDictionary*) admissionState;
+
 /** Return the address the receiver listens for connections on, or nil
  * if it is not listening.
  */
@@ -647,6 +739,13 @@
  */
 - (void) closeConnectionAfter: (WebServerResponse*)response;
 
+/** Starts the closing handshake of the WebSocket identified by the
+ * response (see -acceptWebSocket:response:).  The delegate's
+ * [(WebServerDelegate)-webSocketClosed:for:] method is called once the
+ * client has replied (or the connection has timed out).
+ */
+- (void) closeWebSocket: (WebServerResponse*)response;
+
 /**
  * <p>This may only be called in the case where a call to the delegate's
  * [(WebServerDelegate)-processRequest:response:for:] method
@@ -667,6 +766,14 @@
  */
 - (void) completedWithResponse: (WebServerResponse*)response;
 
+/** Returns a dictionary describing response compression (see
+ * -setCompressionMinimum:types:) containing the <em>Minimum</em> size
+ * setting, the <em>Count</em> of responses compressed so far, the total
+ * <em>BytesIn</em> and <em>BytesOut</em> of compression, and the total
+ * time (<em>Duration</em>) spent compressing.
+ */
+- (NSDictionary*) compressionState;
+
 /** Returns an array containing an object representing each connection
  * currently active for this server instance.
  */
@@ -677,6 +784,8 @@
  * contents into the supplied dictionary.<br />
  * The resulting dictionary keys are strings.<br />
  * The resulting dictionary values are arrays of NSData objects.<br />
+ * The data objects in new arrays are only created (decoded) when they
+ * are first accessed.<br />
  * You probably don't need to call this method yourself ... more likely
  * you will use the -parameters: method instead.<br />
  * NB. For forms POST-ed using <code>multipart/form-data</code> you don't
@@ -718,12 +827,36 @@
 
 /** Escapes special characters in str for use in an HTML page.<br />
  * This converts &amp; to &amp;amp; for instance, and replaces
- * non-ascii characters with the appropriate numeric entity references.
+ * non-ascii characters with the appropriate numeric entity references.<br />
+ * If there is nothing to escape, str itself is returned.
  */
 - (NSString*) escapeHTML: (NSString*)str;
 
+/** As -escapeHTML: but appends the escaped text to result rather than
+ * creating a new string.
+ */
+- (void) escapeHTML: (NSString*)str into: (NSMutableString*)result;
+
+/** As -escapeHTML: but appends the escaped text to result as UTF-8
+ * (the escaped text is actually always ASCII).
+ */
+- (void) escapeHTML: (NSString*)str intoData: (NSMutableData*)result;
+
+/** Returns the path of the file in which the content of a part of a
+ * multipart/form-data request was stored (see
+ * -setUploadDirectory:maxPartSize:maxSize:), or nil if the content of
+ * the part is held in memory.<br />
+ * This is the only way to get the content of a stored part, as such
+ * parts are not included in the result of the -parameters: method.
+ */
+- (NSString*) fileForPart: (GSMimeDocument*)part
+		ofRequest: (WebServerRequest*)request;
+
 /** Returns a data object containing any data read for the body of a
- * partially read request since the last call for the same request.
+ * request being processed incrementally since the last call for the same
+ * request (or nil if there is none).  Calling this method allows the
+ * server to continue reading the body if it was waiting for the data to
+ * be taken.
  */
 - (NSData*) incrementalDataForRequest: (WebServerRequest*)request;
 
@@ -766,14 +899,20 @@
  * multipart/form-data) and return the extracted parameters as a
  * mutable dictionary whose keys are the parameter names and whose
  * values are arrays containing the data for each parameter.<br />
- * You should call this no more than once per request, storing the result
- * and using it as an argument to the methods used to extract particular
- * parameters.<br />
+ * The result is remembered, so later calls for the same request return
+ * the same dictionary (and see any changes you have made to it).<br />
+ * Values of URL encoded fields are only decoded when first accessed,
+ * so a request with many fields is cheap if you use only a few.<br />
  * Parameters from the request data are <em>added</em> to any found in the
  * query string.<br />
  * Values provided as <code>multipart/form-data</code> are also available
  * in a more flexible format (see [GSMimeDocument]) as the content of
- * the request.
+ * the request.<br />
+ * Parts of a multipart/form-data upload which were stored in files (see
+ * -setUploadDirectory:maxPartSize:maxSize:) are left out of the
+ * parameters, since reading them back into memory would defeat the
+ * purpose of storing them; use -fileForPart:ofRequest: with the parts
+ * in the content of the request to get at them.
  */
 - (NSMutableDictionary*) parameters: (WebServerRequest*)request;
 
@@ -827,11 +966,26 @@
  */
 - (NSString*) port;
 
+/** Returns the rate limits set using -setRateLimits: or nil if there
+ * are none.
+ */
+- (NSDictionary*) rateLimits;
+
+/** Returns the number of requests rejected because they exceeded the
+ * rate limits (since the limits were last set).
+ */
+- (NSUInteger) rateLimitedRequests;
+
 /**
  * Loads a template file from disk and places it in aResponse as content
  * whose mime type is determined from the file extension using the
  * provided mapping (or a simple built-in default mapping if map is nil).<br />
  * Text responses use utf-8 enmcoding.<br />
+ * The response has Last-Modified and Accept-Ranges headers, and a GET
+ * request with a Range header (and a matching If-Range header if any)
+ * gets a 206 Partial Content response holding just the requested ranges
+ * (or a 416 response if none of them is within the file), so that only
+ * those parts of the file are read and sent.<br />
  * If you have a dedicated web server for handling static pages (eg images)
  * it is better to use that rather than vending static pages using this
  * method.  It's unlikely that this method can be as efficient as a dedicated
@@ -846,13 +1000,16 @@
  * of type 'text/html' with a charset of 'utf-8'.<br />
  * The argument aPath is a path relative to the root path set using
  * the -setRoot: method.<br />
- * Substitutes values into the template from map using the
+ * Substitutes values into the template from map in the same way as the
  * -substituteFrom:using:into:depth: method.<br />
+ * Templates are compiled when first loaded and cached, and the file is
+ * checked for modification at most once a second, so changes to a
+ * template take effect within a second or so.<br />
  * Returns NO if the template could not be read or if any substitution
  * failed.  In this case no value is set in the response.<br />
- * If the response is actually text of another type, or you want another
- * characterset used, you can change the content type header in the
- * request after you call this method.<br />
+ * The response content is UTF-8 encoded data.  If the response is
+ * actually text of another type you can change the content type header
+ * in the request after you call this method.<br />
  * Note that, although the map is nominally an NSDictionary instance, it
  * can in fact be any object which responds to the [NSDictionary-objectForKey:]
  * message by returning a string or nil.
@@ -861,6 +1018,17 @@
 	    fromTemplate: (NSString*)aPath
 		   using: (NSDictionary*)map;
 
+/** Sends a message to the client of the WebSocket identified by the
+ * response (see -acceptWebSocket:response:).  An NSString is sent as
+ * a text message and NSData as a binary message.<br />
+ * This may be called from any thread.  Messages sent before the
+ * response accepting the WebSocket has been written are held until
+ * then.<br />
+ * Returns YES if the message is scheduled for sending, NO if the
+ * WebSocket has closed (or was never accepted).
+ */
+- (BOOL) sendWebSocket: (id)message withResponse: (WebServerResponse*)response;
+
 /** Sets the time for which requests from the same host should be blocked
  * if a request from the host attempts to authenticate and fails.<br />
  * The default is 1 second but setting a value of zero or less turns this
@@ -880,6 +1048,44 @@
  */
 - (void) setAuthenticationFailureFindTime: (NSTimeInterval)ti;
 
+/**
+ * <p>Sets whether complete responses are given entity tags automatically
+ * (off by default).
+ * </p>
+ * <p>When this is YES, a successful (200) response to a GET or HEAD
+ * request which has no ETag header and whose content is a string or data
+ * is given a weak ETag which is a (fast, non-cryptographic) hash of its
+ * body.  If the request has an If-None-Match header matching that tag,
+ * the response is sent as a 304 Not Modified without a body, so clients
+ * polling for a document which has not changed are not sent it again.
+ * </p>
+ * <p>The hash is computed in the thread pool as the response is sent
+ * (before any compression) so it costs the delegate nothing, but the
+ * delegate still has to produce the response each time.  It does not
+ * apply to streamed responses.
+ * </p>
+ */
+- (void) setAutomaticETags: (BOOL)aFlag;
+
+/**
+ * <p>Turns on compression of responses for clients which send an
+ * Accept-Encoding header accepting gzip or deflate coding.  A response
+ * is compressed if its body is at least bytes long and its content type
+ * starts with one of the strings in the types array (a nil array means
+ * text/*, JSON, JavaScript, XML and SVG).  A bytes value of zero turns
+ * compression off (the default).
+ * </p>
+ * <p>Compression is done in the thread pool as the response is sent,
+ * and is skipped for responses which already have a Content-Encoding
+ * (or are partial content, or have Cache-Control no-transform set).
+ * Data streamed with -streamData:withResponse: is compressed as it is
+ * sent (whatever its size), each piece being flushed so that the client
+ * can use it at once.  Compressible responses get Accept-Encoding added
+ * to their Vary header.
+ * </p>
+ */
+- (void) setCompressionMinimum: (NSUInteger)bytes types: (NSArray*)types;
+
 /**
  * Sets the time after which an idle connection should be shut down.<br />
  * Default is 30.0
@@ -938,6 +1144,43 @@
 - (BOOL) setAddress: (NSString*)anAddress
 	       port: (NSString*)aPort
 	     secure: (NSDictionary*)secure;
+
+/** Sets the path prefixes of requests which are never shed by admission
+ * control (eg health checks and other critical endpoints).<br />
+ * Requests from hosts listed in the WebServerQuiet user default are
+ * also never shed.
+ */
+- (void) setAdmissionExemptPaths: (NSArray*)prefixes;
+
+/** Configures admission control, which sheds load when the server is
+ * overloaded rather than letting requests queue until they time out.<br />
+ * The server measures the delay between a request being read and the
+ * start of its processing (in the thread pool for pre-processing and
+ * in the main thread for processing).  If that delay stays above
+ * target for a whole interval, new requests are rejected at once with
+ * a 503 response until a request is processed with a delay below the
+ * target again.<br />
+ * A target of zero (the default) disables admission control.  The
+ * interval is never less than the target, and should be long compared
+ * with the normal processing time of a request (CoDel suggests a target
+ * of five to ten percent of the interval).
+ */
+- (void) setAdmissionTarget: (NSTimeInterval)target
+		   interval: (NSTimeInterval)interval;
+
+/**
+ * When an address has been banned because of authentication failures
+ * (see -setAuthenticationFailureBanTime:) new connections from it are
+ * rejected as soon as they are accepted, before any TLS handshake or
+ * request parsing is done (unless the server is behind a trusted proxy,
+ * in which case the ban can only be checked once the request headers
+ * have been read).<br />
+ * By default a plain HTTP connection is sent a 429 response before it
+ * is closed, but a TLS connection is simply closed.  Setting aFlag to
+ * YES makes the server close all such connections without a response.
+ */
+- (void) setDropBannedConnections: (BOOL)aFlag;
+
 /**
  * Sets a flag to determine whether logging of request and connection
  * durations is to be performed.<br />
@@ -950,6 +1193,25 @@
  */
 - (void) setDurationLogging: (BOOL)aFlag;
 
+/**
+ * Makes the thread pool (see -setIOThreads:andPool:) elastic, so that it
+ * grows when work is delayed and shrinks when threads are not needed.<br />
+ * Threads are added (a quarter more at a time, but at least one) when
+ * the oldest item of work queued in the pool has been waiting for longer
+ * than the wait interval, and the pool is not grown again until at
+ * least the wait interval has passed.  A thread is removed when there
+ * have been spare threads for the idle interval, and no more than one
+ * thread is removed in each idle interval.<br />
+ * The pool size is kept between minimum and maximum (at most 256), and
+ * each change of size is logged with the reason for it.<br />
+ * Setting a maximum no greater than the minimum turns off elastic sizing
+ * so that the pool size is left as it was last set.
+ */
+- (void) setElasticPoolMinimum: (NSUInteger)minimum
+		       maximum: (NSUInteger)maximum
+		     growAfter: (NSTimeInterval)wait
+		   shrinkAfter: (NSTimeInterval)idle;
+
 /**
  * Sets a flag to determine whether the header lines in responses are
  * folded if they are over 78 characters (off by default).<br />
@@ -968,6 +1230,25 @@
  */
 - (void) setFoldHeaders: (BOOL)aFlag;
 
+/**
+ * Sets whether clients may use HTTP/2 (default NO).<br />
+ * When this is YES, a connection which starts with the HTTP/2 connection
+ * preface (a client with prior knowledge that the server supports it)
+ * uses HTTP/2, so a client can have many requests processed at once
+ * over a single connection.  The request on each stream is passed to
+ * the delegate just as if it had been sent using HTTP/1.1, and the
+ * response is sent back on the stream, so the delegate need not know
+ * which protocol is in use.  The limits on the number of requests and
+ * the duration of a connection apply as usual (the client is asked to
+ * make further requests on a new connection).<br />
+ * Upgrading an HTTP/1.1 connection and server push are not supported,
+ * and the protocol is not negotiated during the SSL handshake, so a
+ * client using SSL must also know in advance to use HTTP/2.<br />
+ * This setting applies to any connection established after the setting
+ * is changed.
+ */
+- (void) setHTTP2: (BOOL)aFlag;
+
 /**
  * Sets the number of threads used to process basic I/O and the size of
  * the thread pool used by the receiver for handling parsing of incoming
@@ -1013,6 +1294,22 @@
  */
 - (void) setMaxConnectionRequests: (NSUInteger)max;
 
+/**
+ * Sets the maximum number of pipelined requests on a connection which may
+ * be processed at the same time.  The default of zero (or one) means that
+ * each request is processed only once the response to the previous one
+ * has been sent.<br />
+ * When this is greater than one, any GET or HEAD requests which a client
+ * has pipelined after a GET or HEAD request are parsed and passed for
+ * processing at once (up to this limit).  Their responses are still sent
+ * in the order of the requests, with the responses which are ready at
+ * the same time sent in a single write.<br />
+ * Since such requests may be handled by different threads at the same
+ * time, your delegate should only enable this if it handles GET and HEAD
+ * requests without side effects.
+ */
+- (void) setMaxPipeline: (NSUInteger)max;
+
 /**
  * Sets the maximum number of simultaneous connections with clients.<br />
  * The default is 128.<br />
@@ -1084,10 +1381,81 @@
  */
 - (void) setPermittedMethods: (NSSet*)s;
 
+/**
+ * <p>Controls the use of gzip compressed variants of the files served by
+ * -produceResponse:fromStaticPage:using: (off by default).
+ * </p>
+ * <p>When aFlag is YES and a client accepts gzip coding, a file with the
+ * same name plus a '.gz' extension (and at least as new as the original)
+ * is sent in place of the original, with a Content-Encoding header.<br />
+ * If there is no such file and directory is not nil, a compressed variant
+ * of a compressible file (see -setCompressionMinimum:types:) is built in
+ * the directory (at the file's path relative to the -setRoot: directory)
+ * when first needed, and rebuilt if the original changes.
+ * </p>
+ * <p>Such responses are not compressed again as they are sent, so static
+ * content is compressed once per deploy rather than once per request.
+ * </p>
+ */
+- (void) setPrecompressedStatic: (BOOL)aFlag cache: (NSString*)directory;
+
 /** Deprecated ... use -setAddress:port:secure: instead.
  */
 - (BOOL) setPort: (NSString*)aPort secure: (NSDictionary*)secure;
 
+/** Configures named processing lanes, so that slow requests can not use
+ * all the processing resources and delay fast requests.<br />
+ * The config dictionary is keyed on lane name, and each value is a
+ * dictionary containing:
+ * <deflist>
+ * <term>Workers</term>
+ * <desc>The maximum number of requests in the lane which may be processed
+ * at the same time (default 1).  A request is being processed from the
+ * time it is passed to the delegate until it is completed (see
+ * -completedWithResponse:).</desc>
+ * <term>Queue</term>
+ * <desc>The maximum number of requests which may wait for a worker in
+ * the lane (default 0).  When the queue is full further requests are
+ * rejected at once with a 503 response.</desc>
+ * <term>Paths</term>
+ * <desc>An array of path prefixes identifying requests for the lane.</desc>
+ * <term>Methods</term>
+ * <desc>An array of HTTP methods identifying requests for the lane.</desc>
+ * </deflist>
+ * A request belongs in the lane whose Paths contain the longest prefix of
+ * the request path (a lane with Methods but no Paths matches any path, as
+ * the least specific match) as long as the request method is in the
+ * Methods of the lane (if specified).  Requests not belonging in any lane
+ * are processed as normal.<br />
+ * The number of requests active and queued in each lane, along with the
+ * average and maximum latency (from the time the request is read until it
+ * is completed), are shown in the description of the receiver.<br />
+ * Setting nil or an empty dictionary removes the lanes.  Requests already
+ * in a lane are unaffected by any change.
+ */
+- (void) setProcessingLanes: (NSDictionary*)config;
+
+/** Sets token bucket limits on the rate at which each client address
+ * may make requests.<br />
+ * The limits dictionary is keyed on path prefixes, and each value is a
+ * dictionary containing a <em>Rate</em> (the number of requests allowed
+ * per second) and optionally a <em>Burst</em> (the number of requests
+ * which may be made at once after the client has been idle, defaulting
+ * to the rate rounded up).<br />
+ * A limit for the empty string applies to all requests from an address,
+ * and is applied in addition to any limit for the longest prefix of the
+ * request path.  Limits are kept separately for each path prefix.<br />
+ * The client address is the originating address supplied by a trusted
+ * proxy where -setSecureProxy: has been used.<br />
+ * A request exceeding a limit is rejected with a 429 response (and a
+ * Retry-After header) as soon as its headers have been read, and the
+ * connection is closed, so the request never uses a processing thread
+ * or reaches the delegate.<br />
+ * Setting nil or an empty dictionary removes all limits.  Changing the
+ * limits resets the state of all clients.
+ */
+- (void) setRateLimits: (NSDictionary*)limits;
+
 /**
  * Set root path for loading template files from.<br />
  * Templates may only be loaded from within this directory.
@@ -1102,6 +1470,24 @@
  */
 - (void) setSecureProxy: (BOOL)aFlag;
 
+/**
+ * <p>Sets the size (in bytes) above which the body of a request is written
+ * to a temporary file rather than being held in memory.  The default of
+ * zero turns this off.
+ * </p>
+ * <p>When the body of a request has more data than this, the data is
+ * written to a file in the upload directory (see
+ * -setUploadDirectory:maxPartSize:maxSize:) or the default temporary
+ * directory.  The file is unlinked as soon as it is created, so nothing
+ * is left behind, and when the body is complete the request content is
+ * a data object with the file mapped into memory.  The content of such a
+ * request is always an NSData object (never a string).<br />
+ * The -setMaxBodySize: limit still applies, but since the body need not
+ * fit in memory it may safely be set much higher.
+ * </p>
+ */
+- (void) setSpoolThreshold: (NSUInteger)bytes;
+
 /**
  * Specifies the number of seconds HSTS is to be turned on for when responding
  * to a request on a secure connection (including via a secure proxy).<br />
@@ -1112,6 +1498,23 @@
  */
 - (void) setStrictTransportSecurity: (NSUInteger)seconds;
 
+/**
+ * <p>Sets the policy for writing data streamed using the
+ * -streamData:withResponse: method (or sent to a WebServerChannel).
+ * The default (a bytes value of zero) writes each piece of data as soon
+ * as any previous write has completed.
+ * </p>
+ * <p>When bytes is greater than zero, streamed data is batched up and
+ * written once at least that many bytes are waiting or once the data has
+ * waited for delay seconds, whichever is sooner.  This greatly reduces
+ * the number of writes (and packets) when a response is streamed as many
+ * small pieces, at the cost of up to delay seconds of latency.<br />
+ * The delay is limited to the range 0.01 to 1.0 seconds.<br />
+ * Use the -streamFlushWithResponse: method to write batched data at once.
+ * </p>
+ */
+- (void) setStreamBatch: (NSUInteger)bytes maxDelay: (NSTimeInterval)delay;
+
 /**
  * Sets the maximum recursion depth allowed for substitutions into
  * templates.  This defaults to 4.
@@ -1140,6 +1543,37 @@
  */
 - (void) setLogRawIO: (BOOL)aFlag;
 
+/**
+ * <p>Sets a directory in which the parts of large multipart/form-data
+ * uploads are stored, so that they need not be held in memory.
+ * Setting a nil path (the default) turns this off, and the whole body
+ * of the request is parsed in memory as normal (subject to the limit
+ * set by -setMaxBodySize:).
+ * </p>
+ * <p>When this is on, the body of a multipart/form-data request is
+ * parsed as it arrives, and any part larger than 64KB is written to a
+ * file in the directory rather than being kept in memory.  The parts
+ * are the content of the request as usual, but a part stored in a file
+ * has an empty body and the -fileForPart:ofRequest: method returns the
+ * path of the file.  Every part has an <code>x-webserver-size</code>
+ * header giving the size of its content (any headers in the parts whose
+ * names begin <code>x-webserver-</code> are removed, as they are
+ * reserved for the server).  The -parameters: method leaves out the
+ * parts stored in files.<br />
+ * The files are removed once the response has been sent, so if you want
+ * to keep one you should move it elsewhere.
+ * </p>
+ * <p>The maxPartSize and maxSize arguments limit the size of any one
+ * part (zero means no limit) and of the whole request body.  A non-zero
+ * maxSize replaces the -setMaxBodySize: limit for these requests, but
+ * with a maxSize of zero that limit still applies.  The HTTP failure
+ * response for too large an upload is 413.
+ * </p>
+ */
+- (void) setUploadDirectory: (NSString*)path
+		maxPartSize: (unsigned long long)maxPartSize
+		    maxSize: (unsigned long long)maxSize;
+
 /**
  * Stores additional user information with a request.<br />
  * This information may be retrieved later using the -userInfoForRequest:
@@ -1177,6 +1611,41 @@
  */
 - (BOOL) streamData: (NSData*)data withResponse: (WebServerResponse*)response;
 
+/**
+ * <p>Renders a template in the same way as the
+ * -produceResponse:fromTemplate:using: method, but sends the page to the
+ * client as it is rendered (using the -streamData:withResponse: mechanism)
+ * so that the client receives the start of a large page while the rest
+ * is still being produced.  Pages small enough that there is no benefit
+ * in streaming are sent as normal responses.
+ * </p>
+ * <p>If this method returns YES it has already called the
+ * -completedWithResponse: method, so the delegate must return NO from
+ * its [(WebServerDelegate)-processRequest:response:for:] method.<br />
+ * The method returns NO (having sent nothing) if the template could not
+ * be read or if substitution failed before any of the page was sent.
+ * If substitution fails after part of the page has been sent, the
+ * method also returns NO, and when the delegate completes the response
+ * the connection is aborted once the partial page has been written.
+ * The end of the chunked response is never sent (nor is anything the
+ * delegate puts in the response after the failure), so the client can
+ * tell that the page is incomplete.<br />
+ * So whenever this method returns NO the delegate should complete the
+ * response in the normal way, just as if it had not called this method.
+ * </p>
+ */
+- (BOOL) streamResponse: (WebServerResponse*)aResponse
+	   fromTemplate: (NSString*)aPath
+		  using: (NSDictionary*)map;
+
+/**
+ * Causes any data streamed for the response but held back by the
+ * -setStreamBatch:maxDelay: policy to be written without waiting for
+ * the rest of the batch.<br />
+ * Returns NO if the client has already dropped the connection.
+ */
+- (BOOL) streamFlushWithResponse: (WebServerResponse*)response;
+
 /**
  * Returns the number of seconds set for HSTS for this server.<br />
  * This will be zero if the server is not using a secure connection or
@@ -1267,5 +1736,79 @@
 @end
 #endif
 
+/** <p>A WebServerChannel broadcasts Server-Sent Events to any number of
+ * subscribed responses.  Each event published is formatted once, and
+ * the same (immutable) data is queued for writing on every subscriber's
+ * connection, so publishing to thousands of clients costs little more
+ * than publishing to one.
+ * </p>
+ * <p>A subscriber which has too much data waiting to be written (its
+ * client is not reading fast enough) is either paused, so that it misses
+ * events until it catches up, or dropped (its connection is closed),
+ * as set by -setBacklogLimit:dropSlow:.  Clients can use the event
+ * identifiers to find out what they missed.
+ * </p>
+ * <p>The methods of this class may be called from any thread.
+ * </p>
+ */
+@interface	WebServerChannel : NSObject
+{
+@private
+  WebServer		*_server;
+  NSLock		*_lock;
+  NSMutableArray	*_threads;	// I/O threads of subscribers
+  NSMutableArray	*_groups;	// Subscribers for each thread
+  NSUInteger		_count;
+  NSUInteger		_limit;
+  BOOL			_drop;
+}
+
+/** Returns the number of subscribers.  A subscriber is removed as soon
+ * as its response is completed or its connection ends.
+ */
+- (NSUInteger) count;
+
+/** Initialises the receiver to publish to the clients of server.
+ */
+- (id) initWithServer: (WebServer*)server;
+
+/** Publishes an event to all subscribers, returning the number of them
+ * it is sent to.<br />
+ * The data is sent as the data lines of the event (it may be nil or
+ * contain line breaks) and the name and identifier (if not nil) as its
+ * event type and id.  An NSInvalidArgumentException is raised if the
+ * name or identifier contains a line break.<br />
+ * As an idle connection is closed after the connection timeout, you
+ * should publish something (an event the client ignores if there is
+ * nothing else) more often than that.
+ */
+- (NSUInteger) publish: (NSString*)data
+		 event: (NSString*)name
+	    identifier: (NSString*)ident;
+
+/** Sets the number of bytes (default 256KB) which may be waiting to be
+ * written to a subscriber before it counts as slow, and whether slow
+ * subscribers are dropped (their connections closed) or paused (events
+ * are not sent to them until the backlog falls below the limit).
+ */
+- (void) setBacklogLimit: (NSUInteger)bytes dropSlow: (BOOL)drop;
+
+/** Subscribes the response (of a request the delegate has not yet
+ * completed) to the receiver.  The response is given the content type
+ * text/event-stream and its headers are sent to the client at once.
+ * The delegate's [(WebServerDelegate)-processRequest:response:for:]
+ * method should then return NO, and the response remains subscribed
+ * until the client goes or the delegate calls -unsubscribe: and then
+ * [WebServer-completedWithResponse:].<br />
+ * Returns NO if the client has already dropped the connection.
+ */
+- (BOOL) subscribe: (WebServerResponse*)response;
+
+/** Removes the response from the subscribers.  This does not end the
+ * response.
+ */
+- (void) unsubscribe: (WebServerResponse*)response;
+@end
+
 #endif
 
@@ -26,12 +26,25 @@
 #import <Foundation/Foundation.h>
 #import <Performance/GSThreadPool.h>
 
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#if	defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #define WEBSERVERINTERNAL       1
 
 #import "WebServer.h"
 #import "Internal.h"
 
 #define	MAXCONNECTIONS	10000
+#define	STREAMCHUNK	16384	// Buffered before streaming a template
 
 static	Class	NSArrayClass = Nil;
 static	Class	NSDataClass = Nil;
@@ -44,6 +57,7 @@ static	Class	NSMutableStringClass = Nil;
 static	Class	NSStringClass = Nil;
 static	Class	GSMimeDocumentClass = Nil;
 static	Class	WebServerHeaderClass = Nil;
+static	Class	WebServerFormValuesClass = Nil;
 static	Class	WebServerResponseClass = Nil;
 static NSZone	*defaultMallocZone = 0;
 static NSSet	*defaultPermittedMethods = nil;
@@ -64,6 +78,95 @@ untrusted(WebServerRequest *request, NSString *key, NSMutableArray **array)
     }
 }
 
+/* Build a 429 response from the pre-rendered text, inserting the
+ * Retry-After value after the head and the reason for the refusal
+ * into the paragraph of the body.
+ */
+static NSData *
+tooManyRequests(int seconds, const char *reason)
+{
+  static const char	*head = 
+    "HTTP/1.0 429 Too Many Requests\r\n"
+    "Content-Type: text/html\r\n"
+    "Retry-After: ";
+  static const char	*body = 
+    "\r\n"
+    "\r\n"
+    "<html>\r\n"
+    "  <head>\r\n"
+    "    <title>Too Many Requests</title>\r\n"
+    "  </head>\r\n"
+    "  <body>\r\n"
+    "    <h1>Too Many Requests</h1>\r\n"
+    "    <p>You are seeing this message because ";
+  static const char	*tail = 
+    "<br />\r\n"
+    "    Please try again later.</p>\r\n"
+    "   </body>\r\n"
+    "</html>\r\n";
+  size_t		headLen = strlen(head);
+  size_t		bodyLen = strlen(body);
+  size_t		reasonLen = strlen(reason);
+  size_t		tailLen = strlen(tail);
+  NSMutableData		*data;
+  char			buf[32];
+  int			len;
+
+  if (seconds < 1)
+    {
+      seconds = 1;
+    }
+  len = snprintf(buf, sizeof(buf), "%d", seconds);
+  data = [NSMutableDataClass dataWithCapacity:
+    headLen + len + bodyLen + reasonLen + tailLen];
+  [data appendBytes: head length: headLen];
+  [data appendBytes: buf length: len];
+  [data appendBytes: body length: bodyLen];
+  [data appendBytes: reason length: reasonLen];
+  [data appendBytes: tail length: tailLen];
+  return data;
+}
+
+NSData *
+WebServerTooManyRequests(int seconds)
+{
+  return tooManyRequests(seconds,
+    "you sent a request\r\n"
+    "    with invalid authentication and as a security measure your\r\n"
+    "    requests are now throttled for a short time.");
+}
+
+/* Returns the (pre-rendered) 503 response sent when shedding load.
+ */
+static NSData *
+serviceUnavailable()
+{
+  static NSData	*data = nil;
+
+  if (nil == data)
+    {
+      static const char	*text =
+	"HTTP/1.0 503 Service Unavailable\r\n"
+	"Content-Type: text/plain\r\n"
+	"Retry-After: 1\r\n"
+	"\r\n"
+	"The server is too busy to handle your request.\r\n";
+
+      data = [[NSDataClass alloc] initWithBytesNoCopy: (void*)text
+					       length: strlen(text)
+					 freeWhenDone: NO];
+    }
+  return data;
+}
+
+NSData *
+WebServerRateLimited(int seconds)
+{
+  return tooManyRequests(seconds,
+    "you have sent\r\n"
+    "    requests faster than this server permits.");
+}
+
 @implementation	WebServer
 
 + (void) initialize
@@ -84,6 +187,7 @@ untrusted(WebServerRequest *request, NSString *key, NSMutableArray **array)
       NSMutableStringClass = [NSMutableString class];
       GSMimeDocumentClass = [GSMimeDocument class];
       WebServerHeaderClass = [WebServerHeader class];
+      WebServerFormValuesClass = [WebServerFormValues class];
       WebServerResponseClass = [WebServerResponse class];
       defaultPermittedMethods = [[NSSet alloc] initWithObjects: m count: 2];
     }
@@ -186,100 +290,120 @@ unescapeData(const uint8_t *bytes, NSUInteger length, uint8_t *buf)
   return url;
 }
 
+/* Return a new data object containing the decoded form of the bytes,
+ * copying them as they are if there is nothing to unescape.
+ */
+static NSData *
+newDecodedData(const uint8_t *bytes, NSUInteger length)
+{
+  uint8_t	*buf;
+  NSUInteger	buflen;
+
+  if (0 == length)
+    {
+      return [NSDataClass new];
+    }
+  if (0 == memchr(bytes, '%', length) && 0 == memchr(bytes, '+', length))
+    {
+      return [Alloc(NSDataClass) initWithBytes: bytes length: length];
+    }
+  buf = NSZoneMalloc(NSDefaultMallocZone(), length);
+  buflen = unescapeData(bytes, length, buf);
+  return [Alloc(NSDataClass) initWithBytesNoCopy: buf
+					   length: buflen
+				     freeWhenDone: YES];
+}
+
 + (NSUInteger) decodeURLEncodedForm: (NSData*)data
 			       into: (NSMutableDictionary*)dict
 {
-  const uint8_t		*bytes = (const uint8_t	*)[data bytes];
-  NSUInteger		length = [data length];
+  NSData		*source = [data copy];	// Retains immutable data
+  const uint8_t		*bytes = (const uint8_t	*)[source bytes];
+  NSUInteger		length = [source length];
   NSUInteger		pos = 0;
   NSUInteger		fields = 0;
 
+  /* We only find the field boundaries here (memchr is much faster than
+   * checking each byte ourselves) and leave the values to be decoded
+   * when they are used.  For that we need data which can not change, so
+   * mutable data is copied (the caller may modify or reuse it).
+   */
   while (pos < length)
     {
       NSUInteger	keyStart = pos;
       NSUInteger	keyEnd;
       NSUInteger	valStart;
       NSUInteger	valEnd;
-      uint8_t		*buf;
-      NSUInteger	buflen;
-      BOOL		escape = NO;
-      NSData		*d;
+      const uint8_t	*p;
       NSString		*k;
-      NSMutableArray	*a;
+      id		a;
 
-      while (pos < length && bytes[pos] != '&')
-	{
-	  pos++;
-	}
-      valEnd = pos;
-      if (pos < length)
-	{
-	  pos++;	// Step past '&'
-	}
+      p = memchr(&bytes[pos], '&', length - pos);
+      valEnd = (0 == p) ? length : (NSUInteger)(p - bytes);
+      pos = (valEnd < length) ? valEnd + 1 : length;	// Step past '&'
 
-      keyEnd = keyStart;
-      while (keyEnd < pos && bytes[keyEnd] != '=')
-	{
-	  if (bytes[keyEnd] == '%' || bytes[keyEnd] == '+')
-	    {
-	      escape = YES;
-	    }
-	  keyEnd++;
-	}
+      p = memchr(&bytes[keyStart], '=', valEnd - keyStart);
+      keyEnd = (0 == p) ? valEnd : (NSUInteger)(p - bytes);
 
-      if (escape)
+      if (0 == memchr(&bytes[keyStart], '%', keyEnd - keyStart)
+	&& 0 == memchr(&bytes[keyStart], '+', keyEnd - keyStart))
 	{
-	  buf = NSZoneMalloc(NSDefaultMallocZone(), keyEnd - keyStart);
-	  buflen = unescapeData(&bytes[keyStart], keyEnd - keyStart, buf);
-	  d = [Alloc(NSDataClass) initWithBytesNoCopy: buf
-						length: buflen
-					  freeWhenDone: YES];
+	  k = [Alloc(NSStringClass) initWithBytes: &bytes[keyStart]
+					   length: keyEnd - keyStart
+					 encoding: NSUTF8StringEncoding];
 	}
       else
 	{
-	  d = [Alloc(NSDataClass) initWithBytesNoCopy: (void*)&bytes[keyStart]
-						length: keyEnd - keyStart
-					  freeWhenDone: NO];
+	  uint8_t	*buf;
+	  NSUInteger	buflen;
+
+	  buf = NSZoneMalloc(NSDefaultMallocZone(), keyEnd - keyStart);
+	  buflen = unescapeData(&bytes[keyStart], keyEnd - keyStart, buf);
+	  k = [Alloc(NSStringClass) initWithBytes: buf
+					   length: buflen
+					 encoding: NSUTF8StringEncoding];
+	  NSZoneFree(NSDefaultMallocZone(), buf);
 	}
-      k = [Alloc(NSStringClass) initWithData: d
-				     encoding: NSUTF8StringEncoding];
       if (k == nil)
 	{
+	  RELEASE(source);
 	  [NSException raise: NSInvalidArgumentException
 		      format: @"Bad UTF-8 form data (key of field %"PRIuPTR")",
             fields];
 	}
-      RELEASE(d);
 
       valStart = keyEnd;
-      if (valStart < pos)
-	{
-	  valStart++;	// Step past '='
-	}
       if (valStart < valEnd)
 	{
-	  buf = NSZoneMalloc(NSDefaultMallocZone(), valEnd - valStart);
-	  buflen = unescapeData(&bytes[valStart], valEnd - valStart, buf);
-	  d = [Alloc(NSDataClass) initWithBytesNoCopy: buf
-						length: buflen
-					  freeWhenDone: YES];
-	}
-      else
-	{
-	  d = [NSDataClass new];
+	  valStart++;	// Step past '='
 	}
       a = [dict objectForKey: k];
       if (a == nil)
 	{
-	  a = [Alloc(NSMutableArrayClass) initWithCapacity: 1];
+	  a = [Alloc(WebServerFormValuesClass) initWithSource: source];
 	  [dict setObject: a forKey: k];
 	  RELEASE(a);
 	}
-      [a addObject: d];
-      RELEASE(d);
+      if ([a isKindOfClass: WebServerFormValuesClass]
+	&& [(WebServerFormValues*)a source] == source)
+	{
+	  [(WebServerFormValues*)a addRange:
+	    NSMakeRange(valStart, valEnd - valStart)];
+	}
+      else
+	{
+	  NSData	*d;
+
+	  /* Values from another form must be decoded now.
+	   */
+	  d = newDecodedData(&bytes[valStart], valEnd - valStart);
+	  [a addObject: d];
+	  RELEASE(d);
+	}
       RELEASE(k);
       fields++;
     }
+  RELEASE(source);
   return fields;
 }
 
@@ -415,158 +539,329 @@ escapeData(const uint8_t *bytes, NSUInteger length, NSMutableData *d)
 			       into: data];
 }
 
-+ (NSString*) escapeHTML: (NSString*)str
+/* Characters (below 128) which may appear in HTML output unchanged.
+ * Everything else is either replaced by an entity or (if it is not
+ * legal in a document) removed.
+ */
+static const uint8_t	htmlSafe[128] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 0, 0, 1, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  1, 1, 0, 1, 1, 1, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,	// " & '
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 0, 1,	// < >
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1
+};
+
+/* Return the number of characters at the start of buf which need no
+ * escaping.  Printable ASCII is by far the commonest case, so where
+ * SSE2 is available we check eight characters at a time.
+ */
+static NSUInteger
+htmlSafeRun(const unichar *buf, NSUInteger length)
 {
-  NSUInteger	length = [str length];
-  NSUInteger	output = 0;
-  unichar	*from;
   NSUInteger	i = 0;
-  BOOL		escape = NO;
 
-  if (length == 0)
+#if	defined(__SSE2__)
+  const __m128i	space = _mm_set1_epi16(0x20);
+  const __m128i	range = _mm_set1_epi16(0x5f);
+  const __m128i	quot = _mm_set1_epi16('"');
+  const __m128i	amp = _mm_set1_epi16('&');
+  const __m128i	apos = _mm_set1_epi16('\'');
+  const __m128i	lt = _mm_set1_epi16('<');
+  const __m128i	gt = _mm_set1_epi16('>');
+  const __m128i	zero = _mm_setzero_si128();
+
+  while (i + 8 <= length)
     {
-      return str;
+      __m128i	v = _mm_loadu_si128((const __m128i*)(buf + i));
+      __m128i	bad;
+
+      /* Anything outside 0x20 to 0x7f saturates to non-zero.
+       */
+      bad = _mm_subs_epu16(_mm_sub_epi16(v, space), range);
+      bad = _mm_xor_si128(_mm_cmpeq_epi16(bad, zero), _mm_set1_epi16(-1));
+      bad = _mm_or_si128(bad, _mm_cmpeq_epi16(v, quot));
+      bad = _mm_or_si128(bad, _mm_cmpeq_epi16(v, amp));
+      bad = _mm_or_si128(bad, _mm_cmpeq_epi16(v, apos));
+      bad = _mm_or_si128(bad, _mm_cmpeq_epi16(v, lt));
+      bad = _mm_or_si128(bad, _mm_cmpeq_epi16(v, gt));
+      if (0 != _mm_movemask_epi8(bad))
+	{
+	  NSUInteger	end = i + 8;
+
+	  /* Either something to escape or a tab/newline, which is safe.
+	   */
+	  while (i < end && buf[i] < 128 && htmlSafe[buf[i]])
+	    {
+	      i++;
+	    }
+	  if (i < end)
+	    {
+	      return i;
+	    }
+	}
+      else
+	{
+	  i += 8;
+	}
+    }
+#endif
+  while (i < length && buf[i] < 128 && htmlSafe[buf[i]])
+    {
+      i++;
+    }
+  return i;
+}
+
+/* Output for HTML escaping is always ASCII, so we build it in a small
+ * buffer and append that to a string or data object when it is full.
+ */
+typedef struct	{
+  NSMutableString	*string;
+  NSMutableData		*data;
+  NSUInteger		length;
+  char			buf[1024];
+} HTMLOut;
+
+static void
+htmlFlush(HTMLOut *o)
+{
+  if (o->length > 0)
+    {
+      if (nil != o->data)
+	{
+	  [o->data appendBytes: o->buf length: o->length];
+	}
+      else
+	{
+	  NSString	*s;
+
+	  s = [Alloc(NSStringClass) initWithBytes: o->buf
+					   length: o->length
+					 encoding: NSASCIIStringEncoding];
+	  [o->string appendString: s];
+	  RELEASE(s);
+	}
+      o->length = 0;
     }
-  from = NSZoneMalloc (NSDefaultMallocZone(), sizeof(unichar) * length);
-  [str getCharacters: from];
+}
+
+/* Append the escaped form of the characters in str to the output.
+ * The first safe characters are known to need no escaping.
+ */
+static void
+htmlEscape(NSString *str, NSUInteger length, NSUInteger safe, HTMLOut *o)
+{
+  unichar	chars[256];
+  NSUInteger	pos = 0;
 
-  for (i = 0; i < length; i++)
+  while (pos < length)
     {
-      unichar	c = from[i];
+      NSUInteger	count = length - pos;
+      NSUInteger	i = 0;
 
-      if ((c >= 0x20 && c <= 0xd7ff)
-	|| c == 0x9 || c == 0xd || c == 0xa
-	|| (c >= 0xe000 && c <= 0xfffd))
+      if (count > 256)
 	{
+	  count = 256;
+	}
+      [str getCharacters: chars range: NSMakeRange(pos, count)];
+      while (i < count)
+	{
+	  NSUInteger	run;
+	  unichar	c;
+
+	  if (pos + i < safe)
+	    {
+	      run = safe - pos - i;
+	      if (run > count - i)
+		{
+		  run = count - i;
+		}
+	    }
+	  else
+	    {
+	      run = htmlSafeRun(chars + i, count - i);
+	    }
+	  while (run > 0)
+	    {
+	      NSUInteger	space = sizeof(o->buf) - o->length;
+	      NSUInteger	n = (run < space) ? run : space;
+	      char		*to = o->buf + o->length;
+
+	      o->length += n;
+	      run -= n;
+	      while (n-- > 0)
+		{
+		  *to++ = (char)chars[i++];
+		}
+	      if (o->length == sizeof(o->buf))
+		{
+		  htmlFlush(o);
+		}
+	    }
+	  if (i == count)
+	    {
+	      break;
+	    }
+
+	  /* Room for the longest escape ('&#65533;').
+	   */
+	  if (sizeof(o->buf) - o->length < 8)
+	    {
+	      htmlFlush(o);
+	    }
+	  c = chars[i++];
 	  switch (c)
 	    {
 	      case '"':
+		memcpy(o->buf + o->length, "&quot;", 6);
+		o->length += 6;
+		break;
+
 	      case '\'':
-		output += 6;
-		escape = YES;
-	        break;
+		memcpy(o->buf + o->length, "&apos;", 6);
+		o->length += 6;
+		break;
 
 	      case '&':
-		output += 5;
-		escape = YES;
-	        break;
+		memcpy(o->buf + o->length, "&amp;", 5);
+		o->length += 5;
+		break;
 
 	      case '<':
+		memcpy(o->buf + o->length, "&lt;", 4);
+		o->length += 4;
+		break;
+
 	      case '>':
-		output += 4;
-		escape = YES;
-	        break;
+		memcpy(o->buf + o->length, "&gt;", 4);
+		o->length += 4;
+		break;
 
 	      default:
-		/*
-		 * For non-ascii characters, we can use &#nnnn; escapes
+		/* For non-ascii characters, we can use &#nnnn; escapes,
+		 * but characters not legal in a document are removed.
 		 */
-		if (c > 127)
+		if ((c > 127 && c <= 0xd7ff) || (c >= 0xe000 && c <= 0xfffd))
 		  {
-		    output += 5;
-		    while (c >= 1000)
+		    char	digits[8];
+		    int		d = 0;
+
+		    while (c > 0)
 		      {
-			output++;
+			digits[d++] = '0' + c % 10;
 			c /= 10;
 		      }
-		    escape = YES;
+		    o->buf[o->length++] = '&';
+		    o->buf[o->length++] = '#';
+		    while (d > 0)
+		      {
+			o->buf[o->length++] = digits[--d];
+		      }
+		    o->buf[o->length++] = ';';
 		  }
-		output++;
 		break;
 	    }
 	}
-      else
+      pos += count;
+    }
+}
+
+/* Return the number of characters at the start of str which need no
+ * escaping (the length of the string if none do).
+ */
+static NSUInteger
+htmlSafeLength(NSString *str, NSUInteger length)
+{
+  unichar	chars[256];
+  NSUInteger	pos = 0;
+
+  while (pos < length)
+    {
+      NSUInteger	count = length - pos;
+      NSUInteger	run;
+
+      if (count > 256)
+	{
+	  count = 256;
+	}
+      [str getCharacters: chars range: NSMakeRange(pos, count)];
+      run = htmlSafeRun(chars, count);
+      pos += run;
+      if (run < count)
 	{
-	  escape = YES;	// Need to remove bad characters
+	  break;
 	}
     }
+  return pos;
+}
+
++ (NSString*) escapeHTML: (NSString*)str
+{
+  NSUInteger	length = [str length];
+  NSUInteger	safe;
+  NSMutableData	*d;
+  HTMLOut	o;
 
-  if (escape)
+  if (length == 0)
+    {
+      return str;
+    }
+  safe = htmlSafeLength(str, length);
+  if (safe == length)
     {
-      unichar	*to;
-      NSUInteger	j = 0;
+      return str;	// Nothing to escape
+    }
+  d = [Alloc(NSMutableDataClass) initWithCapacity: length + 64];
+  o.string = nil;
+  o.data = d;
+  o.length = 0;
+  htmlEscape(str, length, safe, &o);
+  htmlFlush(&o);
+  str = [Alloc(NSStringClass) initWithData: d encoding: NSASCIIStringEncoding];
+  RELEASE(d);
+  return AUTORELEASE(str);
+}
 
-      to = NSZoneMalloc (NSDefaultMallocZone(), sizeof(unichar) * output);
++ (void) escapeHTML: (NSString*)str into: (NSMutableString*)result
+{
+  NSUInteger	length = [str length];
+  NSUInteger	safe;
+  HTMLOut	o;
 
-      for (i = 0; i < length; i++)
-	{
-	  unichar	c = from[i];
+  if (length == 0)
+    {
+      return;
+    }
+  safe = htmlSafeLength(str, length);
+  if (safe == length)
+    {
+      [result appendString: str];
+      return;
+    }
+  o.string = result;
+  o.data = nil;
+  o.length = 0;
+  htmlEscape(str, length, safe, &o);
+  htmlFlush(&o);
+}
 
-	  if ((c >= 0x20 && c <= 0xd7ff)
-	    || c == 0x9 || c == 0xd || c == 0xa
-	    || (c >= 0xe000 && c <= 0xfffd))
-	    {
-	      switch (c)
-		{
-		  case '"':
-		    to[j++] = '&';
-		    to[j++] = 'q';
-		    to[j++] = 'u';
-		    to[j++] = 'o';
-		    to[j++] = 't';
-		    to[j++] = ';';
-		    break;
-
-		  case '\'':
-		    to[j++] = '&';
-		    to[j++] = 'a';
-		    to[j++] = 'p';
-		    to[j++] = 'o';
-		    to[j++] = 's';
-		    to[j++] = ';';
-		    break;
-
-		  case '&':
-		    to[j++] = '&';
-		    to[j++] = 'a';
-		    to[j++] = 'm';
-		    to[j++] = 'p';
-		    to[j++] = ';';
-		    break;
-
-		  case '<':
-		    to[j++] = '&';
-		    to[j++] = 'l';
-		    to[j++] = 't';
-		    to[j++] = ';';
-		    break;
-
-		  case '>':
-		    to[j++] = '&';
-		    to[j++] = 'g';
-		    to[j++] = 't';
-		    to[j++] = ';';
-		    break;
-
-		  default:
-		    if (c > 127)
-		      {
-			char	buf[12];
-			char	*ptr = buf;
-
-			to[j++] = '&';
-			to[j++] = '#';
-			sprintf(buf, "%u", c);
-			while (*ptr != '\0')
-			  {
-			    to[j++] = *ptr++;
-			  }
-			to[j++] = ';';
-		      }
-		    else
-		      {
-			to[j++] = c;
-		      }
-		    break;
-		}
-	    }
-	}
-      str = [[NSString alloc] initWithCharacters: to length: output];
-      NSZoneFree (NSDefaultMallocZone (), to);
-      [str autorelease];
++ (void) escapeHTML: (NSString*)str intoData: (NSMutableData*)result
+{
+  NSUInteger	length = [str length];
+  HTMLOut	o;
+
+  if (length == 0)
+    {
+      return;
     }
-  NSZoneFree (NSDefaultMallocZone (), from);
-  return str;
+  o.string = nil;
+  o.data = result;
+  o.length = 0;
+  htmlEscape(str, length, 0, &o);
+  htmlFlush(&o);
 }
 
 + (BOOL) matchIP: (NSString*)address to: (NSString*)pattern
@@ -810,6 +1105,114 @@ escapeData(const uint8_t *bytes, NSUInteger length, NSMutableData *d)
   return YES;
 }
 
+/* Returns YES if the comma separated list contains the token (ignoring
+ * case).
+ */
+static BOOL
+hasToken(NSString *list, NSString *token)
+{
+  NSEnumerator	*e;
+  NSString	*s;
+
+  e = [[list componentsSeparatedByString: @","] objectEnumerator];
+  while (nil != (s = [e nextObject]))
+    {
+      s = [s stringByTrimmingSpaces];
+      if ([s caseInsensitiveCompare: token] == NSOrderedSame)
+	{
+	  return YES;
+	}
+    }
+  return NO;
+}
+
+- (BOOL) acceptWebSocket: (WebServerRequest*)request
+		response: (WebServerResponse*)response
+{
+  WebServerConnection	*connection;
+  NSString		*key;
+  NSData		*d;
+  BOOL			accepted;
+
+  if (NO == [response isKindOfClass: WebServerResponseClass])
+    {
+      [NSException raise: NSInvalidArgumentException
+        format: @"[%@-%@] argument is not a valid response object",
+        NSStringFromClass([self class]), NSStringFromSelector(_cmd)];
+    }
+  key = [[request headerNamed: @"sec-websocket-key"] value];
+  d = [GSMimeDocumentClass decodeBase64:
+    [key dataUsingEncoding: NSASCIIStringEncoding]];
+  if (NO == [[[request headerNamed: @"x-http-method"] value]
+    isEqualToString: @"GET"]
+    || [[[request headerNamed: @"x-http-version"] value] floatValue] < 1.1
+    || NO == hasToken([[request headerNamed: @"upgrade"] value],
+      @"websocket")
+    || NO == hasToken([[request headerNamed: @"connection"] value],
+      @"upgrade")
+    || 16 != [d length])
+    {
+      [response setHeader: @"http"
+		    value: @"HTTP/1.1 400 Bad Request"
+	       parameters: nil];
+      return NO;
+    }
+  if (NO == [[[request headerNamed: @"sec-websocket-version"] value]
+    isEqualToString: @"13"])
+    {
+      [response setHeader: @"http"
+		    value: @"HTTP/1.1 426 Upgrade Required"
+	       parameters: nil];
+      [response setHeader: @"Sec-WebSocket-Version"
+		    value: @"13"
+	       parameters: nil];
+      return NO;
+    }
+
+  [_lock lock];
+  connection = [[response webServerConnection] retain];
+  [_lock unlock];
+  accepted = [connection acceptWebSocket];
+  [connection release];
+  if (NO == accepted)
+    {
+      [response setHeader: @"http"
+		    value: @"HTTP/1.1 400 Bad Request"
+	       parameters: nil];
+      return NO;
+    }
+  [response setHeader: @"http"
+		value: @"HTTP/1.1 101 Switching Protocols"
+	   parameters: nil];
+  [response setHeader: @"Upgrade"
+		value: @"websocket"
+	   parameters: nil];
+  [response setHeader: @"Connection"
+		value: @"Upgrade"
+	   parameters: nil];
+  [response setHeader: @"Sec-WebSocket-Accept"
+		value: WebServerWebSocketAccept(key)
+	   parameters: nil];
+  return YES;
+}
+
+- (NSDictionary*) admissionState
+{
+  NSDictionary	*d;
+
+  [_lock lock];
+  d = [NSDictionaryClass dictionaryWithObjectsAndKeys:
+    [NSNumber numberWithDouble: _conf->admissionTarget], @"Target",
+    [NSNumber numberWithDouble: _conf->admissionInterval], @"Interval",
+    [NSNumber numberWithDouble: _queueDelay], @"QueueDelay",
+    [NSNumber numberWithBool: _shedding], @"Shedding",
+    [NSNumber numberWithUnsignedInteger: _shedCount], @"Shed",
+    [NSNumber numberWithUnsignedInteger: _processingCount], @"Processing",
+    nil];
+  [_lock unlock];
+  return d;
+}
+
 - (BOOL) accessRequest: (WebServerRequest*)request
 	      response: (WebServerResponse*)response
 {
@@ -919,25 +1322,48 @@ escapeData(const uint8_t *bytes, NSUInteger length, NSMutableData *d)
   [_lock unlock];
 }
 
-- (void) completedWithResponse: (WebServerResponse*)response
+- (void) closeWebSocket: (WebServerResponse*)response
 {
+  WebServerConnection	*connection;
+
   if (NO == [response isKindOfClass: WebServerResponseClass])
     {
       [NSException raise: NSInvalidArgumentException
         format: @"[%@-%@] argument is not a valid response object",
         NSStringFromClass([self class]), NSStringFromSelector(_cmd)];
     }
-  if (YES == [response completing])
+  [_lock lock];
+  connection = [[response webServerConnection] retain];
+  [_lock unlock];
+  if (YES == [connection webSocket])
     {
-      [NSException raise: NSInvalidArgumentException
-        format: @"[%@-%@] argument is already completing",
-        NSStringFromClass([self class]), NSStringFromSelector(_cmd)];
-    }
+      [connection performSelector: @selector(_wsSend:)
+			 onThread: [connection ioThread]->thread
+		       withObject: nil
+		    waitUntilDone: NO];
+    }
+  [connection release];
+}
+
+- (void) completedWithResponse: (WebServerResponse*)response
+{
+  if (NO == [response isKindOfClass: WebServerResponseClass])
+    {
+      [NSException raise: NSInvalidArgumentException
+        format: @"[%@-%@] argument is not a valid response object",
+        NSStringFromClass([self class]), NSStringFromSelector(_cmd)];
+    }
+  if (YES == [response completing])
+    {
+      [NSException raise: NSInvalidArgumentException
+        format: @"[%@-%@] argument is already completing",
+        NSStringFromClass([self class]), NSStringFromSelector(_cmd)];
+    }
   if (YES == _doPostProcess)
     {
-      [_pool scheduleSelector: @selector(_process4:)
-		   onReceiver: self
-		   withObject: response];
+      [self _schedule: @selector(_process4:)
+	   onReceiver: self
+	   withObject: response];
     }
   else
     {
@@ -952,7 +1378,12 @@ escapeData(const uint8_t *bytes, NSUInteger length, NSMutableData *d)
           _processingCount--;
           connection = [[response webServerConnection] retain];
         }
-      [response setWebServerConnection: nil];
+      if (NO == [connection webSocket])
+	{
+	  /* A WebSocket stays linked to the response identifying it.
+	   */
+	  [response setWebServerConnection: nil];
+	}
       [_lock unlock];
       if (YES == wasCompleting)
         {
@@ -962,24 +1393,44 @@ escapeData(const uint8_t *bytes, NSUInteger length, NSMutableData *d)
                 @" which is already complete: %@", response];
             }
         }
-      else if (nil == connection)
-	{
-          if (YES == _conf->verbose)
-            {
-              [self _log: @"The client has already closed the connection"
-                @" for response: %@", response];
-            }
-	}
       else
 	{
-	  [_pool scheduleSelector: @selector(respond:)
-		       onReceiver: connection
-		       withObject: nil];
-	  [connection release];
+	  [self _laneDone: response];
+	  if (nil == connection)
+	    {
+	      if (YES == _conf->verbose)
+		{
+		  [self _log: @"The client has already closed the connection"
+		    @" for response: %@", response];
+		}
+	    }
+	  else
+	    {
+	      [self _schedule: @selector(respond:)
+		   onReceiver: connection
+		   withObject: nil];
+	      [connection release];
+	    }
 	}
     }
 }
 
+- (NSDictionary*) compressionState
+{
+  NSDictionary	*d;
+
+  [_lock lock];
+  d = [NSDictionaryClass dictionaryWithObjectsAndKeys:
+    [NSNumber numberWithUnsignedInteger: _conf->compressMin], @"Minimum",
+    [NSNumber numberWithUnsignedInteger: _compressCount], @"Count",
+    [NSNumber numberWithUnsignedLongLong: _compressIn], @"BytesIn",
+    [NSNumber numberWithUnsignedLongLong: _compressOut], @"BytesOut",
+    [NSNumber numberWithDouble: _compressTime], @"Duration",
+    nil];
+  [_lock unlock];
+  return d;
+}
+
 - (NSArray*) connections
 {
   NSArray	*a;
@@ -995,6 +1446,9 @@ escapeData(const uint8_t *bytes, NSUInteger length, NSMutableData *d)
   [self setAddress: nil port: nil secure: nil];
   [self setIOThreads: 0 andPool: 0];
   DESTROY(_authFailureLog);
+  DESTROY(_rateLimiter);
+  DESTROY(_lanes);
+  DESTROY(_poolQueue);
   DESTROY(_nc);
   DESTROY(_defs);
   DESTROY(_root);
@@ -1009,6 +1463,8 @@ escapeData(const uint8_t *bytes, NSUInteger length, NSMutableData *d)
     }
   DESTROY(_ioThreads);
   DESTROY(_userInfoMap);
+  DESTROY(_parametersMap);
+  DESTROY(_uploadsMap);
   DESTROY(_incrementalDataMap);
   DESTROY(_userInfoLock);
   DESTROY(_incrementalDataLock);
@@ -1045,6 +1501,30 @@ escapeData(const uint8_t *bytes, NSUInteger length, NSMutableData *d)
   return [[self class] escapeHTML: str];
 }
 
+- (void) escapeHTML: (NSString*)str into: (NSMutableString*)result
+{
+  [[self class] escapeHTML: str into: result];
+}
+
+- (void) escapeHTML: (NSString*)str intoData: (NSMutableData*)result
+{
+  [[self class] escapeHTML: str intoData: result];
+}
+
+- (NSString*) fileForPart: (GSMimeDocument*)part
+		ofRequest: (WebServerRequest*)request
+{
+  WebServerMultipartReader	*r;
+  NSString			*file;
+
+  [_userInfoLock lock];
+  r = [[_uploadsMap objectForKey: request] retain];
+  [_userInfoLock unlock];
+  file = [[r fileForPart: part] retain];
+  [r release];
+  return [file autorelease];
+}
+
 - (NSString*) description
 {
   NSString	        *result;
@@ -1093,34 +1573,31 @@ escapeData(const uint8_t *bytes, NSUInteger length, NSMutableData *d)
   result = [NSStringClass stringWithFormat: @"%@ on %@(%@),"
     @"\n  %"PRIuPTR" %@ of %"PRIuPTR" (%"PRIuPTR"/host) connections,"
     @"\n  %"PRIuPTR" active, %"PRIuPTR" idle, %"PRIuPTR" ended,"
-    @" %"PRIuPTR " requests,"
-    @" listening: %@%@%@",
+    @" %"PRIuPTR " requests, %"PRIuPTR" banned,"
+    @" %"PRIuPTR" rate limited,"
+    @"\n  %"PRIuPTR" shed (%@, queue delay %.3f), listening: %@%@%@%@",
     [super description], _port, ([self isSecure] ? @"https" : @"http"),
     count, byHost, _maxConnections, _maxPerHost, active, idle,
-    _handled, _requests, _accepting ? @"yes" : @"no",
-    [self _ioThreadDescription], [self _poolDescription]];
+    _handled, _requests, _bannedRejects, [_rateLimiter limited],
+    _shedCount, (_shedding ? @"shedding" : @"admitting"), _queueDelay,
+    _accepting ? @"yes" : @"no",
+    [self _ioThreadDescription], [self _poolDescription],
+    [self _laneDescription]];
   [_lock unlock];
   return result;
 }
 
 - (NSData*) incrementalDataForRequest: (WebServerRequest*)request
 {
-  NSMutableData *m;
-  NSData        *d;
+  WebServerIncrementalReader	*r;
+  NSData			*d;
 
   [_incrementalDataLock lock];
-  m = [_incrementalDataMap objectForKey: request];
-  if (0 == [m length])
-    {
-      d = nil;
-    }
-  else
-    {
-      d = [m copy];
-      [m setLength: 0];
-    }
+  r = [[_incrementalDataMap objectForKey: request] retain];
   [_incrementalDataLock unlock];
-  return [d autorelease];
+  d = [r take];
+  [r release];
+  return d;
 }
 
 - (id) init
@@ -1169,9 +1646,193 @@ escapeData(const uint8_t *bytes, NSUInteger length, NSMutableData *d)
     {
       return @"";
     }
+  if (_poolMaximum > 0)
+    {
+      NSTimeInterval	oldest = 0.0;
+
+      if (nil != _poolQueue->head)
+	{
+	  oldest = [NSDateClass timeIntervalSinceReferenceDate]
+	    - ((WebServerPoolItem*)_poolQueue->head)->queued;
+	}
+      return [NSString stringWithFormat: @"\nWorkers: %@"
+	@"\n  elastic %"PRIuPTR"-%"PRIuPTR", %"PRIuPTR" active,"
+	@" %"PRIuPTR" queued (oldest %.3f)",
+	_pool, _poolMinimum, _poolMaximum, _poolActive,
+	(NSUInteger)_poolQueue->count, oldest];
+    }
   return [NSString stringWithFormat: @"\nWorkers: %@", _pool];
 }
 
+/* Formats a time as an HTTP date.
+ */
+static NSString *
+httpDate(time_t t)
+{
+  struct tm	tm;
+  char		buf[64];
+
+  gmtime_r(&t, &tm);
+  strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  return [NSStringClass stringWithUTF8String: buf];
+}
+
+/* Sorts the ranges and merges any which overlap or are adjacent, so that
+ * no part of the resource is sent twice.  Returns the number of ranges
+ * left, or -1 if several ranges together cover the whole resource (which
+ * is then better sent as a normal response).
+ */
+static int
+mergeRanges(WebServerByteRange *ranges, int count, unsigned long long size)
+{
+  int	requested = count;
+  int	i;
+  int	j;
+
+  for (i = 1; i < count; i++)
+    {
+      WebServerByteRange	r = ranges[i];
+
+      for (j = i; j > 0 && ranges[j - 1].from > r.from; j--)
+	{
+	  ranges[j] = ranges[j - 1];
+	}
+      ranges[j] = r;
+    }
+  for (i = 0, j = 1; j < count; j++)
+    {
+      if (ranges[j].from <= ranges[i].to + 1)
+	{
+	  if (ranges[j].to > ranges[i].to)
+	    {
+	      ranges[i].to = ranges[j].to;
+	    }
+	}
+      else
+	{
+	  ranges[++i] = ranges[j];
+	}
+    }
+  if (count > 0)
+    {
+      count = i + 1;
+    }
+  if (requested > 1 && 1 == count
+    && 0 == ranges[0].from && size - 1 == ranges[0].to)
+    {
+      return -1;
+    }
+  return count;
+}
+
+int
+WebServerParseRanges(NSString *spec, unsigned long long size,
+  WebServerByteRange *ranges)
+{
+  const char	*s = [spec UTF8String];
+  int		count = 0;
+
+  if (NULL == s)
+    {
+      return -1;
+    }
+  while (' ' == *s)
+    {
+      s++;
+    }
+  if (strncasecmp(s, "bytes=", 6) != 0)
+    {
+      return -1;	// Not a unit we know
+    }
+  s += 6;
+  for (;;)
+    {
+      unsigned long long	from;
+      unsigned long long	to;
+      char			*end;
+      BOOL			ok = YES;
+
+      while (' ' == *s || '\t' == *s)
+	{
+	  s++;
+	}
+      if ('-' == *s)
+	{
+	  /* A suffix range ... the last so many bytes.
+	   */
+	  s++;
+	  if (!isdigit((unsigned char)*s))
+	    {
+	      return -1;
+	    }
+	  to = strtoull(s, &end, 10);
+	  s = end;
+	  if (0 == to || 0 == size)
+	    {
+	      ok = NO;
+	    }
+	  from = (to < size) ? size - to : 0;
+	  to = size - 1;
+	}
+      else
+	{
+	  if (!isdigit((unsigned char)*s))
+	    {
+	      return -1;
+	    }
+	  from = strtoull(s, &end, 10);
+	  s = end;
+	  if (*s++ != '-')
+	    {
+	      return -1;
+	    }
+	  if (isdigit((unsigned char)*s))
+	    {
+	      to = strtoull(s, &end, 10);
+	      s = end;
+	      if (to < from)
+		{
+		  return -1;
+		}
+	    }
+	  else
+	    {
+	      to = size - 1;
+	    }
+	  if (from >= size)
+	    {
+	      ok = NO;
+	    }
+	  else if (to >= size)
+	    {
+	      to = size - 1;
+	    }
+	}
+      if (YES == ok)
+	{
+	  if (WEBSERVER_MAXRANGES == count)
+	    {
+	      return -1;
+	    }
+	  ranges[count].from = from;
+	  ranges[count].to = to;
+	  count++;
+	}
+      while (' ' == *s || '\t' == *s)
+	{
+	  s++;
+	}
+      if ('\0' == *s)
+	{
+	  return mergeRanges(ranges, count, size);
+	}
+      if (*s++ != ',')
+	{
+	  return -1;
+	}
+    }
+}
+
 - (BOOL) produceResponse: (WebServerResponse*)aResponse
 	  fromStaticPage: (NSString*)aPath
 		   using: (NSDictionary*)map
@@ -1180,6 +1841,7 @@ escapeData(const uint8_t *bytes, NSUInteger length, NSMutableData *d)
   NSString	*path = (_root == nil) ? (id)@"" : (id)_root;
   NSString	*ext = [aPath pathExtension];
   id		data = nil;
+  NSString	*gz;
   NSString	*type;
   NSString	*str;
   NSFileManager	*mgr;
@@ -1238,6 +1900,32 @@ escapeData(const uint8_t *bytes, NSUInteger length, NSMutableData *d)
       [self _log: @"Can't read static page '%@' ('%@')", aPath, path];
       result = NO;
     }
+  else if (nil != (gz = [self _gzipVariant: path
+				       root: str
+				       type: type
+					for: aResponse])
+    && YES == [self _produceRange: aResponse fromFile: gz type: type])
+    {
+      /* Part of the compressed variant.
+       */
+      [aResponse setHeader: @"Content-Encoding" value: @"gzip" parameters: nil];
+    }
+  else if (nil == gz
+    && YES == [self _produceRange: aResponse fromFile: path type: type])
+    {
+      result = YES;	// Part of the file
+    }
+  else if (nil != gz
+    && (data = [NSDataClass dataWithContentsOfFile: gz]) != nil)
+    {
+      [aResponse setContent: data type: type name: nil];
+      if (YES == string)
+        {
+	  [[aResponse headerNamed: @"content-type"] setParameter: @"utf-8"
+							  forKey: @"charset"];
+        }
+      [aResponse setHeader: @"Content-Encoding" value: @"gzip" parameters: nil];
+    }
   else if (YES == string
     && (data = [NSStringClass stringWithContentsOfFile: path]) == nil)
     {
@@ -1268,46 +1956,32 @@ escapeData(const uint8_t *bytes, NSUInteger length, NSMutableData *d)
 		   using: (NSDictionary*)map
 {
   CREATE_AUTORELEASE_POOL(arp);
-  NSString	*path = (_root == nil) ? (id)@"" : (id)_root;
-  NSString	*str;
-  NSFileManager	*mgr;
-  BOOL		result;
+  WebServerTemplate	*t;
+  BOOL			result;
 
-  path = [path stringByAppendingString: @"/"];
-  str = [path stringByStandardizingPath];
-  path = [path stringByAppendingPathComponent: aPath];
-  path = [path stringByStandardizingPath];
-  mgr = [NSFileManager defaultManager];
-  if ([path hasPrefix: str] == NO)
-    {
-      [self _log: @"Illegal template '%@' ('%@')", aPath, path];
-      result = NO;
-    }
-  else if ([mgr isReadableFileAtPath: path] == NO)
-    {
-      [self _log: @"Can't read template '%@' ('%@')", aPath, path];
-      result = NO;
-    }
-  else if ((str = [NSStringClass stringWithContentsOfFile: path]) == nil)
+  if ((t = [self _templateAtPath: aPath]) == nil)
     {
-      [self _log: @"Failed to load template '%@' ('%@')", aPath, path];
       result = NO;
     }
   else
     {
-      NSMutableString	*m;
+      NSMutableData	*m;
 
-      m = [Alloc(NSMutableStringClass) initWithCapacity: [str length]];
-      result = [self substituteFrom: str
-			      using: map
-			       into: m
-			      depth: 0];
+      m = [Alloc(NSMutableDataClass) initWithCapacity: [t length] * 2];
+      result = [t renderUsing: map
+			 into: m
+			depth: 0
+			limit: _substitutionLimit];
       if (result)
 	{
 	  [aResponse setContent: m type: @"text/html" name: nil];
 	  [[aResponse headerNamed: @"content-type"] setParameter: @"utf-8"
 							  forKey: @"charset"];
 	}
+      else
+	{
+	  [self _alert: @"Substitution exceeded limit (%u)", _substitutionLimit];
+	}
       RELEASE(m);
     }
   DESTROY(arp);
@@ -1317,9 +1991,18 @@ escapeData(const uint8_t *bytes, NSUInteger length, NSMutableData *d)
 - (NSMutableDictionary*) parameters: (WebServerRequest*)request
 {
   NSMutableDictionary	*params;
-  NSString		*str = [[request headerNamed: @"x-http-query"] value];
+  NSString		*str;
   NSData		*data;
 
+  [_userInfoLock lock];
+  params = [[_parametersMap objectForKey: request] retain];
+  [_userInfoLock unlock];
+  if (nil != params)
+    {
+      return [params autorelease];
+    }
+
+  str = [[request headerNamed: @"x-http-query"] value];
   params = [NSMutableDictionaryClass dictionaryWithCapacity: 32];
   if ([str length] > 0)
     {
@@ -1350,7 +2033,10 @@ escapeData(const uint8_t *bytes, NSUInteger length, NSMutableData *d)
 	      hdr = [doc headerNamed: @"content-disposition"];
 	      k = [hdr parameterForKey: @"name"];
 	    }
-	  if (k != nil)
+	  /* A large upload stored in a file is left for the delegate to
+	   * get using -fileForPart:ofRequest: rather than being read back.
+	   */
+	  if (k != nil && nil == [self fileForPart: doc ofRequest: request])
 	    {
 	      NSMutableArray	*a;
 
@@ -1366,6 +2052,10 @@ escapeData(const uint8_t *bytes, NSUInteger length, NSMutableData *d)
 	}
     }
 
+  if ([request isKindOfClass: [WebServerRequest class]])
+    {
+      [self _setParameters: params forRequest: request];
+    }
   return params;
 }
 
@@ -1421,6 +2111,64 @@ escapeData(const uint8_t *bytes, NSUInteger length, NSMutableData *d)
   return [s autorelease];
 }
 
+- (NSDictionary*) rateLimits
+{
+  NSDictionary	*d;
+
+  [_lock lock];
+  d = [[_rateLimiter limits] retain];
+  [_lock unlock];
+  return [d autorelease];
+}
+
+- (NSUInteger) rateLimitedRequests
+{
+  NSUInteger	count;
+
+  [_lock lock];
+  count = [_rateLimiter limited];
+  [_lock unlock];
+  return count;
+}
+
+- (BOOL) sendWebSocket: (id)message withResponse: (WebServerResponse*)response
+{
+  WebServerConnection	*connection;
+  NSData		*frame;
+
+  if (nil == (frame = WebServerWebSocketFrame(message)))
+    {
+      [NSException raise: NSInvalidArgumentException
+        format: @"[%@-%@] message is neither a string nor data",
+        NSStringFromClass([self class]), NSStringFromSelector(_cmd)];
+    }
+  if (NO == [response isKindOfClass: WebServerResponseClass])
+    {
+      [NSException raise: NSInvalidArgumentException
+        format: @"[%@-%@] argument is not a valid response object",
+        NSStringFromClass([self class]), NSStringFromSelector(_cmd)];
+    }
+
+  [_lock lock];
+  connection = [[response webServerConnection] retain];
+  [_lock unlock];
+  if (NO == [connection webSocket])
+    {
+      if (YES == _conf->verbose)
+        {
+          [self _log: @"No WebSocket to send to for response: %@", response];
+        }
+      [connection release];
+      return NO;
+    }
+  [connection performSelector: @selector(_wsSend:)
+		     onThread: [connection ioThread]->thread
+		   withObject: frame
+		waitUntilDone: NO];
+  [connection release];
+  return YES;
+}
+
 /* For internal use ... must be called in the main I/O thread.
  */
 - (void) _setupIO: (NSArray*)a
@@ -1642,6 +2390,42 @@ escapeData(const uint8_t *bytes, NSUInteger length, NSMutableData *d)
   return ok;
 }
 
+- (void) setAdmissionExemptPaths: (NSArray*)prefixes
+{
+  WebServerConfig	*c = [_conf copy];
+
+  if (0 == [prefixes count])
+    {
+      prefixes = nil;
+    }
+  ASSIGNCOPY(c->admissionExempt, prefixes);
+  [_conf release];
+  _conf = c;
+}
+
+- (void) setAdmissionTarget: (NSTimeInterval)target
+		   interval: (NSTimeInterval)interval
+{
+  WebServerConfig	*c = [_conf copy];
+
+  if (target < 0.0)
+    {
+      target = 0.0;
+    }
+  if (interval < target)
+    {
+      interval = target;
+    }
+  c->admissionTarget = target;
+  c->admissionInterval = interval;
+  [_conf release];
+  _conf = c;
+  [_lock lock];
+  _shedding = NO;
+  _aboveUntil = 0.0;
+  [_lock unlock];
+}
+
 - (void) setAuthenticationFailureBanTime: (NSTimeInterval)ti
 {
   if (ti > 0.0)
@@ -1664,6 +2448,7 @@ escapeData(const uint8_t *bytes, NSUInteger length, NSMutableData *d)
     {
       _authFailureMaxRetry = 0;
     }
+  [_authFailureLog setCapacity: _authFailureMaxRetry + 1];
 }
 
 - (void) setAuthenticationFailureFindTime: (NSTimeInterval)ti
@@ -1679,10 +2464,22 @@ escapeData(const uint8_t *bytes, NSUInteger length, NSMutableData *d)
   [_authFailureLog setFindTime: _authFailureFindTime];
 }
 
-- (void) setDelegate: (id)anObject
+- (void) setAutomaticETags: (BOOL)aFlag
 {
-  _delegate = anObject;
-  _doAudit = [_delegate respondsToSelector:
+  if (aFlag != _conf->autoETag)
+    {
+      WebServerConfig	*c = [_conf copy];
+  
+      c->autoETag = aFlag;
+      [_conf release];
+      _conf = c;
+    }
+}
+
+- (void) setDelegate: (id)anObject
+{
+  _delegate = anObject;
+  _doAudit = [_delegate respondsToSelector:
     @selector(webAudit:for:)];
   _doProcess = [_delegate respondsToSelector:
     @selector(processRequest:response:for:)];
@@ -1694,6 +2491,11 @@ escapeData(const uint8_t *bytes, NSUInteger length, NSMutableData *d)
     @selector(incrementalRequest:for:)];
 }
 
+- (void) setDropBannedConnections: (BOOL)aFlag
+{
+  _dropBanned = aFlag ? YES : NO;
+}
+
 - (void) setDurationLogging: (BOOL)aFlag
 {
   if (aFlag != _conf->durations)
@@ -1742,6 +2544,43 @@ escapeData(const uint8_t *bytes, NSUInteger length, NSMutableData *d)
     }
 }
 
+- (void) setMaxPipeline: (NSUInteger)max
+{
+  if (max != _conf->maxPipeline)
+    {
+      WebServerConfig	*c = [_conf copy];
+  
+      c->maxPipeline = max;
+      [_conf release];
+      _conf = c;
+    }
+}
+
+- (void) setStreamBatch: (NSUInteger)bytes maxDelay: (NSTimeInterval)delay
+{
+  if (0 == bytes)
+    {
+      delay = 0.0;
+    }
+  else if (delay <= 0.0)
+    {
+      delay = 0.01;
+    }
+  else if (delay > 1.0)
+    {
+      delay = 1.0;
+    }
+  if (bytes != _conf->streamBatch || delay != _conf->streamDelay)
+    {
+      WebServerConfig	*c = [_conf copy];
+  
+      c->streamBatch = bytes;
+      c->streamDelay = delay;
+      [_conf release];
+      _conf = c;
+    }
+}
+
 - (void) setMaxConnections: (NSUInteger)max
 {
   if (0 == max || max > MAXCONNECTIONS)
@@ -1809,6 +2648,16 @@ escapeData(const uint8_t *bytes, NSUInteger length, NSMutableData *d)
     }
 }
 
+- (void) setPrecompressedStatic: (BOOL)aFlag cache: (NSString*)directory
+{
+  WebServerConfig	*c = [_conf copy];
+
+  c->staticGzip = aFlag;
+  ASSIGNCOPY(c->gzipCache, (YES == aFlag) ? directory : nil);
+  [_conf release];
+  _conf = c;
+}
+
 - (void) setPermittedMethods: (NSSet*)s
 {
   WebServerConfig	*c = [_conf copy];
@@ -1827,6 +2676,54 @@ escapeData(const uint8_t *bytes, NSUInteger length, NSMutableData *d)
   return [self setAddress: nil port: aPort secure: secure];
 }
 
+- (void) setProcessingLanes: (NSDictionary*)config
+{
+  NSMutableArray	*lanes = nil;
+  NSArray		*names;
+  NSUInteger		count;
+  NSUInteger		index;
+
+  if (nil != config && NO == [config isKindOfClass: NSDictionaryClass])
+    {
+      [NSException raise: NSInvalidArgumentException
+		  format: @"[%@-%@] configuration is not a dictionary",
+	NSStringFromClass([self class]), NSStringFromSelector(_cmd)];
+    }
+  names = [[config allKeys] sortedArrayUsingSelector: @selector(compare:)];
+  count = [names count];
+  if (count > 0)
+    {
+      lanes = [NSMutableArray arrayWithCapacity: count];
+      for (index = 0; index < count; index++)
+	{
+	  NSString	*name = [names objectAtIndex: index];
+	  WebServerLane	*lane;
+
+	  lane = [[WebServerLane alloc] initWithName: name
+					      config: [config objectForKey: name]];
+	  [lanes addObject: lane];
+	  [lane release];
+	}
+    }
+  [_lock lock];
+  ASSIGNCOPY(_lanes, lanes);
+  [_lock unlock];
+}
+
+- (void) setRateLimits: (NSDictionary*)limits
+{
+  WebServerRateLimiter	*limiter = nil;
+
+  if ([limits count] > 0)
+    {
+      limiter = [[WebServerRateLimiter alloc] initWithLimits: limits];
+    }
+  [_lock lock];
+  [_rateLimiter release];
+  _rateLimiter = limiter;
+  [_lock unlock];
+}
+
 - (void) setRoot: (NSString*)aPath
 {
   ASSIGN(_root, aPath);
@@ -1844,11 +2741,45 @@ escapeData(const uint8_t *bytes, NSUInteger length, NSMutableData *d)
     }
 }
 
+- (void) setSpoolThreshold: (NSUInteger)bytes
+{
+  if (bytes != _conf->spoolThreshold)
+    {
+      WebServerConfig	*c = [_conf copy];
+  
+      c->spoolThreshold = bytes;
+      [_conf release];
+      _conf = c;
+    }
+}
+
 - (void) setStrictTransportSecurity: (NSUInteger)seconds
 {
   _strictTransportSecurity = seconds;
 }
 
+- (void) setCompressionMinimum: (NSUInteger)bytes types: (NSArray*)types
+{
+  WebServerConfig	*c = [_conf copy];
+  NSMutableArray	*a = nil;
+
+  if (nil != types)
+    {
+      NSEnumerator	*e = [types objectEnumerator];
+      NSString		*t;
+
+      a = [NSMutableArray arrayWithCapacity: [types count]];
+      while (nil != (t = [e nextObject]))
+	{
+	  [a addObject: [t lowercaseString]];
+	}
+    }
+  c->compressMin = bytes;
+  ASSIGNCOPY(c->compressTypes, a);
+  [_conf release];
+  _conf = c;
+}
+
 - (void) setConnectionTimeout: (NSTimeInterval)aDelay
 {
   if (aDelay != _connectionTimeout)
@@ -1892,6 +2823,60 @@ escapeData(const uint8_t *bytes, NSUInteger length, NSMutableData *d)
     }
 }
 
+- (void) setElasticPoolMinimum: (NSUInteger)minimum
+		       maximum: (NSUInteger)maximum
+		     growAfter: (NSTimeInterval)wait
+		   shrinkAfter: (NSTimeInterval)idle
+{
+  if (maximum > 256)
+    {
+      maximum = 256;
+    }
+  if (minimum < 1)
+    {
+      minimum = 1;
+    }
+  if (maximum <= minimum)
+    {
+      maximum = 0;	// Not elastic
+    }
+  [_lock lock];
+  _poolMinimum = minimum;
+  _poolMaximum = maximum;
+  _poolGrowWait = (wait > 0.0) ? wait : 0.1;
+  _poolIdleTime = (idle > 0.0) ? idle : 60.0;
+  _poolSpare = 0.0;
+  if (maximum > 0)
+    {
+      NSUInteger	threads = [_pool maxThreads];
+
+      if (threads < minimum || threads > maximum)
+	{
+	  [_pool setOperations: _maxConnections];
+	  [_pool setThreads: (threads < minimum) ? minimum : maximum];
+	  _poolResized = [NSDateClass timeIntervalSinceReferenceDate];
+	}
+    }
+  [_lock unlock];
+}
+
+- (void) setHTTP2: (BOOL)aFlag
+{
+  if (NO != aFlag)
+    {
+      aFlag = YES;
+    }
+  if (aFlag != _conf->http2)
+    {
+      WebServerConfig	*c;
+
+      c = [_conf copy];
+      c->http2 = aFlag;
+      [_conf release];
+      _conf = c;
+    }
+}
+
 - (void) setIOThreads: (NSUInteger)threads andPool: (NSInteger)poolSize
 {
   if (threads > 16)
@@ -1989,6 +2974,19 @@ escapeData(const uint8_t *bytes, NSUInteger length, NSMutableData *d)
   _substitutionLimit = depth;
 }
 
+- (void) setUploadDirectory: (NSString*)path
+		maxPartSize: (unsigned long long)maxPartSize
+		    maxSize: (unsigned long long)maxSize
+{
+  WebServerConfig	*c = [_conf copy];
+
+  ASSIGNCOPY(c->uploadDirectory, path);
+  c->maxUploadPartSize = maxPartSize;
+  c->maxUploadSize = maxSize;
+  [_conf release];
+  _conf = c;
+}
+
 - (void) setUserInfo: (NSObject*)info forRequest: (WebServerRequest*)request
 {
   if (nil != info && NO == [info isKindOfClass: [NSObject class]])
@@ -2031,6 +3029,78 @@ escapeData(const uint8_t *bytes, NSUInteger length, NSMutableData *d)
     }
 }
 
+- (BOOL) streamResponse: (WebServerResponse*)aResponse
+	   fromTemplate: (NSString*)aPath
+		  using: (NSDictionary*)map
+{
+  CREATE_AUTORELEASE_POOL(arp);
+  WebServerTemplate	*t;
+  BOOL			result;
+
+  if (NO == [aResponse isKindOfClass: WebServerResponseClass])
+    {
+      [NSException raise: NSInvalidArgumentException
+        format: @"[%@-%@] argument is not a valid response object",
+        NSStringFromClass([self class]), NSStringFromSelector(_cmd)];
+    }
+  if ((t = [self _templateAtPath: aPath]) == nil)
+    {
+      result = NO;
+    }
+  else
+    {
+      NSMutableData	*m;
+      BOOL		started = NO;
+
+      m = [Alloc(NSMutableDataClass) initWithCapacity: 2 * STREAMCHUNK];
+      result = [t streamUsing: map
+			 into: m
+			limit: _substitutionLimit
+		    threshold: STREAMCHUNK
+		       server: self
+		     response: aResponse
+		      started: &started];
+      if (NO == result)
+	{
+	  [self _alert: @"Substitution exceeded limit (%u)", _substitutionLimit];
+	}
+      if (YES == started)
+	{
+	  if (YES == result)
+	    {
+	      [self completedWithResponse: aResponse];
+	    }
+	  else
+	    {
+	      WebServerConnection	*connection;
+
+	      /* We have already sent part of the page, so all we can do
+	       * on failure is abort the connection (without ending the
+	       * stream) once the response is completed, so that the client
+	       * knows the page is incomplete.
+	       */
+	      [_lock lock];
+	      connection = [[aResponse webServerConnection] retain];
+	      [_lock unlock];
+	      [connection _streamAbort];
+	      [connection release];
+	    }
+	}
+      else if (YES == result)
+	{
+	  /* The page was small enough that we didn't need to stream it.
+	   */
+	  [aResponse setContent: m type: @"text/html" name: nil];
+	  [[aResponse headerNamed: @"content-type"] setParameter: @"utf-8"
+							  forKey: @"charset"];
+	  [self completedWithResponse: aResponse];
+	}
+      RELEASE(m);
+    }
+  DESTROY(arp);
+  return result;
+}
+
 - (BOOL) streamData: (NSData*)data withResponse: (WebServerResponse*)response
 {
   WebServerConnection	*connection;
@@ -2062,14 +3132,42 @@ escapeData(const uint8_t *bytes, NSUInteger length, NSMutableData *d)
     }
   else
     {
-      [_pool scheduleSelector: @selector(respond:)
-                   onReceiver: connection
-                   withObject: data];
+      [self _schedule: @selector(respond:)
+	   onReceiver: connection
+	   withObject: data];
       [connection release];
       return YES;
     }
 }
 
+- (BOOL) streamFlushWithResponse: (WebServerResponse*)response
+{
+  WebServerConnection	*connection;
+
+  if (NO == [response isKindOfClass: WebServerResponseClass])
+    {
+      [NSException raise: NSInvalidArgumentException
+        format: @"[%@-%@] argument is not a valid response object",
+        NSStringFromClass([self class]), NSStringFromSelector(_cmd)];
+    }
+
+  [_lock lock];
+  connection = [[response webServerConnection] retain];
+  [_lock unlock];
+  if (nil == connection)
+    {
+      return NO;
+    }
+  /* Scheduled in the same way as the data, so that the flush follows
+   * the data most recently streamed.
+   */
+  [self _schedule: @selector(_streamFlush:)
+       onReceiver: connection
+       withObject: nil];
+  [connection release];
+  return YES;
+}
+
 - (NSUInteger) strictTransportSecurity
 {
   return _strictTransportSecurity;
@@ -2238,6 +3336,7 @@ escapeData(const uint8_t *bytes, NSUInteger length, NSMutableData *d)
     {
       _authFailureLog = [WebServerAuthenticationFailureLog new];
       [_authFailureLog setFindTime: _authFailureFindTime];
+      [_authFailureLog setCapacity: _authFailureMaxRetry + 1];
     }
 
   /* For a bad time interval, we use the value set for authentication failures.
@@ -2260,17 +3359,18 @@ escapeData(const uint8_t *bytes, NSUInteger length, NSMutableData *d)
 
 - (NSDate*) _blocked: (NSString*)address
 {
-  NSDate        *until;
-  NSUInteger    count;
+  NSDate        	*until;
+  NSUInteger    	count;
+  NSTimeInterval	banned;
 
   if (_authFailureBanTime <= 0.0)
     {
       return nil;
     }
 
-  if (nil != (until = [_authFailureLog isBanned: address]))
+  if ((banned = [_authFailureLog bannedUntil: address]) > 0.0)
     {
-      return until;
+      return [NSDateClass dateWithTimeIntervalSinceReferenceDate: banned];
     }
 
   count = [_authFailureLog failureCountForAddress: address
@@ -2329,6 +3429,35 @@ escapeData(const uint8_t *bytes, NSUInteger length, NSMutableData *d)
   return excessive;
 }
 
+- (void) _compressed: (NSUInteger)bytesIn
+		  to: (NSUInteger)bytesOut
+	    duration: (NSTimeInterval)t
+{
+  [_lock lock];
+  _compressCount++;
+  _compressIn += bytesIn;
+  _compressOut += bytesOut;
+  _compressTime += t;
+  [_lock unlock];
+  if (YES == _conf->verbose)
+    {
+      [self _log: @"Compressed %"PRIuPTR" bytes to %"PRIuPTR" in %g seconds",
+	bytesIn, bytesOut, t];
+    }
+}
+
+/* Returns the connection of a response, or nil if the client has gone.
+ */
+- (WebServerConnection*) _connectionForResponse: (WebServerResponse*)r
+{
+  WebServerConnection	*connection;
+
+  [_lock lock];
+  connection = [[r webServerConnection] retain];
+  [_lock unlock];
+  return AUTORELEASE(connection);
+}
+
 - (void) _didConnect: (NSNotification*)notification
 {
   NSDictionary		*userInfo = [notification userInfo];
@@ -2356,6 +3485,21 @@ escapeData(const uint8_t *bytes, NSUInteger length, NSMutableData *d)
       IOThread			*ioThread = nil;
       NSUInteger		counter;
       NSUInteger		ioConns = NSNotFound;
+      NSTimeInterval		until;
+
+      /* Before doing anything else, check to see if the address of the
+       * remote end is banned (unless we are behind a proxy, in which case
+       * we must wait for the request headers to find the real address).
+       */
+      address = [hdl socketAddress];
+      if (nil != address && nil != _authFailureLog
+	&& _authFailureBanTime > 0.0 && NO == [self isTrusted]
+	&& (until = [_authFailureLog quickBannedUntil: address]) > 0.0)
+	{
+	  [self _rejectBanned: hdl address: address until: until];
+	  [self _listen];
+	  return;
+	}
 
       [_lock lock];
       if (nil == _sslConfig)
@@ -2476,7 +3620,6 @@ escapeData(const uint8_t *bytes, NSUInteger length, NSMutableData *d)
             }
 	}
 
-      address = [hdl socketAddress];
       if (nil == address)
 	{
 	  refusal = @"HTTP/1.0 403 Unable to determine client host address";
@@ -2558,43 +3701,347 @@ escapeData(const uint8_t *bytes, NSUInteger length, NSMutableData *d)
     }
 }
 
+/* Start processing of a request, either in the thread pool or (if there
+ * is no pre-processing to be done) in the main thread.
+ */
+- (void) _dispatch: (WebServerConnection*)connection
+{
+  if (YES == _doPreProcess)
+    {
+      connection->queued = [NSDateClass timeIntervalSinceReferenceDate];
+      [self _schedule: @selector(_process2:)
+	   onReceiver: self
+	   withObject: connection];
+    }
+  else if (YES == _doProcess)
+    {
+      /* OK ... now process in main thread.
+       */
+      connection->queued = [NSDateClass timeIntervalSinceReferenceDate];
+      [self performSelector: @selector(_process3:)
+		   onThread: _ioMain->thread
+		 withObject: connection
+	      waitUntilDone: NO];
+    }
+  else
+    {
+      WebServerResponse	*response = [connection response];
+
+      NSLog(@"No delegate to process or pre-process request");
+      [response setHeader: @"http"
+		    value: @"HTTP/1.0 500 Internal Server Error"
+	       parameters: nil];
+      [self completedWithResponse: response];
+    }
+}
+
 - (void) _endConnect: (WebServerConnection*)connection
 {
+  WebServerResponse	*response = [connection response];
+  WebServerLane		*lane;
+
   [_lock lock];
   /* Clear the response so any completion attempt will fail.
    */
-  [[connection response] setWebServerConnection: nil];
-  if (NO == [connection quiet])
+  [response setWebServerConnection: nil];
+  /* A request still waiting in a lane will never be processed, so we
+   * take it out of the lane.
+   */
+  lane = [response lane];
+  if (nil != lane
+    && NSNotFound != [lane->waiting indexOfObjectIdenticalTo: connection])
+    {
+      [lane->waiting removeObjectIdenticalTo: connection];
+      [response setLane: nil];
+      _processingCount--;
+    }
+  /* A follower handling a pipelined request is not counted as a
+   * connection.
+   */
+  if (nil != [_connections member: connection])
     {
-      [self _audit: connection];
-      _handled++;
+      if (NO == [connection quiet])
+	{
+	  [self _audit: connection];
+	  _handled++;
+	}
+      [_perHost removeObject: [connection address]];
+      [_connections removeObject: connection];
     }
-  [_perHost removeObject: [connection address]];
-  [_connections removeObject: connection];
   [_lock unlock];
+  [connection _unsubscribe];
+  if (nil != [connection request])
+    {
+      [self _setParameters: nil forRequest: [connection request]];
+      [self _setUploads: nil forRequest: [connection request]];
+      [self _setIncrementalReader: nil forRequest: [connection request]];
+    }
   [self _listen];
 }
 
-- (NSString*) _ioThreadDescription
+/* Returns the path of a gzip compressed variant of the static file at
+ * path (below the root directory) if the client accepts gzip coding and
+ * an up to date variant exists or can be built in the cache directory.
+ * A variant next to the file is used in preference to one in the cache.
+ */
+- (NSString*) _gzipVariant: (NSString*)path
+		      root: (NSString*)root
+		      type: (NSString*)type
+		       for: (WebServerResponse*)response
 {
-  unsigned		counter = [_ioThreads count];
+  WebServerConfig	*conf = _conf;
+  WebServerConnection	*connection;
+  WebServerCompressor	*c;
+  NSString		*gz;
+  NSString		*enc;
+  NSData		*d;
+  struct stat		sb;
+  time_t		modified;
+  BOOL			build = NO;
 
-  if (0 == counter)
+  if (NO == conf->staticGzip
+    || 0 != stat([path fileSystemRepresentation], &sb))
     {
-      return @"";
+      return nil;
     }
-  else
+  modified = sb.st_mtime;
+  gz = [path stringByAppendingPathExtension: @"gz"];
+  if (0 != stat([gz fileSystemRepresentation], &sb) || sb.st_mtime < modified)
     {
-      NSMutableString	*s = [NSMutableString string];
-
-      [s appendString: @"\nIO threads:"];
-      while (counter-- > 0)
+      if (nil == conf->gzipCache
+	|| NO == WebServerCompressibleType(type, conf->compressTypes))
 	{
-	  [s appendString: @"\n  "];
-	  [s appendString: [[_ioThreads objectAtIndex: counter] description]];
+	  return nil;
 	}
-      return s;
+      gz = [path substringFromIndex: [root length]];
+      gz = [conf->gzipCache stringByAppendingPathComponent: gz];
+      gz = [gz stringByAppendingPathExtension: @"gz"];
+      if (0 != stat([gz fileSystemRepresentation], &sb)
+	|| sb.st_mtime < modified)
+	{
+	  build = YES;
+	}
+    }
+
+  /* Whether we send the variant or not depends on what the client accepts.
+   */
+  WebServerVaryEncoding(response);
+  connection = [self _connectionForResponse: response];
+  enc = [[[connection request] headerNamed: @"accept-encoding"] value];
+  if (NO == [WebServerAcceptedEncoding(enc) isEqualToString: @"gzip"])
+    {
+      return nil;
+    }
+
+  if (YES == build)
+    {
+      if (nil == (d = [NSDataClass dataWithContentsOfFile: path]))
+	{
+	  return nil;
+	}
+      c = [WebServerCompressor compressorForThread: YES];
+      d = [c compress: d finish: YES];
+      [c report: self];
+      [[NSFileManager defaultManager]
+	createDirectoryAtPath: [gz stringByDeletingLastPathComponent]
+	withIntermediateDirectories: YES
+	attributes: nil
+	error: NULL];
+      /* Written atomically so that other threads never see part of it.
+       */
+      if (nil == d || NO == [d writeToFile: gz atomically: YES])
+	{
+	  [self _log: @"Failed to build compressed static page '%@'", gz];
+	  return nil;
+	}
+    }
+  return gz;
+}
+
+- (NSString*) _ioThreadDescription
+{
+  unsigned		counter = [_ioThreads count];
+
+  if (0 == counter)
+    {
+      return @"";
+    }
+  else
+    {
+      NSMutableString	*s = [NSMutableString string];
+
+      [s appendString: @"\nIO threads:"];
+      while (counter-- > 0)
+	{
+	  [s appendString: @"\n  "];
+	  [s appendString: [[_ioThreads objectAtIndex: counter] description]];
+	}
+      return s;
+    }
+}
+
+/* Return a description of the processing lanes (the lock must be held).
+ */
+- (NSString*) _laneDescription
+{
+  NSMutableString	*s;
+  NSEnumerator		*e;
+  WebServerLane		*lane;
+
+  if (0 == [_lanes count])
+    {
+      return @"";
+    }
+  s = [NSMutableString stringWithString: @"\nLanes:"];
+  e = [_lanes objectEnumerator];
+  while (nil != (lane = [e nextObject]))
+    {
+      [s appendFormat: @"\n  %@", lane];
+    }
+  return s;
+}
+
+/* Processing of a request in a lane has finished, so we may start the
+ * next request waiting in the lane (if any).
+ */
+- (void) _laneDone: (WebServerResponse*)response
+{
+  WebServerConnection	*next = nil;
+  WebServerLane		*lane;
+
+  [_lock lock];
+  lane = [response lane];
+  if (nil != lane)
+    {
+      NSTimeInterval	t;
+
+      t = [NSDateClass timeIntervalSinceReferenceDate] - [response laneStart];
+      lane->handled++;
+      lane->totalLatency += t;
+      if (t > lane->maxLatency)
+	{
+	  lane->maxLatency = t;
+	}
+      if ([lane->waiting count] > 0)
+	{
+	  next = [[lane->waiting objectAtIndex: 0] retain];
+	  [lane->waiting removeObjectAtIndex: 0];
+	}
+      else
+	{
+	  lane->active--;
+	}
+      [response setLane: nil];
     }
+  [_lock unlock];
+  if (nil != next)
+    {
+      [self _dispatch: next];
+      [next release];
+    }
+}
+
+/* Start processing the request in its lane if -_laneFor:full:start:
+ * claimed a worker for it or a worker has become free since then,
+ * otherwise put it in the queue place which was reserved for it.
+ */
+- (void) _laneDispatch: (WebServerConnection*)connection
+		 start: (BOOL)start
+{
+  WebServerResponse	*response = [connection response];
+  WebServerLane		*lane;
+
+  [_lock lock];
+  lane = [response lane];
+  if (NO == start)
+    {
+      lane->reserved--;
+      if (nil == [response webServerConnection])
+	{
+	  /* The connection ended while the request was being prepared.
+	   */
+	  [response setLane: nil];
+	  _processingCount--;
+	}
+      else if (lane->active < lane->workers)
+	{
+	  lane->active++;
+	  start = YES;
+	}
+      else
+	{
+	  [lane->waiting addObject: connection];
+	  if ([lane->waiting count] > lane->maxWaiting)
+	    {
+	      lane->maxWaiting = [lane->waiting count];
+	    }
+	}
+    }
+  [_lock unlock];
+  if (YES == start)
+    {
+      [self _dispatch: connection];
+    }
+}
+
+/* Find the lane for the request on the connection (nil if there is none).
+ * Sets *full to YES (and counts the rejection) if the lane has all its
+ * workers busy and its queue full.  Otherwise, under the same lock, it
+ * claims a worker (setting *start to YES) or reserves a place in the
+ * queue, so that concurrent requests can not overfill the lane.
+ */
+- (WebServerLane*) _laneFor: (WebServerConnection*)connection
+		       full: (BOOL*)full
+		      start: (BOOL*)start
+{
+  WebServerRequest	*request;
+  WebServerLane		*found = nil;
+  NSString		*path;
+  NSString		*method;
+  NSUInteger		best = 0;
+  NSUInteger		count;
+  NSUInteger		index;
+
+  if (nil == _lanes)
+    {
+      return nil;
+    }
+  request = [connection request];
+  path = [[request headerNamed: @"x-http-path"] value];
+  method = [[request headerNamed: @"x-http-method"] value];
+  [_lock lock];
+  count = [_lanes count];
+  for (index = 0; index < count; index++)
+    {
+      WebServerLane	*lane = [_lanes objectAtIndex: index];
+      NSUInteger	match = [lane match: path method: method];
+
+      if (NSNotFound != match && (nil == found || match > best))
+	{
+	  found = lane;
+	  best = match;
+	}
+    }
+  if (nil != found)
+    {
+      if (found->active < found->workers)
+	{
+	  found->active++;
+	  *start = YES;
+	}
+      else if ([found->waiting count] + found->reserved < found->queueLimit)
+	{
+	  found->reserved++;
+	}
+      else
+	{
+	  found->rejected++;
+	  *full = YES;
+	}
+    }
+  [found retain];
+  [_lock unlock];
+  return [found autorelease];
 }
 
 - (void) _listen
@@ -2632,6 +4079,88 @@ escapeData(const uint8_t *bytes, NSUInteger length, NSMutableData *d)
   va_end(args);
 }
 
+/* Called regularly from the I/O thread timers to adjust the size of an
+ * elastic thread pool.  We grow the pool when work has been waiting too
+ * long to start, but don't grow again until the new threads have had
+ * time to have an effect.  We shrink the pool by a single thread at a
+ * time when there have been spare threads for the whole idle time.
+ */
+- (void) _poolCheck: (IOThread*)ioThread
+{
+  NSTimeInterval	now;
+  NSTimeInterval	oldest = 0.0;
+  NSUInteger		threads;
+  NSUInteger		size;
+  NSString		*reason = nil;
+
+  if (ioThread != _ioMain || 0 == _poolMaximum)
+    {
+      return;
+    }
+  now = [NSDateClass timeIntervalSinceReferenceDate];
+  [_lock lock];
+  threads = size = [_pool maxThreads];
+  if (nil != _poolQueue->head)
+    {
+      oldest = now - ((WebServerPoolItem*)_poolQueue->head)->queued;
+    }
+  if (threads < _poolMinimum)
+    {
+      size = _poolMinimum;
+      reason = @"below minimum";
+    }
+  else if (threads > _poolMaximum)
+    {
+      size = _poolMaximum;
+      reason = @"above maximum";
+    }
+  else if (oldest > _poolGrowWait)
+    {
+      _poolSpare = 0.0;
+      if (threads < _poolMaximum && now - _poolResized >= _poolGrowWait)
+	{
+	  size = threads + (threads > 4 ? threads / 4 : 1);
+	  if (size > _poolMaximum)
+	    {
+	      size = _poolMaximum;
+	    }
+	  reason = [NSString stringWithFormat:
+	    @"oldest queued item waited %.3f seconds", oldest];
+	}
+    }
+  else if (threads > _poolMinimum
+    && _poolActive + _poolQueue->count < threads)
+    {
+      if (0.0 == _poolSpare)
+	{
+	  _poolSpare = now;
+	}
+      else if (now - _poolSpare >= _poolIdleTime
+	&& now - _poolResized >= _poolIdleTime)
+	{
+	  size = threads - 1;
+	  reason = [NSString stringWithFormat:
+	    @"spare threads for %.3f seconds", now - _poolSpare];
+	  _poolSpare = now;
+	}
+    }
+  else
+    {
+      _poolSpare = 0.0;
+    }
+  if (size != threads)
+    {
+      _poolResized = now;
+      [_pool setThreads: size];
+    }
+  [_lock unlock];
+  if (nil != reason && size != threads)
+    {
+      [self _log: @"Resized thread pool from %"PRIuPTR" to %"PRIuPTR
+	@" threads (%@)", threads, size, reason];
+    }
+}
+
 /* This is called from the _process1: and _incremental: methods, both of
  * which must only be called from the connection I/O thread.  That makes
  * it safe for this method to modify the state of the connection.
@@ -2858,15 +4387,38 @@ escapeData(const uint8_t *bytes, NSUInteger length, NSMutableData *d)
         {
           i = 1024 * 1024;
         }
+      return i;
     }
 
   return 0;
 }
 
+- (BOOL) _incrementalDelegate
+{
+  return _doIncremental;
+}
+
 - (void) _process1: (WebServerConnection*)connection
 {
   WebServerRequest	*request;
   WebServerResponse	*response;
+  WebServerLane		*lane;
+  BOOL			full = NO;
+  BOOL			start = NO;
+
+  if (YES == [self _shed: connection])
+    {
+      [connection reject: serviceUnavailable()
+		  result: @"HTTP/1.0 503 Service Unavailable"];
+      return;
+    }
+  lane = [self _laneFor: connection full: &full start: &start];
+  if (YES == full)
+    {
+      [connection reject: serviceUnavailable()
+		  result: @"HTTP/1.0 503 Service Unavailable"];
+      return;
+    }
 
   request = [connection request];
   response = [connection response];
@@ -2882,8 +4434,12 @@ escapeData(const uint8_t *bytes, NSUInteger length, NSMutableData *d)
   [_lock unlock];
 
   [response setContent: [NSDataClass data] type: @"text/plain" name: nil];
-  if (YES == [self isCompletedRequest: request])
+  if (YES == [self isCompletedRequest: request]
+    && nil == [connection excess])
     {
+      /* Any data after the end of the request belongs to the next one
+       * (unless a body reader has already set that).
+       */
       [connection setExcess: [[connection parser] excess]];
     }
   [connection setProcessing: YES];
@@ -2902,28 +4458,14 @@ escapeData(const uint8_t *bytes, NSUInteger length, NSMutableData *d)
 	}
     }
 
-  if (YES == _doPreProcess)
-    {
-      [_pool scheduleSelector: @selector(_process2:)
-		   onReceiver: self
-		   withObject: connection];
-    }
-  else if (YES == _doProcess)
+  if (nil == lane)
     {
-      /* OK ... now process in main thread.
-       */
-      [self performSelector: @selector(_process3:)
-		   onThread: _ioMain->thread
-		 withObject: connection
-	      waitUntilDone: NO];
+      [self _dispatch: connection];
     }
   else
     {
-      NSLog(@"No delegate to process or pre-process request");
-      [response setHeader: @"http"
-		    value: @"HTTP/1.0 500 Internal Server Error"
-	       parameters: nil];
-      [self completedWithResponse: response];
+      [response setLane: lane];
+      [self _laneDispatch: connection start: start];
     }
 }
 
@@ -2935,6 +4477,7 @@ escapeData(const uint8_t *bytes, NSUInteger length, NSMutableData *d)
   WebServerResponse	*response;
   BOOL			processed = YES;
 
+  [self _queued: connection];
   request = [connection request];
   response = [connection response];
 
@@ -2969,6 +4512,7 @@ escapeData(const uint8_t *bytes, NSUInteger length, NSMutableData *d)
     {
       /* OK ... now process in main thread.
        */
+      connection->queued = [NSDateClass timeIntervalSinceReferenceDate];
       [self performSelector: @selector(_process3:)
 		   onThread: _ioMain->thread
 		 withObject: connection
@@ -2992,6 +4536,7 @@ escapeData(const uint8_t *bytes, NSUInteger length, NSMutableData *d)
   WebServerResponse	*response;
   BOOL			processed = YES;
 
+  [self _queued: connection];
   request = [connection request];
   response = [connection response];
 
@@ -3024,7 +4569,13 @@ escapeData(const uint8_t *bytes, NSUInteger length, NSMutableData *d)
     }
   else
     {
-      // Delegate will complete processing later.
+      /* Delegate will complete processing later, but may be given the
+       * next slice of an incremental request body now.
+       */
+      [connection performSelector: @selector(_sliceDone)
+			 onThread: [connection ioThread]->thread
+		       withObject: nil
+		    waitUntilDone: NO];
     }
 }
 
@@ -3071,81 +4622,405 @@ escapeData(const uint8_t *bytes, NSUInteger length, NSMutableData *d)
   [_lock lock];
   _processingCount--;
   [_lock unlock];
-  [_pool scheduleSelector: @selector(respond)
-	       onReceiver: connection
-	       withObject: nil];
+  [self _laneDone: response];
+  [self _schedule: @selector(respond:)
+       onReceiver: connection
+       withObject: nil];
   [connection release];
 }
 
-- (NSUInteger) _setIncrementalBytes: (const void*)bytes
-                             length: (NSUInteger)length
-                         forRequest: (WebServerRequest*)request
+/* Handles a GET with a Range header for a static file, producing a 206
+ * response holding just the requested parts (mapping the file and copying
+ * only those parts of it) or a 416 response if no range can be satisfied.
+ * Returns NO if the whole file should be sent.  In any case it sets the
+ * Accept-Ranges and Last-Modified headers of the response, since the
+ * modification date is what a client sends in If-Range when resuming.
+ */
+- (BOOL) _produceRange: (WebServerResponse*)response
+	      fromFile: (NSString*)path
+		  type: (NSString*)type
 {
-  if (NO == [request isKindOfClass: [WebServerRequest class]])
+  WebServerByteRange	ranges[WEBSERVER_MAXRANGES];
+  WebServerRequest	*request;
+  WebServerMappedData	*file;
+  NSString		*modified;
+  NSString		*spec;
+  NSString		*s;
+  unsigned long long	size;
+  struct stat		sb;
+  int			count;
+  int			fd;
+
+  if (0 != stat([path fileSystemRepresentation], &sb))
     {
-      [NSException raise: NSInvalidArgumentException
-                  format: @"[%@-%@] bad request argument",
-        NSStringFromClass([self class]), NSStringFromSelector(_cmd)];
+      return NO;
     }
-  [_incrementalDataLock lock];
-  if (0 == bytes)
+  size = (unsigned long long)sb.st_size;
+  modified = httpDate(sb.st_mtime);
+  [response setHeader: @"Accept-Ranges" value: @"bytes" parameters: nil];
+  [response setHeader: @"Last-Modified" value: modified parameters: nil];
+
+  request = [[self _connectionForResponse: response] request];
+  spec = [[request headerNamed: @"range"] value];
+  if (nil == spec || NO == [[[request headerNamed: @"x-http-method"] value]
+    isEqualToString: @"GET"])
     {
-      [_incrementalDataMap removeObjectForKey: request];
-      length = 0;
+      return NO;
+    }
+  /* If-Range holds an entity tag (which we never match) or the date the
+   * client's copy was modified ... if the file has changed since then
+   * the client needs all of it.
+   */
+  if (nil != (s = [[request headerNamed: @"if-range"] value])
+    && NO == [[s stringByTrimmingSpaces] isEqualToString: modified])
+    {
+      return NO;
+    }
+  count = WebServerParseRanges(spec, size, ranges);
+  if (count < 0)
+    {
+      return NO;
+    }
+  if (0 == count)
+    {
+      s = [NSStringClass stringWithFormat: @"bytes */%llu", size];
+      [response setHeader: @"http"
+		    value: @"HTTP/1.1 416 Range Not Satisfiable"
+	       parameters: nil];
+      [response setHeader: @"Content-Range" value: s parameters: nil];
+      [response setContent: [NSDataClass data] type: type name: nil];
+      return YES;
+    }
+  /* The ranges were worked out from the size found earlier, so if the
+   * file has changed since then we just send all of it.
+   */
+  if ((fd = open([path fileSystemRepresentation], O_RDONLY)) < 0)
+    {
+      return NO;
+    }
+  file = nil;
+  if (0 == fstat(fd, &sb) && (unsigned long long)sb.st_size == size)
+    {
+      file = [[WebServerMappedData alloc] initWithFileDescriptor: fd
+							  length: size];
+    }
+  close(fd);
+  if (nil == file)
+    {
+      [self _log: @"Failed to map '%@' for ranges", path];
+      return NO;
+    }
+  if (1 == count)
+    {
+      NSData	*d;
+
+      d = [file subdataWithRange: NSMakeRange((NSUInteger)ranges[0].from,
+	(NSUInteger)(ranges[0].to - ranges[0].from + 1))];
+      [response setContent: d type: type name: nil];
+      s = [NSStringClass stringWithFormat: @"bytes %llu-%llu/%llu",
+	ranges[0].from, ranges[0].to, size];
+      [response setHeader: @"Content-Range" value: s parameters: nil];
     }
   else
     {
-      NSMutableData     *d = [_incrementalDataMap objectForKey: request];
+      NSMutableArray	*parts;
+      int		i;
 
-      if (nil == d)
-        {
-          d = [[NSMutableData alloc] initWithCapacity: length];
-          [_incrementalDataMap setObject: d forKey: request];
-          [d release];
-        }
-      [d appendBytes: bytes length: length];
-      length = [d length];
+      /* Each part of a multipart/byteranges response says which range
+       * it holds.
+       */
+      parts = [NSMutableArray arrayWithCapacity: count];
+      for (i = 0; i < count; i++)
+	{
+	  GSMimeDocument	*part;
+	  NSData		*d;
+
+	  d = [file subdataWithRange: NSMakeRange((NSUInteger)ranges[i].from,
+	    (NSUInteger)(ranges[i].to - ranges[i].from + 1))];
+	  part = [GSMimeDocument documentWithContent: d
+						type: type
+						name: nil];
+	  s = [NSStringClass stringWithFormat: @"bytes %llu-%llu/%llu",
+	    ranges[i].from, ranges[i].to, size];
+	  [part setHeader: @"Content-Range" value: s parameters: nil];
+	  [part setHeader: @"Content-Transfer-Encoding"
+		    value: @"binary"
+	       parameters: nil];
+	  [parts addObject: part];
+	}
+      [response setContent: parts
+		      type: @"multipart/byteranges"
+		      name: nil];
     }
-  [_incrementalDataLock unlock];
-  return length;
+  [file release];
+  [response setHeader: @"http"
+		value: @"HTTP/1.1 206 Partial Content"
+	   parameters: nil];
+  return YES;
 }
 
-- (void) _setup
+/* Record the time a request waited to be processed and update the state
+ * of admission control.  This follows the CoDel approach of looking for
+ * a standing queue rather than a burst ... we start shedding load only
+ * once the delay has been above the target for a whole interval (ie the
+ * minimum delay over the interval is above target), and we stop as soon
+ * as a request gets through with less delay than the target.
+ */
+- (void) _queued: (WebServerConnection*)connection
 {
-  _reserved = 0;
-  _nc = [[NSNotificationCenter defaultCenter] retain];
-  _connectionTimeout = 30.0;
-  _lock =  [NSLock new];
-  _ioMain = [IOThread new];
-  _ioMain->thread = [[NSThread currentThread] retain];
-  _ioMain->server = self;
-  _ioMain->cTimeout = _connectionTimeout;
-  _pool = [GSThreadPool new];
-  [_pool setPoolName: @"websvr"];
-  [_pool setThreads: 0];
-  _defs = [[NSUserDefaults standardUserDefaults] retain];
-  _conf = [WebServerConfig new];
-  _conf->foldHeaders = NO;
-  _conf->reverse = [_defs boolForKey: @"ReverseHostLookup"];
-  _conf->permittedMethods = [defaultPermittedMethods copy];
-  _conf->maxConnectionRequests = 100;
-  _conf->maxConnectionDuration = 10.0;
-  _conf->maxBodySize = 4*1024*1024;
-  _conf->maxRequestSize = 8*1024;
-  _maxPerHost = 32;
-  _maxConnections = 128;
-  _substitutionLimit = 4;
-  _connections = [NSMutableSet new];
-  _perHost = [NSCountedSet new];
-  _ioThreads = [NSMutableArray new];
+  WebServerConfig	*conf = _conf;
+  NSTimeInterval	queued = connection->queued;
+  NSTimeInterval	now;
+  NSTimeInterval	delay;
+  BOOL			was;
+  BOOL			is;
+
+  connection->queued = 0.0;
+  if (queued <= 0.0 || conf->admissionTarget <= 0.0)
+    {
+      return;
+    }
+  now = [NSDateClass timeIntervalSinceReferenceDate];
+  delay = now - queued;
+  [_lock lock];
+  was = _shedding;
+  _queueDelay = delay;
+  _lastSample = now;
+  if (delay < conf->admissionTarget)
+    {
+      _aboveUntil = 0.0;
+      _shedding = NO;
+    }
+  else if (0.0 == _aboveUntil)
+    {
+      _aboveUntil = now + conf->admissionInterval;
+    }
+  else if (now >= _aboveUntil)
+    {
+      _shedding = YES;
+    }
+  is = _shedding;
+  [_lock unlock];
+  if (was != is)
+    {
+      [self _log: @"Admission control %@ shedding load (queue delay %.3f)",
+	(YES == is ? @"started" : @"stopped"), delay];
+    }
+}
+
+/* Check the request against any rate limits, returning the time the
+ * client must wait before retrying if the request must be rejected.
+ */
+- (NSTimeInterval) _rateLimit: (NSString*)address path: (NSString*)path
+{
+  WebServerRateLimiter	*limiter;
+  NSTimeInterval	wait;
+
+  if (nil == _rateLimiter)
+    {
+      return 0.0;
+    }
+  [_lock lock];
+  limiter = [_rateLimiter retain];
+  [_lock unlock];
+  wait = [limiter checkAddress: address path: path];
+  [limiter release];
+  return wait;
+}
+
+/* Handle a new connection from a banned address without creating a
+ * connection object.  For a plain connection (unless configured to drop
+ * banned connections) we try to send a 429 response first, but for a
+ * TLS connection we just close it rather than paying for a handshake.
+ */
+- (void) _rejectBanned: (NSFileHandle*)hdl
+	       address: (NSString*)address
+		 until: (NSTimeInterval)until
+{
+  int	desc = [hdl fileDescriptor];
+
+  [_lock lock];
+  _bannedRejects++;
+  [_lock unlock];
+  if (NO == _dropBanned && nil == _sslConfig && desc >= 0)
+    {
+      NSData	*data;
+      int	seconds;
+      int	flags = 0;
+
+      seconds = ceil(until - [NSDateClass timeIntervalSinceReferenceDate]);
+      data = WebServerTooManyRequests(seconds);
+#if	defined(MSG_DONTWAIT)
+      flags |= MSG_DONTWAIT;
+#endif
+#if	defined(MSG_NOSIGNAL)
+      flags |= MSG_NOSIGNAL;
+#endif
+      /* A new socket has an empty send buffer, so this small write should
+       * complete at once (and if it does not, we don't care).
+       */
+      (void)send(desc, [data bytes], [data length], flags);
+    }
+  [hdl closeFile];
+  [self _log: @"Connection from banned remote (%@) rejected", address];
+}
+
+/* Perform an item of work queued in an elastic pool.
+ */
+- (void) _runPooled: (WebServerPoolItem*)item
+{
+  [_lock lock];
+  GSLinkedListRemove(item, _poolQueue);
+  _poolActive++;
+  [_lock unlock];
+  NS_DURING
+    {
+      [item->receiver performSelector: item->selector
+			   withObject: item->object];
+    }
+  NS_HANDLER
+    {
+      [self _alert: @"Exception %@, performing %@ on %@", localException,
+	NSStringFromSelector(item->selector), item->receiver];
+    }
+  NS_ENDHANDLER
+  [_lock lock];
+  _poolActive--;
+  [_lock unlock];
+  [item release];
+}
+
+/* Queue work in the thread pool.  When the pool is elastic we record the
+ * time the work was queued (so the pool can be resized depending on how
+ * long work waits to start) and perform it via -_runPooled:
+ */
+- (void) _schedule: (SEL)aSelector
+	onReceiver: (id)receiver
+	withObject: (id)anObject
+{
+  WebServerPoolItem	*item;
+
+  if (0 == _poolMaximum || 0 == [_pool maxThreads])
+    {
+      [_pool scheduleSelector: aSelector
+		   onReceiver: receiver
+		   withObject: anObject];
+      return;
+    }
+  item = [WebServerPoolItem new];
+  item->receiver = [receiver retain];
+  item->selector = aSelector;
+  item->object = [anObject retain];
+  item->queued = [NSDateClass timeIntervalSinceReferenceDate];
+  [_lock lock];
+  GSLinkedListInsertAfter(item, _poolQueue, _poolQueue->tail);
+  [_lock unlock];
+  [_pool scheduleSelector: @selector(_runPooled:)
+	       onReceiver: self
+	       withObject: item];
+}
+
+/* Records the reader collecting the body of a request for incremental
+ * processing (or removes it if reader is nil).  The map holds no data,
+ * it just lets -incrementalDataForRequest: find the reader.
+ */
+- (void) _setIncrementalReader: (WebServerIncrementalReader*)reader
+		    forRequest: (WebServerRequest*)request
+{
+  if (NO == [request isKindOfClass: [WebServerRequest class]])
+    {
+      [NSException raise: NSInvalidArgumentException
+                  format: @"[%@-%@] bad request argument",
+        NSStringFromClass([self class]), NSStringFromSelector(_cmd)];
+    }
+  [_incrementalDataLock lock];
+  if (nil == reader)
+    {
+      [_incrementalDataMap removeObjectForKey: request];
+    }
+  else
+    {
+      [_incrementalDataMap setObject: reader forKey: request];
+    }
+  [_incrementalDataLock unlock];
+}
+
+/* Records the parameters decoded for a request (or removes them if
+ * params is nil).  The map is protected by the user info lock.
+ */
+- (void) _setParameters: (NSMutableDictionary*)params
+	     forRequest: (WebServerRequest*)request
+{
+  [_userInfoLock lock];
+  if (nil == params)
+    {
+      [_parametersMap removeObjectForKey: request];
+    }
+  else
+    {
+      [_parametersMap setObject: params forKey: request];
+    }
+  [_userInfoLock unlock];
+}
+
+/* Records the reader storing the parts of a multipart request (or
+ * removes it if reader is nil), so that the files holding the parts can
+ * be found.  The map is protected by the user info lock.
+ */
+- (void) _setUploads: (WebServerMultipartReader*)reader
+	  forRequest: (WebServerRequest*)request
+{
+  [_userInfoLock lock];
+  if (nil == reader)
+    {
+      [_uploadsMap removeObjectForKey: request];
+    }
+  else
+    {
+      [_uploadsMap setObject: reader forKey: request];
+    }
+  [_userInfoLock unlock];
+}
+
+- (void) _setup
+{
+  _reserved = 0;
+  _nc = [[NSNotificationCenter defaultCenter] retain];
+  _connectionTimeout = 30.0;
+  _lock =  [NSLock new];
+  _ioMain = [IOThread new];
+  _ioMain->thread = [[NSThread currentThread] retain];
+  _ioMain->server = self;
+  _ioMain->cTimeout = _connectionTimeout;
+  _pool = [GSThreadPool new];
+  [_pool setPoolName: @"websvr"];
+  [_pool setThreads: 0];
+  _defs = [[NSUserDefaults standardUserDefaults] retain];
+  _conf = [WebServerConfig new];
+  _conf->foldHeaders = NO;
+  _conf->reverse = [_defs boolForKey: @"ReverseHostLookup"];
+  _conf->permittedMethods = [defaultPermittedMethods copy];
+  _conf->maxConnectionRequests = 100;
+  _conf->maxConnectionDuration = 10.0;
+  _conf->maxBodySize = 4*1024*1024;
+  _conf->maxRequestSize = 8*1024;
+  _maxPerHost = 32;
+  _maxConnections = 128;
+  _substitutionLimit = 4;
+  _connections = [NSMutableSet new];
+  _perHost = [NSCountedSet new];
+  _ioThreads = [NSMutableArray new];
   _incrementalDataMap = [NSMutableDictionary new];
   _userInfoMap = [NSMutableDictionary new];
+  _parametersMap = [NSMutableDictionary new];
+  _uploadsMap = [NSMutableDictionary new];
   _incrementalDataLock = [NSLock new];
   _userInfoLock = [NSLock new];
   _strictTransportSecurity = 31536000;  // Default is 1 year
   _authFailureBanTime = 1.0;
   _authFailureMaxRetry = 0;
   _authFailureFindTime = 1.0;
+  _poolQueue = [GSLinkedList new];
 
   /* We need a timer so that the main thread can handle connection
    * timeouts.
@@ -3157,6 +5032,163 @@ escapeData(const uint8_t *bytes, NSUInteger length, NSMutableData *d)
 						   repeats: YES];
 }
 
+/* Return YES if the request on the connection should be rejected because
+ * admission control is shedding load.  Requests for exempt paths and
+ * from quiet (monitoring) hosts are always admitted.
+ */
+- (BOOL) _shed: (WebServerConnection*)connection
+{
+  WebServerConfig	*conf = _conf;
+  NSEnumerator		*e;
+  NSString		*path;
+  NSString		*prefix;
+  BOOL			shed;
+
+  if (NO == _shedding || conf->admissionTarget <= 0.0
+    || YES == [connection quiet])
+    {
+      return NO;
+    }
+  path = [[[connection request] headerNamed: @"x-http-path"] value];
+  e = [conf->admissionExempt objectEnumerator];
+  while (nil != (prefix = [e nextObject]))
+    {
+      if (YES == [path hasPrefix: prefix])
+	{
+	  return NO;
+	}
+    }
+  [_lock lock];
+  if (YES == _shedding && 0 == _processingCount
+    && [NSDateClass timeIntervalSinceReferenceDate] - _lastSample
+    > conf->admissionInterval)
+    {
+      /* Nothing is being processed and we have had no samples for an
+       * interval, so the overload must be over.
+       */
+      _shedding = NO;
+      _aboveUntil = 0.0;
+    }
+  shed = _shedding;
+  if (YES == shed)
+    {
+      _shedCount++;
+    }
+  [_lock unlock];
+  return shed;
+}
+
+/* Return the (cached) template at aPath relative to the root, or nil
+ * (after logging the problem) if it is outside the root or unreadable.
+ */
+- (WebServerTemplate*) _templateAtPath: (NSString*)aPath
+{
+  NSString		*path = (_root == nil) ? (id)@"" : (id)_root;
+  NSString		*str;
+  NSFileManager		*mgr;
+  WebServerTemplate	*t = nil;
+
+  path = [path stringByAppendingString: @"/"];
+  str = [path stringByStandardizingPath];
+  path = [path stringByAppendingPathComponent: aPath];
+  path = [path stringByStandardizingPath];
+  mgr = [NSFileManager defaultManager];
+  if ([path hasPrefix: str] == NO)
+    {
+      [self _log: @"Illegal template '%@' ('%@')", aPath, path];
+    }
+  else if ([mgr isReadableFileAtPath: path] == NO)
+    {
+      [self _log: @"Can't read template '%@' ('%@')", aPath, path];
+    }
+  else if ((t = [WebServerTemplate templateAtPath: path]) == nil)
+    {
+      [self _log: @"Failed to load template '%@' ('%@')", aPath, path];
+    }
+  return t;
+}
+
+/* Called in the I/O thread of a WebSocket with the messages received,
+ * to pass them to the delegate in the master thread.
+ */
+- (void) _webSocket: (WebServerConnection*)connection
+	   received: (NSArray*)messages
+{
+  NSArray	*a;
+
+  a = [NSArrayClass arrayWithObjects: [connection response], messages, nil];
+  [self performSelector: @selector(_webSocketDeliver:)
+	       onThread: _ioMain->thread
+	     withObject: a
+	  waitUntilDone: NO];
+}
+
+/* Called in the I/O thread when a WebSocket has closed, to tell the
+ * delegate in the master thread (after any messages still queued).
+ */
+- (void) _webSocketClosed: (WebServerConnection*)connection
+{
+  NSArray	*a;
+
+  a = [NSArrayClass arrayWithObject: [connection response]];
+  [self performSelector: @selector(_webSocketDeliver:)
+	       onThread: _ioMain->thread
+	     withObject: a
+	  waitUntilDone: NO];
+}
+
+/* Passes the messages received on a WebSocket (or the news that it has
+ * closed if there are none) to the delegate, then lets the connection
+ * read more.
+ */
+- (void) _webSocketDeliver: (NSArray*)a
+{
+  WebServerResponse	*response = [a objectAtIndex: 0];
+  WebServerConnection	*connection;
+
+  if (1 == [a count])
+    {
+      if ([_delegate respondsToSelector: @selector(webSocketClosed:for:)])
+	{
+	  NS_DURING
+	    [_delegate webSocketClosed: response for: self];
+	  NS_HANDLER
+	    [self _alert: @"Exception %@, closing WebSocket for %@",
+	      localException, response];
+	  NS_ENDHANDLER
+	}
+      return;
+    }
+
+  if ([_delegate respondsToSelector: @selector(webSocket:received:for:)])
+    {
+      NSEnumerator	*e = [[a objectAtIndex: 1] objectEnumerator];
+      id		m;
+
+      while (nil != (m = [e nextObject]))
+	{
+	  NS_DURING
+	    [_delegate webSocket: response received: m for: self];
+	  NS_HANDLER
+	    [self _alert: @"Exception %@, handling WebSocket message for %@",
+	      localException, response];
+	  NS_ENDHANDLER
+	}
+    }
+
+  [_lock lock];
+  connection = [[response webServerConnection] retain];
+  [_lock unlock];
+  if (nil != connection)
+    {
+      [connection performSelector: @selector(_wsRead)
+			 onThread: [connection ioThread]->thread
+		       withObject: nil
+		    waitUntilDone: NO];
+      [connection release];
+    }
+}
+
 - (NSString*) _xCountRequests
 {
   NSString	*str;
@@ -3177,74 +5209,605 @@ escapeData(const uint8_t *bytes, NSUInteger length, NSMutableData *d)
   return str;
 }
 
-- (NSString*) _xCountConnectedHosts
+- (NSString*) _xCountConnectedHosts
+{
+  NSString	*str;
+
+  [_lock lock];
+  str = [NSStringClass stringWithFormat: @"%"PRIuPTR, [_perHost count]];
+  [_lock unlock];
+  return str;
+}
+
+@end
+
+@implementation	WebServerConfig
+- (id) copyWithZone: (NSZone*)z
+{
+  WebServerConfig	*c;
+
+  c = (WebServerConfig*)NSCopyObject(self, 0, z);
+  c->permittedMethods = [c->permittedMethods copy];
+  c->admissionExempt = [c->admissionExempt copy];
+  c->uploadDirectory = [c->uploadDirectory copy];
+  c->compressTypes = [c->compressTypes copy];
+  c->gzipCache = [c->gzipCache copy];
+  return c;
+}
+- (void) dealloc
+{
+  [permittedMethods release];
+  [admissionExempt release];
+  [uploadDirectory release];
+  [compressTypes release];
+  [gzipCache release];
+  [super dealloc];
+}
+@end
+
+@implementation	WebServerPoolItem
+- (void) dealloc
+{
+  [receiver release];
+  [object release];
+  [super dealloc];
+}
+@end
+
+@implementation	WebServerLane
+
+- (void) dealloc
+{
+  DESTROY(name);
+  DESTROY(paths);
+  DESTROY(methods);
+  DESTROY(waiting);
+  [super dealloc];
+}
+
+/* Called with the server lock held.
+ */
+- (NSString*) description
+{
+  return [NSStringClass stringWithFormat:
+    @"%@: %"PRIuPTR"/%"PRIuPTR" active, %"PRIuPTR"/%"PRIuPTR" queued"
+    @" (max %"PRIuPTR"), %"PRIuPTR" handled, %"PRIuPTR" rejected,"
+    @" latency %.3f avg %.3f max",
+    name, active, workers, [waiting count], queueLimit, maxWaiting,
+    handled, rejected, (handled > 0 ? totalLatency / handled : 0.0),
+    maxLatency];
+}
+
+- (id) initWithName: (NSString*)n config: (NSDictionary*)d
+{
+  if (NO == [d isKindOfClass: NSDictionaryClass])
+    {
+      [self release];
+      [NSException raise: NSInvalidArgumentException
+		  format: @"bad configuration for lane '%@'", n];
+    }
+  if (nil != (self = [super init]))
+    {
+      NSInteger	i;
+      id	o;
+
+      name = [n copy];
+      i = [[d objectForKey: @"Workers"] integerValue];
+      workers = (i > 0) ? i : 1;
+      i = [[d objectForKey: @"Queue"] integerValue];
+      queueLimit = (i > 0) ? i : 0;
+      o = [d objectForKey: @"Paths"];
+      if ([o isKindOfClass: NSStringClass])
+	{
+	  o = [NSArrayClass arrayWithObject: o];
+	}
+      paths = [o copy];
+      o = [d objectForKey: @"Methods"];
+      if ([o isKindOfClass: NSStringClass])
+	{
+	  o = [NSArrayClass arrayWithObject: o];
+	}
+      if ([o count] > 0)
+	{
+	  methods = [[NSSet alloc] initWithArray: o];
+	}
+      waiting = [NSMutableArray new];
+    }
+  return self;
+}
+
+/* Returns NSNotFound if the request does not belong in the lane, otherwise
+ * a measure of how specific the match is (the length of the matching
+ * path prefix).
+ */
+- (NSUInteger) match: (NSString*)path method: (NSString*)method
+{
+  NSUInteger	best = NSNotFound;
+
+  if (nil != methods && NO == [methods containsObject: method])
+    {
+      return NSNotFound;
+    }
+  if (nil == paths)
+    {
+      return (nil == methods) ? NSNotFound : 0;
+    }
+  if (nil != path)
+    {
+      NSEnumerator	*e = [paths objectEnumerator];
+      NSString		*prefix;
+
+      while (nil != (prefix = [e nextObject]))
+	{
+	  if (YES == [path hasPrefix: prefix]
+	    && (NSNotFound == best || [prefix length] > best))
+	    {
+	      best = [prefix length];
+	    }
+	}
+    }
+  return best;
+}
+
+@end
+
+@implementation	WebServerFormValues
+
+/* Make sure there is space for another value.
+ */
+- (void) _makeRoom
+{
+  if (count == capacity)
+    {
+      capacity = (0 == capacity) ? 1 : capacity * 2;
+      ranges = realloc(ranges, capacity * sizeof(NSRange));
+      values = realloc(values, capacity * sizeof(id));
+    }
+}
+
+- (void) addObject: (id)anObject
+{
+  [self insertObject: anObject atIndex: count];
+}
+
+- (void) addRange: (NSRange)r
+{
+  [self _makeRoom];
+  ranges[count] = r;
+  values[count] = nil;
+  count++;
+}
+
+- (NSUInteger) count
+{
+  return count;
+}
+
+- (void) dealloc
+{
+  NSUInteger	i;
+
+  for (i = 0; i < count; i++)
+    {
+      [values[i] release];
+    }
+  free(ranges);
+  free(values);
+  DESTROY(source);
+  [super dealloc];
+}
+
+- (id) init
+{
+  return [self initWithSource: nil];
+}
+
+- (id) initWithCapacity: (NSUInteger)numItems
+{
+  return [self initWithSource: nil];
+}
+
+- (id) initWithSource: (NSData*)data
+{
+  if (nil != (self = [super init]))
+    {
+      source = [data retain];
+    }
+  return self;
+}
+
+- (void) insertObject: (id)anObject atIndex: (NSUInteger)index
+{
+  if (nil == anObject)
+    {
+      [NSException raise: NSInvalidArgumentException
+		  format: @"[%@-%@] nil object",
+	NSStringFromClass([self class]), NSStringFromSelector(_cmd)];
+    }
+  if (index > count)
+    {
+      [NSException raise: NSRangeException
+		  format: @"[%@-%@] index %"PRIuPTR" out of range",
+	NSStringFromClass([self class]), NSStringFromSelector(_cmd), index];
+    }
+  [self _makeRoom];
+  memmove(&ranges[index + 1], &ranges[index],
+    (count - index) * sizeof(NSRange));
+  memmove(&values[index + 1], &values[index], (count - index) * sizeof(id));
+  ranges[index] = NSMakeRange(0, 0);
+  values[index] = [anObject retain];
+  count++;
+}
+
+- (id) objectAtIndex: (NSUInteger)index
+{
+  id	o;
+
+  if (index >= count)
+    {
+      [NSException raise: NSRangeException
+		  format: @"[%@-%@] index %"PRIuPTR" out of range",
+	NSStringFromClass([self class]), NSStringFromSelector(_cmd), index];
+    }
+  o = __atomic_load_n(&values[index], __ATOMIC_ACQUIRE);
+  if (nil == o)
+    {
+      const uint8_t	*bytes = (const uint8_t*)[source bytes];
+      id		expected = nil;
+
+      /* If another thread decodes the value at the same time, we use
+       * whichever was stored first.
+       */
+      o = newDecodedData(bytes + ranges[index].location,
+	ranges[index].length);
+      if (NO == __atomic_compare_exchange_n(&values[index], &expected, o,
+	NO, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+	  [o release];
+	  o = expected;
+	}
+    }
+  return o;
+}
+
+- (void) removeLastObject
+{
+  if (0 == count)
+    {
+      [NSException raise: NSRangeException
+		  format: @"[%@-%@] array is empty",
+	NSStringFromClass([self class]), NSStringFromSelector(_cmd)];
+    }
+  [self removeObjectAtIndex: count - 1];
+}
+
+- (void) removeObjectAtIndex: (NSUInteger)index
+{
+  if (index >= count)
+    {
+      [NSException raise: NSRangeException
+		  format: @"[%@-%@] index %"PRIuPTR" out of range",
+	NSStringFromClass([self class]), NSStringFromSelector(_cmd), index];
+    }
+  [values[index] release];
+  count--;
+  memmove(&ranges[index], &ranges[index + 1],
+    (count - index) * sizeof(NSRange));
+  memmove(&values[index], &values[index + 1], (count - index) * sizeof(id));
+}
+
+- (void) replaceObjectAtIndex: (NSUInteger)index withObject: (id)anObject
+{
+  id	old;
+
+  if (nil == anObject)
+    {
+      [NSException raise: NSInvalidArgumentException
+		  format: @"[%@-%@] nil object",
+	NSStringFromClass([self class]), NSStringFromSelector(_cmd)];
+    }
+  if (index >= count)
+    {
+      [NSException raise: NSRangeException
+		  format: @"[%@-%@] index %"PRIuPTR" out of range",
+	NSStringFromClass([self class]), NSStringFromSelector(_cmd), index];
+    }
+  old = values[index];
+  values[index] = [anObject retain];
+  [old release];
+}
+
+- (NSData*) source
+{
+  return source;
+}
+
+@end
+
+BOOL
+WebServerAddressKeyFromString(NSString *address, WebServerAddressKey *key)
+{
+  const char	*str;
+  NSUInteger	len;
+
+  memset(key, '\0', sizeof(*key));
+  if (NO == [address isKindOfClass: [NSString class]])
+    {
+      return NO;
+    }
+  str = [address UTF8String];
+  if (0 == str)
+    {
+      return NO;
+    }
+  if (1 == inet_pton(AF_INET, str, key->bytes))
+    {
+      key->family = AF_INET;
+      key->length = 4;
+    }
+  else if (1 == inet_pton(AF_INET6, str, key->bytes))
+    {
+      key->family = AF_INET6;
+      key->length = 16;
+    }
+  else if ((len = strlen(str)) <= sizeof(key->bytes))
+    {
+      /* Not a numeric address, but short enough to use as it is.
+       */
+      memcpy(key->bytes, str, len);
+      key->length = len;
+    }
+  else
+    {
+      uint64_t	h1 = 0xcbf29ce484222325ULL;
+      uint64_t	h2 = 0x84222325cbf29ce4ULL;
+      NSUInteger	i;
+
+      /* Too long ... use a pair of FNV-1a hashes of the text.
+       */
+      for (i = 0; i < len; i++)
+	{
+	  h1 = (h1 ^ (uint8_t)str[i]) * 0x100000001b3ULL;
+	  h2 = (h2 ^ (uint8_t)str[len - i - 1]) * 0x100000001b3ULL;
+	}
+      memcpy(key->bytes, &h1, sizeof(h1));
+      memcpy(key->bytes + sizeof(h1), &h2, sizeof(h2));
+      key->family = 0xff;
+      key->length = 16;
+    }
+  return YES;
+}
+
+NSUInteger
+WebServerAddressKeyHash(const WebServerAddressKey *key)
+{
+  uint64_t	h = 0xcbf29ce484222325ULL ^ key->family;
+  NSUInteger	i;
+
+  for (i = 0; i < key->length; i++)
+    {
+      h = (h ^ key->bytes[i]) * 0x100000001b3ULL;
+    }
+  return (NSUInteger)(h ^ (h >> 32));
+}
+
+/* The failure log is a hash table divided into stripes, each with its
+ * own lock, so that threads handling different addresses rarely contend.
+ * Each entry holds a ring of the most recent failures for one address
+ * (as times rather than objects) along with any ban in force.
+ */
+#define	AF_STRIPES	32
+
+typedef struct	{
+  NSTimeInterval	when;		// Time of failure
+  NSTimeInterval	until;		// Time any block ends
+} AFSlot;
+
+typedef struct AFEntry {
+  struct AFEntry	*next;
+  WebServerAddressKey	key;
+  NSTimeInterval	banUntil;	// Zero if not banned
+  NSUInteger		capacity;	// Number of slots in ring
+  NSUInteger		used;		// Number of failures in ring
+  NSUInteger		head;		// Next slot to be written
+  AFSlot		slots[0];
+} AFEntry;
+
+typedef struct	{
+  NSLock		*lock;
+  AFEntry		**buckets;
+  NSUInteger		size;		// Number of buckets (power of two)
+  NSUInteger		count;		// Number of entries
+} AFStripe;
+
+#define	AFKeyEqual(A, B) ((A)->family == (B)->family \
+  && (A)->length == (B)->length \
+  && 0 == memcmp((A)->bytes, (B)->bytes, (A)->length))
+
+/* Find the entry for a key in a (locked) stripe.  Returns a pointer to
+ * the link to the entry so that it can be removed or replaced, or null
+ * if there is no entry and create is NO.
+ */
+static AFEntry **
+afFind(AFStripe *s, const WebServerAddressKey *k, NSUInteger h,
+  NSUInteger capacity, BOOL create)
 {
-  NSString	*str;
+  AFEntry	**link;
+  AFEntry	*e;
 
-  [_lock lock];
-  str = [NSStringClass stringWithFormat: @"%"PRIuPTR, [_perHost count]];
-  [_lock unlock];
-  return str;
-}
+  if (0 == s->size)
+    {
+      if (NO == create)
+	{
+	  return 0;
+	}
+      s->size = 16;
+      s->buckets = calloc(s->size, sizeof(AFEntry*));
+    }
+  link = &s->buckets[(h / AF_STRIPES) & (s->size - 1)];
+  while (0 != (e = *link))
+    {
+      if (AFKeyEqual(&e->key, k))
+	{
+	  return link;
+	}
+      link = &e->next;
+    }
+  if (NO == create)
+    {
+      return 0;
+    }
 
-@end
+  if (s->count >= s->size * 2)
+    {
+      NSUInteger	size = s->size * 2;
+      AFEntry		**buckets = calloc(size, sizeof(AFEntry*));
+      NSUInteger	i;
 
-@implementation	WebServerConfig
-- (id) copyWithZone: (NSZone*)z
-{
-  WebServerConfig	*c;
+      /* Grow the stripe to keep chains short.
+       */
+      for (i = 0; i < s->size; i++)
+	{
+	  while (0 != (e = s->buckets[i]))
+	    {
+	      NSUInteger	b;
 
-  c = (WebServerConfig*)NSCopyObject(self, 0, z);
-  c->permittedMethods = [c->permittedMethods copy];
-  return c;
+	      s->buckets[i] = e->next;
+	      b = (WebServerAddressKeyHash(&e->key) / AF_STRIPES) & (size - 1);
+	      e->next = buckets[b];
+	      buckets[b] = e;
+	    }
+	}
+      free(s->buckets);
+      s->buckets = buckets;
+      s->size = size;
+      link = &s->buckets[(h / AF_STRIPES) & (s->size - 1)];
+    }
+
+  e = calloc(1, sizeof(AFEntry) + capacity * sizeof(AFSlot));
+  e->key = *k;
+  e->capacity = capacity;
+  e->next = *link;
+  *link = e;
+  s->count++;
+  return link;
 }
-- (void) dealloc
+
+/* Discard failures which are too old to count, then return YES if the
+ * entry is no longer of use (no failures and no ban in force).
+ */
+static BOOL
+afExpire(AFEntry *e, NSTimeInterval now, NSTimeInterval findTime)
 {
-  [permittedMethods release];
-  [super dealloc];
-}
-@end
+  NSTimeInterval	since = now - findTime;
 
-@implementation WebServerAuthenticationFailure
+  while (e->used > 0)
+    {
+      NSUInteger	oldest;
 
-- (id) initWithDate: (NSDate*)date
-            banTime: (NSTimeInterval)banTime
-{
-  if (nil != (self = [super init]))
+      oldest = (e->head + e->capacity - e->used) % e->capacity;
+      if (e->slots[oldest].when > since)
+	{
+	  break;
+	}
+      e->used--;
+    }
+  if (e->banUntil > 0.0 && e->banUntil < now)
     {
-      ASSIGN(_date, date);
-      _banTime = banTime;
+      e->banUntil = 0.0;
     }
-  return self;
+  return (0 == e->used && 0.0 == e->banUntil) ? YES : NO;
 }
 
-- (void) dealloc
+/* Remove the entry at the link from the (locked) stripe.
+ */
+static void
+afRemove(AFStripe *s, AFEntry **link)
 {
-  DESTROY(_date);
-  [super dealloc];
+  AFEntry	*e = *link;
+
+  *link = e->next;
+  free(e);
+  s->count--;
 }
 
-- (NSDate*) date
+/* Expire all the entries in a (locked) stripe, removing unused ones.
+ */
+static void
+afSweep(AFStripe *s, NSTimeInterval now, NSTimeInterval findTime)
 {
-  return _date;
+  NSUInteger	i;
+
+  for (i = 0; i < s->size; i++)
+    {
+      AFEntry	**link = &s->buckets[i];
+
+      while (0 != *link)
+	{
+	  if (YES == afExpire(*link, now, findTime))
+	    {
+	      afRemove(s, link);
+	    }
+	  else
+	    {
+	      link = &(*link)->next;
+	    }
+	}
+    }
 }
 
-- (NSTimeInterval) banTime
+/* In front of the ban table we keep a Bloom filter (two bits per banned
+ * address) which may be read without locking, so that the great majority
+ * of addresses (those which are not banned) can be checked very cheaply.
+ * Bits are only ever set in the live filter (under the filter lock) and
+ * a replacement containing only current bans is built after each full
+ * cycle of cleanup.
+ */
+#define	AF_FILTER_BITS	65536
+#define	AF_FILTER_WORDS	(AF_FILTER_BITS / 64)
+
+static inline NSUInteger
+afBit1(NSUInteger h)
 {
-  return _banTime;
+  return h % AF_FILTER_BITS;
 }
 
-- (NSDate*) blockUntil
+static inline NSUInteger
+afBit2(NSUInteger h)
 {
-  return [_date dateByAddingTimeInterval: _banTime];
+  return ((h / AF_FILTER_BITS) ^ (h * 2654435761U)) % AF_FILTER_BITS;
 }
 
-+ (id) failureWithBanTime: (NSTimeInterval)banTime
+static inline void
+afFilterSet(uint64_t *filter, NSUInteger h)
 {
-  return AUTORELEASE([[self alloc] initWithDate: [NSDate date] banTime: banTime]);
+  NSUInteger	b1 = afBit1(h);
+  NSUInteger	b2 = afBit2(h);
+
+  __atomic_fetch_or(&filter[b1 / 64], (uint64_t)1 << (b1 % 64),
+    __ATOMIC_RELAXED);
+  __atomic_fetch_or(&filter[b2 / 64], (uint64_t)1 << (b2 % 64),
+    __ATOMIC_RELAXED);
 }
 
-@end
+static inline BOOL
+afFilterTest(uint64_t *filter, NSUInteger h)
+{
+  NSUInteger	b1 = afBit1(h);
+  NSUInteger	b2 = afBit2(h);
+
+  if (0 == (__atomic_load_n(&filter[b1 / 64], __ATOMIC_RELAXED)
+    & ((uint64_t)1 << (b1 % 64))))
+    {
+      return NO;
+    }
+  if (0 == (__atomic_load_n(&filter[b2 / 64], __ATOMIC_RELAXED)
+    & ((uint64_t)1 << (b2 % 64))))
+    {
+      return NO;
+    }
+  return YES;
+}
 
 @implementation WebServerAuthenticationFailureLog
 
@@ -3252,10 +5815,19 @@ escapeData(const uint8_t *bytes, NSUInteger length, NSMutableData *d)
 {
   if (nil != (self = [super init]))
     {
+      AFStripe	*stripes;
+      NSUInteger	i;
+
       _findTime = 1.0;
-      _failuresByAddress = [NSMutableDictionary new];
-      _banUntilByAddress = [NSMutableDictionary new];
-      _lock = [NSLock new];
+      _capacity = 16;
+      stripes = calloc(AF_STRIPES, sizeof(AFStripe));
+      for (i = 0; i < AF_STRIPES; i++)
+	{
+	  stripes[i].lock = [NSLock new];
+	}
+      _stripes = stripes;
+      _filter = calloc(AF_FILTER_WORDS, sizeof(uint64_t));
+      _filterLock = [NSLock new];
       _cleanupInterval = 60.0;
       [self setupCleanupTimer];
     }
@@ -3264,14 +5836,61 @@ escapeData(const uint8_t *bytes, NSUInteger length, NSMutableData *d)
 
 - (void) dealloc
 {
+  AFStripe	*stripes = (AFStripe*)_stripes;
+
   [_cleanupTimer invalidate];
   _cleanupTimer = nil;
-  DESTROY(_failuresByAddress);
-  DESTROY(_banUntilByAddress);
-  DESTROY(_lock);
+  if (0 != stripes)
+    {
+      NSUInteger	i;
+
+      for (i = 0; i < AF_STRIPES; i++)
+	{
+	  AFStripe	*s = &stripes[i];
+	  NSUInteger	b;
+
+	  for (b = 0; b < s->size; b++)
+	    {
+	      while (0 != s->buckets[b])
+		{
+		  afRemove(s, &s->buckets[b]);
+		}
+	    }
+	  free(s->buckets);
+	  DESTROY(s->lock);
+	}
+      free(stripes);
+      _stripes = 0;
+    }
+  if (0 != _filter)
+    {
+      free(_filter);
+      _filter = 0;
+    }
+  DESTROY(_filterLock);
   [super dealloc];
 }
 
+- (NSUInteger) capacity
+{
+  return _capacity;
+}
+
+- (NSUInteger) count
+{
+  AFStripe	*stripes = (AFStripe*)_stripes;
+  NSUInteger	count = 0;
+  NSUInteger	i;
+
+  for (i = 0; i < AF_STRIPES; i++)
+    {
+      [stripes[i].lock lock];
+      count += stripes[i].count;
+      [stripes[i].lock unlock];
+    }
+  return count;
+}
+
 - (NSTimeInterval) findTime
 {
   return _findTime;
@@ -3282,14 +5901,27 @@ escapeData(const uint8_t *bytes, NSUInteger length, NSMutableData *d)
   return _cleanupInterval;
 }
 
+/* The timer fires once per stripe in each cleanup interval, so that each
+ * stripe is swept once per interval but only one is locked at a time.
+ */
 - (void) setupCleanupTimer
 {
   [_cleanupTimer invalidate];
-  _cleanupTimer = [NSTimer scheduledTimerWithTimeInterval: _cleanupInterval
-                                                   target: self
-                                                 selector: @selector(cleanup)
-                                                 userInfo: 0
-                                                  repeats: YES];
+  _cleanupTimer = [NSTimer
+    scheduledTimerWithTimeInterval: _cleanupInterval / AF_STRIPES
+			    target: self
+			  selector: @selector(cleanupStripe)
+			  userInfo: 0
+			   repeats: YES];
+}
+
+- (void) setCapacity: (NSUInteger)capacity
+{
+  if (capacity < 1)
+    {
+      capacity = 1;
+    }
+  _capacity = capacity;
 }
 
 - (void) setFindTime: (NSTimeInterval)findTime
@@ -3316,178 +5948,341 @@ escapeData(const uint8_t *bytes, NSUInteger length, NSMutableData *d)
   return isValid;
 }
 
+/* Set up the key for an address and return the stripe it belongs in,
+ * or null if the address is not valid.
+ */
+- (AFStripe*) stripeForAddress: (NSString*)address
+			   key: (WebServerAddressKey*)key
+			  hash: (NSUInteger*)hash
+{
+  if (NO == [self isValidAddress: address]
+    || NO == WebServerAddressKeyFromString(address, key))
+    {
+      return 0;
+    }
+  *hash = WebServerAddressKeyHash(key);
+  return &((AFStripe*)_stripes)[*hash % AF_STRIPES];
+}
+
 - (void) addFailureForAddress: (NSString*)address
                       banTime: (NSTimeInterval)banTime
 {
-  NSMutableArray                  *failures;
-  WebServerAuthenticationFailure  *failure;
-  
-  if (NO == [self isValidAddress: address])
+  WebServerAddressKey	key;
+  NSUInteger		hash;
+  AFStripe		*s;
+  AFEntry		**link;
+  AFEntry		*e;
+  NSTimeInterval	now;
+
+  if (0 == (s = [self stripeForAddress: address key: &key hash: &hash]))
     {
       return;
     }
+  now = [NSDateClass timeIntervalSinceReferenceDate];
 
-  failure = [WebServerAuthenticationFailure failureWithBanTime: banTime];
-
-  [_lock lock];
-  if (nil != (failures = [_failuresByAddress objectForKey: address]))
+  [s->lock lock];
+  link = afFind(s, &key, hash, _capacity, YES);
+  e = *link;
+  afExpire(e, now, _findTime);
+  if (e->capacity < _capacity)
     {
-      [failures addObject: failure];
+      AFEntry		*n;
+      NSUInteger	i;
+
+      /* The capacity has been increased since this entry was created,
+       * so we copy the failures (oldest first) into a larger entry.
+       */
+      n = calloc(1, sizeof(AFEntry) + _capacity * sizeof(AFSlot));
+      n->next = e->next;
+      n->key = e->key;
+      n->banUntil = e->banUntil;
+      n->capacity = _capacity;
+      for (i = 0; i < e->used; i++)
+	{
+	  n->slots[i] = e->slots[(e->head + e->capacity - e->used + i)
+	    % e->capacity];
+	}
+      n->used = n->head = e->used;
+      free(e);
+      *link = e = n;
     }
-  else
+  e->slots[e->head].when = now;
+  e->slots[e->head].until = now + banTime;
+  e->head = (e->head + 1) % e->capacity;
+  if (e->used < e->capacity)
     {
-      failures = [NSMutableArray arrayWithObject: failure];
-      [_failuresByAddress setObject: failures forKey: address];
+      e->used++;
     }
-  [_lock unlock];
+  [s->lock unlock];
 }
 
 - (void) removeFailuresForAddress: (NSString*)address
 {
-  if (NO == [self isValidAddress: address])
+  WebServerAddressKey	key;
+  NSUInteger		hash;
+  AFStripe		*s;
+  AFEntry		**link;
+
+  if (0 == (s = [self stripeForAddress: address key: &key hash: &hash]))
     {
       return;
     }
 
-  [_lock lock];
-  [_failuresByAddress removeObjectForKey: address];
-  [_lock unlock];
+  [s->lock lock];
+  if (0 != (link = afFind(s, &key, hash, _capacity, NO)))
+    {
+      (*link)->used = 0;
+      if (YES == afExpire(*link, [NSDateClass timeIntervalSinceReferenceDate],
+	_findTime))
+	{
+	  afRemove(s, link);
+	}
+    }
+  [s->lock unlock];
 }
 
 - (NSUInteger) failureCountForAddress: (NSString*)address
                            blockUntil: (NSDate**)until
 {
-  NSMutableArray                  *failures;
-  NSUInteger                      count = 0;
-  WebServerAuthenticationFailure  *failure;
-  NSDate                          *since;
-  NSDate                          *latest = nil;
-  NSDate                          *blockUntil;
-  
-  if (NO == [self isValidAddress: address])
-    {
-      if (NULL != until)
-        {
-          *until = nil;
-        }
-      return 0;
-    }
+  WebServerAddressKey	key;
+  NSUInteger		hash;
+  AFStripe		*s;
+  AFEntry		**link;
+  NSUInteger		count = 0;
+  NSTimeInterval	latest = 0.0;
 
-  [_lock lock];
-  if (nil != (failures = [_failuresByAddress objectForKey: address]))
+  if (0 != (s = [self stripeForAddress: address key: &key hash: &hash]))
     {
-      since = [NSDate dateWithTimeIntervalSinceNow: -_findTime];
-      for (NSInteger i = [failures count] - 1; i >= 0; i--)
-        {
-          failure = [failures objectAtIndex: i];
-          if ([[failure date] compare: since] == NSOrderedDescending)
-            {
-              count++;
-              blockUntil = [failure blockUntil];
-              if (nil == latest 
-                || [blockUntil compare: latest] == NSOrderedDescending)
-                {
-                  latest = [failure blockUntil];
-                }
-            }
-          else
-            {
-              break;
-            }
-        }
+      [s->lock lock];
+      if (0 != (link = afFind(s, &key, hash, _capacity, NO)))
+	{
+	  AFEntry	*e = *link;
+
+	  if (YES == afExpire(e, [NSDateClass timeIntervalSinceReferenceDate],
+	    _findTime))
+	    {
+	      afRemove(s, link);
+	    }
+	  else
+	    {
+	      NSUInteger	i;
+
+	      count = e->used;
+	      for (i = 0; i < count; i++)
+		{
+		  AFSlot	*slot = &e->slots[(e->head + e->capacity - 1 - i)
+		    % e->capacity];
+
+		  if (slot->until > latest)
+		    {
+		      latest = slot->until;
+		    }
+		}
+	    }
+	}
+      [s->lock unlock];
     }
   if (NULL != until)
     {
-      *until = AUTORELEASE(RETAIN(latest));
+      if (count > 0)
+	{
+	  *until = [NSDateClass dateWithTimeIntervalSinceReferenceDate: latest];
+	}
+      else
+	{
+	  *until = nil;
+	}
     }
-  [_lock unlock];
+  return count;
+}
+
+- (NSUInteger) failuresRecordedForAddress: (NSString*)address
+{
+  WebServerAddressKey	key;
+  NSUInteger		hash;
+  AFStripe		*s;
+  AFEntry		**link;
+  NSUInteger		count = 0;
 
+  if (0 != (s = [self stripeForAddress: address key: &key hash: &hash]))
+    {
+      [s->lock lock];
+      if (0 != (link = afFind(s, &key, hash, _capacity, NO)))
+	{
+	  count = (*link)->used;
+	}
+      [s->lock unlock];
+    }
   return count;
 }
 
 - (void) banAddress: (NSString*)address
               until: (NSDate*)until
 {
-  if (NO == [self isValidAddress: address])
+  WebServerAddressKey	key;
+  NSUInteger		hash;
+  AFStripe		*s;
+  AFEntry		**link;
+
+  if (0 == (s = [self stripeForAddress: address key: &key hash: &hash]))
     {
       return;
     }
 
-  [_lock lock];
+  [s->lock lock];
   if (nil != until)
     {
-      [_banUntilByAddress setObject: until forKey: address];
+      link = afFind(s, &key, hash, _capacity, YES);
+      (*link)->banUntil = [until timeIntervalSinceReferenceDate];
     }
-  else
+  else if (0 != (link = afFind(s, &key, hash, _capacity, NO)))
     {
-      [_banUntilByAddress removeObjectForKey: address];
+      (*link)->banUntil = 0.0;
+      if (YES == afExpire(*link, [NSDateClass timeIntervalSinceReferenceDate],
+	_findTime))
+	{
+	  afRemove(s, link);
+	}
+    }
+  [s->lock unlock];
+
+  if (nil != until)
+    {
+      /* NB. The stripe must be unlocked before we lock the filter, since
+       * the filter is rebuilt by locking stripes with the filter locked.
+       */
+      [_filterLock lock];
+      afFilterSet((uint64_t*)_filter, hash);
+      [_filterLock unlock];
     }
-  [_lock unlock];
 }
 
-- (NSDate*) isBanned: (NSString*)address
+- (NSTimeInterval) bannedUntil: (NSString*)address
 {
-  NSDate  *until;
+  WebServerAddressKey	key;
+  NSUInteger		hash;
+  AFStripe		*s;
+  AFEntry		**link;
+  NSTimeInterval	until = 0.0;
 
-  if (NO == [self isValidAddress: address])
+  if (0 == (s = [self stripeForAddress: address key: &key hash: &hash]))
     {
-      return nil;
+      return 0.0;
     }
 
-  [_lock lock];
-  until = RETAIN([_banUntilByAddress objectForKey: address]);
-  if (nil != until && [until compare: [NSDate date]] == NSOrderedAscending)
+  [s->lock lock];
+  if (0 != (link = afFind(s, &key, hash, _capacity, NO)))
     {
-      RELEASE(until);
-      until = nil;
+      until = (*link)->banUntil;
+      if (until > 0.0 && until < [NSDateClass timeIntervalSinceReferenceDate])
+	{
+	  until = 0.0;
+	}
     }
-  [_lock unlock];
+  [s->lock unlock];
+  return until;
+}
+
+- (NSTimeInterval) quickBannedUntil: (NSString*)address
+{
+  WebServerAddressKey	key;
+  NSUInteger		hash;
+
+  if (NO == [self isValidAddress: address]
+    || NO == WebServerAddressKeyFromString(address, &key))
+    {
+      return 0.0;
+    }
+  hash = WebServerAddressKeyHash(&key);
+  if (NO == afFilterTest((uint64_t*)_filter, hash))
+    {
+      return 0.0;	// Definitely not banned.
+    }
+  return [self bannedUntil: address];
+}
+
+- (NSDate*) isBanned: (NSString*)address
+{
+  NSTimeInterval	until = [self bannedUntil: address];
 
-  return AUTORELEASE(until);
+  if (until > 0.0)
+    {
+      return [NSDateClass dateWithTimeIntervalSinceReferenceDate: until];
+    }
+  return nil;
 }
 
 - (void) cleanup
 {
-  NSString                        *address;
-  NSMutableArray                  *failures;
-  WebServerAuthenticationFailure  *failure;
-  NSDate                          *since;
-  NSArray                         *addresses;
-  NSDate                          *until;
+  AFStripe		*stripes = (AFStripe*)_stripes;
+  NSTimeInterval	now = [NSDateClass timeIntervalSinceReferenceDate];
+  NSUInteger		i;
 
-  since = [NSDate dateWithTimeIntervalSinceNow: -_findTime];
+  for (i = 0; i < AF_STRIPES; i++)
+    {
+      [stripes[i].lock lock];
+      afSweep(&stripes[i], now, _findTime);
+      [stripes[i].lock unlock];
+    }
+  [self rebuildFilter];
+}
 
-  [_lock lock];
+- (void) cleanupStripe
+{
+  AFStripe		*s = &((AFStripe*)_stripes)[_cleanupStripe];
+  NSTimeInterval	now = [NSDateClass timeIntervalSinceReferenceDate];
 
-  addresses = [_failuresByAddress allKeys];
-  for (address in addresses)
+  _cleanupStripe = (_cleanupStripe + 1) % AF_STRIPES;
+  [s->lock lock];
+  afSweep(s, now, _findTime);
+  [s->lock unlock];
+  if (0 == _cleanupStripe)
     {
-      failures = [_failuresByAddress objectForKey: address];
-      for (NSInteger j = [failures count] - 1; j >= 0; j--)
-        {
-          failure = [failures objectAtIndex: j];
-          if ([[failure date] compare: since] == NSOrderedAscending)
-            {
-              [failures removeObjectAtIndex: j];
-            }
-        }
-      if ([failures count] == 0)
-        {
-          [_failuresByAddress removeObjectForKey: address];
-        }
+      [self rebuildFilter];
     }
+}
+
+/* Build a new filter containing only the bans currently in force and
+ * copy it over the live one.  A reader may briefly see a mixture of the
+ * two, which can only make it miss a ban that is about to expire anyway
+ * (and the ban is still found when the request headers are checked).
+ */
+- (void) rebuildFilter
+{
+  AFStripe		*stripes = (AFStripe*)_stripes;
+  uint64_t		*live = (uint64_t*)_filter;
+  uint64_t		*f;
+  NSTimeInterval	now = [NSDateClass timeIntervalSinceReferenceDate];
+  NSUInteger		i;
 
-  addresses = [_banUntilByAddress allKeys];
-  for (address in addresses)
+  f = calloc(AF_FILTER_WORDS, sizeof(uint64_t));
+  [_filterLock lock];
+  for (i = 0; i < AF_STRIPES; i++)
     {
-      until = [_banUntilByAddress objectForKey: address];
-      if ([until compare: [NSDate date]] == NSOrderedAscending)
-        {
-          [_banUntilByAddress removeObjectForKey: address];
-        }
+      AFStripe		*s = &stripes[i];
+      NSUInteger	b;
+
+      [s->lock lock];
+      for (b = 0; b < s->size; b++)
+	{
+	  AFEntry	*e;
+
+	  for (e = s->buckets[b]; 0 != e; e = e->next)
+	    {
+	      if (e->banUntil >= now)
+		{
+		  afFilterSet(f, WebServerAddressKeyHash(&e->key));
+		}
+	    }
+	}
+      [s->lock unlock];
     }
-  
-  [_lock unlock];
+  for (i = 0; i < AF_FILTER_WORDS; i++)
+    {
+      __atomic_store_n(&live[i], f[i], __ATOMIC_RELAXED);
+    }
+  [_filterLock unlock];
+  free(f);
 }
 
 @end
@@ -3641,6 +6436,10 @@ escapeData(const uint8_t *bytes, NSUInteger length, NSMutableData *d)
       [ended release];
       while (nil != (con = [e nextObject]))
 	{
+	  if (YES == [con _wsPing])
+	    {
+	      continue;		// Idle WebSocket ... see if client is alive
+	    }
 	  if (con->owner == processing)
 	    {
 	      [server _alert: @"%@ abort after %g seconds to process %@",
@@ -3660,6 +6459,7 @@ escapeData(const uint8_t *bytes, NSUInteger length, NSMutableData *d)
 	  [con end];
 	}
     }
+  [server _poolCheck: self];
 }
 @end
 
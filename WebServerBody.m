@@ -0,0 +1,958 @@
+/**
+   Copyright (C) 2026 Free Software Foundation, Inc.
+
+   Written by:  agent <agent@local>
+   Date:	October 2026
+
+   This file is part of the WebServer Library.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA.
+
+   $Date$ $Revision$
+   */
+#import	<Foundation/Foundation.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define WEBSERVERINTERNAL       1
+
+#import	"WebServer.h"
+#import	"Internal.h"
+
+/* States of the body reader.
+ */
+enum {
+  BodyFixed,		// Reading content-length bytes
+  BodyChunkSize,	// Reading hex size of chunk
+  BodyChunkExt,		// Skipping chunk extension
+  BodyChunkData,	// Reading chunk data
+  BodyChunkEnd,		// Expecting CRLF after chunk data
+  BodyTrailer,		// Reading trailer lines
+  BodyTrailerLine,	// Within a non-empty trailer line
+  BodyDone
+};
+
+/* States of the multipart reader.
+ */
+enum {
+  PartPreamble,		// Looking for the first boundary
+  PartBoundary,		// After a boundary (expecting CRLF or --)
+  PartHeaders,		// Reading the headers of a part
+  PartData,		// Reading the content of a part
+  PartEpilogue		// After the final boundary
+};
+
+/* Parts of up to this size are kept in memory.
+ */
+#define	PART_MEMORY	(64 * 1024)
+
+/* Limit on the size of the headers of a part.
+ */
+#define	PART_HEADERS	(16 * 1024)
+
+/* Return the offset of the first occurrence of the pattern in the bytes,
+ * or NSNotFound if there is none.
+ */
+static NSUInteger
+findBytes(const uint8_t *bytes, NSUInteger length,
+  const uint8_t *pattern, NSUInteger patternLength)
+{
+  NSUInteger	pos = 0;
+
+  while (pos + patternLength <= length)
+    {
+      const uint8_t	*p;
+
+      p = memchr(bytes + pos, pattern[0], length - pos - patternLength + 1);
+      if (0 == p)
+	{
+	  break;
+	}
+      pos = p - bytes;
+      if (0 == memcmp(p, pattern, patternLength))
+	{
+	  return pos;
+	}
+      pos++;
+    }
+  return NSNotFound;
+}
+
+/* Write all the bytes to the file descriptor, returning NO on failure.
+ */
+static BOOL
+writeAll(int fd, const uint8_t *bytes, NSUInteger length)
+{
+  while (length > 0)
+    {
+      ssize_t	n = write(fd, bytes, length);
+
+      if (n < 0)
+	{
+	  if (EINTR == errno)
+	    {
+	      continue;
+	    }
+	  return NO;
+	}
+      bytes += n;
+      length -= n;
+    }
+  return YES;
+}
+
+/* Remove the headers reserved for the server from a single part.
+ */
+static void
+untrustedPart(GSMimeDocument *part)
+{
+  NSEnumerator	*e = [[part allHeaders] objectEnumerator];
+  GSMimeHeader	*h;
+
+  while (nil != (h = [e nextObject]))
+    {
+      if (YES == [[h name] hasPrefix: @"x-webserver-"])
+	{
+	  [part deleteHeader: h];
+	}
+    }
+}
+
+void
+WebServerUntrustedParts(GSMimeDocument *doc)
+{
+  id	content = [doc content];
+
+  if (YES == [content isKindOfClass: [NSArray class]])
+    {
+      NSEnumerator	*e = [content objectEnumerator];
+      id		part;
+
+      while (nil != (part = [e nextObject]))
+	{
+	  if (YES == [part isKindOfClass: [GSMimeDocument class]])
+	    {
+	      untrustedPart(part);
+	    }
+	}
+    }
+}
+
+/* Create a temporary file in the directory, returning its descriptor
+ * (or -1 on failure) and the path.
+ */
+int
+WebServerTemporaryFile(NSString *directory, NSString **path)
+{
+  NSString	*template;
+  char		*buf;
+  int		fd;
+
+  if (nil == directory)
+    {
+      directory = NSTemporaryDirectory();
+    }
+  template = [directory stringByAppendingPathComponent: @"WebServer.XXXXXX"];
+  buf = strdup([template fileSystemRepresentation]);
+  fd = mkstemp(buf);
+  if (fd >= 0 && 0 != path)
+    {
+      *path = [[NSFileManager defaultManager]
+	stringWithFileSystemRepresentation: buf length: strlen(buf)];
+    }
+  free(buf);
+  return fd;
+}
+
+@implementation	WebServerBodyReader
+
+- (void) bodyData: (const uint8_t*)bytes length: (NSUInteger)length
+{
+  [self subclassResponsibility: _cmd];
+}
+
+- (void) bodyEnd
+{
+  [self subclassResponsibility: _cmd];
+}
+
+- (BOOL) complete
+{
+  return complete;
+}
+
+- (void) dealloc
+{
+  DESTROY(request);
+  DESTROY(error);
+  [super dealloc];
+}
+
+- (void) detach
+{
+  return;
+}
+
+- (NSString*) error
+{
+  return error;
+}
+
+- (void) fail: (NSString*)status
+{
+  if (nil == error)
+    {
+      ASSIGN(error, status);
+    }
+}
+
+- (id) initWithRequest: (WebServerRequest*)r
+{
+  if (nil != (self = [super init]))
+    {
+      NSString	*str;
+
+      request = [r retain];
+      str = [[r headerNamed: @"transfer-encoding"] value];
+      if ([[str lowercaseString] rangeOfString: @"chunked"].length > 0)
+	{
+	  state = BodyChunkSize;
+	}
+      else if (nil != (str = [[r headerNamed: @"content-length"] value]))
+	{
+	  state = BodyFixed;
+	  remaining = strtoull([str UTF8String], 0, 10);
+	}
+      else
+	{
+	  DESTROY(self);	// No body to read
+	}
+    }
+  return self;
+}
+
+- (BOOL) pause
+{
+  return NO;
+}
+
+- (NSUInteger) read: (const uint8_t*)bytes length: (NSUInteger)length
+{
+  NSUInteger	pos = 0;
+
+  while (pos < length && BodyDone != state && nil == error)
+    {
+      uint8_t	c;
+
+      switch (state)
+	{
+	  case BodyFixed:
+	  case BodyChunkData:
+	    {
+	      NSUInteger	n = length - pos;
+	      NSUInteger	space = [self space];
+
+	      if (n > remaining)
+		{
+		  n = (NSUInteger)remaining;
+		}
+	      if (n > space)
+		{
+		  n = space;
+		}
+	      if (0 == n && remaining > 0)
+		{
+		  return pos;	// Subclass can't take any more yet
+		}
+	      if (n > 0)
+		{
+		  total += n;
+		  remaining -= n;
+		  [self bodyData: bytes + pos length: n];
+		  pos += n;
+		}
+	      if (0 == remaining)
+		{
+		  state = (BodyFixed == state) ? BodyDone : BodyChunkEnd;
+		}
+	    }
+	    break;
+
+	  case BodyChunkSize:
+	    c = bytes[pos++];
+	    if (isxdigit(c))
+	      {
+		if (remaining >> 60)
+		  {
+		    [self fail: @"HTTP/1.0 413 Chunk too large"];
+		    break;
+		  }
+		remaining = remaining * 16
+		  + (isdigit(c) ? c - '0' : (tolower(c) - 'a' + 10));
+	      }
+	    else if ('\n' == c)
+	      {
+		state = (0 == remaining) ? BodyTrailer : BodyChunkData;
+	      }
+	    else
+	      {
+		state = BodyChunkExt;
+	      }
+	    break;
+
+	  case BodyChunkExt:
+	    if ('\n' == bytes[pos++])
+	      {
+		state = (0 == remaining) ? BodyTrailer : BodyChunkData;
+	      }
+	    break;
+
+	  case BodyChunkEnd:
+	    c = bytes[pos++];
+	    if ('\n' == c)
+	      {
+		state = BodyChunkSize;
+	      }
+	    else if ('\r' != c)
+	      {
+		[self fail: @"HTTP/1.0 400 Bad chunked encoding"];
+	      }
+	    break;
+
+	  case BodyTrailer:
+	    c = bytes[pos++];
+	    if ('\n' == c)
+	      {
+		state = BodyDone;
+	      }
+	    else if ('\r' != c)
+	      {
+		state = BodyTrailerLine;
+	      }
+	    break;
+
+	  case BodyTrailerLine:
+	    if ('\n' == bytes[pos++])
+	      {
+		state = BodyTrailer;
+	      }
+	    break;
+	}
+    }
+  if (BodyDone == state && NO == complete && nil == error)
+    {
+      [self bodyEnd];
+      complete = YES;
+    }
+  return pos;
+}
+
+- (NSUInteger) space
+{
+  return NSUIntegerMax;
+}
+
+- (unsigned long long) total
+{
+  return total;
+}
+
+@end
+
+
+@implementation	WebServerIncrementalReader
+
+- (void) bodyData: (const uint8_t*)bytes length: (NSUInteger)length
+{
+  [lock lock];
+  [slice appendBytes: bytes length: length];
+  [lock unlock];
+}
+
+- (void) bodyEnd
+{
+  return;	// All content is left for the delegate to take
+}
+
+- (void) dealloc
+{
+  DESTROY(slice);
+  DESTROY(lock);
+  [super dealloc];
+}
+
+- (void) detach
+{
+  [lock lock];
+  connection = nil;
+  [lock unlock];
+}
+
+- (id) initWithRequest: (WebServerRequest*)r
+	    connection: (WebServerConnection*)c
+		 limit: (NSUInteger)l
+{
+  if (nil != (self = [super initWithRequest: r]))
+    {
+      lock = [NSLock new];
+      limit = (l > 0) ? l : 1;
+      slice = [[NSMutableData alloc] initWithCapacity: limit];
+      connection = c;
+    }
+  return self;
+}
+
+- (BOOL) pause
+{
+  BOOL	result;
+
+  [lock lock];
+  if ([slice length] >= limit)
+    {
+      paused = YES;
+    }
+  result = paused;
+  [lock unlock];
+  return result;
+}
+
+- (NSUInteger) space
+{
+  NSUInteger	length;
+
+  [lock lock];
+  length = [slice length];
+  [lock unlock];
+  return (length >= limit) ? 0 : limit - length;
+}
+
+- (NSData*) take
+{
+  NSData	*d = nil;
+
+  [lock lock];
+  if ([slice length] > 0)
+    {
+      d = slice;
+      slice = [[NSMutableData alloc] initWithCapacity: limit];
+    }
+  if (YES == paused && nil != connection)
+    {
+      paused = NO;
+      [connection performSelector: @selector(_resumeBody)
+			 onThread: [connection ioThread]->thread
+		       withObject: nil
+		    waitUntilDone: NO];
+    }
+  [lock unlock];
+  return [d autorelease];
+}
+
+@end
+
+
+@implementation	WebServerMultipartReader
+
+- (void) bodyData: (const uint8_t*)bytes length: (NSUInteger)length
+{
+  /* The limit applies to everything in the body, whether it is kept in
+   * memory or written to a file.
+   */
+  if (maxSize > 0 && total > maxSize)
+    {
+      [self fail: @"HTTP/1.0 413 Upload too large"];
+      return;
+    }
+  [pending appendBytes: bytes length: length];
+  [self _parse];
+}
+
+- (void) bodyEnd
+{
+  [self _parse];
+  if (nil == error && PartEpilogue != mstate)
+    {
+      [self fail: @"HTTP/1.0 400 Incomplete multipart form"];
+    }
+  if (nil == error)
+    {
+      [request setContent: parts];
+    }
+}
+
+- (void) dealloc
+{
+  NSEnumerator	*e = [files objectEnumerator];
+  NSString	*path;
+
+  if (partFile >= 0)
+    {
+      close(partFile);
+    }
+  while (nil != (path = [e nextObject]))
+    {
+      unlink([path fileSystemRepresentation]);
+    }
+  DESTROY(files);
+  DESTROY(spooled);
+  DESTROY(delimiter);
+  DESTROY(directory);
+  DESTROY(pending);
+  DESTROY(parts);
+  DESTROY(part);
+  DESTROY(partData);
+  [super dealloc];
+}
+
+- (id) initWithRequest: (WebServerRequest*)r
+	      boundary: (NSString*)b
+	     directory: (NSString*)d
+	   maxPartSize: (unsigned long long)p
+	       maxSize: (unsigned long long)t
+{
+  if (nil != (self = [super initWithRequest: r]))
+    {
+      NSString	*str = [[r headerNamed: @"content-length"] value];
+
+      partFile = -1;
+      if ([b length] == 0)
+	{
+	  [self fail: @"HTTP/1.0 400 Missing multipart boundary"];
+	}
+      else if (BodyFixed == state && t > 0
+	&& strtoull([str UTF8String], 0, 10) > t)
+	{
+	  [self fail: @"HTTP/1.0 413 Upload too large"];
+	}
+      b = [@"\r\n--" stringByAppendingString: b];
+      delimiter = [[b dataUsingEncoding: NSUTF8StringEncoding] retain];
+
+      /* The first boundary need not be preceded by CRLF, so we pretend
+       * that the body starts with one.
+       */
+      pending = [[NSMutableData alloc] initWithBytes: "\r\n" length: 2];
+      parts = [NSMutableArray new];
+      files = [NSMutableArray new];
+      spooled = [NSMutableArray new];
+      directory = [d copy];
+      maxPartSize = p;
+      maxSize = t;
+    }
+  return self;
+}
+
+- (NSString*) fileForPart: (GSMimeDocument*)p
+{
+  NSUInteger	index = [spooled indexOfObjectIdenticalTo: p];
+
+  if (NSNotFound == index)
+    {
+      return nil;
+    }
+  return [files objectAtIndex: index];
+}
+
+/* Parse the headers of a part (using a mime parser to handle the
+ * header parameters) and start reading its content.  Any headers the
+ * client sent with names reserved for the server are discarded.
+ */
+- (void) _partHeaders: (const uint8_t*)bytes length: (NSUInteger)length
+{
+  GSMimeParser	*p = AUTORELEASE([GSMimeParser new]);
+  NSString	*str;
+  NSArray	*lines;
+  NSEnumerator	*e;
+  NSString	*line;
+  NSString	*header = nil;
+
+  str = AUTORELEASE([[NSString alloc] initWithBytes: bytes
+					     length: length
+					   encoding: NSUTF8StringEncoding]);
+  if (nil == str)
+    {
+      str = AUTORELEASE([[NSString alloc] initWithBytes: bytes
+						 length: length
+					       encoding: NSISOLatin1StringEncoding]);
+    }
+  lines = [str componentsSeparatedByString: @"\r\n"];
+  e = [lines objectEnumerator];
+  while (nil != (line = [e nextObject]))
+    {
+      if ([line length] > 0 && isspace([line characterAtIndex: 0]))
+	{
+	  header = [header stringByAppendingString: line];	// Folded
+	  continue;
+	}
+      if (nil != header)
+	{
+	  [p parseHeader: header];
+	}
+      header = line;
+    }
+  if ([header length] > 0)
+    {
+      [p parseHeader: header];
+    }
+  ASSIGN(part, [p mimeDocument]);
+  untrustedPart(part);
+  DESTROY(partData);
+  partData = [[NSMutableData alloc] initWithCapacity: 1024];
+  partSize = 0;
+}
+
+/* Add content to the current part, moving it from memory to a file once
+ * it gets too large to keep in memory.
+ */
+- (void) _partData: (const uint8_t*)bytes length: (NSUInteger)length
+{
+  if (0 == length || nil != error)
+    {
+      return;
+    }
+  partSize += length;
+  if (maxPartSize > 0 && partSize > maxPartSize)
+    {
+      [self fail: @"HTTP/1.0 413 Upload part too large"];
+      return;
+    }
+  if (partFile < 0 && partSize > PART_MEMORY)
+    {
+      NSString	*path = nil;
+
+      partFile = WebServerTemporaryFile(directory, &path);
+      if (partFile < 0)
+	{
+	  [self fail: @"HTTP/1.0 500 Unable to store upload"];
+	  return;
+	}
+      /* The path is recorded here rather than in a header of the part,
+       * so that a client can never supply it.
+       */
+      [files addObject: path];
+      [spooled addObject: part];
+      if (NO == writeAll(partFile, [partData bytes], [partData length]))
+	{
+	  [self fail: @"HTTP/1.0 500 Unable to store upload"];
+	  return;
+	}
+      DESTROY(partData);
+    }
+  if (partFile >= 0)
+    {
+      if (NO == writeAll(partFile, bytes, length))
+	{
+	  [self fail: @"HTTP/1.0 500 Unable to store upload"];
+	}
+    }
+  else
+    {
+      [partData appendBytes: bytes length: length];
+    }
+}
+
+- (void) _partEnd
+{
+  NSString	*size;
+
+  size = [NSString stringWithFormat: @"%llu", partSize];
+  [part setHeader: @"x-webserver-size" value: size parameters: nil];
+  if (partFile >= 0)
+    {
+      close(partFile);
+      partFile = -1;
+      [part setContent: [NSData data]];
+    }
+  else
+    {
+      [part setContent: partData];
+      DESTROY(partData);
+    }
+  [parts addObject: part];
+  DESTROY(part);
+}
+
+/* Process as much of the pending data as we can.
+ */
+- (void) _parse
+{
+  const uint8_t	*d = (const uint8_t*)[delimiter bytes];
+  NSUInteger	dlen = [delimiter length];
+  NSUInteger	used = 0;
+  BOOL		more = YES;
+
+  while (YES == more && nil == error)
+    {
+      const uint8_t	*b = (const uint8_t*)[pending bytes] + used;
+      NSUInteger	l = [pending length] - used;
+      NSUInteger	pos;
+
+      switch (mstate)
+	{
+	  case PartPreamble:
+	  case PartData:
+	    pos = findBytes(b, l, d, dlen);
+	    if (NSNotFound == pos)
+	      {
+		/* Keep enough to match a delimiter split between reads.
+		 */
+		if (l >= dlen)
+		  {
+		    if (PartData == mstate)
+		      {
+			[self _partData: b length: l - dlen + 1];
+		      }
+		    used += l - dlen + 1;
+		  }
+		more = NO;
+	      }
+	    else
+	      {
+		if (PartData == mstate)
+		  {
+		    [self _partData: b length: pos];
+		    [self _partEnd];
+		  }
+		used += pos + dlen;
+		mstate = PartBoundary;
+	      }
+	    break;
+
+	  case PartBoundary:
+	    /* Skip any transport padding before the CRLF.
+	     */
+	    while (l > 0 && (' ' == *b || '\t' == *b))
+	      {
+		b++;
+		l--;
+		used++;
+	      }
+	    if (l < 2)
+	      {
+		more = NO;
+	      }
+	    else if ('-' == b[0] && '-' == b[1])
+	      {
+		used += 2;
+		mstate = PartEpilogue;
+	      }
+	    else if ('\r' == b[0] && '\n' == b[1])
+	      {
+		used += 2;
+		mstate = PartHeaders;
+	      }
+	    else
+	      {
+		[self fail: @"HTTP/1.0 400 Bad multipart boundary"];
+	      }
+	    break;
+
+	  case PartHeaders:
+	    if (l >= 2 && '\r' == b[0] && '\n' == b[1])
+	      {
+		[self _partHeaders: b length: 0];	// No headers
+		used += 2;
+		mstate = PartData;
+	      }
+	    else if (NSNotFound != (pos = findBytes(b, l,
+	      (const uint8_t*)"\r\n\r\n", 4)))
+	      {
+		[self _partHeaders: b length: pos];
+		used += pos + 4;
+		mstate = PartData;
+	      }
+	    else if (l > PART_HEADERS)
+	      {
+		[self fail: @"HTTP/1.0 413 Multipart headers too long"];
+	      }
+	    else
+	      {
+		more = NO;
+	      }
+	    break;
+
+	  case PartEpilogue:
+	    used += l;		// Ignored
+	    more = NO;
+	    break;
+	}
+    }
+  if (used > 0)
+    {
+      [pending replaceBytesInRange: NSMakeRange(0, used)
+			 withBytes: 0
+			    length: 0];
+    }
+}
+
+@end
+
+
+@implementation	WebServerSpoolReader
+
+- (void) bodyData: (const uint8_t*)bytes length: (NSUInteger)length
+{
+  /* The content is mapped into memory when complete, so it can't be
+   * larger than our address space.
+   */
+  if ((maxSize > 0 && total > maxSize)
+    || total > (unsigned long long)NSUIntegerMax)
+    {
+      [self fail: @"HTTP/1.0 413 Request body too long"];
+      return;
+    }
+  if (fd < 0 && [data length] + length > threshold)
+    {
+      NSString	*path = nil;
+
+      /* Move to a file which we unlink at once so that it can't be left
+       * behind however the request ends.
+       */
+      fd = WebServerTemporaryFile(directory, &path);
+      if (fd < 0)
+	{
+	  [self fail: @"HTTP/1.0 500 Unable to store request"];
+	  return;
+	}
+      unlink([path fileSystemRepresentation]);
+      if (NO == writeAll(fd, [data bytes], [data length]))
+	{
+	  [self fail: @"HTTP/1.0 500 Unable to store request"];
+	  return;
+	}
+      DESTROY(data);
+    }
+  if (fd >= 0)
+    {
+      if (NO == writeAll(fd, bytes, length))
+	{
+	  [self fail: @"HTTP/1.0 500 Unable to store request"];
+	}
+    }
+  else
+    {
+      [data appendBytes: bytes length: length];
+    }
+}
+
+- (void) bodyEnd
+{
+  if (fd >= 0)
+    {
+      WebServerMappedData	*d;
+
+      d = [[WebServerMappedData alloc] initWithFileDescriptor: fd
+						       length: total];
+      close(fd);
+      fd = -1;
+      if (nil == d)
+	{
+	  [self fail: @"HTTP/1.0 500 Unable to store request"];
+	  return;
+	}
+      [request setContent: d];
+      [d release];
+    }
+  else
+    {
+      [request setContent: data];
+    }
+}
+
+- (void) dealloc
+{
+  if (fd >= 0)
+    {
+      close(fd);
+    }
+  DESTROY(data);
+  DESTROY(directory);
+  [super dealloc];
+}
+
+- (id) initWithRequest: (WebServerRequest*)r
+	     directory: (NSString*)d
+	     threshold: (NSUInteger)t
+	       maxSize: (unsigned long long)m
+{
+  if (nil != (self = [super initWithRequest: r]))
+    {
+      fd = -1;
+      if (BodyFixed == state && m > 0 && remaining > m)
+	{
+	  [self fail: @"HTTP/1.0 413 Request body too long"];
+	}
+      data = [NSMutableData new];
+      directory = [d copy];
+      threshold = t;
+      maxSize = m;
+    }
+  return self;
+}
+
+@end
+
+
+@implementation	WebServerMappedData
+
+- (const void*) bytes
+{
+  return bytes;
+}
+
+- (void) dealloc
+{
+  if (length > 0)
+    {
+      munmap(bytes, length);
+    }
+  [super dealloc];
+}
+
+/* NSData is a class cluster, so there is no designated initialiser for
+ * us to call.
+ */
+- (id) initWithFileDescriptor: (int)fd length: (unsigned long long)l
+{
+  if (l > (unsigned long long)NSUIntegerMax
+    || l > (unsigned long long)(size_t)-1)
+    {
+      DESTROY(self);	// Can't be mapped in our address space
+      return nil;
+    }
+  if (l > 0)
+    {
+      bytes = mmap(0, (size_t)l, PROT_READ, MAP_SHARED, fd, 0);
+      if (MAP_FAILED == bytes)
+	{
+	  bytes = 0;
+	  DESTROY(self);
+	  return nil;
+	}
+      length = (NSUInteger)l;
+    }
+  return self;
+}
+
+- (NSUInteger) length
+{
+  return length;
+}
+
+@end
@@ -31,6 +31,8 @@
 #import	"WebServer.h"
 #import	"WebServerBundles.h"
 
+@class	WebServerRouter;
+
 /**
  * WebServerBundles is an example delegate for the WebServer class.<br />
  * This is intended to act as a convenience for a scheme where the
@@ -46,7 +48,16 @@
  * last path component until a matching handler is found.<br />
  * The paths in the dictionary must <em>not</em> end with a slash...
  * an empty string will match all requests which do not match a handler
- * with a longer path.
+ * with a longer path.<br />
+ * A path component of the form <code>{name}</code> matches any single
+ * (non-empty) component of a request path, and a final component of
+ * <code>*</code> or <code>{name*}</code> matches all the remaining
+ * components.  The values matched are passed to the handler as
+ * parameters of the <code>x-http-path-params</code> header (see
+ * the -processRequest:response:for: method).<br />
+ * All the paths are compiled into a WebServerRouter so that finding
+ * the handler for a request takes a single pass over the request path
+ * however many handlers are configured.
  * <example>
  * </example>
  */
@@ -54,6 +65,14 @@
 {
   NSMutableDictionary	*_handlers;
   WebServer		*_http;
+  NSDictionary		*_bundles;
+  WebServerRouter	*_router;
+  NSLock		*_lock;
+  NSMutableDictionary	*_timings;
+  NSConditionLock	*_preloading;
+  NSSet			*_perThread;
+  NSString		*_threadKey;
+  GSThreadPool		*_loader;
 }
 
 /**
@@ -74,7 +93,25 @@
  *     values are dictionaries, each containing per-handler configuration
  *     information and the name of the bundle containing the code to handle
  *     requests sent to the path.  NB. the bundle name listed should
- *     omit the <code>.bundle</code> extension.
+ *     omit the <code>.bundle</code> extension.<br />
+ *     If the per-handler dictionary contains PerThread set to YES, a
+ *     separate instance of the handler class is created for each thread
+ *     which processes requests for the path, so the handler does not
+ *     need to protect any per-request state against use by other threads.
+ *     In this case requests are also passed to the handler's
+ *     -preProcessRequest:response:for: method (if it has one) in the
+ *     worker thread where pre-processing takes place.
+ *   </item>
+ *   <item>
+ *     WebServerPreload may be set to YES to have all the handlers listed
+ *     in the WebServerBundles dictionary loaded in advance (using the
+ *     -preloadHandlersAndWait: method) rather than when the first
+ *     request for each of them arrives.
+ *   </item>
+ *   <item>
+ *     WebServerPreloadWait may be set to YES (along with WebServerPreload)
+ *     to have this method wait until all the handlers have been loaded
+ *     and warmed up before the WebServer starts listening for connections.
  *   </item>
  * </list>
  * Returns YES on success, NO on failure (if the port of the WebServer
@@ -90,9 +127,23 @@
  */
 - (id) handlerForPath: (NSString*)path info: (NSString**)info;
 
+/**
+ * As for -handlerForPath:info: but, if the parameters argument is
+ * non-null, it is also used to return a dictionary of the values
+ * matched by any parameter or wildcard components of the handler's
+ * configured path (or nil if there are no such components).
+ */
+- (id) handlerForPath: (NSString*)path
+		 info: (NSString**)info
+	   parameters: (NSDictionary**)parameters;
+
 /**
  * Return dictionary of all handlers by name (path in request which maps
- * to that handler instance).
+ * to that handler instance).<br />
+ * Handlers added to or removed from this dictionary are routed from the
+ * next request onwards, but changes made to it are not thread-safe, so
+ * while the server is running -registerHandler:forPath: should be used
+ * instead.
  */
 - (NSMutableDictionary*) handlers;
 
@@ -102,6 +153,13 @@
  */
 - (WebServer*) http;
 
+/**
+ * Returns a dictionary (keyed on path) of the time in seconds taken to
+ * load and warm up each of the handlers loaded by the
+ * -preloadHandlersAndWait: method.
+ */
+- (NSDictionary*) loadTimings;
+
 /** <init />
  * Initialises the receiver as the delegate of HTTP and configures
  * the WebServer based upon the settings found in the user defaults
@@ -109,6 +167,37 @@
  */
 - (id) initAsDelegateOf: (WebServer*)http;
 
+/**
+ * Loads, instantiates and warms up (see
+ * [NSObject(WebServerBundles)-webServerBundles:warmUpForPath:])
+ * the handlers for all the paths in the WebServerBundles configuration
+ * which do not already have a handler, and returns the number of
+ * handlers to be loaded.<br />
+ * The work is done by the thread pool of the WebServer (see
+ * [WebServer-setIOThreads:andPool:]) so that bundles are loaded in
+ * parallel, and each handler is registered as soon as it has warmed up.
+ * If that pool has no threads (as when preloading is configured before
+ * the server has been given a pool), a temporary pool of up to eight
+ * threads is used instead.
+ * The time taken for each handler is logged and is available from the
+ * -loadTimings method.<br />
+ * If wait is YES, this method does not return until all the handlers
+ * have been loaded.  In that case warm up code must not wait for
+ * anything to be done by the thread calling this method.
+ */
+- (NSUInteger) preloadHandlersAndWait: (BOOL)wait;
+
+/**
+ * If any handlers are configured to have an instance per thread, this
+ * method is used to forward requests to the handler's own
+ * -preProcessRequest:response:for: method (returning NO if the handler
+ * has no such method).  The handler instance used is the one belonging
+ * to the worker thread doing the pre-processing.
+ */
+- (BOOL) preProcessRequest: (WebServerRequest*)request
+		  response: (WebServerResponse*)response
+		       for: (WebServer*)http;
+
 /**
  * <p>Handles an incoming request by forwarding it to another handler.<br />
  * If a direct mapping is available from the path in the request to
@@ -120,11 +209,22 @@
  * <p>The configuration information is a dictionary containing the name
  * of the bundle (keyed on 'Name'), and this is used to locate the
  * bundle in the applications resources.<br />
+ * Where the handler is configured to have an instance per thread, the
+ * request is passed to the instance belonging to the current thread.<br />
  * Before a request is passed on to a handler, two extra headers are set
  * in it ... <code>x-http-path-base</code> and <code>x-http-path-info</code>
  * being the actual path matched for the handler, and the remainder of the
  * path after that base part.
  * </p>
+ * <p>A third header, <code>x-http-path-params</code> is also set.
+ * The parameters of that header are the values matched by any parameter
+ * or wildcard components of the path used to match the handler (keyed
+ * on the parameter names), so the handler may use
+ * [GSMimeHeader-parameterForKey:] to get them.<br />
+ * The value of a wildcard is the remainder of the path (without a
+ * leading slash) and, if the wildcard was not named, it is keyed on
+ * <code>*</code>.
+ * </p>
  */
 - (BOOL) processRequest: (WebServerRequest*)request
                response: (WebServerResponse*)response
@@ -132,7 +232,10 @@
 
 /**
  * Registers an object as the handler for a particular path.<br />
- * Registering a nil handler destroys any existing handler for the path.
+ * Registering a nil handler destroys any existing handler for the path.<br />
+ * This is the thread-safe way to change the handlers while the server
+ * is running (rather than modifying the dictionary returned by the
+ * -handlers method).
  */
 - (void) registerHandler: (id)handler forPath: (NSString*)path;
 
@@ -154,6 +257,86 @@
 
 @end
 
+/**
+ * This category declares the methods which may be implemented by the
+ * handlers used by a WebServerBundles instance.
+ */
+@interface	NSObject (WebServerBundles)
+
+/**
+ * This method is called when a handler has been created (either in
+ * advance by [WebServerBundles-preloadHandlersAndWait:] or on demand
+ * when the first request for the path arrives), before the handler is
+ * registered and used for any request.  It may be called in a worker
+ * thread.<br />
+ * The handler may implement it to open connections, fill caches, etc.
+ * so that the cost of doing so is not added to the time taken for the
+ * first request it handles.<br />
+ * The default implementation does nothing.
+ */
+- (void) webServerBundles: (WebServerBundles*)bundles
+	    warmUpForPath: (NSString*)path;
+@end
+
+/**
+ * A WebServerRouter is an immutable table of routes (path patterns)
+ * organised as a tree of path components, so that the route for a
+ * request path can be found in a single pass over the components of
+ * the path (the time taken depends on the length of the path rather
+ * than on the number of routes).<br />
+ * Routes are of the same form as the paths used in the WebServerBundles
+ * configuration:  components are separated by slashes, a component of
+ * the form <code>{name}</code> matches any single non-empty component
+ * of a request path, and a final component of <code>*</code> or
+ * <code>{name*}</code> matches the whole of the rest of the path.<br />
+ * Where more than one route could match, the route matching the most
+ * components of the path is used (a wildcard matches all the remaining
+ * components) and, if routes match the same number of components, a
+ * literal component is preferred to a parameter, which is preferred to
+ * a wildcard.<br />
+ * Since a router can not be modified once it has been created, changes
+ * to the routing configuration are made by building a new router and
+ * replacing the old one, so a router may safely be used by multiple
+ * threads at once.
+ */
+@interface	WebServerRouter : NSObject
+{
+  id		_root;
+  NSUInteger	_count;
+}
+
+/**
+ * Returns an autoreleased router built from the array of routes.
+ */
++ (WebServerRouter*) routerWithRoutes: (NSArray*)routes;
+
+/**
+ * Returns the number of distinct routes in the receiver.
+ */
+- (NSUInteger) count;
+
+/** <init />
+ * Initialises the receiver with the supplied routes.<br />
+ * If the same route appears more than once, only the first occurrence
+ * is used.
+ */
+- (id) initWithRoutes: (NSArray*)routes;
+
+/**
+ * Matches the request path against the routes in the receiver and
+ * returns the route which matched (or nil if there was no match).<br />
+ * If base is non-null it is used to return the leading part of the
+ * path which was matched by the route (excluding any part matched by a
+ * wildcard).<br />
+ * If parameters is non-null it is used to return a dictionary of the
+ * values matched by parameter and wildcard components, or nil if the
+ * route had no such components.
+ */
+- (NSString*) match: (NSString*)path
+	       base: (NSString**)base
+	 parameters: (NSDictionary**)parameters;
+@end
+
 
 #endif
 
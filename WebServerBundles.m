@@ -23,6 +23,7 @@
    $Date$ $Revision$
    */ 
 #import	<Foundation/Foundation.h>
+#import <Performance/GSThreadPool.h>
 
 #define WEBSERVERINTERNAL       1
 
@@ -30,6 +31,24 @@
 #import	"WebServerBundles.h"
 #import	"Internal.h"
 
+#define	PRELOADTHREADS	8	// Threads used to preload without a pool
+
+@interface	WebServerBundles (Private)
+- (id) _handlerForRoute: (NSString*)route
+	       threaded: (BOOL*)threaded
+		  error: (NSString**)error;
+- (id) _loadHandlerForPath: (NSString*)path error: (NSString**)error;
+- (NSString*) _matchPath: (NSString*)path
+		    base: (NSString**)base
+	      parameters: (NSDictionary**)parameters;
+- (void) _preload: (NSString*)path;
+- (void) _setPathHeaders: (WebServerRequest*)request
+		    base: (NSString*)base
+	      parameters: (NSDictionary*)params;
+- (id) _threadHandler: (id)handler forPath: (NSString*)path;
+- (void) _updateRouter;
+@end
+
 @implementation WebServerBundles
 - (void) dealloc
 {
@@ -39,6 +58,14 @@
     }
   RELEASE(_http);
   RELEASE(_handlers);
+  RELEASE(_bundles);
+  RELEASE(_router);
+  RELEASE(_lock);
+  RELEASE(_timings);
+  RELEASE(_preloading);
+  RELEASE(_perThread);
+  RELEASE(_threadKey);
+  RELEASE(_loader);
   [super dealloc];
 }
 
@@ -47,6 +74,45 @@
   NSUserDefaults	*defs = [aNotification object];
   NSString		*port;
   NSDictionary		*secure;
+  NSDictionary		*conf;
+
+  conf = [defs dictionaryForKey: @"WebServerBundles"];
+  if (nil == _router || NO == [conf isEqual: _bundles])
+    {
+      NSMutableSet	*perThread = [NSMutableSet set];
+      NSEnumerator	*e = [conf keyEnumerator];
+      NSString		*path;
+      BOOL		wasThreaded = ([_perThread count] > 0);
+
+      while (nil != (path = [e nextObject]))
+	{
+	  NSDictionary	*byPath = [conf objectForKey: path];
+
+	  if ([byPath isKindOfClass: [NSDictionary class]]
+	    && [[byPath objectForKey: @"PerThread"] boolValue])
+	    {
+	      [perThread addObject: path];
+	    }
+	}
+      [_lock lock];
+      ASSIGNCOPY(_bundles, conf);
+      ASSIGNCOPY(_perThread, perThread);
+      [_lock unlock];
+      [self _updateRouter];
+
+      /* Setting the delegate again makes the server check whether we
+       * want requests to be pre-processed.
+       */
+      if (wasThreaded != ([_perThread count] > 0))
+	{
+	  [_http setDelegate: self];
+	}
+    }
+
+  if (YES == [defs boolForKey: @"WebServerPreload"])
+    {
+      [self preloadHandlersAndWait: [defs boolForKey: @"WebServerPreloadWait"]];
+    }
 
   port = [defs stringForKey: @"WebServerPort"];
   if ([port length] == 0)
@@ -58,87 +124,38 @@
 }
 
 - (id) handlerForPath: (NSString*)path info: (NSString**)info
+{
+  return [self handlerForPath: path info: info parameters: 0];
+}
+
+- (id) handlerForPath: (NSString*)path
+		 info: (NSString**)info
+	   parameters: (NSDictionary**)parameters
 {
   NSString		*error = nil;
-  NSMutableDictionary	*handlers;
-  id			handler;
+  NSString		*base = nil;
+  NSString		*route;
+  id			handler = nil;
 
-  if (info != 0)
+  route = [self _matchPath: path base: &base parameters: parameters];
+  if (nil == route)
     {
-      *info = path;
+      error = [NSString stringWithFormat:
+	@"Unable to find handler in Bundles config for '%@'", path];
     }
-  handlers = [self handlers];
-  handler = [handlers objectForKey: path];
-  if (handler == nil)
+  else
     {
-      NSUserDefaults	*defs;
-      NSDictionary	*conf;
-      NSDictionary	*byPath;
-
-      defs = [NSUserDefaults standardUserDefaults];
-      conf = [defs dictionaryForKey: @"WebServerBundles"];
-      byPath = [conf objectForKey: path];
-      if ([byPath isKindOfClass: [NSDictionary class]] == NO)
-	{
-	  NSRange	r;
-
-	  r = [path rangeOfString: @"/" options: NSBackwardsSearch];
-	  if (r.length > 0)
-	    {
-	      path = [path substringToIndex: r.location];
-	      handler = [self handlerForPath: path info: info];
-	    }
-	  else
-	    {
-	      error = [NSString stringWithFormat:
-		@"Unable to find handler in Bundles config for '%@'", path];
-	    }
-	}
-      else
-	{
-	  NSString	*name;
-
-	  name = [byPath objectForKey: @"Name"];
-
-	  if ([name length] == 0)
-	    {
-	      error = [NSString stringWithFormat:
-		@"Unable to find Name in Bundles config for '%@'", path];
-	    }
-	  else
-	    {
-	      NSBundle	*mb = [NSBundle mainBundle];
-	      NSString	*p = [mb pathForResource: name ofType: @"bundle"];
-	      NSBundle	*b = [NSBundle bundleWithPath: p];
-	      Class	c = [b principalClass];
-
-	      if (c == 0)
-		{
-		  error = [NSString stringWithFormat:
-		    @"Unable to find class in '%@' for '%@'", p, path];
-		}
-	      else
-		{
-		  handler = [c new];
-		  [self registerHandler: handler forPath: path];
-		  RELEASE(handler);
-		}
-	    }
-	}
+      handler = [self _handlerForRoute: route threaded: 0 error: &error];
     }
-  if (handler == nil && info != 0)
+  if (info != 0)
     {
-      *info = error;
+      *info = (nil == handler) ? error : base;
     }
   return handler;
 }
 
 - (NSMutableDictionary*) handlers
 {
-  if (_handlers == nil)
-    {
-      _handlers = [NSMutableDictionary new];
-    }
   return _handlers;
 }
 
@@ -152,6 +169,16 @@
   return [self initAsDelegateOf: nil];
 }
 
+- (NSDictionary*) loadTimings
+{
+  NSDictionary	*d;
+
+  [_lock lock];
+  d = AUTORELEASE([_timings copy]);
+  [_lock unlock];
+  return d;
+}
+
 - (id) initAsDelegateOf: (WebServer*)http
 {
   if (nil != (self = [super init]))
@@ -168,6 +195,12 @@
 
 	  ASSIGN(_http, http);
 	  [_http setDelegate: self];
+	  _handlers = [WebServerHandlers new];
+	  _lock = [NSLock new];
+	  _timings = [NSMutableDictionary new];
+	  _preloading = [[NSConditionLock alloc] initWithCondition: 0];
+	  _threadKey = [[NSString alloc] initWithFormat:
+	    @"WebServerBundles-%p", self];
 
 	  /*
 	   * Watch for config changes, and set initial config by sending a
@@ -190,6 +223,111 @@
   return self;
 }
 
+- (NSUInteger) preloadHandlersAndWait: (BOOL)wait
+{
+  GSThreadPool		*pool = [_http threadPool];
+  NSMutableArray	*paths;
+  NSEnumerator		*e;
+  NSString		*path;
+  NSUInteger		count;
+
+  [_lock lock];
+  paths = [NSMutableArray arrayWithCapacity: [_bundles count]];
+  e = [_bundles keyEnumerator];
+  while (nil != (path = [e nextObject]))
+    {
+      if (nil == [_handlers objectForKey: path]
+	&& [[_bundles objectForKey: path] isKindOfClass: [NSDictionary class]])
+	{
+	  [paths addObject: path];
+	}
+    }
+  [_lock unlock];
+
+  if (nil != _loader && YES == [_preloading tryLockWhenCondition: 0])
+    {
+      /* An earlier preload has finished with its temporary pool.
+       */
+      [_preloading unlock];
+      DESTROY(_loader);
+    }
+
+  count = [paths count];
+  if (count > 0 && 0 == [pool maxThreads])
+    {
+      /* The server has no worker threads (yet), so we use a pool of our
+       * own rather than loading the handlers one after another in this
+       * thread.
+       */
+      if (nil == _loader)
+	{
+	  _loader = [GSThreadPool new];
+	  [_loader setPoolName: @"websvrload"];
+	}
+      [_loader setOperations: count + [_loader maxOperations]];
+      [_loader setThreads: MAX([_loader maxThreads],
+	MIN(count, PRELOADTHREADS))];
+      pool = _loader;
+    }
+  if (count > 0)
+    {
+      [_preloading lock];
+      [_preloading unlockWithCondition: [_preloading condition] + count];
+      e = [paths objectEnumerator];
+      while (nil != (path = [e nextObject]))
+	{
+	  [pool scheduleSelector: @selector(_preload:)
+		      onReceiver: self
+		      withObject: path];
+	}
+    }
+  if (YES == wait)
+    {
+      [_preloading lockWhenCondition: 0];
+      [_preloading unlock];
+      DESTROY(_loader);
+    }
+  return count;
+}
+
+/**
+ * We pre-process incoming requests here (in a worker thread) if any
+ * handlers are configured to have an instance per thread.
+ */
+- (BOOL) preProcessRequest: (WebServerRequest*)request
+		  response: (WebServerResponse*)response
+		       for: (WebServer*)http
+{
+  NSString		*path;
+  NSString		*route;
+  NSString		*base = nil;
+  NSDictionary		*params = nil;
+  NSString		*error = nil;
+  BOOL			threaded = NO;
+  id			handler = nil;
+
+  /* Only handlers with an instance per thread are pre-processed; all
+   * others are left for the main processing (as are requests for paths
+   * with no handler).
+   */
+  path = [[request headerNamed: @"x-http-path"] value];
+  route = [self _matchPath: path base: &base parameters: &params];
+  if (nil != route)
+    {
+      handler = [self _handlerForRoute: route
+			      threaded: &threaded
+				 error: &error];
+    }
+  if (NO == threaded || NO == [handler respondsToSelector: _cmd])
+    {
+      return NO;	// Leave it for the main processing.
+    }
+  [self _setPathHeaders: request base: base parameters: params];
+  return [handler preProcessRequest: request
+			   response: response
+				for: http];
+}
+
 /**
  * We handle the incoming requests here.
  */
@@ -199,10 +337,11 @@
 {
   NSString		*path;
   NSString		*info;
+  NSDictionary		*params;
   id			handler;
 
   path = [[request headerNamed: @"x-http-path"] value];
-  handler = [self handlerForPath: path info: &info];
+  handler = [self handlerForPath: path info: &info parameters: &params];
   if (handler == nil)
     {
       NSString	*error = @"bad path";
@@ -221,34 +360,43 @@
     }
   else
     {
-      NSString	*extra = [path substringFromIndex: [info length]];
-
-      /*
-       * Provide extra information about the exact path used to match
-       * the handler, and any remaining path information beyond it.
-       */
-      [request setHeader: @"x-http-path-base"
-		   value: info
-	      parameters: nil];
-      [request setHeader: @"x-http-path-info"
-		   value: extra
-	      parameters: nil];
-
+      [self _setPathHeaders: request base: info parameters: params];
       return [handler processRequest: request
 			    response: response
 				 for: http];
     }
 }
 
+- (BOOL) respondsToSelector: (SEL)aSelector
+{
+  if (sel_isEqual(aSelector, @selector(preProcessRequest:response:for:)))
+    {
+      return ([_perThread count] > 0) ? YES : NO;
+    }
+  return [super respondsToSelector: aSelector];
+}
+
 - (void) registerHandler: (id)handler forPath: (NSString*)path
 {
+  BOOL	changed;
+
+  [_lock lock];
   if (handler == nil)
     {
-      [[self handlers] removeObjectForKey: path];
+      changed = (nil != [_handlers objectForKey: path]
+	&& nil == [_bundles objectForKey: path]);
+      [_handlers removeObjectForKey: path];
     }
   else
     {
-      [[self handlers] setObject: handler forKey: path];
+      changed = (nil == [_handlers objectForKey: path]
+	&& nil == [_bundles objectForKey: path]);
+      [_handlers setObject: handler forKey: path];
+    }
+  [_lock unlock];
+  if (YES == changed)
+    {
+      [self _updateRouter];
     }
 }
 
@@ -269,3 +417,311 @@
 
 @end
 
+@implementation	NSObject (WebServerBundles)
+
+- (void) webServerBundles: (WebServerBundles*)bundles
+	    warmUpForPath: (NSString*)path
+{
+  return;
+}
+
+@end
+
+@implementation WebServerBundles (Private)
+
+/* Load the bundle configured for the path, create an instance of its
+ * principal class and allow it to warm up, then register it as the
+ * handler for the path.  If another thread registered a handler while
+ * we were doing that, the existing handler is returned instead.
+ */
+- (id) _loadHandlerForPath: (NSString*)path error: (NSString**)error
+{
+  NSDictionary	*byPath;
+  NSString	*name;
+  id		handler;
+  id		old;
+
+  [_lock lock];
+  byPath = AUTORELEASE(RETAIN([_bundles objectForKey: path]));
+  [_lock unlock];
+  if ([byPath isKindOfClass: [NSDictionary class]] == NO)
+    {
+      *error = [NSString stringWithFormat:
+	@"Unable to find handler in Bundles config for '%@'", path];
+      return nil;
+    }
+
+  name = [byPath objectForKey: @"Name"];
+  if ([name length] == 0)
+    {
+      *error = [NSString stringWithFormat:
+	@"Unable to find Name in Bundles config for '%@'", path];
+      return nil;
+    }
+  else
+    {
+      NSBundle	*mb = [NSBundle mainBundle];
+      NSString	*p = [mb pathForResource: name ofType: @"bundle"];
+      NSBundle	*b = [NSBundle bundleWithPath: p];
+      Class	c = [b principalClass];
+
+      if (c == 0)
+	{
+	  *error = [NSString stringWithFormat:
+	    @"Unable to find class in '%@' for '%@'", p, path];
+	  return nil;
+	}
+      handler = AUTORELEASE([c new]);
+      [handler webServerBundles: self warmUpForPath: path];
+    }
+
+  [_lock lock];
+  old = AUTORELEASE(RETAIN([_handlers objectForKey: path]));
+  [_lock unlock];
+  if (nil != old)
+    {
+      return old;
+    }
+  [self registerHandler: handler forPath: path];
+  return handler;
+}
+
+/* Runs in a worker thread to load a handler in advance of its first use.
+ */
+- (void) _preload: (NSString*)path
+{
+  NSTimeInterval	start;
+  NSTimeInterval	t;
+  NSString		*error = nil;
+  id			handler = nil;
+
+  ENTER_POOL
+  start = [NSDate timeIntervalSinceReferenceDate];
+  NS_DURING
+    {
+      handler = [self _loadHandlerForPath: path error: &error];
+    }
+  NS_HANDLER
+    {
+      error = [NSString stringWithFormat:
+	@"Exception loading handler for '%@': %@", path, localException];
+    }
+  NS_ENDHANDLER
+  t = [NSDate timeIntervalSinceReferenceDate] - start;
+  if (nil == handler)
+    {
+      [self webAlert: error for: _http];
+    }
+  else
+    {
+      [_lock lock];
+      [_timings setObject: [NSNumber numberWithDouble: t] forKey: path];
+      [_lock unlock];
+      [self webLog: [NSString stringWithFormat:
+	@"Preloaded handler for '%@' in %g seconds", path, t] for: _http];
+    }
+  [_preloading lock];
+  [_preloading unlockWithCondition: [_preloading condition] - 1];
+  LEAVE_POOL
+}
+
+/* Return the handler for a matched route (loading it if necessary),
+ * or the current thread's instance of it if the route is configured
+ * to have an instance per thread.
+ */
+- (id) _handlerForRoute: (NSString*)route
+	       threaded: (BOOL*)threaded
+		  error: (NSString**)error
+{
+  id	handler;
+  BOOL	perThread;
+
+  [_lock lock];
+  handler = AUTORELEASE(RETAIN([_handlers objectForKey: route]));
+  perThread = (nil != [_perThread member: route]);
+  [_lock unlock];
+  if (threaded != 0)
+    {
+      *threaded = perThread;
+    }
+  if (nil == handler)
+    {
+      handler = [self _loadHandlerForPath: route error: error];
+    }
+  if (nil != handler && YES == perThread)
+    {
+      handler = [self _threadHandler: handler forPath: route];
+    }
+  return handler;
+}
+
+/* Match a request path against the current router, returning the
+ * configured route (or nil if there is none).
+ */
+- (NSString*) _matchPath: (NSString*)path
+		    base: (NSString**)base
+	      parameters: (NSDictionary**)parameters
+{
+  WebServerRouter	*router;
+  NSString		*route;
+
+  [_lock lock];
+  if (YES == ((WebServerHandlers*)_handlers)->changed)
+    {
+      /* Paths were added to or removed from the -handlers dictionary
+       * directly rather than by registering them.
+       */
+      [_lock unlock];
+      [self _updateRouter];
+      [_lock lock];
+    }
+  router = RETAIN(_router);
+  [_lock unlock];
+  route = [router match: path base: base parameters: parameters];
+  RELEASE(router);
+  return route;
+}
+
+/* Provide extra information about the exact path used to match the
+ * handler, and any remaining path information beyond it.
+ */
+- (void) _setPathHeaders: (WebServerRequest*)request
+		    base: (NSString*)base
+	      parameters: (NSDictionary*)params
+{
+  NSString	*path = [[request headerNamed: @"x-http-path"] value];
+  NSString	*extra = [path substringFromIndex: [base length]];
+
+  [request setHeader: @"x-http-path-base"
+	       value: base
+	  parameters: nil];
+  [request setHeader: @"x-http-path-info"
+	       value: extra
+	  parameters: nil];
+  [request setHeader: @"x-http-path-params"
+	       value: @""
+	  parameters: params];
+}
+
+/* Return the instance of the handler's class belonging to the current
+ * thread, creating (and warming up) a new one if necessary.  The
+ * instances are kept in the thread dictionary so they are released
+ * when the thread exits.
+ */
+- (id) _threadHandler: (id)handler forPath: (NSString*)path
+{
+  NSMutableDictionary	*td = [[NSThread currentThread] threadDictionary];
+  NSMutableDictionary	*instances = [td objectForKey: _threadKey];
+  id			local;
+
+  if (nil == instances)
+    {
+      instances = [NSMutableDictionary new];
+      [td setObject: instances forKey: _threadKey];
+      RELEASE(instances);
+    }
+  local = [instances objectForKey: path];
+  if (nil == local || [local class] != [handler class])
+    {
+      local = AUTORELEASE([[handler class] new]);
+      [local webServerBundles: self warmUpForPath: path];
+      [instances setObject: local forKey: path];
+    }
+  return local;
+}
+
+/* Build a new router containing all the configured and registered paths
+ * and use it to replace the existing one.  Lookups in progress continue
+ * to use the old router (which they have retained) so the replacement
+ * is seen atomically by each request.
+ */
+- (void) _updateRouter
+{
+  NSMutableSet		*paths;
+  NSEnumerator		*e;
+  NSString		*path;
+  WebServerRouter	*router;
+
+  [_lock lock];
+  ((WebServerHandlers*)_handlers)->changed = NO;
+  paths = [NSMutableSet setWithArray: [_handlers allKeys]];
+  e = [_bundles keyEnumerator];
+  while (nil != (path = [e nextObject]))
+    {
+      if ([[_bundles objectForKey: path] isKindOfClass: [NSDictionary class]])
+	{
+	  [paths addObject: path];
+	}
+    }
+  [_lock unlock];
+
+  router = [[WebServerRouter alloc] initWithRoutes: [paths allObjects]];
+  [_lock lock];
+  ASSIGN(_router, router);
+  [_lock unlock];
+  RELEASE(router);
+}
+
+@end
+
+
+@implementation	WebServerHandlers
+
+- (NSUInteger) count
+{
+  return [dict count];
+}
+
+- (void) dealloc
+{
+  DESTROY(dict);
+  [super dealloc];
+}
+
+- (id) init
+{
+  return [self initWithCapacity: 0];
+}
+
+/* We don't call the superclass version (which may call -init) but set
+ * up directly.
+ */
+- (id) initWithCapacity: (NSUInteger)numItems
+{
+  if (nil != (self = [super init]))
+    {
+      dict = [[NSMutableDictionary alloc] initWithCapacity: numItems];
+    }
+  return self;
+}
+
+- (NSEnumerator*) keyEnumerator
+{
+  return [dict keyEnumerator];
+}
+
+- (id) objectForKey: (id)aKey
+{
+  return [dict objectForKey: aKey];
+}
+
+- (void) removeObjectForKey: (id)aKey
+{
+  if (nil != [dict objectForKey: aKey])
+    {
+      [dict removeObjectForKey: aKey];
+      changed = YES;
+    }
+}
+
+- (void) setObject: (id)anObject forKey: (id)aKey
+{
+  if (nil == [dict objectForKey: aKey])
+    {
+      changed = YES;
+    }
+  [dict setObject: anObject forKey: aKey];
+}
+
+@end
+
@@ -0,0 +1,350 @@
+/**
+   Copyright (C) 2026 Free Software Foundation, Inc.
+
+   Written by:  agent <agent@local>
+   Date:	October 2026
+
+   This file is part of the WebServer Library.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA.
+
+   $Date$ $Revision$
+   */
+#import	<Foundation/Foundation.h>
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#define WEBSERVERINTERNAL       1
+
+#import	"WebServer.h"
+#import	"Internal.h"
+
+/* Subscribers are grouped by the I/O thread of their connection, so that
+ * publishing an event needs just one message to each thread, which then
+ * queues the event on the connections it handles.  Each event is held as
+ * a chunk (for chunked transfer encoding) and as the plain event data
+ * (for HTTP/1.0 clients), and those two objects are shared by all the
+ * connections.
+ */
+
+@interface	WebServerChannel (Private)
+- (void) _deliver: (NSArray*)a;
+- (void) _remove: (WebServerConnection*)c;
+@end
+
+/* Appends a field of an event to the data, one line for each line of
+ * the value.
+ */
+static void
+appendField(NSMutableData *d, const char *field, NSString *value)
+{
+  NSEnumerator	*e;
+  NSString	*line;
+  NSUInteger	l = strlen(field);
+
+  value = [value stringByReplacingString: @"\r\n" withString: @"\n"];
+  value = [value stringByReplacingString: @"\r" withString: @"\n"];
+  e = [[value componentsSeparatedByString: @"\n"] objectEnumerator];
+  while (nil != (line = [e nextObject]))
+    {
+      [d appendBytes: field length: l];
+      [d appendBytes: ": " length: 2];
+      [d appendData: [line dataUsingEncoding: NSUTF8StringEncoding]];
+      [d appendBytes: "\n" length: 1];
+    }
+}
+
+@implementation	WebServerChannel
+
+- (NSUInteger) count
+{
+  NSUInteger	c;
+
+  [_lock lock];
+  c = _count;
+  [_lock unlock];
+  return c;
+}
+
+- (void) dealloc
+{
+  DESTROY(_server);
+  DESTROY(_lock);
+  DESTROY(_threads);
+  DESTROY(_groups);
+  [super dealloc];
+}
+
+- (id) initWithServer: (WebServer*)server
+{
+  if (nil != (self = [super init]))
+    {
+      _server = [server retain];
+      _lock = [NSLock new];
+      _threads = [NSMutableArray new];
+      _groups = [NSMutableArray new];
+      _limit = 256 * 1024;
+      _drop = NO;
+    }
+  return self;
+}
+
+- (NSUInteger) publish: (NSString*)data
+		 event: (NSString*)name
+	    identifier: (NSString*)ident
+{
+  NSCharacterSet	*breaks;
+  NSMutableData		*raw;
+  NSMutableData		*chunk;
+  NSData		*r;
+  NSData		*c;
+  char			buf[20];
+  NSUInteger		count;
+  NSUInteger		index;
+
+  breaks = [NSCharacterSet characterSetWithCharactersInString: @"\r\n"];
+  if ([name rangeOfCharacterFromSet: breaks].length > 0
+    || [ident rangeOfCharacterFromSet: breaks].length > 0)
+    {
+      [NSException raise: NSInvalidArgumentException
+        format: @"[%@-%@] event name or identifier contains a line break",
+        NSStringFromClass([self class]), NSStringFromSelector(_cmd)];
+    }
+
+  raw = [NSMutableData dataWithCapacity: [data length] + 64];
+  if (nil != ident)
+    {
+      appendField(raw, "id", ident);
+    }
+  if (nil != name)
+    {
+      appendField(raw, "event", name);
+    }
+  if (nil != data)
+    {
+      appendField(raw, "data", data);
+    }
+  [raw appendBytes: "\n" length: 1];
+
+  sprintf(buf, "%"PRIXPTR"\r\n", [raw length]);
+  chunk = [NSMutableData dataWithCapacity: [raw length] + 32];
+  [chunk appendBytes: buf length: strlen(buf)];
+  [chunk appendData: raw];
+  [chunk appendBytes: "\r\n" length: 2];
+  r = AUTORELEASE([raw copy]);
+  c = AUTORELEASE([chunk copy]);
+
+  [_lock lock];
+  count = _count;
+  for (index = 0; index < [_threads count]; index++)
+    {
+      IOThread	*t = [_threads objectAtIndex: index];
+      NSArray	*g = [[_groups objectAtIndex: index] copy];
+      NSArray	*a = [NSArray arrayWithObjects: c, r, g, nil];
+
+      [g release];
+      [self performSelector: @selector(_deliver:)
+		   onThread: t->thread
+		 withObject: a
+	      waitUntilDone: NO];
+    }
+  [_lock unlock];
+  return count;
+}
+
+- (void) setBacklogLimit: (NSUInteger)bytes dropSlow: (BOOL)drop
+{
+  [_lock lock];
+  _limit = bytes;
+  _drop = (NO == drop) ? NO : YES;
+  [_lock unlock];
+}
+
+- (BOOL) subscribe: (WebServerResponse*)response
+{
+  WebServerConnection	*c;
+  IOThread		*t;
+  NSMutableArray	*g;
+  NSUInteger		index;
+
+  if (NO == [response isKindOfClass: [WebServerResponse class]])
+    {
+      [NSException raise: NSInvalidArgumentException
+        format: @"[%@-%@] argument is not a valid response object",
+        NSStringFromClass([self class]), NSStringFromSelector(_cmd)];
+    }
+  if (nil == (c = [_server _connectionForResponse: response]))
+    {
+      return NO;
+    }
+  [response setHeader: @"content-type"
+		value: @"text/event-stream"
+	   parameters: nil];
+  [response setHeader: @"cache-control"
+		value: @"no-cache"
+	   parameters: nil];
+
+  /* Start streaming in the I/O thread, so that the headers are sent
+   * before any event queued by that thread.  The data is a comment,
+   * which the client ignores.
+   */
+  t = [c ioThread];
+  [c _subscribe: self];
+  [c performSelector: @selector(respond:)
+	    onThread: t->thread
+	  withObject: [NSData dataWithBytes: ":\n\n" length: 3]
+       waitUntilDone: NO];
+
+  [_lock lock];
+  index = [_threads indexOfObjectIdenticalTo: t];
+  if (NSNotFound == index)
+    {
+      [_threads addObject: t];
+      g = [NSMutableArray array];
+      [_groups addObject: g];
+    }
+  else
+    {
+      g = [_groups objectAtIndex: index];
+    }
+  if (NSNotFound == [g indexOfObjectIdenticalTo: c])
+    {
+      [g addObject: c];
+      _count++;
+    }
+  [_lock unlock];
+
+  /* If the response ended while we were adding it, it may have been
+   * removed before it was added, so we must remove it ourselves.
+   */
+  if (nil == [_server _connectionForResponse: response])
+    {
+      [self _unsubscribe: c];
+      return NO;
+    }
+  return YES;
+}
+
+- (void) unsubscribe: (WebServerResponse*)response
+{
+  WebServerConnection	*c;
+
+  if (nil != (c = [_server _connectionForResponse: response]))
+    {
+      [self _unsubscribe: c];
+    }
+}
+
+@end
+
+@implementation	WebServerChannel (Internal)
+
+- (void) _unsubscribe: (WebServerConnection*)c
+{
+  [_lock lock];
+  [self _remove: c];
+  [_lock unlock];
+}
+
+@end
+
+@implementation	WebServerChannel (Private)
+
+/* Called in an I/O thread to queue an event on the connections of the
+ * subscribers using that thread.
+ */
+- (void) _deliver: (NSArray*)a
+{
+  NSData		*chunk = [a objectAtIndex: 0];
+  NSData		*raw = [a objectAtIndex: 1];
+  NSEnumerator		*e = [[a objectAtIndex: 2] objectEnumerator];
+  NSMutableArray	*gone = nil;
+  WebServerConnection	*c;
+  NSUInteger		limit;
+  BOOL			drop;
+
+  [_lock lock];
+  limit = _limit;
+  drop = _drop;
+  [_lock unlock];
+
+  while (nil != (c = [e nextObject]))
+    {
+      if ([c _backlog] + [chunk length] > limit)
+	{
+	  if (YES == drop)
+	    {
+	      if (YES == [c verbose])
+		{
+		  [_server _log: @"%@ dropped slow subscriber", c];
+		}
+	      [c end];
+	      if (nil == gone)
+		{
+		  gone = [NSMutableArray array];
+		}
+	      [gone addObject: c];
+	    }
+	  continue;	// Paused until it catches up
+	}
+      if (NO == [c _share: chunk raw: raw])
+	{
+	  if (nil == gone)
+	    {
+	      gone = [NSMutableArray array];
+	    }
+	  [gone addObject: c];
+	}
+    }
+
+  if (nil != gone)
+    {
+      e = [gone objectEnumerator];
+      [_lock lock];
+      while (nil != (c = [e nextObject]))
+	{
+	  [self _remove: c];
+	}
+      [_lock unlock];
+    }
+}
+
+/* Removes a subscriber ... the lock must be held.
+ */
+- (void) _remove: (WebServerConnection*)c
+{
+  NSUInteger	index = [_threads indexOfObjectIdenticalTo: [c ioThread]];
+
+  if (NSNotFound != index)
+    {
+      NSMutableArray	*g = [_groups objectAtIndex: index];
+      NSUInteger	i = [g indexOfObjectIdenticalTo: c];
+
+      if (NSNotFound != i)
+	{
+	  [g removeObjectAtIndex: i];
+	  _count--;
+	  if (0 == [g count])
+	    {
+	      [_groups removeObjectAtIndex: index];
+	      [_threads removeObjectAtIndex: index];
+	    }
+	}
+    }
+}
+
+@end
@@ -0,0 +1,270 @@
+/**
+   Copyright (C) 2026 Free Software Foundation, Inc.
+
+   Written by:  agent <agent@local>
+   Date:	October 2026
+
+   This file is part of the WebServer Library.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA.
+
+   $Date$ $Revision$
+   */
+#import	<Foundation/Foundation.h>
+
+#include <zlib.h>
+
+#define WEBSERVERINTERNAL       1
+
+#import	"WebServer.h"
+#import	"Internal.h"
+
+/* Responses are compressed with a zlib deflate stream producing either
+ * gzip format or zlib format (which is what HTTP calls 'deflate').
+ * Setting up a deflate stream allocates a few hundred KB, so complete
+ * responses are compressed using a stream kept by each thread and reset
+ * after each use, while a streamed response has its own stream for as
+ * long as the response lasts.
+ */
+
+static NSString	*threadKeys[2] = { @"WebServerDeflate", @"WebServerGzip" };
+
+/* The content types compressed if none are configured.  These are
+ * constant strings, so the table needs no (thread-unsafe) setting up.
+ */
+static NSString	*defaultTypes[5] = { @"text/", @"application/json",
+  @"application/javascript", @"application/xml", @"image/svg+xml" };
+
+BOOL
+WebServerCompressibleType(NSString *type, NSArray *types)
+{
+  NSEnumerator		*e;
+  NSString		*t;
+
+  if (nil == type)
+    {
+      return NO;
+    }
+  type = [type lowercaseString];
+  if (nil == types)
+    {
+      unsigned	i;
+
+      for (i = 0; i < sizeof(defaultTypes) / sizeof(*defaultTypes); i++)
+	{
+	  if ([type hasPrefix: defaultTypes[i]])
+	    {
+	      return YES;
+	    }
+	}
+      return NO;
+    }
+  e = [types objectEnumerator];
+  while (nil != (t = [e nextObject]))
+    {
+      if ([type hasPrefix: t])
+	{
+	  return YES;
+	}
+    }
+  return NO;
+}
+
+NSString *
+WebServerAcceptedEncoding(NSString *accept)
+{
+  NSEnumerator	*e;
+  NSString	*s;
+  float		gzip = -1.0;
+  float		deflate = -1.0;
+  float		any = -1.0;
+
+  if (nil == accept)
+    {
+      return nil;
+    }
+  e = [[accept componentsSeparatedByString: @","] objectEnumerator];
+  while (nil != (s = [e nextObject]))
+    {
+      NSRange	r = [s rangeOfString: @";"];
+      float	q = 1.0;
+
+      if (r.length > 0)
+	{
+	  NSString	*p = [s substringFromIndex: NSMaxRange(r)];
+
+	  s = [s substringToIndex: r.location];
+	  p = [[p stringByTrimmingSpaces] lowercaseString];
+	  if ([p hasPrefix: @"q="])
+	    {
+	      q = [[p substringFromIndex: 2] floatValue];
+	    }
+	}
+      s = [[s stringByTrimmingSpaces] lowercaseString];
+      if ([s isEqualToString: @"gzip"] || [s isEqualToString: @"x-gzip"])
+	{
+	  gzip = q;
+	}
+      else if ([s isEqualToString: @"deflate"])
+	{
+	  deflate = q;
+	}
+      else if ([s isEqualToString: @"*"])
+	{
+	  any = q;
+	}
+    }
+  if (gzip < 0.0)
+    {
+      gzip = any;
+    }
+  if (gzip > 0.0 && gzip >= deflate)
+    {
+      return @"gzip";
+    }
+  if (deflate > 0.0)
+    {
+      return @"deflate";
+    }
+  return nil;
+}
+
+void
+WebServerVaryEncoding(GSMimeDocument *response)
+{
+  NSString	*s = [[response headerNamed: @"vary"] value];
+
+  if (nil == s)
+    {
+      [response setHeader: @"Vary" value: @"Accept-Encoding" parameters: nil];
+    }
+  else if (NO == [s isEqualToString: @"*"]
+    && 0 == [[s lowercaseString] rangeOfString: @"accept-encoding"].length)
+    {
+      s = [s stringByAppendingString: @", Accept-Encoding"];
+      [response setHeader: @"Vary" value: s parameters: nil];
+    }
+}
+
+@implementation	WebServerCompressor
+
++ (WebServerCompressor*) compressorForThread: (BOOL)gzip
+{
+  NSMutableDictionary	*d = [[NSThread currentThread] threadDictionary];
+  NSString		*k = threadKeys[gzip ? 1 : 0];
+  WebServerCompressor	*c = [d objectForKey: k];
+
+  if (nil == c)
+    {
+      c = [[self alloc] initWithGzip: gzip];
+      if (nil != c)
+	{
+	  [d setObject: c forKey: k];
+	  [c release];
+	}
+    }
+  return c;
+}
+
+- (NSData*) compress: (NSData*)data finish: (BOOL)finish
+{
+  z_stream		*s = (z_stream*)zs;
+  NSUInteger		length = [data length];
+  NSMutableData		*out;
+  NSUInteger		used = 0;
+  NSTimeInterval	start;
+  int			err;
+
+  if (length > UINT_MAX)
+    {
+      return nil;
+    }
+  start = [NSDate timeIntervalSinceReferenceDate];
+  out = [NSMutableData dataWithLength: deflateBound(s, length) + 64];
+  s->next_in = (Bytef*)[data bytes];
+  s->avail_in = (uInt)length;
+  for (;;)
+    {
+      s->next_out = (Bytef*)[out mutableBytes] + used;
+      s->avail_out = (uInt)([out length] - used);
+      err = deflate(s, (YES == finish) ? Z_FINISH : Z_SYNC_FLUSH);
+      used = [out length] - s->avail_out;
+      if (err != Z_OK || s->avail_out > 0)
+	{
+	  break;
+	}
+      [out setLength: [out length] * 2];	// Need more output space
+    }
+  if (YES == finish)
+    {
+      deflateReset(s);
+    }
+  if (Z_STREAM_ERROR == err || (YES == finish && err != Z_STREAM_END))
+    {
+      return nil;
+    }
+  [out setLength: used];
+  bytesIn += length;
+  bytesOut += used;
+  spent += [NSDate timeIntervalSinceReferenceDate] - start;
+  return out;
+}
+
+- (void) dealloc
+{
+  if (0 != zs)
+    {
+      deflateEnd((z_stream*)zs);
+      free(zs);
+    }
+  [super dealloc];
+}
+
+- (id) initWithGzip: (BOOL)flag
+{
+  if (nil != (self = [super init]))
+    {
+      zs = calloc(1, sizeof(z_stream));
+      /* Window bits above 15 select gzip rather than zlib format.
+       */
+      if (Z_OK != deflateInit2((z_stream*)zs, Z_DEFAULT_COMPRESSION,
+	Z_DEFLATED, (YES == flag) ? 31 : 15, 8, Z_DEFAULT_STRATEGY))
+	{
+	  free(zs);
+	  zs = 0;
+	  DESTROY(self);
+	}
+      gzip = flag;
+    }
+  return self;
+}
+
+- (BOOL) isGzip
+{
+  return gzip;
+}
+
+- (void) report: (WebServer*)server
+{
+  if (bytesIn > 0)
+    {
+      [server _compressed: bytesIn to: bytesOut duration: spent];
+    }
+  bytesIn = 0;
+  bytesOut = 0;
+  spent = 0.0;
+}
+
+@end
@@ -199,6 +199,155 @@ debugWrite(WebServer *server, WebServerConnection *c, NSData *data)
   free(b64);
 }
 
+/* Returns YES if the data starts with a complete GET or HEAD request
+ * (one which has no body), which may be processed at the same time as
+ * the request before it.
+ */
+static BOOL
+pipelinable(NSData *data)
+{
+  const uint8_t	*bytes = (const uint8_t*)[data bytes];
+  NSUInteger	length = [data length];
+  NSUInteger	pos;
+
+  if (length < 4 || (memcmp(bytes, "GET ", 4) != 0
+    && (length < 5 || memcmp(bytes, "HEAD ", 5) != 0)))
+    {
+      return NO;
+    }
+  for (pos = 1; pos < length; pos++)
+    {
+      if ('\n' == bytes[pos]
+	&& ('\n' == bytes[pos - 1]
+	  || (pos > 1 && '\r' == bytes[pos - 1] && '\n' == bytes[pos - 2])))
+	{
+	  return YES;	// Found the empty line ending the headers
+	}
+    }
+  return NO;
+}
+
+/* Returns the body of a response whose content is simple (a string is
+ * encoded using the charset of its content type, or UTF-8 if that has
+ * none), or nil if the content is multipart.
+ */
+static NSData *
+bodyData(WebServerResponse *r)
+{
+  id	content = [r content];
+
+  if ([content isKindOfClass: [NSData class]])
+    {
+      return content;
+    }
+  if ([content isKindOfClass: [NSString class]])
+    {
+      NSString		*charset;
+      NSStringEncoding	e = NSUTF8StringEncoding;
+
+      charset = [[r headerNamed: @"content-type"] parameterForKey: @"charset"];
+      if (nil != charset)
+	{
+	  e = [GSMimeDocumentClass encodingFromCharset: charset];
+	}
+      return [content dataUsingEncoding: e];
+    }
+  return nil;
+}
+
+/* Returns the status code set in a response (200 if none is set).
+ */
+static int
+responseStatus(WebServerResponse *r)
+{
+  NSString	*s = [[r headerNamed: @"http"] value];
+  NSRange	range;
+
+  if (nil == s)
+    {
+      return 200;
+    }
+  range = [s rangeOfString: @" "];
+  if (0 == range.length)
+    {
+      return 0;
+    }
+  return [[s substringFromIndex: NSMaxRange(range)] intValue];
+}
+
+NSString *
+WebServerETag(NSData *body)
+{
+  const uint8_t	*p = (const uint8_t*)[body bytes];
+  NSUInteger	len = [body length];
+  uint64_t	h = 0xcbf29ce484222325ULL;	// FNV-1a basis
+
+  while (len-- > 0)
+    {
+      h ^= *p++;
+      h *= 0x100000001b3ULL;			// FNV-1a prime
+    }
+  return [NSString stringWithFormat: @"W/\"%016llx-%"PRIxPTR"\"",
+    (unsigned long long)h, [body length]];
+}
+
+BOOL
+WebServerETagMatches(NSString *header, NSString *etag)
+{
+  NSUInteger	length = [header length];
+  NSUInteger	pos = 0;
+
+  if (nil == etag)
+    {
+      return NO;
+    }
+  if ([etag hasPrefix: @"W/"])
+    {
+      etag = [etag substringFromIndex: 2];	// Weak comparison
+    }
+  while (pos < length)
+    {
+      unichar	c = [header characterAtIndex: pos];
+      NSRange	r;
+
+      if (' ' == c || '\t' == c || ',' == c)
+	{
+	  pos++;
+	  continue;
+	}
+      if ('*' == c)
+	{
+	  return YES;
+	}
+      if ('W' == c && pos + 1 < length
+	&& '/' == [header characterAtIndex: pos + 1])
+	{
+	  pos += 2;				// Weak comparison
+	}
+      if (pos >= length || '"' != [header characterAtIndex: pos])
+	{
+	  return NO;				// Not a valid list
+	}
+      /* The tag is quoted and may contain commas, so we look for the
+       * closing quote rather than splitting the list at commas.
+       */
+      r = [header rangeOfString: @"\""
+			options: NSLiteralSearch
+			  range: NSMakeRange(pos + 1, length - pos - 1)];
+      if (0 == r.length)
+	{
+	  return NO;
+	}
+      if ([etag isEqualToString:
+	[header substringWithRange: NSMakeRange(pos, NSMaxRange(r) - pos)]])
+	{
+	  return YES;
+	}
+      pos = NSMaxRange(r);
+    }
+  return NO;
+}
+
 @implementation	WebServerRequest
 
 + (void) initialize
@@ -316,6 +465,7 @@ debugWrite(WebServer *server, WebServerConnection *c, NSData *data)
 - (void) dealloc
 {
   DESTROY(userInfo);
+  DESTROY(lane);
   DEALLOC
 }
 
@@ -357,6 +507,16 @@ debugWrite(WebServer *server, WebServerConnection *c, NSData *data)
   return (other == self) ? YES : NO;
 }
 
+- (WebServerLane*) lane
+{
+  return lane;
+}
+
+- (NSTimeInterval) laneStart
+{
+  return laneStart;
+}
+
 - (BOOL) prepared
 {
   return prepared;
@@ -372,6 +532,12 @@ debugWrite(WebServer *server, WebServerConnection *c, NSData *data)
   foldHeaders = (NO == aFlag) ? NO : YES;
 }
 
+- (void) setLane: (WebServerLane*)l
+{
+  ASSIGN(lane, l);
+  laneStart = [NSDate timeIntervalSinceReferenceDate];
+}
+
 - (void) setPrepared
 {
   prepared = YES;
@@ -414,6 +580,19 @@ debugWrite(WebServer *server, WebServerConnection *c, NSData *data)
     }
 }
 
+- (BOOL) acceptWebSocket
+{
+  if (nil != leader || nil != h2 || YES == simple || nil == handle)
+    {
+      return NO;	// Pipelined or HTTP/2 requests can't be upgraded
+    }
+  if (nil == ws)
+    {
+      ws = [[WebServerWebSocket alloc] initWithLimit: conf->maxBodySize];
+    }
+  return YES;
+}
+
 - (NSString*) address
 {
   if (address)
@@ -535,6 +714,16 @@ debugWrite(WebServer *server, WebServerConnection *c, NSData *data)
 - (void) dealloc
 {
   [handle closeFile];
+  DESTROY(leader);
+  DESTROY(pipeline);
+  DESTROY(pipeOut);
+  DESTROY(h2);
+  DESTROY(ws);
+  DESTROY(shared);
+  DESTROY(channels);
+  DESTROY(outSpare);
+  DESTROY(outWriting);
+  DESTROY(compressor);
   DESTROY(ioThread);
   DESTROY(frameOpts);
   DESTROY(handle);
@@ -546,6 +735,9 @@ debugWrite(WebServer *server, WebServerConnection *c, NSData *data)
   DESTROY(remPort);
   DESTROY(buffer);
   DESTROY(parser);
+  [reader detach];
+  DESTROY(reader);
+  DESTROY(unread);
   DESTROY(command);
   DESTROY(agent);
   DESTROY(result);
@@ -634,6 +826,25 @@ debugWrite(WebServer *server, WebServerConnection *c, NSData *data)
 	  GSLinkedListRemove(self, owner);
 	}
       [ioThread->threadLock unlock];
+      [reader detach];
+      if (nil != pipeline)
+	{
+	  NSEnumerator		*e = [pipeline objectEnumerator];
+	  WebServerConnection	*f;
+
+	  /* Abandon any pipelined requests.
+	   */
+	  while (nil != (f = [e nextObject]))
+	    {
+	      [server _endConnect: f];
+	    }
+	  DESTROY(pipeline);
+	}
+      [h2 abandon];
+      if (YES == [ws open])
+	{
+	  [server _webSocketClosed: self];
+	}
       [server _endConnect: self];
     }
 }
@@ -659,6 +870,10 @@ debugWrite(WebServer *server, WebServerConnection *c, NSData *data)
 
 - (NSFileHandle*) handle
 {
+  if (nil != leader)
+    {
+      return [leader handle];
+    }
   return handle;
 }
 
@@ -792,6 +1007,35 @@ debugWrite(WebServer *server, WebServerConnection *c, NSData *data)
   return self;
 }
 
+- (id) initWithLeader: (WebServerConnection*)c
+{
+  if ((self = [super init]) != nil)
+    {
+      leader = [c retain];
+      nc = [c->nc retain];
+      server = c->server;
+      identity = c->identity;
+      /* Count the requests ahead of this one so that the limit on the
+       * number of requests for the connection works.
+       */
+      requests = c->requests + [c->pipeline count] + 1;
+      requestCount = c->requestCount;
+      ASSIGN(frameOpts, c->frameOpts);
+      ASSIGN(locAddr, c->locAddr);
+      ASSIGN(locPort, c->locPort);
+      ASSIGN(remAddr, c->remAddr);
+      ASSIGN(remPort, c->remPort);
+      ASSIGN(address, c->address);
+      ASSIGN(descIn, c->descIn);
+      ASSIGN(descOut, c->descOut);
+      conf = [c->conf retain];
+      quiet = c->quiet;
+      ssl = c->ssl;
+      ioThread = [c->ioThread retain];
+    }
+  return self;
+}
+
 - (IOThread*) ioThread
 {
   return ioThread;
@@ -828,6 +1072,16 @@ debugWrite(WebServer *server, WebServerConnection *c, NSData *data)
   return quiet;
 }
 
+/* Reject the request by writing a (pre-rendered) response and closing
+ * the connection.  Must be called in the I/O thread.
+ */
+- (void) reject: (NSData*)data result: (NSString*)aString
+{
+  [self setShouldClose: YES];	// Not persistent.
+  [self setResult: aString];
+  [self _doWrite: data];
+}
+
 - (NSString*) remoteAddress
 {
   return remAddr;
@@ -868,23 +1122,39 @@ debugWrite(WebServer *server, WebServerConnection *c, NSData *data)
   hadRequest = NO;
   autoBlock = NO;
   incremental = NO;
+  hdrMidLine = NO;
   streaming = NO;
   chunked = NO;
+  streamAbort = NO;
+  subscribed = NO;
   DESTROY(outBuffer);
+  DESTROY(outSpare);
+  DESTROY(outWriting);
+  DESTROY(compressor);
+  DESTROY(shared);
+  sharedBytes = 0;
   DESTROY(command);
   r = [self request];
   if (nil != r)
     {
-      [server _setIncrementalBytes: 0 length: 0 forRequest: r];
+      [server _setIncrementalReader: nil forRequest: r];
       [server setUserInfo: nil forRequest: r];
+      [server _setParameters: nil forRequest: r];
+      [server _setUploads: nil forRequest: r];
     }
   [response setWebServerConnection: nil];
+  [self _unsubscribe];
   DESTROY(response);
   DESTROY(agent);
   DESTROY(result);
   DESTROY(user);
   byteCount = 0;
-  bodyLength = 0;
+  dispatched = NO;
+  sliceBusy = NO;
+  sliceReady = NO;
+  [reader detach];
+  DESTROY(reader);
+  DESTROY(unread);
   DESTROY(buffer);
   [self setRequestStart: 0.0];
   [self setParser: nil];
@@ -895,51 +1165,100 @@ debugWrite(WebServer *server, WebServerConnection *c, NSData *data)
 {
   NSData	*data;
 
+  if (nil == stream && NO == streaming)
+    {
+      /* Tag and compress a complete response before (possibly) passing
+       * it to the I/O thread, so the work is done in the pool.
+       */
+      if (YES == conf->autoETag && nil == [response headerNamed: @"etag"])
+	{
+	  [self _etagResponse];
+	}
+      if (conf->compressMin > 0
+	&& nil == [response headerNamed: @"content-encoding"])
+	{
+	  [self _compressResponse];
+	}
+    }
+
+  if ((nil != leader || YES == subscribed)
+    && [NSThread currentThread] != ioThread->thread)
+    {
+      /* A pipelined request shares its output with the leader, and a
+       * broadcast subscriber has data queued by the I/O thread, so we
+       * must build the response in the I/O thread.
+       */
+      [self performSelector: @selector(respond:)
+		   onThread: ioThread->thread
+		 withObject: stream
+	      waitUntilDone: NO];
+      return;
+    }
+
   ticked = [NSDateClass timeIntervalSinceReferenceDate];
 
   if (YES == streaming)
     {
+      NSMutableData	*m;
+
       /* We are already streaming, so we just need to stream the new data
-       * or to end streaming if there is no new data.
+       * or to end streaming if there is no new data.  The data is
+       * compressed and framed in this thread (usually one in the pool),
+       * but the output buffer is only ever used in the I/O thread.
        */
+      m = [NSMutableDataClass dataWithCapacity: [stream length] + 16];
       if (nil == stream)
         {
           /* We are stopping streaming.
            */
-          streaming = NO;
-          if (YES == chunked)
+          if (YES == streamAbort)
             {
-              /* Terminate the chunked transfer encoding.
+              /* The response failed part way through, so we must not
+               * end the stream properly ... the client should see the
+               * connection close with the response incomplete.
                */
-              [outBuffer appendBytes: "0\r\n\r\n" length: 5];
+              DESTROY(compressor);
             }
-          chunked = NO;
-          if (NO == responding)
+          else if (nil != compressor)
             {
-              if ([outBuffer length] > 0)
-                {
-                  /* There's still data to be written ... try to do it.
-                   */
-                  responding = YES;
-                  [self performSelector: @selector(_doWrite:)
-                               onThread: ioThread->thread
-                             withObject: outBuffer
-                          waitUntilDone: NO];
-                }
-              else
+              /* End the compressed stream.
+               */
+              stream = [compressor compress: nil finish: YES];
+              [compressor report: server];
+              DESTROY(compressor);
+              if ([stream length] > 0)
                 {
-                  /* We have finished streaming data, and the last write
-                   * has already completed, so we fake another write
-                   * completion notification to get the end of streaming
-                   * cleanup done.
-                   */
-                  DESTROY(outBuffer);
-                  [self _didWrite:
-                    [NSNotification notificationWithName:
-                      GSFileHandleWriteCompletionNotification
-                      object: handle userInfo: nil]];
+                  if (YES == chunked)
+                    {
+                      char      buf[16];
+
+                      sprintf(buf, "%"PRIXPTR"\r\n", [stream length]);
+                      [m appendBytes: buf length: strlen(buf)];
+                    }
+                  [m appendData: stream];
+                  if (YES == chunked)
+                    {
+                      [m appendBytes: "\r\n" length: 2];
+                    }
                 }
             }
+          if (YES == chunked && NO == streamAbort)
+            {
+              /* Terminate the chunked transfer encoding.
+               */
+              [m appendBytes: "0\r\n\r\n" length: 5];
+            }
+          if ([NSThread currentThread] == ioThread->thread)
+            {
+              [self _streamEnd: m];
+            }
+          else
+            {
+              [self performSelector: @selector(_streamEnd:)
+                           onThread: ioThread->thread
+                         withObject: m
+                      waitUntilDone: NO];
+            }
         }
       else
         {
@@ -949,26 +1268,33 @@ debugWrite(WebServer *server, WebServerConnection *c, NSData *data)
             {
               [server _log: @"Response continued %@ - %@", descOut, stream];
             }
-          if (YES == chunked)
+          if (nil != compressor)
+            {
+              stream = [compressor compress: stream finish: NO];
+            }
+          if (YES == chunked && [stream length] > 0)
             {
               char      buf[16];
 
               sprintf(buf, "%"PRIXPTR"\r\n", [stream length]);
-              [outBuffer appendBytes: buf length: strlen(buf)];
+              [m appendBytes: buf length: strlen(buf)];
+              [m appendData: stream];
+              [m appendBytes: "\r\n" length: 2];
             }
-          [outBuffer appendData: stream];
-          if (NO == responding)
+          else
             {
-              NSData    *data;
-
-              responding = YES;
-              data = [outBuffer copy];
-              [outBuffer setLength: 0];
-              [self performSelector: @selector(_doWrite:)
+              [m appendData: stream];
+            }
+          if ([NSThread currentThread] == ioThread->thread)
+            {
+              [self _streamAppend: m];
+            }
+          else
+            {
+              [self performSelector: @selector(_streamAppend:)
                            onThread: ioThread->thread
-                         withObject: data
+                         withObject: m
                       waitUntilDone: NO];
-              [data release];
             }
         }
     }
@@ -1018,6 +1344,7 @@ debugWrite(WebServer *server, WebServerConnection *c, NSData *data)
           else
             {
               streaming = YES;
+              outBuffer = [NSMutableDataClass new];
               data = stream;
             }
           [self setResult: @""];
@@ -1072,10 +1399,31 @@ debugWrite(WebServer *server, WebServerConnection *c, NSData *data)
           [response deleteHeaderNamed: @"content-transfer-encoding"];
           if (nil != stream)
             {
+              NSString	*enc = [self _compressible: NSNotFound];
+
+              if (nil != enc)
+                {
+                  compressor = [WebServerCompressor alloc];
+                  compressor = [compressor initWithGzip:
+                    [enc isEqualToString: @"gzip"]];
+                  data = [compressor compress: stream finish: NO];
+                  if (nil == data)
+                    {
+                      DESTROY(compressor);
+                      data = stream;
+                    }
+                  else
+                    {
+                      [response setHeader: @"content-encoding"
+                                    value: enc
+                               parameters: nil];
+                    }
+                }
               [response setHeader: @"transfer-encoding"
                             value: @"chunked"
                        parameters: nil];
               streaming = YES;
+              outBuffer = [NSMutableDataClass new];
               chunked = YES;
             }
           else
@@ -1083,7 +1431,14 @@ debugWrite(WebServer *server, WebServerConnection *c, NSData *data)
               [response deleteHeaderNamed: @"transfer-encoding"];
             }
 
-          if (NO == streaming)
+          if (NO == streaming && 304 == responseStatus(response))
+            {
+              /* A 304 has no body, and no length (any length would be
+               * taken as that of the body the client already has).
+               */
+              [response deleteHeaderNamed: @"content-type"];
+            }
+          else if (NO == streaming)
             {
               if (0 == contentLength)
                 {
@@ -1185,8 +1540,15 @@ debugWrite(WebServer *server, WebServerConnection *c, NSData *data)
           /* We will close this connection if the maximum number of requests
            * or maximum request duration has been exceeded or if the keepalive
            * limit for the thread has been reached.
+           * None of that applies if we are switching to a WebSocket, and
+           * the switching response has no content.
            */
-          if (requests >= conf->maxConnectionRequests)
+          if (nil != ws && NO == streaming && NO == [self shouldClose]
+	    && YES == [result hasPrefix: @"HTTP/1.1 101"])
+            {
+              [response deleteHeaderNamed: @"content-length"];
+            }
+          else if (requests >= conf->maxConnectionRequests)
             {
               [self setShouldClose: YES];
             }
@@ -1233,10 +1595,14 @@ debugWrite(WebServer *server, WebServerConnection *c, NSData *data)
                 {
                   char      buf[16];
 
-                  sprintf(buf, "%"PRIXPTR"\r\n", [raw length]);
+                  sprintf(buf, "%"PRIXPTR"\r\n", [data length]);
                   [out appendBytes: buf length: strlen(buf)];
                 }
-              [out appendData: raw];
+              [out appendData: data];
+              if (YES == chunked)
+                {
+                  [out appendBytes: "\r\n" length: 2];
+                }
             }
           data = out;
         }
@@ -1372,6 +1738,10 @@ debugWrite(WebServer *server, WebServerConnection *c, NSData *data)
 
 - (void) setProcessing: (BOOL)aFlag
 {
+  if (nil != leader)
+    {
+      return;	// Not in the I/O thread lists
+    }
   [ioThread->threadLock lock];
   if (YES == aFlag)
     {
@@ -1556,28 +1926,136 @@ debugWrite(WebServer *server, WebServerConnection *c, NSData *data)
   return conf->verbose;
 }
 
+- (BOOL) webSocket
+{
+  return (nil == ws) ? NO : YES;
+}
+
+/* Returns the number of bytes of streamed response waiting to be written.
+ */
+- (NSUInteger) _backlog
+{
+  return [outBuffer length] + sharedBytes;
+}
+
+/* Returns the content coding to use to compress the response body (whose
+ * length is NSNotFound if it is to be streamed), or nil if it should not
+ * be compressed.  Any response which would be compressed for a client
+ * accepting compression gets Accept-Encoding added to its Vary header.
+ */
+- (NSString*) _compressible: (NSUInteger)length
+{
+  WebServerConfig	*c = conf;
+  NSString		*s;
+  int			status = responseStatus(response);
+
+  if (0 == c->compressMin || YES == simple || YES == subscribed || nil != ws)
+    {
+      return nil;
+    }
+  if (NSNotFound != length && length < c->compressMin)
+    {
+      return nil;
+    }
+  if (nil != [response headerNamed: @"content-encoding"]
+    || nil != [response headerNamed: @"content-range"])
+    {
+      return nil;	// Already encoded or partial content
+    }
+  s = [[[response headerNamed: @"cache-control"] value] lowercaseString];
+  if (nil != s && [s rangeOfString: @"no-transform"].length > 0)
+    {
+      return nil;
+    }
+  if (status < 200 || status >= 300 || 204 == status || 206 == status)
+    {
+      return nil;
+    }
+  s = [[response headerNamed: @"content-type"] value];
+  if (NO == WebServerCompressibleType(s, c->compressTypes))
+    {
+      return nil;
+    }
+  WebServerVaryEncoding(response);
+  s = [[[self request] headerNamed: @"accept-encoding"] value];
+  return WebServerAcceptedEncoding(s);
+}
+
+/* Compresses the body of a complete response if the client accepts
+ * compression and the content is of a type and size to be compressed.
+ * Only simple (string or data) content is compressed.
+ */
+- (void) _compressResponse
+{
+  GSMimeHeader		*type = [response headerNamed: @"content-type"];
+  WebServerCompressor	*c;
+  NSString		*enc;
+  NSData		*body;
+  NSData		*z;
+
+  if (nil == (body = bodyData(response)))
+    {
+      return;
+    }
+  if (nil == (enc = [self _compressible: [body length]]))
+    {
+      return;
+    }
+  c = [WebServerCompressor compressorForThread: [enc isEqualToString: @"gzip"]];
+  z = [c compress: body finish: YES];
+  [c report: server];
+  if (nil == z || [z length] >= [body length])
+    {
+      return;	// Not worth it
+    }
+  if ([[response content] isKindOfClass: [NSString class]]
+    && nil == [type parameterForKey: @"charset"])
+    {
+      /* Say how the text we compressed was encoded.
+       */
+      [type setParameter: @"utf-8" forKey: @"charset"];
+    }
+  [response setContent: z];
+  [response setHeader: @"Content-Encoding" value: enc parameters: nil];
+}
+
+/* Sets a weak entity tag (a hash of the body) in a successful response
+ * to a GET or HEAD request, and turns the response into a 304 if the
+ * client already has a copy with that tag.
+ */
+- (void) _etagResponse
+{
+  NSString		*method;
+  NSString		*etag;
+  NSData		*body;
+
+  method = [[[self request] headerNamed: @"x-http-method"] value];
+  if (YES == simple || 200 != responseStatus(response)
+    || (NO == [method isEqualToString: @"GET"]
+      && NO == [method isEqualToString: @"HEAD"])
+    || nil == (body = bodyData(response)))
+    {
+      return;
+    }
+  etag = WebServerETag(body);
+  [response setHeader: @"ETag" value: etag parameters: nil];
+
+  if (YES == WebServerETagMatches(
+    [[[self request] headerNamed: @"if-none-match"] value], etag))
+    {
+      [response setHeader: @"http"
+		    value: @"HTTP/1.1 304 Not Modified"
+	       parameters: nil];
+      [response setContent: [NSData data]];
+    }
+}
+
 #define PROCESS \
-if (incremental > 0) \
-  { \
-    NSData        *d = [parser data]; \
-    const void    *b = [d bytes]; \
-    NSUInteger    l = [d length]; \
- \
-    if (l > bodyLength) \
-      { \
-        NSUInteger buffered = [server _setIncrementalBytes: b + bodyLength \
-                                                    length: l - bodyLength \
-                                                forRequest: doc]; \
-        bodyLength = l; \
-        if (YES == hadRequest || buffered >= incremental) \
-          { \
-            [server _process1: self]; \
-          } \
-      } \
-  } \
-else if (YES == hadRequest) \
+if (YES == hadRequest) \
   { \
+    dispatched = YES; \
     [server _process1: self]; \
+    [self _pipelineRequests]; \
   }
 
 - (BOOL) _checkHeaders
@@ -1585,14 +2063,16 @@ else if (YES == hadRequest) \
   NSData	*data;
   NSString      *a; 
   NSDate        *b;
+  NSTimeInterval	wait;
 
   /* When a connection is from a trusted proxy, we do per-host counting by
    * originating host (header information from the proxy) rather than the
    * address of the remote end of the TCP/IP connection.
    * We must therefore inform the server of the change in connections from
-   * each address.
+   * each address.  A follower (handling a pipelined request) is counted
+   * as part of its leader.
    */
-  if ([server isTrusted])
+  if ([server isTrusted] && nil == leader)
     {
       NSString  *newAddress;
 
@@ -1628,35 +2108,37 @@ else if (YES == hadRequest) \
   b = [server _blocked: a];
   if (b)
     {
-      NSString	*body;
-      int	seconds;
-
       [server _log:
         @"%@ Request from remote (%@) blocked until %@. rejected", self, a, b];
       [self setShouldClose: YES];	// Not persistent.
       [self setResult:
         @"HTTP/1.0 429 Too Many Requests"];
-      seconds = ceil([b timeIntervalSinceNow]);
-      if (seconds < 1) seconds = 1;
-      body = [NSString stringWithFormat:
-        @"HTTP/1.0 429 Too Many Requests\r\n"
-	@"Content-Type: text/html\r\n"
-	@"Retry-After: %d\r\n"
-	@"\r\n"
-	@"<html>\r\n"
-	@"  <head>\r\n"
-	@"    <title>Too Many Requests</title>\r\n"
-	@"  </head>\r\n"
-	@"  <body>\r\n"
-	@"    <h1>Too Many Requests</h1>\r\n"
-	@"    <p>You are seeing this message because you sent a request\r\n"
-        @"    with invalid authentication and as a security measure your\r\n"
-	@"    requests are now throttled for a short time.<br />\r\n"
-	@"    Please try again after %d seconds.</p>\r\n"
-	@"   </body>\r\n"
-	@"</html>\r\n",
-	seconds, seconds];
-      data = [body dataUsingEncoding: NSASCIIStringEncoding];
+      data = WebServerTooManyRequests(ceil([b timeIntervalSinceNow]));
+      [self performSelector: @selector(_doWrite:)
+                   onThread: ioThread->thread
+                 withObject: data
+              waitUntilDone: NO];
+      return YES;
+    }
+
+  /* See if this request exceeds a rate limit.  We do this here in the
+   * I/O thread so that an abusive client does not get to use any of the
+   * processing pool.  The connection must be closed as we have not read
+   * any request body.
+   */
+  wait = [server _rateLimit: a
+		       path: [[[self request] headerNamed: @"x-http-path"] value]];
+  if (wait > 0.0)
+    {
+      if (YES == conf->verbose && NO == quiet)
+	{
+	  [server _log: @"%@ Request from remote (%@) rate limited. rejected",
+	    self, a];
+	}
+      [self setShouldClose: YES];	// Not persistent.
+      [self setResult:
+        @"HTTP/1.0 429 Too Many Requests"];
+      data = WebServerRateLimited(ceil(wait));
       [self performSelector: @selector(_doWrite:)
                    onThread: ioThread->thread
                  withObject: data
@@ -1736,10 +2218,22 @@ else if (YES == hadRequest) \
   NSString		*path = @"";
   NSString		*version = @"";
   WebServerRequest	*doc = nil;
+  NSData		*rest = nil;
 
   // Mark as having had I/O ... not idle.
   ticked = [NSDateClass timeIntervalSinceReferenceDate];
 
+  if (nil != h2)
+    {
+      [self _h2Data: d];
+      return;
+    }
+  if (YES == [ws open])
+    {
+      [self _wsData: d];
+      return;
+    }
+
   if (nil == parser)
     {
       uint8_t		*bytes;
@@ -1767,14 +2261,40 @@ else if (YES == hadRequest) \
       bytes = [buffer mutableBytes];
       length = [buffer length];
 
-      /* 0x16 is a TLS session header, and is not a legal character in a
-       * method name.
+      /* A client which knows we support HTTP/2 starts with the preface.
        */
-      if (length > 0 && 0x16 == bytes[0])
+      if (YES == conf->http2 && NO == hasReset && length > 0
+	&& YES == WebServerHTTP2Preface(bytes, length))
 	{
-	  NSData	*data;
-
-	  [server _log: @"%@ Request may be encrypted", self];
+	  if (length < 24)
+	    {
+	      [self performSelector: @selector(_doRead)
+			   onThread: ioThread->thread
+			 withObject: nil
+		      waitUntilDone: NO];
+	    }
+	  else
+	    {
+	      NSData	*data = [buffer autorelease];
+
+	      buffer = nil;
+	      [self setRequestStart: 0.0];
+	      h2 = [[WebServerHTTP2 alloc] initWithConnection: self
+						       server: server
+						       config: conf];
+	      [self _h2Data: data];
+	    }
+	  return;
+	}
+
+      /* 0x16 is a TLS session header, and is not a legal character in a
+       * method name.
+       */
+      if (length > 0 && 0x16 == bytes[0])
+	{
+	  NSData	*data;
+
+	  [server _log: @"%@ Request may be encrypted", self];
 	  [self setShouldClose: YES];
 	  [self setResult: @"HTTP/1.0 400 Bad Request (HTTPS to HTTP server?)"];
 	  [nc removeObserver: self
@@ -2060,6 +2580,28 @@ else if (YES == hadRequest) \
     }
   method = [[doc headerNamed: @"x-http-method"] value];
 
+  if (nil != reader)
+    {
+      [self _readBody: d];
+      return;
+    }
+
+  /* While reading the headers of a request which may have a body, we
+   * stop at the end of the headers so that the body can be read by a
+   * body reader rather than the mime parser if necessary.
+   */
+  if (nil != d && YES == [parser isInHeaders]
+    && YES == [self _mayReadBody: method])
+    {
+      NSUInteger	used = [self _headerBytes: d];
+
+      if (used < [d length])
+	{
+	  rest = [d subdataWithRange: NSMakeRange(used, [d length] - used)];
+	  d = [d subdataWithRange: NSMakeRange(0, used)];
+	}
+    }
+
   /* Abandon request if the total data read is too long.
    * NB.  If we are doing incremental parsing then no length is too great
    * and it's the responsibility of the higher level application to end
@@ -2094,7 +2636,12 @@ else if (YES == hadRequest) \
                 }
               incremental = [server _incremental: self];
             }
+	  if (nil != rest)
+	    {
+	      [self setExcess: rest];	// Start of next request
+	    }
 	  requestCount++;
+	  WebServerUntrustedParts(doc);
 	  [doc setHeader: @"x-webserver-completed"
                    value: @"YES"
               parameters: nil];
@@ -2130,7 +2677,12 @@ else if (YES == hadRequest) \
             }
           incremental = [server _incremental: self];
         }
+      if (nil != rest)
+	{
+	  [self setExcess: rest];	// Start of next request
+	}
       requestCount++;
+      WebServerUntrustedParts(doc);
       [doc setHeader: @"x-webserver-completed"
                value: @"YES"
           parameters: nil];
@@ -2160,6 +2712,29 @@ else if (YES == hadRequest) \
               PROCESS
               return;
             }
+          reader = [self _newBodyReader];
+          if (nil != reader)
+            {
+              if (nil != rest || nil != [reader error])
+                {
+                  [self _readBody: rest];
+                }
+              else
+                {
+                  [self performSelector: @selector(_doRead)
+                               onThread: ioThread->thread
+                             withObject: nil
+                          waitUntilDone: NO];
+                }
+              return;
+            }
+        }
+      if (nil != rest)
+        {
+          /* The body is to be read by the mime parser after all.
+           */
+          [self _didData: rest];
+          return;
         }
       PROCESS
     }
@@ -2202,7 +2777,14 @@ else if (YES == hadRequest) \
 
   if ([d length] == 0)
     {
-      if (parser == nil)
+      if (YES == [ws open])
+	{
+	  if (YES == conf->verbose && NO == quiet)
+	    {
+	      [server _log: @"%@ WebSocket dropped by client", self];
+	    }
+	}
+      else if (parser == nil)
 	{
 	  if ([buffer length] == 0)
 	    {
@@ -2212,7 +2794,7 @@ else if (YES == hadRequest) \
 	       * Don't log this in quiet mode as it could just be a
 	       * test connection that we are ignoring.
 	       */
-	      if (NO == quiet && [self hasReset] == NO)
+	      if (NO == quiet && [self hasReset] == NO && nil == h2)
 		{
 		  [server _log: @"%@ read end-of-file in empty request", self];
 		}
@@ -2244,6 +2826,13 @@ else if (YES == hadRequest) \
   NSTimeInterval	now;
   NSString		*err;
 
+  if (nil != leader)
+    {
+      /* A pipelined request has finished streaming its response.
+       */
+      [leader _pipeFlush];
+      return;
+    }
   if ([notification object] != handle)
     {
       return;	// Must be an old notification
@@ -2253,6 +2842,16 @@ else if (YES == hadRequest) \
 
   responding = NO;
   err = [[notification userInfo] objectForKey: GSFileHandleNotificationError];
+  if (nil != h2 && nil == err)
+    {
+      [self _h2Write];
+      return;
+    }
+  if (YES == [ws open] && nil == err)
+    {
+      [self _wsWrite];
+      return;
+    }
   if ([self shouldClose] == YES && nil == outBuffer)
     {
       [self end];
@@ -2263,8 +2862,16 @@ else if (YES == hadRequest) \
       if (nil == outBuffer)
         {
           NSTimeInterval	t = [self requestDuration: now];
-          NSData		*more;
 
+          if (YES == pipeOnly)
+            {
+              /* We have written the responses to pipelined requests.
+               */
+              pipeOnly = NO;
+              [self _pipeWritten];
+              [self _nextRequest];
+              return;
+            }
           if (t > 0.0)
             {
               [self setRequestEnd: now];
@@ -2285,62 +2892,67 @@ else if (YES == hadRequest) \
             {
               [server _audit: self];
             }
-          [self reset];
-
-          [self _keepalive];
-
-          more = [self excess];
-          [nc addObserver: self
-                 selector: @selector(_didRead:)
-                     name: NSFileHandleReadCompletionNotification
-                   object: handle];
-          if (nil != more)
-            {
-              /* Use pipelined data to start new request.
-               */
-              [more retain];
-              [self setExcess: nil];
-              [self _didData: more];
-              [more release];
-            }
-          else
+          if (nil != ws)
             {
-              /* Start reading a new request.
-               */
-              [self performSelector: @selector(_doRead)
-                           onThread: ioThread->thread
-                         withObject: nil
-                      waitUntilDone: NO];
+              if (YES == [result hasPrefix: @"HTTP/1.1 101"])
+                {
+                  [self _wsStart];
+                  return;
+                }
+              DESTROY(ws);	// Delegate did not switch protocols
             }
+          [self reset];
+          [self _pipeWritten];	// Any written along with our response
+          [self _nextRequest];
         }
       else
         {
-          /* We are streaming data ... if there is any ready we write it now,
-           * otherwise the connection becomes idle until more data is added.
+          /* We are streaming data ... if enough is ready we write it now,
+           * otherwise the connection becomes idle until more data is added
+           * or the batching delay expires.
            */
+          if (nil != outWriting)
+            {
+              /* Keep the buffer we just wrote for the next swap.
+               */
+              [outWriting setLength: 0];
+              [outSpare release];
+              outSpare = outWriting;
+              outWriting = nil;
+            }
           if ([outBuffer length] > 0)
             {
-              NSData    *data;
-
               if (YES == streaming)
                 {
-                  data = [outBuffer copy];
-                  [outBuffer setLength: 0];
+                  if ([outBuffer length] >= conf->streamBatch)
+                    {
+                      [self _streamWrite];
+                    }
+                  else
+                    {
+                      [self _streamLater];
+                    }
                 }
               else
                 {
+                  NSData    *data;
+
                   /* Streaming is ended ... write the last data and then we
                    * will be done.
                    */
                   data = outBuffer;
                   outBuffer = nil;
+                  responding = YES;
+                  [self performSelector: @selector(_doWrite:)
+                               onThread: ioThread->thread
+                             withObject: data
+                          waitUntilDone: NO];
+                  [data release];
                 }
-              responding = YES;
-              [self performSelector: @selector(_doWrite:)
-                           onThread: ioThread->thread
-                         withObject: data
-                      waitUntilDone: NO];
-              [data release];
+            }
+          else
+            {
+              [self _writeShared];
             }
         }
     }
@@ -2370,6 +2982,31 @@ else if (YES == hadRequest) \
  */
 - (void) _doWrite: (NSData*)d
 {
+  if (nil != leader)
+    {
+      /* A pipelined request's response is queued for the leader to write
+       * in order.
+       */
+      if (nil == pipeOut)
+	{
+	  pipeOut = [NSMutableDataClass new];
+	}
+      [pipeOut appendData: d];
+      [leader _pipeFlush];
+      return;
+    }
+  if (nil == h2 && [pipeline count] > 0 && 0 == pipeWritten
+    && NO == pipeOnly && NO == streaming && nil == outBuffer
+    && NO == [self shouldClose])
+    {
+      NSMutableData	*out = [NSMutableDataClass dataWithData: d];
+
+      /* This is the end of our own response, so the responses of any
+       * pipelined requests which have completed may go in the same write.
+       */
+      [self _pipeCollect: out];
+      d = out;
+    }
   if (YES == conf->logRawIO && NO == quiet)
     {
       debugWrite(server, self, d);
@@ -2377,6 +3014,85 @@ else if (YES == hadRequest) \
   [handle writeInBackgroundAndNotify: d];
 }
 
+/* Passes data read from the client to the HTTP/2 session, then writes
+ * whatever it produces and continues reading.
+ */
+- (void) _h2Data: (NSData*)d
+{
+  [h2 read: d];
+  [self _h2Write];
+  if (NO == [h2 finished])
+    {
+      [self performSelector: @selector(_doRead)
+		   onThread: ioThread->thread
+		 withObject: nil
+	      waitUntilDone: NO];
+    }
+}
+
+/* Writes any frames the HTTP/2 session has ready (one write at a time),
+ * ending the connection when the session is finished and everything has
+ * been written.  While streams are being processed the connection is in
+ * the processing list, otherwise it is idle.
+ */
+- (void) _h2Write
+{
+  NSData	*d;
+
+  if (YES == responding)
+    {
+      return;
+    }
+  if (nil != (d = [h2 output]))
+    {
+      responding = YES;
+      [self _doWrite: d];
+    }
+  else if (YES == [h2 finished])
+    {
+      [self end];
+      return;
+    }
+  if ([h2 active] > 0)
+    {
+      [self setProcessing: YES];
+    }
+  else
+    {
+      [self _keepalive];
+    }
+}
+
+/* Returns the number of bytes of d which belong to the request headers
+ * (the length of d if the blank line ending the headers is not in it).
+ * The state is kept between calls as a line may be split across reads.
+ */
+- (NSUInteger) _headerBytes: (NSData*)d
+{
+  const uint8_t		*bytes = (const uint8_t*)[d bytes];
+  NSUInteger		length = [d length];
+  NSUInteger		pos;
+
+  for (pos = 0; pos < length; pos++)
+    {
+      uint8_t	c = bytes[pos];
+
+      if ('\n' == c)
+	{
+	  if (NO == hdrMidLine)
+	    {
+	      return pos + 1;	// Empty line ends headers
+	    }
+	  hdrMidLine = NO;
+	}
+      else if ('\r' != c)
+	{
+	  hdrMidLine = YES;
+	}
+    }
+  return length;
+}
+
 - (void) _keepalive
 {
   [ioThread->threadLock lock];
@@ -2390,37 +3106,860 @@ else if (YES == hadRequest) \
   [ioThread->threadLock unlock];
 }
 
-/* Called to try an ssl handshake.
+/* Returns YES if the body of a request using method might need to be
+ * read by a body reader rather than by the mime parser.
  */
-- (void) _timeout: (NSTimer*)t
+- (BOOL) _mayReadBody: (NSString*)method
 {
-  BOOL	established;
+  if (nil == conf->uploadDirectory && 0 == conf->spoolThreshold
+    && NO == [server _incrementalDelegate])
+    {
+      return NO;
+    }
+  if (YES == [method isEqualToString: @"POST"]
+    || YES == [method isEqualToString: @"PUT"])
+    {
+      return YES;
+    }
+  return NO;
+}
 
-  handshakeTimer = nil;
-  if (YES == [handle sslHandshakeEstablished: &established outgoing: NO])
+/* Called when the headers of a request have been parsed, to create a
+ * reader for the body if the mime parser should not be used for it.
+ */
+- (WebServerBodyReader*) _newBodyReader
+{
+  WebServerRequest	*doc = [self request];
+  GSMimeHeader		*hdr = [doc headerNamed: @"content-type"];
+
+  if (incremental > 0)
     {
-      if (YES == established)
+      WebServerIncrementalReader	*r;
+
+      r = [[WebServerIncrementalReader alloc] initWithRequest: doc
+						   connection: self
+							limit: incremental];
+      if (nil != r)
 	{
-	  [self run];
+	  [server _setIncrementalReader: r forRequest: doc];
 	}
-      else
+      return r;
+    }
+  if (nil != conf->uploadDirectory
+    && YES == [[hdr value] isEqualToString: @"multipart/form-data"])
+    {
+      WebServerMultipartReader	*r;
+      unsigned long long	max = conf->maxUploadSize;
+
+      if (0 == max)
 	{
-	  [self end];
+	  max = conf->maxBodySize;
+	}
+      r = [[WebServerMultipartReader alloc]
+	initWithRequest: doc
+	       boundary: [hdr parameterForKey: @"boundary"]
+	      directory: conf->uploadDirectory
+	    maxPartSize: conf->maxUploadPartSize
+		maxSize: max];
+      if (nil != r)
+	{
+	  [server _setUploads: r forRequest: doc];
 	}
+      return r;
     }
-  else if (ioThread->handshakes == owner)
+  if (conf->spoolThreshold > 0)
     {
-      handshakeRetry *= 2.0;
-      if (handshakeRetry > 0.5)
+      NSString	*str = [[doc headerNamed: @"content-length"] value];
+
+      /* A body which is known to be small enough is left for the parser.
+       */
+      if (nil != [doc headerNamed: @"transfer-encoding"]
+	|| [str longLongValue] > (long long)conf->spoolThreshold)
 	{
-	  handshakeRetry = 0.01;
+	  return [[WebServerSpoolReader alloc]
+	    initWithRequest: doc
+		  directory: conf->uploadDirectory
+		  threshold: conf->spoolThreshold
+		    maxSize: conf->maxBodySize];
 	}
-      handshakeTimer
-	= [NSTimer scheduledTimerWithTimeInterval: handshakeRetry
-					   target: self
-					 selector: @selector(_timeout:)
-					 userInfo: nil
-					  repeats: NO];
+    }
+  return nil;
+}
+
+/* Starts on the next request once the response to the current one has
+ * been written, either using pipelined data or by reading from the client.
+ */
+- (void) _nextRequest
+{
+  NSData	*more;
+
+  if ([pipeline count] > 0)
+    {
+      /* The responses to pipelined requests being processed must be
+       * written before we start on another request.
+       */
+      [self setProcessing: YES];
+      [self _pipeFlush];
+      return;
+    }
+
+  [self _keepalive];
+
+  more = [self excess];
+  [nc addObserver: self
+	 selector: @selector(_didRead:)
+	     name: NSFileHandleReadCompletionNotification
+	   object: handle];
+  if (nil != more)
+    {
+      /* Use pipelined data to start new request.
+       */
+      [more retain];
+      [self setExcess: nil];
+      [self _didData: more];
+      [more release];
+    }
+  else
+    {
+      /* Start reading a new request.
+       */
+      [self performSelector: @selector(_doRead)
+		   onThread: ioThread->thread
+		 withObject: nil
+	      waitUntilDone: NO];
+    }
+}
+
+/* Appends to out the responses of the pipelined requests which are
+ * ready, in the order the requests were received, stopping at the first
+ * which is not complete (though any data it has ready is taken) or which
+ * will close the connection.  Records how many were completely taken.
+ */
+- (void) _pipeCollect: (NSMutableData*)out
+{
+  NSUInteger	count = [pipeline count];
+  NSUInteger	i;
+
+  for (i = pipeWritten; i < count; i++)
+    {
+      WebServerConnection	*f = [pipeline objectAtIndex: i];
+
+      if (NO == [f _pipeTake: out])
+	{
+	  break;	// Response not complete
+	}
+      pipeWritten = i + 1;
+      if (YES == [f shouldClose])
+	{
+	  [self setShouldClose: YES];
+	  break;
+	}
+    }
+}
+
+/* Finishes with a follower once its response has been sent, counting
+ * the request as one made on this connection.
+ */
+- (void) _pipeDone: (WebServerConnection*)f
+{
+  NSTimeInterval	t = [f requestDuration: ticked];
+
+  if (t > 0.0)
+    {
+      [f setRequestEnd: ticked];
+      [server _completedResponse: f->response duration: t];
+      requests++;
+      duration += t;
+    }
+  if (NO == quiet)
+    {
+      [server _audit: f];
+    }
+  requestCount++;
+  [f reset];
+}
+
+/* Writes whatever response data is ready from the pipelined requests,
+ * in the order the requests were received.  The responses of adjacent
+ * requests which have completed are merged into a single write.
+ * We only do this when our own response has been written (responses
+ * ready before then are written along with the end of our own).
+ */
+- (void) _pipeFlush
+{
+  NSMutableData	*out;
+
+  if (nil != h2)
+    {
+      [h2 flush];
+      [self _h2Write];
+      return;
+    }
+  if (YES == responding || nil != parser || pipeWritten > 0)
+    {
+      return;	// Busy ... called again when the write completes
+    }
+  out = [NSMutableDataClass data];
+  [self _pipeCollect: out];
+  if ([out length] > 0)
+    {
+      responding = YES;
+      pipeOnly = YES;
+      [self performSelector: @selector(_doWrite:)
+		   onThread: ioThread->thread
+		 withObject: out
+	      waitUntilDone: NO];
+    }
+  else if (pipeWritten > 0)
+    {
+      [self _pipeWritten];	// Nothing to write
+      [self _nextRequest];
+    }
+}
+
+/* When pipelining is enabled, start processing any GET or HEAD requests
+ * following a completed GET or HEAD request, without waiting for the
+ * response to be sent.  Each is parsed by a follower connection which
+ * queues its response for us to write.
+ */
+- (void) _pipelineRequests
+{
+  NSString	*method;
+
+  if (nil != leader || conf->maxPipeline < 2 || NO == hadRequest)
+    {
+      return;
+    }
+  method = [[[self request] headerNamed: @"x-http-method"] value];
+  if (NO == [method isEqualToString: @"GET"]
+    && NO == [method isEqualToString: @"HEAD"])
+    {
+      return;
+    }
+  if (nil != [[self request] headerNamed: @"upgrade"])
+    {
+      return;	// Anything following may be in another protocol
+    }
+  while ([pipeline count] + 1 < conf->maxPipeline
+    && NO == [self shouldClose] && YES == pipelinable(excess))
+    {
+      WebServerConnection	*f;
+      NSData			*d;
+
+      if (nil == pipeline)
+	{
+	  pipeline = [NSMutableArray new];
+	}
+      f = [[WebServerConnection alloc] initWithLeader: self];
+      [pipeline addObject: f];
+      [f release];
+      d = [excess retain];
+      [self setExcess: nil];
+      [f _didData: d];
+      [d release];
+      [self setExcess: [f excess]];
+      [f setExcess: nil];
+      if (YES == [f shouldClose])
+	{
+	  break;
+	}
+    }
+}
+
+/* Called by the leader to append any response data we have ready to
+ * out.  Taking the data counts as writing it.  Returns YES if the
+ * response is complete.
+ */
+- (BOOL) _pipeTake: (NSMutableData*)out
+{
+  if (nil == pipeOut)
+    {
+      return NO;	// Not responded yet
+    }
+  [out appendData: pipeOut];
+  [pipeOut setLength: 0];
+  if (YES == responding)
+    {
+      responding = NO;
+      if ([outBuffer length] > 0)
+	{
+	  [out appendData: outBuffer];
+	  if (YES == streaming)
+	    {
+	      [outBuffer setLength: 0];
+	    }
+	  else
+	    {
+	      DESTROY(outBuffer);
+	    }
+	}
+    }
+  return (NO == streaming && nil == outBuffer) ? YES : NO;
+}
+
+/* Called when the responses to pipelined requests have been written,
+ * to finish with those requests.
+ */
+- (void) _pipeWritten
+{
+  while (pipeWritten > 0)
+    {
+      [self _pipeDone: [pipeline objectAtIndex: 0]];
+      [pipeline removeObjectAtIndex: 0];
+      pipeWritten--;
+    }
+}
+
+/* Passes data to the body reader, starting processing of the request
+ * once the body is complete.  For incremental processing the request is
+ * passed to the delegate whenever the reader pauses with a full slice
+ * (and we don't read any more until the delegate takes the slice).
+ */
+- (void) _readBody: (NSData*)d
+{
+  WebServerRequest	*doc = [self request];
+  NSString		*status;
+  NSUInteger		used;
+
+  used = [reader read: (const uint8_t*)[d bytes] length: [d length]];
+  [self moreBytes: used];
+  if (nil != (status = [reader error]))
+    {
+      NSString	*s = [status stringByAppendingString: @"\r\n\r\n"];
+
+      [server _log: @"%@ Request body rejected - %@", self, status];
+      [self reject: [s dataUsingEncoding: NSASCIIStringEncoding]
+	    result: status];
+      return;
+    }
+  if (YES == [reader complete])
+    {
+      if (used < [d length])
+	{
+	  [self setExcess: [d subdataWithRange:
+	    NSMakeRange(used, [d length] - used)]];
+	}
+      hadRequest = YES;
+      requestCount++;
+      [doc setHeader: @"x-webserver-completed"
+	       value: @"YES"
+	  parameters: nil];
+    }
+  else if (YES == [reader pause])
+    {
+      if (used < [d length])
+	{
+	  ASSIGN(unread, [d subdataWithRange:
+	    NSMakeRange(used, [d length] - used)]);
+	}
+    }
+  else
+    {
+      [self performSelector: @selector(_doRead)
+		   onThread: ioThread->thread
+		 withObject: nil
+	      waitUntilDone: NO];
+      return;
+    }
+
+  if (NO == dispatched)
+    {
+      dispatched = YES;
+      sliceBusy = YES;
+      [server _process1: self];
+    }
+  else if (NO == [response completing])
+    {
+      /* More data for a request the delegate is already handling.
+       */
+      [self _sliceDispatch];
+    }
+}
+
+/* Called when the delegate takes a slice of the body of a request, to
+ * continue reading where we paused.
+ */
+- (void) _resumeBody
+{
+  NSData	*d;
+
+  if (nil == reader)
+    {
+      return;	// Request has been dropped
+    }
+  if (nil != (d = unread))
+    {
+      unread = nil;
+      [self _readBody: d];
+      [d release];
+    }
+  else
+    {
+      [self performSelector: @selector(_doRead)
+		   onThread: ioThread->thread
+		 withObject: nil
+	      waitUntilDone: NO];
+    }
+}
+
+/* Passes the request to the delegate for the next slice of its body,
+ * unless the delegate is still handling the previous slice, in which
+ * case we wait for -_sliceDone to do it.
+ * Called in the IO thread.
+ */
+- (void) _sliceDispatch
+{
+  if (YES == sliceBusy)
+    {
+      sliceReady = YES;
+    }
+  else
+    {
+      sliceBusy = YES;
+      [server _dispatch: self];
+    }
+}
+
+/* Called (in the IO thread) when the delegate has returned from handling
+ * a slice of the body of a request without completing the request, so
+ * that any slice read in the meantime may be passed on.
+ */
+- (void) _sliceDone
+{
+  sliceBusy = NO;
+  if (YES == sliceReady)
+    {
+      sliceReady = NO;
+      if (nil != reader && NO == [response completing])
+	{
+	  [self _sliceDispatch];
+	}
+    }
+}
+
+/* Queues an event shared with other connections (chunk if we are using
+ * chunked transfer encoding, raw otherwise) without copying it, unless
+ * there is data buffered which must be written first.  Returns NO if the
+ * response is no longer being streamed.
+ */
+- (BOOL) _share: (NSData*)chunk raw: (NSData*)raw
+{
+  NSData	*d = (YES == chunked) ? chunk : raw;
+
+  if (nil != leader)
+    {
+      /* A pipelined request (or HTTP/2 stream) has its output copied by
+       * the leader anyway.
+       */
+      if (NO == streaming || YES == [leader ended])
+	{
+	  return NO;
+	}
+      [self respond: raw];
+      return YES;
+    }
+  if (NO == streaming || nil == handle)
+    {
+      return NO;
+    }
+  if ([outBuffer length] > 0)
+    {
+      [outBuffer appendData: d];
+    }
+  else
+    {
+      if (nil == shared)
+	{
+	  shared = [NSMutableArray new];
+	}
+      [shared addObject: d];
+      sharedBytes += [d length];
+      [self _writeShared];
+    }
+  return YES;
+}
+
+/* Marks a streamed response as having failed, so that completing it
+ * closes the connection after the data already streamed, without the
+ * end of the stream being sent.  Must be called before the response is
+ * completed.
+ */
+- (void) _streamAbort
+{
+  streamAbort = YES;
+  [self setShouldClose: YES];
+}
+
+/* Called in the I/O thread to add streamed data to the output buffer,
+ * writing it now or once enough has been batched up.
+ */
+- (void) _streamAppend: (NSData*)d
+{
+  if (NO == streaming)
+    {
+      return;	// Streaming was ended (or the connection reset)
+    }
+  [self _unshare];
+  [outBuffer appendData: d];
+  if (NO == responding)
+    {
+      /* Small pieces of data are batched up (for at most the configured
+       * delay) so that each write sends a reasonable amount rather than
+       * a packet per piece.
+       */
+      if ([outBuffer length] >= conf->streamBatch)
+        {
+          [self _streamWrite];
+        }
+      else
+        {
+          [self _streamLater];
+        }
+    }
+}
+
+/* Called in the I/O thread to add the last of the streamed data to the
+ * output buffer and end streaming.
+ */
+- (void) _streamEnd: (NSData*)d
+{
+  NSData	*data;
+
+  if (NO == streaming)
+    {
+      return;	// Streaming was ended (or the connection reset)
+    }
+  [self _unshare];
+  [outBuffer appendData: d];
+  streaming = NO;
+  chunked = NO;
+  if (NO == responding)
+    {
+      if ([outBuffer length] > 0)
+        {
+          /* There's still data to be written ... try to do it.
+           * Once it's written we are done.
+           */
+          responding = YES;
+          data = outBuffer;
+          outBuffer = nil;
+          [self _doWrite: data];
+          [data release];
+        }
+      else
+        {
+          /* We have finished streaming data, and the last write
+           * has already completed, so we fake another write
+           * completion notification to get the end of streaming
+           * cleanup done.
+           */
+          DESTROY(outBuffer);
+          [self _didWrite:
+            [NSNotification notificationWithName:
+              GSFileHandleWriteCompletionNotification
+              object: handle userInfo: nil]];
+        }
+    }
+}
+
+/* Writes any batched streaming data at once unless a write is already
+ * in progress (in which case the data goes when that write completes).
+ */
+- (void) _streamFlush: (id)ignored
+{
+  if ([NSThread currentThread] != ioThread->thread)
+    {
+      [self performSelector: @selector(_streamFlush:)
+		   onThread: ioThread->thread
+		 withObject: nil
+	      waitUntilDone: NO];
+      return;
+    }
+  if (YES == streaming && NO == responding && [outBuffer length] > 0)
+    {
+      [self _streamWrite];
+    }
+}
+
+/* Arranges for batched streaming data to be written once the maximum
+ * delay has passed, if it has not been written sooner.  The timer must
+ * run in the I/O thread.
+ */
+- (void) _streamLater
+{
+  if ([NSThread currentThread] != ioThread->thread)
+    {
+      [self performSelector: @selector(_streamLater)
+		   onThread: ioThread->thread
+		 withObject: nil
+	      waitUntilDone: NO];
+      return;
+    }
+  if (NO == flushPending)
+    {
+      flushPending = YES;
+      [self performSelector: @selector(_streamTimer)
+		 withObject: nil
+		 afterDelay: conf->streamDelay];
+    }
+}
+
+- (void) _streamTimer
+{
+  flushPending = NO;
+  [self _streamFlush: nil];
+}
+
+/* Writes the streamed data buffered so far.  Rather than copying the
+ * buffer we hand it to the write and continue with the spare buffer
+ * (the one written last time), so at most two buffers are ever used.
+ */
+- (void) _streamWrite
+{
+  NSMutableData	*d = outBuffer;
+
+  outBuffer = (nil == outSpare) ? [NSMutableDataClass new] : outSpare;
+  outSpare = nil;
+  [outWriting release];
+  outWriting = [d retain];
+  responding = YES;
+  [self performSelector: @selector(_doWrite:)
+	       onThread: ioThread->thread
+	     withObject: d
+	  waitUntilDone: NO];
+  [d release];
+}
+
+/* Marks the response as subscribed to a broadcast channel, so that all
+ * streaming is done in the I/O thread, and records the channel so that
+ * the response can be removed from it when it ends.
+ */
+- (void) _subscribe: (WebServerChannel*)channel
+{
+  subscribed = YES;
+  [ioThread->threadLock lock];
+  if (nil == channels)
+    {
+      channels = [NSMutableArray new];
+    }
+  if (NSNotFound == [channels indexOfObjectIdenticalTo: channel])
+    {
+      [channels addObject: channel];
+    }
+  [ioThread->threadLock unlock];
+}
+
+/* Called to try an ssl handshake.
+ */
+- (void) _timeout: (NSTimer*)t
+{
+  BOOL	established;
+
+  handshakeTimer = nil;
+  if (YES == [handle sslHandshakeEstablished: &established outgoing: NO])
+    {
+      if (YES == established)
+	{
+	  [self run];
+	}
+      else
+	{
+	  [self end];
+	}
+    }
+  else if (ioThread->handshakes == owner)
+    {
+      handshakeRetry *= 2.0;
+      if (handshakeRetry > 0.5)
+	{
+	  handshakeRetry = 0.01;
+	}
+      handshakeTimer
+	= [NSTimer scheduledTimerWithTimeInterval: handshakeRetry
+					   target: self
+					 selector: @selector(_timeout:)
+					 userInfo: nil
+					  repeats: NO];
+    }
+}
+
+/* Moves any shared data waiting to be written into the output buffer,
+ * so that other streamed data follows it.
+ */
+- (void) _unshare
+{
+  if ([shared count] > 0)
+    {
+      NSEnumerator	*e = [shared objectEnumerator];
+      NSData		*d;
+
+      while (nil != (d = [e nextObject]))
+	{
+	  [outBuffer appendData: d];
+	}
+      [shared removeAllObjects];
+      sharedBytes = 0;
+    }
+}
+
+/* Removes the response from any channels it is subscribed to, once the
+ * response has ended or the connection has gone.
+ */
+- (void) _unsubscribe
+{
+  NSArray	*a;
+
+  [ioThread->threadLock lock];
+  a = channels;
+  channels = nil;
+  [ioThread->threadLock unlock];
+  if (nil != a)
+    {
+      NSEnumerator	*e = [a objectEnumerator];
+      WebServerChannel	*channel;
+
+      while (nil != (channel = [e nextObject]))
+	{
+	  [channel _unsubscribe: self];
+	}
+      [a release];
+    }
+}
+
+/* Writes the next piece of shared data (if any) unless a write is in
+ * progress.
+ */
+- (void) _writeShared
+{
+  NSData	*d;
+
+  if (YES == responding || 0 == [shared count])
+    {
+      return;
+    }
+  d = [[shared objectAtIndex: 0] retain];
+  [shared removeObjectAtIndex: 0];
+  sharedBytes -= [d length];
+  responding = YES;
+  [self performSelector: @selector(_doWrite:)
+	       onThread: ioThread->thread
+	     withObject: d
+	  waitUntilDone: NO];
+  [d release];
+}
+
+/* Passes data read from the client to the WebSocket and writes whatever
+ * it produces.  We read more once the delegate has been given any
+ * messages which were completed.
+ */
+- (void) _wsData: (NSData*)d
+{
+  NSArray	*messages = [ws read: d];
+
+  [self _wsWrite];
+  if ([messages count] > 0)
+    {
+      [server _webSocket: self received: messages];
+    }
+  else
+    {
+      [self _wsRead];
+    }
+}
+
+/* Called when a WebSocket has been idle for the connection timeout.
+ * The first time we ping the client (and return YES to keep the
+ * connection), so it stays open as long as the client answers.
+ */
+- (BOOL) _wsPing
+{
+  if (NO == [ws open] || NO == [ws ping])
+    {
+      return NO;
+    }
+  [self setTicked: [NSDateClass timeIntervalSinceReferenceDate]];
+  [self _wsWrite];
+  return YES;
+}
+
+- (void) _wsRead
+{
+  if (NO == [ws finished])
+    {
+      [self _doRead];
+    }
+}
+
+/* Queues a frame for the client (or starts closing if frame is nil).
+ * Frames queued before the WebSocket is open are written once the
+ * response accepting it has been written.
+ */
+- (void) _wsSend: (NSData*)frame
+{
+  if (nil == handle)
+    {
+      return;	// Connection has ended
+    }
+  if (nil == frame)
+    {
+      [ws close];
+    }
+  else
+    {
+      [ws send: frame];
+    }
+  if (YES == [ws open])
+    {
+      [self _wsWrite];
+    }
+}
+
+/* Switches to the WebSocket once the response accepting it has been
+ * written.  Any data the client sent after the request is frames.
+ */
+- (void) _wsStart
+{
+  NSData	*more = [[self excess] retain];
+
+  [self setExcess: nil];
+  DESTROY(buffer);
+  [ws setOpen];
+  [nc addObserver: self
+	 selector: @selector(_didRead:)
+	     name: NSFileHandleReadCompletionNotification
+	   object: handle];
+  [self _wsWrite];
+  if (nil != more)
+    {
+      [self _wsData: more];
+      [more release];
+    }
+  else
+    {
+      [self _wsRead];
+    }
+}
+
+/* Writes any frames the WebSocket has ready (one write at a time),
+ * ending the connection when it has finished and everything has been
+ * written.
+ */
+- (void) _wsWrite
+{
+  NSData	*d;
+
+  if (YES == responding)
+    {
+      return;
+    }
+  if (nil != (d = [ws output]))
+    {
+      responding = YES;
+      [self _doWrite: d];
+    }
+  else if (YES == [ws finished])
+    {
+      [self end];
     }
 }
 
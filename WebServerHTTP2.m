@@ -0,0 +1,2004 @@
+/**
+   Copyright (C) 2026 Free Software Foundation, Inc.
+
+   Written by:  agent <agent@local>
+   Date:	October 2026
+
+   This file is part of the WebServer Library.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA.
+
+   $Date$ $Revision$
+   */
+#import	<Foundation/Foundation.h>
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define WEBSERVERINTERNAL       1
+
+#import	"WebServer.h"
+#import	"Internal.h"
+
+/* An HTTP/2 session (RFC 9113) runs on a connection in place of the
+ * HTTP/1.x request/response cycle.  Each stream is handled by a follower
+ * of the connection (as for pipelined requests), so the request headers
+ * decoded from HPACK are passed to the follower as the text of an HTTP/1.1
+ * request, and the HTTP/1.1 response the follower produces is translated
+ * back into HEADERS and DATA frames.  That way the delegate sees exactly
+ * the same requests and responses whichever protocol the client uses.
+ * Everything here happens in the I/O thread of the connection.
+ */
+
+/* Frame types.
+ */
+enum {
+  FrameData = 0,
+  FrameHeaders,
+  FramePriority,
+  FrameResetStream,
+  FrameSettings,
+  FramePushPromise,
+  FramePing,
+  FrameGoAway,
+  FrameWindowUpdate,
+  FrameContinuation
+};
+
+/* Frame flags.
+ */
+#define	FlagAck		0x01
+#define	FlagEndStream	0x01
+#define	FlagEndHeaders	0x04
+#define	FlagPadded	0x08
+#define	FlagPriority	0x20
+
+/* Error codes.
+ */
+enum {
+  ErrorNone = 0,
+  ErrorProtocol,
+  ErrorInternal,
+  ErrorFlowControl,
+  ErrorSettingsTimeout,
+  ErrorStreamClosed,
+  ErrorFrameSize,
+  ErrorRefusedStream,
+  ErrorCancel,
+  ErrorCompression,
+  ErrorConnect,
+  ErrorCalm
+};
+
+/* Settings identifiers.
+ */
+enum {
+  SettingTableSize = 1,
+  SettingEnablePush,
+  SettingMaxStreams,
+  SettingWindowSize,
+  SettingFrameSize,
+  SettingHeaderListSize
+};
+
+/* The number of streams a client may have open at once.
+ */
+#define	MAX_STREAMS	100
+
+/* Limits on the number of streams a client may start, and the number it
+ * may reset, in a period.  A client exceeding either is making us start
+ * work it has no use for (eg. the 'rapid reset' attack), so it gets a
+ * GOAWAY.
+ */
+#define	RAPID_PERIOD	10.0
+#define	MAX_OPENED	(10 * MAX_STREAMS)
+#define	MAX_RESETS	MAX_STREAMS
+
+/* Limit on the size of the headers of a request, both as received and
+ * once decoded (the decoded size is counted as for the HPACK table).
+ */
+#define	MAX_HEADERS	(64 * 1024)
+
+/* The largest frame we accept and the size of our HPACK dynamic table
+ * (the protocol defaults, which we don't change).
+ */
+#define	FRAME_SIZE	16384
+#define	TABLE_SIZE	4096
+
+#define	MAX_WINDOW	0x7fffffff
+
+static const char	preface[24] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+/* The HPACK static table (RFC 7541 appendix A).
+ */
+static const char	*staticTable[61][2] = {
+  {":authority", ""},
+  {":method", "GET"},
+  {":method", "POST"},
+  {":path", "/"},
+  {":path", "/index.html"},
+  {":scheme", "http"},
+  {":scheme", "https"},
+  {":status", "200"},
+  {":status", "204"},
+  {":status", "206"},
+  {":status", "304"},
+  {":status", "400"},
+  {":status", "404"},
+  {":status", "500"},
+  {"accept-charset", ""},
+  {"accept-encoding", "gzip, deflate"},
+  {"accept-language", ""},
+  {"accept-ranges", ""},
+  {"accept", ""},
+  {"access-control-allow-origin", ""},
+  {"age", ""},
+  {"allow", ""},
+  {"authorization", ""},
+  {"cache-control", ""},
+  {"content-disposition", ""},
+  {"content-encoding", ""},
+  {"content-language", ""},
+  {"content-length", ""},
+  {"content-location", ""},
+  {"content-range", ""},
+  {"content-type", ""},
+  {"cookie", ""},
+  {"date", ""},
+  {"etag", ""},
+  {"expect", ""},
+  {"expires", ""},
+  {"from", ""},
+  {"host", ""},
+  {"if-match", ""},
+  {"if-modified-since", ""},
+  {"if-none-match", ""},
+  {"if-range", ""},
+  {"if-unmodified-since", ""},
+  {"last-modified", ""},
+  {"link", ""},
+  {"location", ""},
+  {"max-forwards", ""},
+  {"proxy-authenticate", ""},
+  {"proxy-authorization", ""},
+  {"range", ""},
+  {"referer", ""},
+  {"refresh", ""},
+  {"retry-after", ""},
+  {"server", ""},
+  {"set-cookie", ""},
+  {"strict-transport-security", ""},
+  {"transfer-encoding", ""},
+  {"user-agent", ""},
+  {"vary", ""},
+  {"via", ""},
+  {"www-authenticate", ""}
+};
+
+/* The HPACK Huffman code (RFC 7541 appendix B), indexed by symbol
+ * (256 is EOS).
+ */
+static const uint32_t	huffmanCodes[257] = {
+  0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5,
+  0xfffffe6, 0xfffffe7, 0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9,
+  0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec, 0xfffffed, 0xfffffee,
+  0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+  0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9,
+  0xffffffa, 0xffffffb, 0x14, 0x3f8, 0x3f9, 0xffa,
+  0x1ff9, 0x15, 0xf8, 0x7fa, 0x3fa, 0x3fb,
+  0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+  0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b,
+  0x1c, 0x1d, 0x1e, 0x1f, 0x5c, 0xfb,
+  0x7ffc, 0x20, 0xffb, 0x3fc, 0x1ffa, 0x21,
+  0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+  0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+  0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e,
+  0x6f, 0x70, 0x71, 0x72, 0xfc, 0x73,
+  0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+  0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5,
+  0x25, 0x26, 0x27, 0x6, 0x74, 0x75,
+  0x28, 0x29, 0x2a, 0x7, 0x2b, 0x76,
+  0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+  0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd,
+  0x1ffd, 0xffffffc, 0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8,
+  0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9, 0x3fffd6, 0x7fffda,
+  0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+  0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1,
+  0x7fffe2, 0x7fffe3, 0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5,
+  0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef, 0x3fffda, 0x1fffdd,
+  0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+  0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf,
+  0x7fffeb, 0x7fffec, 0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2,
+  0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef, 0xfffea, 0x3fffe2,
+  0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+  0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2,
+  0x3fffe8, 0x1ffffec, 0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde,
+  0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed, 0x7fff2, 0x1fffe3,
+  0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+  0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3,
+  0x7ffffe4, 0x7ffffe5, 0xfffec, 0xfffff3, 0xfffed, 0x1fffe6,
+  0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3, 0x3fffea, 0x3fffeb,
+  0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+  0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8,
+  0x7ffffe9, 0x7ffffea, 0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed,
+  0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee, 0x3fffffff
+};
+
+static const uint8_t	huffmanBits[257] = {
+  13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+  28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+  6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+  5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+  13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+  7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+  15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+  6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+  20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+  24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+  22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+  21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+  26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+  19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+  20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+  26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+  30
+};
+
+/* The Huffman decoding tree.  Node 0 is the root, and each node has two
+ * children: a positive value is the index of another node and a negative
+ * one is a leaf (minus one more than the symbol).  As the code is
+ * complete there are exactly 256 nodes.
+ */
+static int16_t		huffmanTree[256][2];
+
+static NSArray		*staticEntries = nil;
+
+/* Returns YES if the bytes are consistent with the start of the client
+ * connection preface.
+ */
+BOOL
+WebServerHTTP2Preface(const uint8_t *bytes, NSUInteger length)
+{
+  if (length > sizeof(preface))
+    {
+      length = sizeof(preface);
+    }
+  return (0 == memcmp(bytes, preface, length)) ? YES : NO;
+}
+
+static void
+buildHuffmanTree(void)
+{
+  int16_t	next = 1;
+  unsigned	sym;
+
+  for (sym = 0; sym < 257; sym++)
+    {
+      uint32_t	code = huffmanCodes[sym];
+      unsigned	bits = huffmanBits[sym];
+      int16_t	node = 0;
+
+      while (bits-- > 0)
+	{
+	  unsigned	bit = (code >> bits) & 1;
+
+	  if (0 == bits)
+	    {
+	      huffmanTree[node][bit] = -(int16_t)(sym + 1);
+	    }
+	  else
+	    {
+	      if (0 == huffmanTree[node][bit])
+		{
+		  huffmanTree[node][bit] = next++;
+		}
+	      node = huffmanTree[node][bit];
+	    }
+	}
+    }
+}
+
+/* Decodes Huffman coded bytes, returning nil if they are not valid
+ * (including if the padding is longer than seven bits or is not the
+ * most significant bits of EOS).
+ */
+static NSString *
+huffmanDecode(const uint8_t *bytes, NSUInteger length)
+{
+  NSMutableData	*d = [NSMutableData dataWithCapacity: length * 8 / 5];
+  int16_t	node = 0;
+  unsigned	depth = 0;
+  BOOL		ones = YES;
+  NSUInteger	i;
+
+  for (i = 0; i < length; i++)
+    {
+      int	bit;
+
+      for (bit = 7; bit >= 0; bit--)
+	{
+	  unsigned	b = (bytes[i] >> bit) & 1;
+	  int16_t	n = huffmanTree[node][b];
+
+	  if (n < 0)
+	    {
+	      uint8_t	c;
+
+	      if (-n - 1 == 256)
+		{
+		  return nil;	// EOS must not be encoded
+		}
+	      c = (uint8_t)(-n - 1);
+	      [d appendBytes: &c length: 1];
+	      node = 0;
+	      depth = 0;
+	      ones = YES;
+	    }
+	  else
+	    {
+	      node = n;
+	      depth++;
+	      if (0 == b)
+		{
+		  ones = NO;
+		}
+	    }
+	}
+    }
+  if (depth > 7 || NO == ones)
+    {
+      return nil;
+    }
+  return AUTORELEASE([[NSString alloc] initWithData: d
+    encoding: NSISOLatin1StringEncoding]);
+}
+
+/* Decodes an HPACK integer with a prefix of the given number of bits,
+ * advancing *pos past it.  Returns NO if it is incomplete or too large.
+ */
+static BOOL
+getInteger(const uint8_t *b, NSUInteger len, NSUInteger *pos,
+  unsigned prefix, NSUInteger *value)
+{
+  NSUInteger	max = (1 << prefix) - 1;
+  NSUInteger	v;
+  unsigned	shift = 0;
+
+  if (*pos >= len)
+    {
+      return NO;
+    }
+  v = b[(*pos)++] & max;
+  if (v == max)
+    {
+      uint8_t	c;
+
+      do
+	{
+	  if (*pos >= len || shift > 21)
+	    {
+	      return NO;
+	    }
+	  c = b[(*pos)++];
+	  v += (NSUInteger)(c & 0x7f) << shift;
+	  shift += 7;
+	}
+      while (c & 0x80);
+    }
+  *value = v;
+  return YES;
+}
+
+/* Decodes an HPACK string literal (as Latin1, so the bytes are kept
+ * exactly), advancing *pos past it.  Returns nil if it is not valid.
+ */
+static NSString *
+getString(const uint8_t *b, NSUInteger len, NSUInteger *pos)
+{
+  NSUInteger	n;
+  BOOL		huffman;
+  NSString	*s;
+
+  if (*pos >= len)
+    {
+      return nil;
+    }
+  huffman = (b[*pos] & 0x80) ? YES : NO;
+  if (NO == getInteger(b, len, pos, 7, &n) || n > len - *pos)
+    {
+      return nil;
+    }
+  if (YES == huffman)
+    {
+      s = huffmanDecode(b + *pos, n);
+    }
+  else
+    {
+      s = AUTORELEASE([[NSString alloc] initWithBytes: b + *pos
+	length: n
+	encoding: NSISOLatin1StringEncoding]);
+    }
+  *pos += n;
+  return s;
+}
+
+static void
+putInteger(NSMutableData *d, uint8_t first, unsigned prefix, NSUInteger value)
+{
+  NSUInteger	max = (1 << prefix) - 1;
+  uint8_t	c;
+
+  if (value < max)
+    {
+      c = first | (uint8_t)value;
+      [d appendBytes: &c length: 1];
+      return;
+    }
+  c = first | (uint8_t)max;
+  [d appendBytes: &c length: 1];
+  value -= max;
+  while (value >= 128)
+    {
+      c = (uint8_t)((value & 0x7f) | 0x80);
+      [d appendBytes: &c length: 1];
+      value >>= 7;
+    }
+  c = (uint8_t)value;
+  [d appendBytes: &c length: 1];
+}
+
+/* Appends a header field as a literal which is not added to the dynamic
+ * table (we never index, so we need not track the client's table size).
+ */
+static void
+putField(NSMutableData *d, const uint8_t *name, NSUInteger nameLength,
+  const uint8_t *value, NSUInteger valueLength)
+{
+  putInteger(d, 0x00, 4, 0);
+  putInteger(d, 0x00, 7, nameLength);
+  [d appendBytes: name length: nameLength];
+  putInteger(d, 0x00, 7, valueLength);
+  [d appendBytes: value length: valueLength];
+}
+
+static void
+putStatus(NSMutableData *d, int status)
+{
+  unsigned	index;
+  char		buf[4];
+
+  switch (status)
+    {
+      case 200: index = 8; break;
+      case 204: index = 9; break;
+      case 206: index = 10; break;
+      case 304: index = 11; break;
+      case 400: index = 12; break;
+      case 404: index = 13; break;
+      case 500: index = 14; break;
+      default: index = 0; break;
+    }
+  if (index > 0)
+    {
+      putInteger(d, 0x80, 7, index);
+    }
+  else
+    {
+      snprintf(buf, sizeof(buf), "%03d", status);
+      putInteger(d, 0x00, 4, 8);	// Literal value for :status name
+      putInteger(d, 0x00, 7, 3);
+      [d appendBytes: buf length: 3];
+    }
+}
+
+static void
+putFrame(NSMutableData *d, uint8_t type, uint8_t flags, uint32_t stream,
+  const void *payload, NSUInteger length)
+{
+  uint8_t	h[9];
+
+  h[0] = (uint8_t)(length >> 16);
+  h[1] = (uint8_t)(length >> 8);
+  h[2] = (uint8_t)length;
+  h[3] = type;
+  h[4] = flags;
+  h[5] = (uint8_t)((stream >> 24) & 0x7f);
+  h[6] = (uint8_t)(stream >> 16);
+  h[7] = (uint8_t)(stream >> 8);
+  h[8] = (uint8_t)stream;
+  [d appendBytes: h length: 9];
+  if (length > 0)
+    {
+      [d appendBytes: payload length: length];
+    }
+}
+
+static inline void
+put32(uint8_t *b, uint32_t v)
+{
+  b[0] = (uint8_t)(v >> 24);
+  b[1] = (uint8_t)(v >> 16);
+  b[2] = (uint8_t)(v >> 8);
+  b[3] = (uint8_t)v;
+}
+
+static inline uint32_t
+get32(const uint8_t *b)
+{
+  return ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16)
+    | ((uint32_t)b[2] << 8) | (uint32_t)b[3];
+}
+
+/* Returns YES if the string is a valid field name (a token which, as
+ * HTTP/2 requires, is in lowercase) or a valid method (any case).
+ */
+static BOOL
+validToken(NSString *s, BOOL lower)
+{
+  NSUInteger	length = [s length];
+  NSUInteger	i;
+
+  if (0 == length)
+    {
+      return NO;
+    }
+  for (i = 0; i < length; i++)
+    {
+      unichar	c = [s characterAtIndex: i];
+
+      if ((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9'))
+	{
+	  continue;
+	}
+      if (c >= 'A' && c <= 'Z' && NO == lower)
+	{
+	  continue;
+	}
+      if (c < 128 && 0 != c && strchr("!#$%&'*+-.^_`|~", c) != 0)
+	{
+	  continue;
+	}
+      return NO;
+    }
+  return YES;
+}
+
+/* Returns YES unless the string contains characters which would break
+ * the HTTP/1.1 text we pass to the follower (or any control characters
+ * or spaces if strict is YES).
+ */
+static BOOL
+validValue(NSString *s, BOOL strict)
+{
+  NSUInteger	length = [s length];
+  NSUInteger	i;
+
+  for (i = 0; i < length; i++)
+    {
+      unichar	c = [s characterAtIndex: i];
+
+      if (0 == c || '\r' == c || '\n' == c)
+	{
+	  return NO;
+	}
+      if (YES == strict && (c <= ' ' || 127 == c))
+	{
+	  return NO;
+	}
+    }
+  return YES;
+}
+
+static inline void
+appendLatin1(NSMutableData *d, NSString *s)
+{
+  [d appendData: [s dataUsingEncoding: NSISOLatin1StringEncoding]];
+}
+
+
+/* Decodes the content of a response (as produced for HTTP/1.1) into the
+ * data to be sent in DATA frames.
+ */
+@interface	WebServerHTTP2Content : WebServerBodyReader
+{
+  NSMutableData		*out;
+}
+- (id) initWithRequest: (WebServerRequest*)r into: (NSMutableData*)d;
+@end
+
+@implementation	WebServerHTTP2Content
+
+- (void) bodyData: (const uint8_t*)bytes length: (NSUInteger)length
+{
+  [out appendBytes: bytes length: length];
+}
+
+- (void) bodyEnd
+{
+  return;
+}
+
+- (void) dealloc
+{
+  DESTROY(out);
+  [super dealloc];
+}
+
+- (id) initWithRequest: (WebServerRequest*)r into: (NSMutableData*)d
+{
+  if (nil != (self = [super initWithRequest: r]))
+    {
+      out = [d retain];
+    }
+  return self;
+}
+
+@end
+
+
+@interface	WebServerHTTP2Stream : NSObject
+{
+@public
+  uint32_t		identifier;
+  WebServerConnection	*follower;	// Handles the request
+  NSMutableData		*request;	// Request headers as HTTP/1.1 text
+  NSMutableData		*body;		// Request content
+  NSMutableData		*raw;		// Response taken from follower
+  WebServerHTTP2Content	*content;	// Decodes response content
+  NSMutableData		*pending;	// Content waiting to be sent
+  NSUInteger		sent;		// Bytes of pending already sent
+  int64_t		window;		// Send window
+  BOOL			head;		// HEAD request
+  BOOL			received;	// Request is complete
+  BOOL			parsed;		// Response headers sent
+  BOOL			complete;	// Response fully taken
+  BOOL			done;		// Response content all decoded
+  BOOL			closed;		// End of stream sent
+}
+@end
+
+@implementation	WebServerHTTP2Stream
+
+- (void) dealloc
+{
+  DESTROY(follower);
+  DESTROY(request);
+  DESTROY(body);
+  DESTROY(raw);
+  DESTROY(content);
+  DESTROY(pending);
+  [super dealloc];
+}
+
+@end
+
+
+@interface	WebServerHTTP2 (Private)
+- (void) _add: (NSString*)name value: (NSString*)value;
+- (void) _close;
+- (void) _data: (uint8_t)flags
+	 stream: (uint32_t)sid
+	payload: (const uint8_t*)p
+	 length: (NSUInteger)len;
+- (NSArray*) _entry: (NSUInteger)index;
+- (void) _evict;
+- (void) _frame: (uint8_t)type
+	  flags: (uint8_t)flags
+	 stream: (uint32_t)sid
+	payload: (const uint8_t*)p
+	 length: (NSUInteger)len;
+- (void) _goaway: (uint32_t)code;
+- (void) _headerBlock;
+- (void) _headers: (NSData*)hb stream: (uint32_t)sid end: (BOOL)end;
+- (BOOL) _rapid: (BOOL)reset;
+- (void) _refuse: (WebServerHTTP2Stream*)s status: (int)status;
+- (void) _remove: (WebServerHTTP2Stream*)s;
+- (BOOL) _request: (NSArray*)list stream: (WebServerHTTP2Stream*)s;
+- (void) _reset: (WebServerHTTP2Stream*)s code: (uint32_t)code;
+- (void) _resetStream: (uint32_t)sid code: (uint32_t)code;
+- (BOOL) _response: (WebServerHTTP2Stream*)s;
+- (void) _send: (WebServerHTTP2Stream*)s;
+- (void) _settings: (uint8_t)flags
+	   payload: (const uint8_t*)p
+	    length: (NSUInteger)len;
+- (void) _start: (WebServerHTTP2Stream*)s;
+- (WebServerHTTP2Stream*) _stream: (uint32_t)sid;
+- (void) _windowUpdate: (uint32_t)sid payload: (const uint8_t*)p;
+@end
+
+@implementation	WebServerHTTP2
+
++ (void) initialize
+{
+  if (nil == staticEntries)
+    {
+      NSMutableArray	*a = [NSMutableArray arrayWithCapacity: 61];
+      unsigned		i;
+
+      for (i = 0; i < 61; i++)
+	{
+	  [a addObject: [NSArray arrayWithObjects:
+	    [NSString stringWithUTF8String: staticTable[i][0]],
+	    [NSString stringWithUTF8String: staticTable[i][1]],
+	    nil]];
+	}
+      staticEntries = [a copy];
+      buildHuffmanTree();
+    }
+}
+
+- (void) abandon
+{
+  NSEnumerator		*e = [streams objectEnumerator];
+  WebServerHTTP2Stream	*s;
+
+  while (nil != (s = [e nextObject]))
+    {
+      if (nil != s->follower)
+	{
+	  [server _endConnect: s->follower];
+	}
+    }
+  [streams removeAllObjects];
+  connection = nil;
+  finished = YES;
+}
+
+- (NSUInteger) active
+{
+  return [streams count];
+}
+
+- (void) dealloc
+{
+  DESTROY(conf);
+  DESTROY(input);
+  DESTROY(output);
+  DESTROY(streams);
+  DESTROY(table);
+  DESTROY(block);
+  [super dealloc];
+}
+
+- (NSMutableArray*) decode: (NSData*)data
+{
+  const uint8_t		*b = (const uint8_t*)[data bytes];
+  NSUInteger		len = [data length];
+  NSUInteger		pos = 0;
+  NSUInteger		total = 0;
+  NSMutableArray	*list = [NSMutableArray array];
+
+  oversized = NO;
+  while (pos < len)
+    {
+      uint8_t		c = b[pos];
+      NSUInteger	index;
+      NSString		*name;
+      NSString		*value;
+      NSArray		*entry;
+
+      if (c & 0x80)
+	{
+	  /* Indexed field.
+	   */
+	  if (NO == getInteger(b, len, &pos, 7, &index)
+	    || nil == (entry = [self _entry: index]))
+	    {
+	      return nil;
+	    }
+	  name = [entry objectAtIndex: 0];
+	  value = [entry objectAtIndex: 1];
+	}
+      else if (0x20 == (c & 0xe0))
+	{
+	  /* Dynamic table size update.
+	   */
+	  if (NO == getInteger(b, len, &pos, 5, &index) || index > TABLE_SIZE)
+	    {
+	      return nil;
+	    }
+	  tableMax = index;
+	  [self _evict];
+	  continue;
+	}
+      else
+	{
+	  BOOL	indexing = (0x40 == (c & 0xc0)) ? YES : NO;
+
+	  /* Literal field, with or without indexing.
+	   */
+	  if (NO == getInteger(b, len, &pos, (indexing ? 6 : 4), &index))
+	    {
+	      return nil;
+	    }
+	  if (0 == index)
+	    {
+	      name = getString(b, len, &pos);
+	    }
+	  else if (nil != (entry = [self _entry: index]))
+	    {
+	      name = [entry objectAtIndex: 0];
+	    }
+	  else
+	    {
+	      name = nil;
+	    }
+	  if (nil == name || nil == (value = getString(b, len, &pos)))
+	    {
+	      return nil;
+	    }
+	  if (YES == indexing)
+	    {
+	      [self _add: name value: value];
+	    }
+	}
+
+      /* Once the headers are too large we carry on decoding (to keep
+       * the dynamic table right) but don't keep any more of them.
+       */
+      total += [name length] + [value length] + 32;
+      if (total > MAX_HEADERS)
+	{
+	  oversized = YES;
+	}
+      else
+	{
+	  [list addObject: [NSArray arrayWithObjects: name, value, nil]];
+	}
+    }
+  return list;
+}
+
+- (BOOL) finished
+{
+  return finished;
+}
+
+- (void) flush
+{
+  NSUInteger	i = 0;
+
+  if (YES == finished)
+    {
+      return;
+    }
+  while (i < [streams count])
+    {
+      WebServerHTTP2Stream	*s = [streams objectAtIndex: i];
+
+      if (nil != s->follower)
+	{
+	  int64_t	room = (window < s->window) ? window : s->window;
+
+	  /* Once the response headers are sent we only take content from
+	   * the follower while the client will accept more of it, leaving
+	   * the rest buffered (and counted) in the follower.
+	   */
+	  room -= (int64_t)([s->pending length] - s->sent);
+	  if (NO == s->complete
+	    && (NO == s->parsed || YES == s->done || room > 0)
+	    && YES == [s->follower _pipeTake: s->raw])
+	    {
+	      s->complete = YES;
+	    }
+	  if (NO == [self _response: s])
+	    {
+	      [self _reset: s code: ErrorInternal];
+	      continue;
+	    }
+	  [self _send: s];
+	  if (YES == s->closed && YES == s->complete)
+	    {
+	      /* The follower says the connection should close if one of
+	       * the connection limits has been reached.
+	       */
+	      if (YES == [s->follower shouldClose])
+		{
+		  [self _close];
+		}
+	      [self _remove: s];
+	      continue;
+	    }
+	}
+      i++;
+    }
+  if (YES == closing && 0 == [streams count])
+    {
+      finished = YES;
+    }
+}
+
+- (id) initWithConnection: (WebServerConnection*)c
+		   server: (WebServer*)svr
+		   config: (WebServerConfig*)config
+{
+  if (nil != (self = [super init]))
+    {
+      uint8_t	b[6];
+
+      connection = c;
+      server = svr;
+      conf = [config retain];
+      input = [NSMutableData new];
+      output = [NSMutableData new];
+      streams = [NSMutableArray new];
+      table = [NSMutableArray new];
+      block = [NSMutableData new];
+      tableMax = TABLE_SIZE;
+      window = 65535;
+      initialWindow = 65535;
+      frameMax = FRAME_SIZE;
+
+      /* Our SETTINGS must be the first frame we send.  We only need to
+       * limit the number of streams, as the defaults suit us otherwise.
+       */
+      b[0] = 0;
+      b[1] = SettingMaxStreams;
+      put32(b + 2, MAX_STREAMS);
+      putFrame(output, FrameSettings, 0, 0, b, 6);
+    }
+  return self;
+}
+
+- (NSData*) output
+{
+  NSData	*d;
+
+  if (0 == [output length])
+    {
+      return nil;
+    }
+  d = output;
+  output = [NSMutableData new];
+  return AUTORELEASE(d);
+}
+
+- (void) read: (NSData*)d
+{
+  const uint8_t	*b;
+  NSUInteger	length;
+  NSUInteger	pos = 0;
+
+  if (YES == finished)
+    {
+      return;
+    }
+  [input appendData: d];
+  b = (const uint8_t*)[input bytes];
+  length = [input length];
+  if (NO == hadPreface)
+    {
+      if (length < sizeof(preface))
+	{
+	  return;
+	}
+      if (0 != memcmp(b, preface, sizeof(preface)))
+	{
+	  [self _goaway: ErrorProtocol];
+	  return;
+	}
+      pos = sizeof(preface);
+      hadPreface = YES;
+    }
+  while (NO == finished && length - pos >= 9)
+    {
+      const uint8_t	*f = b + pos;
+      NSUInteger	size;
+
+      size = ((NSUInteger)f[0] << 16) | ((NSUInteger)f[1] << 8) | f[2];
+      if (size > FRAME_SIZE)
+	{
+	  [self _goaway: ErrorFrameSize];
+	  break;
+	}
+      if (length - pos - 9 < size)
+	{
+	  break;	// Need more data
+	}
+      pos += 9 + size;
+      [self _frame: f[3]
+	     flags: f[4]
+	    stream: get32(f + 5) & MAX_WINDOW
+	   payload: f + 9
+	    length: size];
+    }
+  [input replaceBytesInRange: NSMakeRange(0, pos) withBytes: 0 length: 0];
+  [self flush];
+}
+
+@end
+
+@implementation	WebServerHTTP2 (Private)
+
+- (void) _add: (NSString*)name value: (NSString*)value
+{
+  [table insertObject: [NSArray arrayWithObjects: name, value, nil]
+	      atIndex: 0];
+  tableSize += [name length] + [value length] + 32;
+  [self _evict];
+}
+
+/* Starts a graceful shutdown, letting the streams already started
+ * complete.
+ */
+- (void) _close
+{
+  uint8_t	b[8];
+
+  if (NO == closing)
+    {
+      put32(b, lastStream);
+      put32(b + 4, ErrorNone);
+      putFrame(output, FrameGoAway, 0, 0, b, 8);
+      closing = YES;
+    }
+}
+
+- (void) _data: (uint8_t)flags
+	stream: (uint32_t)sid
+       payload: (const uint8_t*)p
+	length: (NSUInteger)len
+{
+  WebServerHTTP2Stream	*s;
+  NSUInteger		size = len;
+  uint8_t		b[4];
+
+  if (0 == sid || sid > lastStream)
+    {
+      [self _goaway: ErrorProtocol];
+      return;
+    }
+  if (flags & FlagPadded)
+    {
+      if (0 == len || p[0] >= len)
+	{
+	  [self _goaway: ErrorProtocol];
+	  return;
+	}
+      len -= p[0] + 1;
+      p++;
+    }
+
+  /* We don't hold back the client ... the limit on the body size
+   * prevents it sending too much, so the whole frame is immediately
+   * returned to the connection window (and the stream window below).
+   */
+  if (size > 0)
+    {
+      put32(b, size);
+      putFrame(output, FrameWindowUpdate, 0, 0, b, 4);
+    }
+  if (nil == (s = [self _stream: sid]))
+    {
+      return;	// Stream has been closed
+    }
+  if (YES == s->received)
+    {
+      [self _reset: s code: ErrorStreamClosed];
+      return;
+    }
+  if ([s->body length] + len > conf->maxBodySize)
+    {
+      [self _refuse: s status: 413];
+      return;
+    }
+  if (buffered + len > conf->maxBodySize)
+    {
+      /* The content of all the streams together may be no more than we
+       * would hold for a single request, so this one must be retried.
+       */
+      [self _reset: s code: ErrorRefusedStream];
+      return;
+    }
+  buffered += len;
+  [s->body appendBytes: p length: len];
+  if (flags & FlagEndStream)
+    {
+      [self _start: s];
+    }
+  else if (size > 0)
+    {
+      putFrame(output, FrameWindowUpdate, 0, sid, b, 4);
+    }
+}
+
+- (NSArray*) _entry: (NSUInteger)index
+{
+  if (0 == index)
+    {
+      return nil;
+    }
+  if (index <= [staticEntries count])
+    {
+      return [staticEntries objectAtIndex: index - 1];
+    }
+  index -= [staticEntries count] + 1;
+  if (index < [table count])
+    {
+      return [table objectAtIndex: index];
+    }
+  return nil;
+}
+
+- (void) _evict
+{
+  while (tableSize > tableMax)
+    {
+      NSArray	*e = [table lastObject];
+
+      tableSize -= [[e objectAtIndex: 0] length]
+	+ [[e objectAtIndex: 1] length] + 32;
+      [table removeLastObject];
+    }
+}
+
+- (void) _frame: (uint8_t)type
+	  flags: (uint8_t)flags
+	 stream: (uint32_t)sid
+	payload: (const uint8_t*)p
+	 length: (NSUInteger)len
+{
+  WebServerHTTP2Stream	*s;
+  NSUInteger		pad;
+
+  /* The client must start with its SETTINGS, and a header block must
+   * not be interrupted by any other frame.
+   */
+  if (NO == hadSettings && (FrameSettings != type || (flags & FlagAck)))
+    {
+      [self _goaway: ErrorProtocol];
+      return;
+    }
+  if (0 != blockStream && (FrameContinuation != type || sid != blockStream))
+    {
+      [self _goaway: ErrorProtocol];
+      return;
+    }
+
+  switch (type)
+    {
+      case FrameData:
+	[self _data: flags stream: sid payload: p length: len];
+	break;
+
+      case FrameHeaders:
+	pad = 0;
+	if (0 == sid)
+	  {
+	    [self _goaway: ErrorProtocol];
+	    return;
+	  }
+	if (flags & FlagPadded)
+	  {
+	    if (0 == len)
+	      {
+		[self _goaway: ErrorProtocol];
+		return;
+	      }
+	    pad = p[0];
+	    p++;
+	    len--;
+	  }
+	if (flags & FlagPriority)
+	  {
+	    if (len < 5)
+	      {
+		[self _goaway: ErrorProtocol];
+		return;
+	      }
+	    p += 5;
+	    len -= 5;
+	  }
+	if (pad > len)
+	  {
+	    [self _goaway: ErrorProtocol];
+	    return;
+	  }
+	len -= pad;
+	[block setLength: 0];
+	[block appendBytes: p length: len];
+	blockStream = sid;
+	blockFlags = flags;
+	if (flags & FlagEndHeaders)
+	  {
+	    [self _headerBlock];
+	  }
+	break;
+
+      case FrameContinuation:
+	if (0 == blockStream)
+	  {
+	    [self _goaway: ErrorProtocol];
+	    return;
+	  }
+	if ([block length] + len > MAX_HEADERS)
+	  {
+	    [self _goaway: ErrorCalm];
+	    return;
+	  }
+	[block appendBytes: p length: len];
+	if (flags & FlagEndHeaders)
+	  {
+	    [self _headerBlock];
+	  }
+	break;
+
+      case FramePriority:
+	if (0 == sid)
+	  {
+	    [self _goaway: ErrorProtocol];
+	  }
+	else if (5 != len)
+	  {
+	    [self _resetStream: sid code: ErrorFrameSize];
+	  }
+	break;	// We don't prioritise streams
+
+      case FrameResetStream:
+	if (0 == sid || sid > lastStream)
+	  {
+	    [self _goaway: ErrorProtocol];
+	  }
+	else if (4 != len)
+	  {
+	    [self _goaway: ErrorFrameSize];
+	  }
+	else if (nil != (s = [self _stream: sid]))
+	  {
+	    [self _remove: s];
+	    [self _rapid: YES];
+	  }
+	break;
+
+      case FrameSettings:
+	[self _settings: flags payload: p length: len];
+	break;
+
+      case FramePing:
+	if (0 != sid)
+	  {
+	    [self _goaway: ErrorProtocol];
+	  }
+	else if (8 != len)
+	  {
+	    [self _goaway: ErrorFrameSize];
+	  }
+	else if (0 == (flags & FlagAck))
+	  {
+	    putFrame(output, FramePing, FlagAck, 0, p, 8);
+	  }
+	break;
+
+      case FrameGoAway:
+	if (0 != sid)
+	  {
+	    [self _goaway: ErrorProtocol];
+	  }
+	else
+	  {
+	    closing = YES;	// Finish the streams we have
+	  }
+	break;
+
+      case FrameWindowUpdate:
+	if (4 != len)
+	  {
+	    [self _goaway: ErrorFrameSize];
+	  }
+	else
+	  {
+	    [self _windowUpdate: sid payload: p];
+	  }
+	break;
+
+      case FramePushPromise:
+	[self _goaway: ErrorProtocol];	// Clients can't push
+	break;
+
+      default:
+	break;	// Unknown frame types are ignored
+    }
+}
+
+/* Sends GOAWAY for a connection error.  Nothing more is read, and the
+ * connection closes once the frame has been written.
+ */
+- (void) _goaway: (uint32_t)code
+{
+  uint8_t	b[8];
+
+  put32(b, lastStream);
+  put32(b + 4, code);
+  putFrame(output, FrameGoAway, 0, 0, b, 8);
+  closing = YES;
+  finished = YES;
+}
+
+/* Handles a complete header block, which either starts a new stream or
+ * holds the trailers of a request.
+ */
+- (void) _headerBlock
+{
+  uint32_t		sid = blockStream;
+  BOOL			end = (blockFlags & FlagEndStream) ? YES : NO;
+  NSMutableArray	*list;
+  WebServerHTTP2Stream	*s;
+
+  blockStream = 0;
+  if (nil == (list = [self decode: block]))
+    {
+      [self _goaway: ErrorCompression];
+      return;
+    }
+  if (nil != (s = [self _stream: sid]))
+    {
+      if (YES == s->received)
+	{
+	  [self _reset: s code: ErrorStreamClosed];
+	}
+      else if (NO == end)
+	{
+	  [self _reset: s code: ErrorProtocol];
+	}
+      else
+	{
+	  [self _start: s];	// Trailers are ignored
+	}
+      return;
+    }
+  if (sid <= lastStream || 0 == (sid & 1))
+    {
+      [self _goaway: ErrorProtocol];
+      return;
+    }
+  lastStream = sid;
+  if (YES == closing)
+    {
+      return;	// Not processed once we have sent GOAWAY
+    }
+  if (NO == [self _rapid: NO])
+    {
+      return;
+    }
+  if ([streams count] >= MAX_STREAMS)
+    {
+      [self _resetStream: sid code: ErrorRefusedStream];
+      return;
+    }
+  s = [WebServerHTTP2Stream new];
+  s->identifier = sid;
+  s->window = initialWindow;
+  s->body = [NSMutableData new];
+  s->raw = [NSMutableData new];
+  s->pending = [NSMutableData new];
+  [streams addObject: s];
+  [s release];
+  if (YES == oversized)
+    {
+      [self _refuse: s status: 431];
+    }
+  else if (NO == [self _request: list stream: s])
+    {
+      [self _reset: s code: ErrorProtocol];
+    }
+  else if (YES == end)
+    {
+      [self _start: s];
+    }
+}
+
+/* Sends a header block, split into a HEADERS frame and as many
+ * CONTINUATION frames as needed.
+ */
+- (void) _headers: (NSData*)hb stream: (uint32_t)sid end: (BOOL)end
+{
+  const uint8_t	*b = (const uint8_t*)[hb bytes];
+  NSUInteger	length = [hb length];
+  uint8_t	type = FrameHeaders;
+  uint8_t	flags = (YES == end) ? FlagEndStream : 0;
+
+  for (;;)
+    {
+      NSUInteger	n = (length > frameMax) ? frameMax : length;
+
+      if (n == length)
+	{
+	  flags |= FlagEndHeaders;
+	}
+      putFrame(output, type, flags, sid, b, n);
+      if (n == length)
+	{
+	  break;
+	}
+      b += n;
+      length -= n;
+      type = FrameContinuation;
+      flags = 0;
+    }
+}
+
+/* Counts a stream started (or reset if the argument is YES) by the
+ * client, sending GOAWAY and returning NO if it has exceeded the limit
+ * for the current period.
+ */
+- (BOOL) _rapid: (BOOL)reset
+{
+  NSTimeInterval	now = [NSDate timeIntervalSinceReferenceDate];
+
+  if (now - rapidStart > RAPID_PERIOD)
+    {
+      rapidStart = now;
+      opened = 0;
+      resets = 0;
+    }
+  if (YES == reset)
+    {
+      resets++;
+    }
+  else
+    {
+      opened++;
+    }
+  if (opened > MAX_OPENED || resets > MAX_RESETS)
+    {
+      [self _goaway: ErrorCalm];
+      return NO;
+    }
+  return YES;
+}
+
+/* Responds to a request we won't pass on (with no content), and stops
+ * the client sending any more of it.
+ */
+- (void) _refuse: (WebServerHTTP2Stream*)s status: (int)status
+{
+  NSMutableData	*hb = [NSMutableData dataWithCapacity: 8];
+
+  putStatus(hb, status);
+  [self _headers: hb stream: s->identifier end: YES];
+  if (NO == s->received)
+    {
+      [self _resetStream: s->identifier code: ErrorNone];
+    }
+  [self _remove: s];
+}
+
+- (void) _remove: (WebServerHTTP2Stream*)s
+{
+  if (nil != s->follower)
+    {
+      if (YES == s->complete)
+	{
+	  [connection _pipeDone: s->follower];
+	}
+      else
+	{
+	  [server _endConnect: s->follower];
+	}
+    }
+  if (nil != s->body)
+    {
+      buffered -= [s->body length];
+    }
+  [streams removeObjectIdenticalTo: s];
+}
+
+/* Builds the HTTP/1.1 text of the request from its header fields.
+ * Returns NO if the request is malformed.
+ */
+- (BOOL) _request: (NSArray*)list stream: (WebServerHTTP2Stream*)s
+{
+  NSEnumerator		*e = [list objectEnumerator];
+  NSMutableData		*fields = [NSMutableData dataWithCapacity: 1024];
+  NSMutableString	*cookie = nil;
+  NSString		*method = nil;
+  NSString		*path = nil;
+  NSString		*authority = nil;
+  BOOL			host = NO;
+  BOOL			regular = NO;
+  NSArray		*field;
+
+  while (nil != (field = [e nextObject]))
+    {
+      NSString	*n = [field objectAtIndex: 0];
+      NSString	*v = [field objectAtIndex: 1];
+
+      if (NO == validValue(v, NO))
+	{
+	  return NO;
+	}
+      if ([n hasPrefix: @":"])
+	{
+	  if (YES == regular)
+	    {
+	      return NO;	// Pseudo-headers must come first
+	    }
+	  if ([n isEqualToString: @":method"] && nil == method)
+	    {
+	      method = v;
+	    }
+	  else if ([n isEqualToString: @":path"] && nil == path)
+	    {
+	      path = v;
+	    }
+	  else if ([n isEqualToString: @":authority"] && nil == authority)
+	    {
+	      authority = v;
+	    }
+	  else if (NO == [n isEqualToString: @":scheme"])
+	    {
+	      return NO;
+	    }
+	  continue;
+	}
+      regular = YES;
+      if (NO == validToken(n, YES))
+	{
+	  return NO;
+	}
+      if ([n isEqualToString: @"connection"]
+	|| [n isEqualToString: @"keep-alive"]
+	|| [n isEqualToString: @"proxy-connection"]
+	|| [n isEqualToString: @"transfer-encoding"]
+	|| [n isEqualToString: @"upgrade"])
+	{
+	  return NO;	// Connection specific
+	}
+      if ([n isEqualToString: @"te"] || [n isEqualToString: @"expect"]
+	|| [n isEqualToString: @"content-length"])
+	{
+	  continue;	// We have the whole body and set its length
+	}
+      if ([n isEqualToString: @"cookie"])
+	{
+	  /* Cookies may be split into separate fields, but HTTP/1.1
+	   * needs a single header.
+	   */
+	  if (nil == cookie)
+	    {
+	      cookie = [NSMutableString stringWithString: v];
+	    }
+	  else
+	    {
+	      [cookie appendString: @"; "];
+	      [cookie appendString: v];
+	    }
+	  continue;
+	}
+      if ([n isEqualToString: @"host"])
+	{
+	  host = YES;
+	}
+      appendLatin1(fields, n);
+      [fields appendBytes: ": " length: 2];
+      appendLatin1(fields, v);
+      [fields appendBytes: "\r\n" length: 2];
+    }
+  if (NO == validToken(method, NO) || 0 == [path length]
+    || NO == validValue(path, YES)
+    || NO == validValue(authority, YES))
+    {
+      return NO;	// CONNECT is not supported
+    }
+
+  s->request = [[NSMutableData alloc] initWithCapacity: [fields length] + 256];
+  appendLatin1(s->request, method);
+  [s->request appendBytes: " " length: 1];
+  appendLatin1(s->request, path);
+  [s->request appendBytes: " HTTP/1.1\r\n" length: 11];
+  if (NO == host && [authority length] > 0)
+    {
+      [s->request appendBytes: "host: " length: 6];
+      appendLatin1(s->request, authority);
+      [s->request appendBytes: "\r\n" length: 2];
+    }
+  [s->request appendData: fields];
+  if (nil != cookie)
+    {
+      [s->request appendBytes: "cookie: " length: 8];
+      appendLatin1(s->request, cookie);
+      [s->request appendBytes: "\r\n" length: 2];
+    }
+  s->head = [method isEqualToString: @"HEAD"];
+  return YES;
+}
+
+- (void) _reset: (WebServerHTTP2Stream*)s code: (uint32_t)code
+{
+  [self _resetStream: s->identifier code: code];
+  [self _remove: s];
+}
+
+- (void) _resetStream: (uint32_t)sid code: (uint32_t)code
+{
+  uint8_t	b[4];
+
+  put32(b, code);
+  putFrame(output, FrameResetStream, 0, sid, b, 4);
+}
+
+/* Translates as much of the HTTP/1.1 response taken from the follower
+ * as we can, sending the headers and decoding any content for sending
+ * in DATA frames.  Returns NO if the response is not valid.
+ */
+- (BOOL) _response: (WebServerHTTP2Stream*)s
+{
+  const uint8_t	*b = (const uint8_t*)[s->raw bytes];
+  NSUInteger	length = [s->raw length];
+
+  if (NO == s->parsed)
+    {
+      GSMimeDocument	*doc;
+      NSMutableData	*hb;
+      NSMutableData	*name = nil;
+      NSMutableData	*value = nil;
+      NSString		*str;
+      NSUInteger	end;
+      NSUInteger	pos;
+      BOOL		empty;
+      int		status;
+
+      for (end = 3; end < length; end++)
+	{
+	  if ('\n' == b[end] && 0 == memcmp(b + end - 3, "\r\n\r\n", 4))
+	    {
+	      break;
+	    }
+	}
+      if (end >= length)
+	{
+	  return (YES == s->complete) ? NO : YES;
+	}
+      end -= 1;		// Position after the CRLF of the last header
+
+      for (pos = 0; pos < end && ' ' != b[pos]; pos++)
+	;
+      status = (int)strtol((const char*)b + pos, 0, 10);
+      if (status < 200 || status > 999)
+	{
+	  return NO;
+	}
+      hb = [NSMutableData dataWithCapacity: 512];
+      putStatus(hb, status);
+      doc = AUTORELEASE([GSMimeDocument new]);
+
+      while (pos < end && '\n' != b[pos])
+	{
+	  pos++;	// Skip status line
+	}
+      pos++;
+      while (pos <= end)
+	{
+	  NSUInteger	eol = pos;
+	  NSUInteger	colon;
+
+	  while (eol < end && '\r' != b[eol])
+	    {
+	      eol++;
+	    }
+	  if (eol > pos && (' ' == b[pos] || '\t' == b[pos]))
+	    {
+	      if (nil != value)
+		{
+		  [value appendBytes: b + pos length: eol - pos];
+		}
+	      pos = eol + 2;
+	      continue;	// Folded header
+	    }
+	  if (nil != name)
+	    {
+	      const char	*n = [name bytes];
+	      NSUInteger	l = [name length];
+
+	      /* Content length and transfer encoding tell us how to read
+	       * the content, and connection specific headers go.
+	       */
+	      if (14 == l && 0 == memcmp(n, "content-length", 14))
+		{
+		  str = AUTORELEASE([[NSString alloc] initWithData: value
+		    encoding: NSISOLatin1StringEncoding]);
+		  [doc setHeader: @"content-length" value: str parameters: nil];
+		}
+	      if (17 == l && 0 == memcmp(n, "transfer-encoding", 17))
+		{
+		  str = AUTORELEASE([[NSString alloc] initWithData: value
+		    encoding: NSISOLatin1StringEncoding]);
+		  [doc setHeader: @"transfer-encoding"
+			   value: str
+		      parameters: nil];
+		}
+	      else if ((10 != l || 0 != memcmp(n, "connection", 10))
+		&& (10 != l || 0 != memcmp(n, "keep-alive", 10))
+		&& (16 != l || 0 != memcmp(n, "proxy-connection", 16))
+		&& (7 != l || 0 != memcmp(n, "upgrade", 7)))
+		{
+		  putField(hb, [name bytes], l, [value bytes], [value length]);
+		}
+	      name = nil;
+	      value = nil;
+	    }
+	  if (eol >= end)
+	    {
+	      break;
+	    }
+	  for (colon = pos; colon < eol && ':' != b[colon]; colon++)
+	    ;
+	  if (colon < eol && colon > pos)
+	    {
+	      NSUInteger	i;
+	      NSUInteger	v = colon + 1;
+
+	      name = [NSMutableData dataWithBytes: b + pos length: colon - pos];
+	      for (i = 0; i < colon - pos; i++)
+		{
+		  ((uint8_t*)[name mutableBytes])[i] = tolower(b[pos + i]);
+		}
+	      while (v < eol && (' ' == b[v] || '\t' == b[v]))
+		{
+		  v++;
+		}
+	      value = [NSMutableData dataWithBytes: b + v length: eol - v];
+	    }
+	  pos = eol + 2;
+	}
+
+      /* There is no content for HEAD or a 204 or 304 response (though
+       * the connection may have produced some), or with a zero length.
+       */
+      str = [[doc headerNamed: @"content-length"] value];
+      empty = (YES == s->head || 204 == status || 304 == status
+	|| (nil != str && 0 == [str longLongValue]
+	  && nil == [doc headerNamed: @"transfer-encoding"])) ? YES : NO;
+      if (NO == empty)
+	{
+	  s->content = [[WebServerHTTP2Content alloc]
+	    initWithRequest: (WebServerRequest*)doc
+		       into: s->pending];
+	}
+      s->parsed = YES;
+      [self _headers: hb stream: s->identifier end: (nil == s->content)];
+      if (nil == s->content)
+	{
+	  s->done = YES;
+	  s->closed = YES;
+	}
+      [s->raw replaceBytesInRange: NSMakeRange(0, end + 2)
+			withBytes: 0
+			   length: 0];
+      b = (const uint8_t*)[s->raw bytes];
+      length = [s->raw length];
+    }
+
+  if (length > 0)
+    {
+      if (NO == s->done)
+	{
+	  [s->content read: b length: length];
+	  if (nil != [s->content error])
+	    {
+	      return NO;
+	    }
+	  s->done = [s->content complete];
+	}
+      [s->raw setLength: 0];	// Anything more is not content
+    }
+  if (YES == s->complete && NO == s->done)
+    {
+      return NO;	// Truncated
+    }
+  return YES;
+}
+
+/* Sends as much of the pending content as flow control permits, ending
+ * the stream once it has all been sent.
+ */
+- (void) _send: (WebServerHTTP2Stream*)s
+{
+  const uint8_t	*b = (const uint8_t*)[s->pending bytes];
+  NSUInteger	length = [s->pending length];
+
+  while (s->sent < length && window > 0 && s->window > 0)
+    {
+      NSUInteger	n = length - s->sent;
+      uint8_t		flags = 0;
+
+      if (n > frameMax)
+	{
+	  n = frameMax;
+	}
+      if ((int64_t)n > window)
+	{
+	  n = (NSUInteger)window;
+	}
+      if ((int64_t)n > s->window)
+	{
+	  n = (NSUInteger)s->window;
+	}
+      if (YES == s->done && s->sent + n == length)
+	{
+	  flags = FlagEndStream;
+	  s->closed = YES;
+	}
+      putFrame(output, FrameData, flags, s->identifier, b + s->sent, n);
+      s->sent += n;
+      window -= n;
+      s->window -= n;
+    }
+  if (s->sent == length)
+    {
+      [s->pending setLength: 0];
+      s->sent = 0;
+      if (YES == s->done && NO == s->closed)
+	{
+	  putFrame(output, FrameData, FlagEndStream, s->identifier, 0, 0);
+	  s->closed = YES;
+	}
+    }
+  else if (s->sent > 65536)
+    {
+      [s->pending replaceBytesInRange: NSMakeRange(0, s->sent)
+			    withBytes: 0
+			       length: 0];
+      s->sent = 0;
+    }
+}
+
+- (void) _settings: (uint8_t)flags
+	   payload: (const uint8_t*)p
+	    length: (NSUInteger)len
+{
+  NSUInteger	pos;
+
+  if (flags & FlagAck)
+    {
+      if (0 != len)
+	{
+	  [self _goaway: ErrorFrameSize];
+	}
+      return;
+    }
+  if (0 != len % 6)
+    {
+      [self _goaway: ErrorFrameSize];
+      return;
+    }
+  for (pos = 0; pos < len; pos += 6)
+    {
+      unsigned	ident = ((unsigned)p[pos] << 8) | p[pos + 1];
+      uint32_t	v = get32(p + pos + 2);
+
+      if (SettingEnablePush == ident && v > 1)
+	{
+	  [self _goaway: ErrorProtocol];
+	  return;
+	}
+      if (SettingWindowSize == ident)
+	{
+	  NSEnumerator		*e = [streams objectEnumerator];
+	  WebServerHTTP2Stream	*s;
+	  int64_t		delta;
+
+	  if (v > MAX_WINDOW)
+	    {
+	      [self _goaway: ErrorFlowControl];
+	      return;
+	    }
+	  delta = (int64_t)v - initialWindow;
+	  initialWindow = v;
+	  while (nil != (s = [e nextObject]))
+	    {
+	      s->window += delta;
+	      if (s->window > MAX_WINDOW)
+		{
+		  [self _goaway: ErrorFlowControl];
+		  return;
+		}
+	    }
+	}
+      if (SettingFrameSize == ident)
+	{
+	  if (v < 16384 || v > 16777215)
+	    {
+	      [self _goaway: ErrorProtocol];
+	      return;
+	    }
+	  frameMax = v;
+	}
+    }
+  hadSettings = YES;
+  putFrame(output, FrameSettings, FlagAck, 0, 0, 0);
+}
+
+/* The request is complete, so pass it to a new follower to handle.
+ */
+- (void) _start: (WebServerHTTP2Stream*)s
+{
+  NSMutableData		*d = s->request;
+  WebServerConnection	*f;
+
+  s->received = YES;
+  s->request = nil;
+  if ([s->body length] > 0)
+    {
+      char	buf[48];
+
+      snprintf(buf, sizeof(buf), "content-length: %lu\r\n",
+	(unsigned long)[s->body length]);
+      [d appendBytes: buf length: strlen(buf)];
+    }
+  [d appendBytes: "\r\n" length: 2];
+  [d appendData: s->body];
+  buffered -= [s->body length];
+  DESTROY(s->body);
+
+  f = [[WebServerConnection alloc] initWithLeader: connection];
+  s->follower = f;
+  [s retain];
+  [f _didData: d];
+  [s release];
+  [d release];
+}
+
+- (WebServerHTTP2Stream*) _stream: (uint32_t)sid
+{
+  NSUInteger	count = [streams count];
+  NSUInteger	i;
+
+  for (i = 0; i < count; i++)
+    {
+      WebServerHTTP2Stream	*s = [streams objectAtIndex: i];
+
+      if (s->identifier == sid)
+	{
+	  return s;
+	}
+    }
+  return nil;
+}
+
+- (void) _windowUpdate: (uint32_t)sid payload: (const uint8_t*)p
+{
+  uint32_t		increment = get32(p) & MAX_WINDOW;
+  WebServerHTTP2Stream	*s;
+
+  if (0 == sid)
+    {
+      window += increment;
+      if (0 == increment || window > MAX_WINDOW)
+	{
+	  [self _goaway: (0 == increment) ? ErrorProtocol : ErrorFlowControl];
+	}
+    }
+  else if (nil != (s = [self _stream: sid]))
+    {
+      s->window += increment;
+      if (0 == increment)
+	{
+	  [self _reset: s code: ErrorProtocol];
+	}
+      else if (s->window > MAX_WINDOW)
+	{
+	  [self _reset: s code: ErrorFlowControl];
+	}
+    }
+  else if (sid > lastStream)
+    {
+      [self _goaway: ErrorProtocol];
+    }
+}
+
+@end
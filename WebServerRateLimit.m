@@ -0,0 +1,378 @@
+/**
+   Copyright (C) 2026 Free Software Foundation, Inc.
+
+   Written by:  agent <agent@local>
+   Date:	October 2026
+
+   This file is part of the WebServer Library.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA.
+
+   $Date$ $Revision$
+   */
+#import	<Foundation/Foundation.h>
+
+#define WEBSERVERINTERNAL       1
+
+#import	"WebServer.h"
+#import	"Internal.h"
+
+/* The buckets are held in a table divided into shards (allocated when
+ * first used) each of which is a small open addressed hash table.
+ * Each slot holds a tag (a hash of the client address and the rule, and
+ * zero if the slot is free) and the state of the bucket packed into a
+ * single 64bit word, so that both may be updated by compare and swap
+ * without any locking.
+ * The state holds the time of the last update (milliseconds since the
+ * limiter was created) in the top 40 bits and the number of tokens left
+ * (in thousandths of a token) in the bottom 24 bits.  A state of zero
+ * represents a full bucket, so a newly claimed slot needs no setting up.
+ * A slot whose bucket would have refilled completely may be reclaimed
+ * for another client, so no cleanup is needed.  If no slot can be found
+ * within a few probes the request is allowed (and counted) rather than
+ * blocking or allocating memory.
+ */
+#define	RL_SHARDS	64
+#define	RL_SLOTS	1024
+#define	RL_PROBES	8
+#define	RL_TOKEN	1000
+#define	RL_MAXTOKENS	((1 << 24) - 1)
+
+typedef struct	{
+  uint64_t	tag;
+  uint64_t	state;
+} RLSlot;
+
+typedef struct	{
+  double	rate;		// Thousandths of a token per millisecond
+  uint64_t	burst;		// Thousandths of a token
+} RLRule;
+
+static inline uint64_t
+rlTag(const WebServerAddressKey *key, NSUInteger rule)
+{
+  uint64_t	h = 0xcbf29ce484222325ULL;
+  NSUInteger	i;
+
+  h = (h ^ key->family) * 0x100000001b3ULL;
+  for (i = 0; i < key->length; i++)
+    {
+      h = (h ^ key->bytes[i]) * 0x100000001b3ULL;
+    }
+  h = (h ^ (uint64_t)rule) * 0x100000001b3ULL;
+  h ^= h >> 29;
+  return (0 == h) ? 1 : h;
+}
+
+/* Return the number of tokens in a bucket whose state is given, after
+ * refilling it up to the time now.
+ */
+static inline uint64_t
+rlTokens(uint64_t state, uint64_t now, RLRule *r)
+{
+  uint64_t	last = state >> 24;
+  uint64_t	tokens = state & RL_MAXTOKENS;
+  double	fill;
+
+  if (0 == state || now <= last)
+    {
+      return (0 == state) ? r->burst : tokens;
+    }
+  fill = (now - last) * r->rate;
+  if (fill >= (double)(r->burst - tokens))
+    {
+      return r->burst;
+    }
+  return tokens + (uint64_t)fill;
+}
+
+@implementation	WebServerRateLimiter
+
+- (NSTimeInterval) _consume: (const WebServerAddressKey*)key
+		       rule: (NSUInteger)rule
+			now: (uint64_t)now
+{
+  RLRule	*r = &((RLRule*)_rules)[rule];
+  RLSlot	**shards = (RLSlot**)_shards;
+  RLSlot	*shard;
+  RLSlot	*slot = 0;
+  uint64_t	tag = rlTag(key, rule);
+  uint64_t	t;
+  NSUInteger	index;
+  NSUInteger	i;
+
+  shard = __atomic_load_n(&shards[tag % RL_SHARDS], __ATOMIC_ACQUIRE);
+  if (0 == shard)
+    {
+      RLSlot	*expected = 0;
+
+      shard = calloc(RL_SLOTS, sizeof(RLSlot));
+      if (NO == __atomic_compare_exchange_n(&shards[tag % RL_SHARDS],
+	&expected, shard, NO, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+	  free(shard);
+	  shard = expected;
+	}
+    }
+
+  /* Look for the slot with our tag, or failing that for the first slot
+   * which is free or idle (and may therefore be reclaimed).
+   */
+  index = (tag / RL_SHARDS) % RL_SLOTS;
+  for (i = 0; i < RL_PROBES; i++)
+    {
+      RLSlot	*s = &shard[(index + i) % RL_SLOTS];
+
+      t = __atomic_load_n(&s->tag, __ATOMIC_ACQUIRE);
+      if (t == tag)
+	{
+	  slot = s;
+	  break;
+	}
+      if (0 == slot)
+	{
+	  uint64_t	state = __atomic_load_n(&s->state, __ATOMIC_RELAXED);
+
+	  if (0 == t || (state >> 24) + _idle < now)
+	    {
+	      slot = s;
+	    }
+	}
+    }
+  if (0 == slot)
+    {
+      __atomic_add_fetch(&_overflows, 1, __ATOMIC_RELAXED);
+      return 0.0;
+    }
+  t = __atomic_load_n(&slot->tag, __ATOMIC_ACQUIRE);
+  if (t != tag)
+    {
+      /* Claim the free or idle slot.  If another thread gets there first
+       * we just allow the request.
+       */
+      if (NO == __atomic_compare_exchange_n(&slot->tag, &t, tag,
+	NO, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+	  if (t != tag)
+	    {
+	      __atomic_add_fetch(&_overflows, 1, __ATOMIC_RELAXED);
+	      return 0.0;
+	    }
+	}
+      else
+	{
+	  __atomic_store_n(&slot->state, 0, __ATOMIC_RELEASE);
+	}
+    }
+
+  for (;;)
+    {
+      uint64_t	old = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+      uint64_t	tokens = rlTokens(old, now, r);
+      uint64_t	new;
+
+      if (tokens < RL_TOKEN)
+	{
+	  /* Return the time until a whole token is available.
+	   */
+	  return (RL_TOKEN - tokens) / r->rate / 1000.0;
+	}
+      new = (now << 24) | (tokens - RL_TOKEN);
+      if (0 == new)
+	{
+	  new = 1 << 24;	// Zero would mean a full bucket
+	}
+      if (YES == __atomic_compare_exchange_n(&slot->state, &old, new,
+	NO, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+	  return 0.0;
+	}
+    }
+}
+
+- (NSTimeInterval) checkAddress: (NSString*)address path: (NSString*)path
+{
+  WebServerAddressKey	key;
+  NSTimeInterval	wait = 0.0;
+  NSUInteger		count;
+  uint64_t		now;
+
+  if (0 == _ruleCount || NO == WebServerAddressKeyFromString(address, &key))
+    {
+      return 0.0;
+    }
+  now = (uint64_t)(([NSDate timeIntervalSinceReferenceDate] - _base) * 1000.0);
+
+  /* The rule for the empty prefix (if any) applies to every request,
+   * and is used in addition to the rule for the longest prefix of the
+   * path (if any).
+   */
+  if (YES == _global)
+    {
+      wait = [self _consume: &key rule: 0 now: now];
+    }
+  if (0.0 == wait && nil != path)
+    {
+      count = [_prefixes count];
+      while (count-- > 0)
+	{
+	  if (YES == [path hasPrefix: [_prefixes objectAtIndex: count]])
+	    {
+	      wait = [self _consume: &key
+			       rule: count + (YES == _global ? 1 : 0)
+				now: now];
+	      break;
+	    }
+	}
+    }
+  if (wait > 0.0)
+    {
+      __atomic_add_fetch(&_limited, 1, __ATOMIC_RELAXED);
+    }
+  return wait;
+}
+
+- (void) dealloc
+{
+  RLSlot	**shards = (RLSlot**)_shards;
+
+  if (0 != shards)
+    {
+      NSUInteger	i;
+
+      for (i = 0; i < RL_SHARDS; i++)
+	{
+	  free(shards[i]);
+	}
+      free(shards);
+      _shards = 0;
+    }
+  if (0 != _rules)
+    {
+      free(_rules);
+      _rules = 0;
+    }
+  DESTROY(_limits);
+  DESTROY(_prefixes);
+  [super dealloc];
+}
+
+- (id) init
+{
+  return [self initWithLimits: nil];
+}
+
+- (id) initWithLimits: (NSDictionary*)limits
+{
+  if (nil != (self = [super init]))
+    {
+      NSMutableArray	*prefixes;
+      NSEnumerator	*e;
+      NSString		*prefix;
+      RLRule		*rules;
+      NSUInteger	count;
+      NSUInteger	index;
+      double		idle = 0.0;
+
+      _limits = [limits copy];
+      prefixes = [NSMutableArray arrayWithCapacity: [limits count]];
+      e = [limits keyEnumerator];
+      while (nil != (prefix = [e nextObject]))
+	{
+	  NSDictionary	*d = [limits objectForKey: prefix];
+
+	  if (NO == [prefix isKindOfClass: [NSString class]]
+	    || NO == [d isKindOfClass: [NSDictionary class]]
+	    || [[d objectForKey: @"Rate"] doubleValue] <= 0.0)
+	    {
+	      [NSException raise: NSInvalidArgumentException
+			  format: @"[%@-%@] bad limit for '%@'",
+		NSStringFromClass([self class]), NSStringFromSelector(_cmd),
+		prefix];
+	    }
+	  if (0 == [prefix length])
+	    {
+	      _global = YES;
+	    }
+	  else
+	    {
+	      [prefixes addObject: prefix];
+	    }
+	}
+
+      /* Sorted so that a longer prefix comes after any shorter prefix
+       * of the same path, so we can search from the end.
+       */
+      [prefixes sortUsingSelector: @selector(compare:)];
+      _prefixes = [prefixes copy];
+      _ruleCount = [_prefixes count] + (YES == _global ? 1 : 0);
+      rules = calloc(_ruleCount + 1, sizeof(RLRule));
+      count = 0;
+      for (index = 0; index < _ruleCount; index++)
+	{
+	  NSDictionary	*d;
+	  double	rate;
+	  NSInteger	burst;
+
+	  if (YES == _global && 0 == index)
+	    {
+	      d = [limits objectForKey: @""];
+	    }
+	  else
+	    {
+	      d = [limits objectForKey: [_prefixes objectAtIndex: count++]];
+	    }
+	  rate = [[d objectForKey: @"Rate"] doubleValue];
+	  burst = [[d objectForKey: @"Burst"] integerValue];
+	  if (burst < 1)
+	    {
+	      burst = ceil(rate);
+	    }
+	  if (burst > RL_MAXTOKENS / RL_TOKEN)
+	    {
+	      burst = RL_MAXTOKENS / RL_TOKEN;
+	    }
+	  rules[index].rate = rate;	// Tokens per second == thousandths/ms
+	  rules[index].burst = burst * RL_TOKEN;
+	  if (burst / rate > idle)
+	    {
+	      idle = burst / rate;
+	    }
+	}
+      _rules = rules;
+      _idle = (uint64_t)(idle * 1000.0) + 1;
+      _shards = calloc(RL_SHARDS, sizeof(RLSlot*));
+      _base = [NSDate timeIntervalSinceReferenceDate];
+    }
+  return self;
+}
+
+- (NSDictionary*) limits
+{
+  return _limits;
+}
+
+- (NSUInteger) limited
+{
+  return __atomic_load_n(&_limited, __ATOMIC_RELAXED);
+}
+
+- (NSUInteger) overflows
+{
+  return __atomic_load_n(&_overflows, __ATOMIC_RELAXED);
+}
+
+@end
+
@@ -0,0 +1,367 @@
+/**
+   Copyright (C) 2026 Free Software Foundation, Inc.
+
+   Written by:  agent <agent@local>
+   Date:	October 2026
+
+   This file is part of the WebServer Library.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA.
+
+   $Date$ $Revision$
+   */
+#import	<Foundation/Foundation.h>
+
+#define WEBSERVERINTERNAL       1
+
+#import	"WebServer.h"
+#import	"WebServerBundles.h"
+
+/* A node in the route tree corresponds to one path component.
+ * Static components are held in a dictionary keyed on the component
+ * text, while all parameter components at the same level share a single
+ * child node (the names are stored with the route which ends at the
+ * node rather than in the node itself, so routes may use different
+ * names for the same position).  A wildcard may only appear as the
+ * final component of a route and is therefore recorded in the node
+ * above it.
+ */
+@interface	WebServerRouteNode : NSObject
+{
+@public
+  NSMutableDictionary	*statics;	// Children by literal component
+  WebServerRouteNode	*param;		// Child matching any component
+  NSString		*route;		// Route ending at this node
+  NSArray		*names;		// Parameter names for route
+  NSString		*wildRoute;	// Wildcard route below this node
+  NSArray		*wildNames;	// Parameter names for wildRoute
+}
+@end
+
+@implementation	WebServerRouteNode
+- (void) dealloc
+{
+  DESTROY(statics);
+  DESTROY(param);
+  DESTROY(route);
+  DESTROY(names);
+  DESTROY(wildRoute);
+  DESTROY(wildNames);
+  [super dealloc];
+}
+@end
+
+/* Return the parameter name if the component is of the form {name},
+ * otherwise return nil.
+ */
+static NSString *
+paramName(NSString *component)
+{
+  NSUInteger	length = [component length];
+
+  if (length >= 2 && [component characterAtIndex: 0] == '{'
+    && [component characterAtIndex: length - 1] == '}')
+    {
+      return [component substringWithRange: NSMakeRange(1, length - 2)];
+    }
+  return nil;
+}
+
+/* Return YES if the component is a wildcard ... either a bare asterisk
+ * or a parameter whose name ends in an asterisk.  The name to be used
+ * for the captured remainder of the path is returned in *name.
+ */
+static BOOL
+isWildcard(NSString *component, NSString **name)
+{
+  NSString	*n;
+
+  if ([component isEqualToString: @"*"])
+    {
+      *name = component;
+      return YES;
+    }
+  n = paramName(component);
+  if ([n hasSuffix: @"*"])
+    {
+      if ([n length] > 1)
+	{
+	  n = [n substringToIndex: [n length] - 1];
+	}
+      *name = n;
+      return YES;
+    }
+  return NO;
+}
+
+/* The state of a match in progress.
+ */
+typedef struct {
+  NSArray		*components;	// The components of the request
+  NSUInteger		count;		// The number of components
+  NSMutableArray	*values;	// The stack of parameter values
+} MatchState;
+
+/* The result of a match.
+ */
+typedef struct {
+  NSString		*route;		// The route found
+  NSArray		*names;		// The parameter names for route
+  NSArray		*found;		// The parameter values for route
+  NSUInteger		depth;		// Components in the base
+  NSUInteger		length;		// Components matched by route
+} MatchResult;
+
+/* Record a successful match of the route.
+ */
+static void
+matched(MatchState *s, MatchResult *r, NSString *route, NSArray *names,
+  NSUInteger depth, NSUInteger length)
+{
+  r->route = route;
+  r->names = names;
+  r->found = [[s->values copy] autorelease];
+  r->depth = depth;
+  r->length = length;
+}
+
+/* Match the components from index onwards below the node, returning
+ * YES and setting up the result if a route was found.
+ * The route matching the most components wins (a wildcard matches all
+ * the remaining components), and where routes match the same number of
+ * components a literal is preferred to a parameter, which is preferred
+ * to a wildcard.  The route at the node itself is therefore used only
+ * if no longer route matches, which gives the same behavior as the
+ * original repeated shortening of the path.  We only need to explore
+ * more than one branch where literals and parameters overlap at the
+ * same level.
+ */
+static BOOL
+matchNode(WebServerRouteNode *node, MatchState *s, NSUInteger index,
+  MatchResult *best)
+{
+  BOOL	found = NO;
+
+  if (index < s->count)
+    {
+      NSString		*component = [s->components objectAtIndex: index];
+      MatchResult	r;
+
+      if (nil != node->statics)
+	{
+	  WebServerRouteNode	*child = [node->statics objectForKey: component];
+
+	  if (nil != child && YES == matchNode(child, s, index + 1, &r))
+	    {
+	      *best = r;
+	      found = YES;
+	    }
+	}
+      if (nil != node->param && [component length] > 0
+	&& (NO == found || best->length < s->count))
+	{
+	  [s->values addObject: component];
+	  if (YES == matchNode(node->param, s, index + 1, &r)
+	    && (NO == found || r.length > best->length))
+	    {
+	      *best = r;
+	      found = YES;
+	    }
+	  [s->values removeLastObject];
+	}
+      if (nil != node->wildRoute
+	&& (NO == found || best->length < s->count))
+	{
+	  NSArray	*rest;
+
+	  rest = [s->components subarrayWithRange:
+	    NSMakeRange(index, s->count - index)];
+	  [s->values addObject: [rest componentsJoinedByString: @"/"]];
+	  matched(s, best, node->wildRoute, node->wildNames, index, s->count);
+	  [s->values removeLastObject];
+	  found = YES;
+	}
+    }
+  if (NO == found && nil != node->route)
+    {
+      matched(s, best, node->route, node->names, index, index);
+      found = YES;
+    }
+  return found;
+}
+
+@implementation	WebServerRouter
+
++ (WebServerRouter*) routerWithRoutes: (NSArray*)routes
+{
+  return AUTORELEASE([[self alloc] initWithRoutes: routes]);
+}
+
+- (NSUInteger) count
+{
+  return _count;
+}
+
+- (void) dealloc
+{
+  DESTROY(_root);
+  [super dealloc];
+}
+
+- (id) init
+{
+  return [self initWithRoutes: nil];
+}
+
+- (id) initWithRoutes: (NSArray*)routes
+{
+  if (nil != (self = [super init]))
+    {
+      NSEnumerator	*e = [routes objectEnumerator];
+      NSString		*route;
+
+      _root = [WebServerRouteNode new];
+      while (nil != (route = [e nextObject]))
+	{
+	  NSArray		*components;
+	  NSMutableArray	*names;
+	  WebServerRouteNode	*node = _root;
+	  NSUInteger		count;
+	  NSUInteger		index;
+
+	  if (NO == [route isKindOfClass: [NSString class]])
+	    {
+	      continue;
+	    }
+	  components = [route componentsSeparatedByString: @"/"];
+	  count = [components count];
+	  names = [NSMutableArray arrayWithCapacity: count];
+	  for (index = 0; index < count; index++)
+	    {
+	      NSString		*component = [components objectAtIndex: index];
+	      NSString		*name;
+	      WebServerRouteNode	*child;
+
+	      if (index == count - 1 && YES == isWildcard(component, &name))
+		{
+		  [names addObject: name];
+		  if (nil == node->wildRoute)
+		    {
+		      node->wildRoute = [route copy];
+		      node->wildNames = [names copy];
+		      _count++;
+		    }
+		  node = nil;
+		  break;
+		}
+	      if (nil != (name = paramName(component)))
+		{
+		  [names addObject: name];
+		  if (nil == node->param)
+		    {
+		      node->param = [WebServerRouteNode new];
+		    }
+		  node = node->param;
+		}
+	      else
+		{
+		  if (nil == node->statics)
+		    {
+		      node->statics = [NSMutableDictionary new];
+		    }
+		  child = [node->statics objectForKey: component];
+		  if (nil == child)
+		    {
+		      child = [WebServerRouteNode new];
+		      [node->statics setObject: child forKey: component];
+		      RELEASE(child);
+		    }
+		  node = child;
+		}
+	    }
+	  if (nil != node && nil == node->route)
+	    {
+	      node->route = [route copy];
+	      node->names = [names copy];
+	      _count++;
+	    }
+	}
+    }
+  return self;
+}
+
+- (NSString*) match: (NSString*)path
+	       base: (NSString**)base
+	 parameters: (NSDictionary**)parameters
+{
+  MatchState	s;
+  MatchResult	r;
+  NSUInteger	length;
+  NSUInteger	index;
+
+  if (nil == path)
+    {
+      return nil;
+    }
+  s.components = [path componentsSeparatedByString: @"/"];
+  s.count = [s.components count];
+  s.values = [NSMutableArray arrayWithCapacity: 4];
+  if (NO == matchNode(_root, &s, 0, &r))
+    {
+      return nil;
+    }
+
+  if (0 != base)
+    {
+      /* The base is the part of the request path consumed by the match,
+       * that is the matched components plus the separators between them.
+       */
+      length = 0;
+      for (index = 0; index < r.depth; index++)
+	{
+	  length += [[s.components objectAtIndex: index] length];
+	}
+      if (r.depth > 1)
+	{
+	  length += r.depth - 1;
+	}
+      *base = [path substringToIndex: length];
+    }
+  if (0 != parameters)
+    {
+      NSUInteger	count = [r.names count];
+
+      if (0 == count)
+	{
+	  *parameters = nil;
+	}
+      else
+	{
+	  NSMutableDictionary	*d;
+
+	  d = [NSMutableDictionary dictionaryWithCapacity: count];
+	  for (index = 0; index < count; index++)
+	    {
+	      [d setObject: [r.found objectAtIndex: index]
+		    forKey: [r.names objectAtIndex: index]];
+	    }
+	  *parameters = d;
+	}
+    }
+  return r.route;
+}
+
+@end
+
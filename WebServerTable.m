@@ -79,6 +79,12 @@
       NSURL	*u;
 
       [m appendString: @"    <td>\n"];
+      if (nil == _delegate)
+	{
+	  [WebServer escapeHTML: str into: m];
+	  [m appendString: @"</td>\n"];
+	  continue;
+	}
       tmp = [_delegate webServerTable: self
 			  replaceText: str
 			       forRow: NSNotFound
@@ -135,6 +141,14 @@
 	  NSURL	*u;
 
           [m appendString: @"    <td>"];
+	  if (nil == _delegate)
+	    {
+	      /* Nothing to replace, so escape straight into the output.
+	       */
+	      [WebServer escapeHTML: str into: m];
+	      [m appendString: @"</td>\n"];
+	      continue;
+	    }
 	  tmp = [_delegate webServerTable: self
 			      replaceText: str
 				   forRow: row
@@ -166,7 +180,7 @@
           [m appendString: str];
           [m appendString: @"</td>\n"];
 	}
-      while (col < _cols)
+      while (col++ < _cols)
 	{
           [m appendString: @"    <td></td>\n"];
 	}
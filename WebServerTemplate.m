@@ -0,0 +1,475 @@
+/**
+   Copyright (C) 2026 Free Software Foundation, Inc.
+
+   Written by:  agent <agent@local>
+   Date:	October 2026
+
+   This file is part of the WebServer Library.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA.
+
+   $Date$ $Revision$
+   */
+#import	<Foundation/Foundation.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+
+#define WEBSERVERINTERNAL       1
+
+#import	"WebServer.h"
+#import	"Internal.h"
+
+/* A compiled template is the UTF-8 text of the template along with a list
+ * of the places where a substitution might be made (each occurrence of
+ * '<!--').  Whether a substitution is actually made depends on whether
+ * the map contains a value for the key, so for each occurrence we store
+ * the key (nil if there is no closing '-->') and the index of the next
+ * occurrence to be considered if the substitution is made.  If it is not
+ * made, the next occurrence is simply the following one in the list.
+ * This gives exactly the same results as scanning the text each time.
+ */
+typedef struct	{
+  NSUInteger	start;		// Offset of '<!--'
+  NSUInteger	end;		// Offset after '-->'
+  NSUInteger	next;		// Next occurrence after a substitution
+  NSString	*key;		// Text between markers or nil
+} WSTOccurrence;
+
+/* When streaming, the rendered output is sent to the client whenever
+ * the amount buffered reaches the threshold.  The response headers are
+ * only sent with the first chunk, so if the entire page is smaller than
+ * the threshold nothing is streamed and the caller may send the output
+ * as a normal response.
+ */
+typedef struct	{
+  WebServer		*server;
+  WebServerResponse	*response;
+  NSUInteger		threshold;
+  BOOL			started;	// Some data has been streamed
+  BOOL			dropped;	// The client has gone away
+} WSTStream;
+
+/* The cache of templates loaded from files is limited in the number of
+ * templates and in their total size.  When a new template would exceed
+ * a limit, the ones least recently checked are removed to make room.
+ */
+#define	WST_CACHE_COUNT	256
+#define	WST_CACHE_BYTES	(32 * 1024 * 1024)
+
+/* The nanosecond part of the modification time of a file, so that we
+ * see a change made within the same second as the one we loaded.
+ */
+#if	defined(__APPLE__)
+#define	MTIME_NSEC(sb)	((long)(sb).st_mtimespec.tv_nsec)
+#elif	defined(_WIN32)
+#define	MTIME_NSEC(sb)	0L
+#else
+#define	MTIME_NSEC(sb)	((long)(sb).st_mtim.tv_nsec)
+#endif
+
+static NSMutableDictionary	*cache = nil;
+static NSLock			*cacheLock = nil;
+static NSUInteger		cacheBytes = 0;
+
+/* Find the first occurrence of the literal (ASCII) marker in the bytes
+ * from pos onwards, returning NSNotFound if there is none.
+ */
+static NSUInteger
+findMarker(const uint8_t *bytes, NSUInteger length, NSUInteger pos,
+  const char *marker, NSUInteger markerLength)
+{
+  while (pos + markerLength <= length)
+    {
+      const uint8_t	*p;
+
+      p = memchr(bytes + pos, marker[0], length - pos - markerLength + 1);
+      if (0 == p)
+	{
+	  break;
+	}
+      pos = p - bytes;
+      if (0 == memcmp(p, marker, markerLength))
+	{
+	  return pos;
+	}
+      pos++;
+    }
+  return NSNotFound;
+}
+
+/* Append the UTF-8 representation of a string to the data.
+ */
+static inline void
+appendUTF8(NSMutableData *out, NSString *s)
+{
+  const char	*u = [s UTF8String];
+
+  [out appendBytes: u length: strlen(u)];
+}
+
+/* Send any buffered output to the client if there is enough of it
+ * (or if force is YES).  Returns NO if the client has gone away.
+ */
+static BOOL
+flush(NSMutableData *out, WSTStream *s, BOOL force)
+{
+  NSData	*d;
+
+  if (0 == s || [out length] == 0
+    || (NO == force && [out length] < s->threshold))
+    {
+      return YES;
+    }
+  if (NO == s->started)
+    {
+      [s->response setHeader: @"content-type"
+		       value: @"text/html"
+		  parameters: [NSDictionary dictionaryWithObject: @"utf-8"
+							  forKey: @"charset"]];
+      s->started = YES;
+    }
+  d = [out copy];
+  [out setLength: 0];
+  if (NO == [s->server streamData: d withResponse: s->response])
+    {
+      s->dropped = YES;
+    }
+  [d release];
+  return (s->dropped ? NO : YES);
+}
+
+/* Remove a template from the cache (which must be locked).
+ */
+static void
+cacheRemove(NSString *path)
+{
+  WebServerTemplate	*old = [cache objectForKey: path];
+
+  if (nil != old)
+    {
+      cacheBytes -= [old->_bytes length];
+      [cache removeObjectForKey: path];
+    }
+}
+
+/* Add a template to the cache (which must be locked), removing the least
+ * recently checked ones as needed to keep within the limits.
+ */
+static void
+cacheAdd(NSString *path, WebServerTemplate *t)
+{
+  NSUInteger	length = [t->_bytes length];
+
+  cacheRemove(path);
+  if (length > WST_CACHE_BYTES)
+    {
+      return;		// Too big to cache
+    }
+  while ([cache count] > 0 && ([cache count] >= WST_CACHE_COUNT
+    || cacheBytes + length > WST_CACHE_BYTES))
+    {
+      NSEnumerator		*e = [cache keyEnumerator];
+      NSString			*oldest = nil;
+      NSTimeInterval		when = 0.0;
+      NSString			*k;
+
+      while (nil != (k = [e nextObject]))
+	{
+	  WebServerTemplate	*o = [cache objectForKey: k];
+
+	  if (nil == oldest || o->_checked < when)
+	    {
+	      oldest = k;
+	      when = o->_checked;
+	    }
+	}
+      cacheRemove(oldest);
+    }
+  [cache setObject: t forKey: path];
+  cacheBytes += length;
+}
+
+@implementation	WebServerTemplate
+
++ (void) initialize
+{
+  if (nil == cache)
+    {
+      cache = [NSMutableDictionary new];
+      cacheLock = [NSLock new];
+    }
+}
+
++ (WebServerTemplate*) templateAtPath: (NSString*)path
+{
+  NSTimeInterval	now = [NSDate timeIntervalSinceReferenceDate];
+  WebServerTemplate	*t;
+  NSString		*str;
+  struct stat		sb;
+
+  [cacheLock lock];
+  t = [[cache objectForKey: path] retain];
+  [cacheLock unlock];
+
+  /* Don't check the file more than once a second.
+   */
+  if (nil != t && now - t->_checked < 1.0)
+    {
+      return [t autorelease];
+    }
+  if (0 != stat([path fileSystemRepresentation], &sb))
+    {
+      [t release];
+      [cacheLock lock];
+      cacheRemove(path);
+      [cacheLock unlock];
+      return nil;
+    }
+  if (nil != t && t->_modified == (NSTimeInterval)sb.st_mtime
+    && t->_modifiedNsec == MTIME_NSEC(sb)
+    && t->_size == (unsigned long long)sb.st_size
+    && t->_inode == (unsigned long long)sb.st_ino)
+    {
+      t->_checked = now;
+      return [t autorelease];
+    }
+  [t release];
+
+  /* Load the file as we have always done (so the encoding is determined
+   * in the same way) but compile it to UTF-8 for rendering.
+   */
+  str = [NSString stringWithContentsOfFile: path];
+  if (nil == str)
+    {
+      return nil;
+    }
+  t = [[self alloc] initWithString: str];
+  t->_modified = (NSTimeInterval)sb.st_mtime;
+  t->_modifiedNsec = MTIME_NSEC(sb);
+  t->_size = (unsigned long long)sb.st_size;
+  t->_inode = (unsigned long long)sb.st_ino;
+  t->_checked = now;
+  [cacheLock lock];
+  cacheAdd(path, t);
+  [cacheLock unlock];
+  return [t autorelease];
+}
+
+- (void) dealloc
+{
+  WSTOccurrence	*o = (WSTOccurrence*)_occurrences;
+
+  if (0 != o)
+    {
+      NSUInteger	i;
+
+      for (i = 0; i < _count; i++)
+	{
+	  [o[i].key release];
+	}
+      free(o);
+      _occurrences = 0;
+    }
+  DESTROY(_bytes);
+  [super dealloc];
+}
+
+- (id) initWithString: (NSString*)aString
+{
+  if (nil != (self = [super init]))
+    {
+      const uint8_t	*b;
+      WSTOccurrence	*o;
+      NSUInteger	length;
+      NSUInteger	capacity = 8;
+      NSUInteger	pos = 0;
+      NSUInteger	i;
+      NSUInteger	j;
+
+      _bytes = [[aString dataUsingEncoding: NSUTF8StringEncoding] retain];
+      b = (const uint8_t*)[_bytes bytes];
+      length = [_bytes length];
+      o = malloc(capacity * sizeof(WSTOccurrence));
+      while (NSNotFound != (pos = findMarker(b, length, pos, "<!--", 4)))
+	{
+	  NSUInteger	close;
+
+	  if (_count == capacity)
+	    {
+	      capacity *= 2;
+	      o = realloc(o, capacity * sizeof(WSTOccurrence));
+	    }
+	  o[_count].start = pos;
+	  close = findMarker(b, length, pos + 4, "-->", 3);
+	  if (NSNotFound == close)
+	    {
+	      o[_count].key = nil;
+	      o[_count].end = pos + 4;
+	    }
+	  else
+	    {
+	      o[_count].key = [[NSString alloc] initWithBytes: b + pos + 4
+		length: close - pos - 4
+		encoding: NSUTF8StringEncoding];
+	      o[_count].end = close + 3;
+	    }
+	  _count++;
+	  pos += 4;
+	}
+
+      /* Work out where to continue after each possible substitution.
+       * As the ends are in ascending order of start, so are the next
+       * indexes and we need only a single pass.
+       */
+      j = 0;
+      for (i = 0; i < _count; i++)
+	{
+	  while (j < _count && o[j].start < o[i].end)
+	    {
+	      j++;
+	    }
+	  o[i].next = j;
+	}
+      _occurrences = o;
+    }
+  return self;
+}
+
+- (NSUInteger) length
+{
+  return [_bytes length];
+}
+
+- (BOOL) _render: (NSDictionary*)map
+	    into: (NSMutableData*)out
+	   depth: (NSUInteger)depth
+	   limit: (NSUInteger)limit
+	  stream: (WSTStream*)s
+{
+  const uint8_t	*b = (const uint8_t*)[_bytes bytes];
+  NSUInteger	length = [_bytes length];
+  WSTOccurrence	*o = (WSTOccurrence*)_occurrences;
+  NSUInteger	pos = 0;
+  NSUInteger	i = 0;
+
+  if (depth > limit)
+    {
+      return NO;
+    }
+  while (i < _count)
+    {
+      WSTOccurrence	*occ = &o[i];
+      NSString		*value;
+
+      if (occ->start > pos)
+	{
+	  [out appendBytes: b + pos length: occ->start - pos];
+	}
+      pos = occ->start;
+      if (nil != occ->key && nil != (value = [map objectForKey: occ->key]))
+	{
+	  /* Unless the value substituted in is a comment,
+	   * perform recursive substitution.
+	   */
+	  if ([value hasPrefix: @"<!--"] == YES)
+	    {
+	      appendUTF8(out, value);
+	    }
+	  else if (depth + 1 > limit)
+	    {
+	      return NO;
+	    }
+	  else if ([value rangeOfString: @"<!--"].length == 0)
+	    {
+	      appendUTF8(out, value);	// Nothing to substitute
+	    }
+	  else
+	    {
+	      WebServerTemplate	*t;
+	      BOOL		ok;
+
+	      t = [[WebServerTemplate alloc] initWithString: value];
+	      ok = [t _render: map
+			 into: out
+			depth: depth + 1
+			limit: limit
+		       stream: s];
+	      [t release];
+	      if (NO == ok)
+		{
+		  return NO;
+		}
+	    }
+	  pos = occ->end;
+	  i = occ->next;
+	}
+      else
+	{
+	  [out appendBytes: "<!--" length: 4];
+	  pos += 4;
+	  i++;
+	}
+      if (NO == flush(out, s, NO))
+	{
+	  return NO;
+	}
+    }
+  if (pos < length)
+    {
+      [out appendBytes: b + pos length: length - pos];
+    }
+  return flush(out, s, NO);
+}
+
+- (BOOL) renderUsing: (NSDictionary*)map
+		into: (NSMutableData*)out
+	       depth: (NSUInteger)depth
+	       limit: (NSUInteger)limit
+{
+  return [self _render: map into: out depth: depth limit: limit stream: 0];
+}
+
+- (BOOL) streamUsing: (NSDictionary*)map
+		into: (NSMutableData*)out
+	       limit: (NSUInteger)limit
+	   threshold: (NSUInteger)threshold
+	      server: (WebServer*)server
+	    response: (WebServerResponse*)response
+	     started: (BOOL*)started
+{
+  WSTStream	s;
+  BOOL		ok;
+
+  s.server = server;
+  s.response = response;
+  s.threshold = threshold;
+  s.started = NO;
+  s.dropped = NO;
+  ok = [self _render: map into: out depth: 0 limit: limit stream: &s];
+  if (YES == ok && YES == s.started)
+    {
+      flush(out, &s, YES);
+    }
+  *started = s.started;
+  /* If the client went away we stopped rendering, but that's not a
+   * substitution failure.
+   */
+  return (YES == s.dropped) ? YES : ok;
+}
+
+@end
+
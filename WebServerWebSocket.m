@@ -0,0 +1,570 @@
+/**
+   Copyright (C) 2026 Free Software Foundation, Inc.
+
+   Written by:  agent <agent@local>
+   Date:	October 2026
+
+   This file is part of the WebServer Library.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111 USA.
+
+   $Date$ $Revision$
+   */
+#import	<Foundation/Foundation.h>
+
+#include <string.h>
+
+#define WEBSERVERINTERNAL       1
+
+#import	"WebServer.h"
+#import	"Internal.h"
+
+/* A WebSocket (RFC 6455) replaces the HTTP/1.1 request/response cycle on
+ * a connection once the delegate has accepted an upgrade request.  The
+ * session here just deals with the framing: it parses and unmasks the
+ * frames read from the client, reassembles fragmented messages, answers
+ * pings and handles the closing handshake.  The connection passes the
+ * complete messages to the delegate and writes the output.
+ */
+
+/* Opcodes.
+ */
+enum {
+  OpContinuation = 0,
+  OpText = 1,
+  OpBinary = 2,
+  OpClose = 8,
+  OpPing = 9,
+  OpPong = 10
+};
+
+/* Status codes for closing.
+ */
+enum {
+  CloseNormal = 1000,
+  CloseGoingAway = 1001,
+  CloseProtocol = 1002,
+  CloseUnsupported = 1003,
+  CloseNoStatus = 1005,
+  CloseAbnormal = 1006,
+  CloseInvalid = 1007,
+  ClosePolicy = 1008,
+  CloseTooBig = 1009
+};
+
+/* Appended to the key from the client to produce the accept value.
+ */
+static const char	guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+#define	ROL(x, n)	(((x) << (n)) | ((x) >> (32 - (n))))
+
+/* Processes a 64 byte block of data for SHA-1 (RFC 3174).  We only
+ * need the digest for the handshake, so this is the simplest version.
+ */
+static void
+sha1Block(uint32_t h[5], const uint8_t *b)
+{
+  uint32_t	w[80];
+  uint32_t	a = h[0];
+  uint32_t	c = h[2];
+  uint32_t	d = h[3];
+  uint32_t	e = h[4];
+  uint32_t	x = h[1];
+  int		i;
+
+  for (i = 0; i < 16; i++)
+    {
+      w[i] = ((uint32_t)b[i*4] << 24) | ((uint32_t)b[i*4+1] << 16)
+	| ((uint32_t)b[i*4+2] << 8) | b[i*4+3];
+    }
+  for (; i < 80; i++)
+    {
+      uint32_t	t = w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16];
+
+      w[i] = ROL(t, 1);
+    }
+  for (i = 0; i < 80; i++)
+    {
+      uint32_t	f;
+      uint32_t	k;
+      uint32_t	t;
+
+      if (i < 20)
+	{
+	  f = (x & c) | (~x & d);
+	  k = 0x5A827999;
+	}
+      else if (i < 40)
+	{
+	  f = x ^ c ^ d;
+	  k = 0x6ED9EBA1;
+	}
+      else if (i < 60)
+	{
+	  f = (x & c) | (x & d) | (c & d);
+	  k = 0x8F1BBCDC;
+	}
+      else
+	{
+	  f = x ^ c ^ d;
+	  k = 0xCA62C1D6;
+	}
+      t = ROL(a, 5) + f + e + k + w[i];
+      e = d;
+      d = c;
+      c = ROL(x, 30);
+      x = a;
+      a = t;
+    }
+  h[0] += a;
+  h[1] += x;
+  h[2] += c;
+  h[3] += d;
+  h[4] += e;
+}
+
+/* Puts the SHA-1 digest of the data into the 20 byte buffer.
+ */
+static void
+sha1(const uint8_t *data, NSUInteger length, uint8_t digest[20])
+{
+  uint32_t		h[5] = {
+    0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0
+  };
+  uint8_t		b[128];
+  unsigned long long	bits = (unsigned long long)length * 8;
+  NSUInteger		pos = 0;
+  NSUInteger		rest;
+  NSUInteger		end;
+  int			i;
+
+  while (length - pos >= 64)
+    {
+      sha1Block(h, data + pos);
+      pos += 64;
+    }
+
+  /* Pad the last block(s) with a one bit, zeros and the bit count.
+   */
+  rest = length - pos;
+  memcpy(b, data + pos, rest);
+  b[rest] = 0x80;
+  end = (rest < 56) ? 64 : 128;
+  memset(b + rest + 1, 0, end - rest - 1);
+  for (i = 0; i < 8; i++)
+    {
+      b[end - 1 - i] = (uint8_t)(bits >> (i * 8));
+    }
+  sha1Block(h, b);
+  if (128 == end)
+    {
+      sha1Block(h, b + 64);
+    }
+  for (i = 0; i < 5; i++)
+    {
+      digest[i*4] = (uint8_t)(h[i] >> 24);
+      digest[i*4+1] = (uint8_t)(h[i] >> 16);
+      digest[i*4+2] = (uint8_t)(h[i] >> 8);
+      digest[i*4+3] = (uint8_t)h[i];
+    }
+}
+
+NSString *
+WebServerWebSocketAccept(NSString *key)
+{
+  NSMutableData	*m;
+  NSData	*d;
+  uint8_t	digest[20];
+
+  m = [NSMutableData dataWithData:
+    [key dataUsingEncoding: NSASCIIStringEncoding]];
+  [m appendBytes: guid length: sizeof(guid) - 1];
+  sha1((const uint8_t*)[m bytes], [m length], digest);
+  d = [GSMimeDocument encodeBase64:
+    [NSData dataWithBytes: digest length: sizeof(digest)]];
+  return AUTORELEASE([[NSString alloc] initWithData: d
+					   encoding: NSASCIIStringEncoding]);
+}
+
+/* Appends a frame to out.  Frames from the server are never masked.
+ */
+static void
+putFrame(NSMutableData *out, uint8_t opcode, const void *payload,
+  NSUInteger length)
+{
+  uint8_t	h[10];
+  NSUInteger	l;
+
+  h[0] = 0x80 | opcode;		// No fragmentation
+  if (length < 126)
+    {
+      h[1] = (uint8_t)length;
+      l = 2;
+    }
+  else if (length <= 0xffff)
+    {
+      h[1] = 126;
+      h[2] = (uint8_t)(length >> 8);
+      h[3] = (uint8_t)length;
+      l = 4;
+    }
+  else
+    {
+      unsigned long long	v = length;
+      int			i;
+
+      h[1] = 127;
+      for (i = 0; i < 8; i++)
+	{
+	  h[9 - i] = (uint8_t)(v >> (i * 8));
+	}
+      l = 10;
+    }
+  [out appendBytes: h length: l];
+  if (length > 0)
+    {
+      [out appendBytes: payload length: length];
+    }
+}
+
+NSData *
+WebServerWebSocketFrame(id message)
+{
+  NSMutableData	*out;
+  NSData	*d;
+  uint8_t	opcode;
+
+  if ([message isKindOfClass: [NSString class]])
+    {
+      d = [message dataUsingEncoding: NSUTF8StringEncoding];
+      opcode = OpText;
+    }
+  else if ([message isKindOfClass: [NSData class]])
+    {
+      d = message;
+      opcode = OpBinary;
+    }
+  else
+    {
+      return nil;
+    }
+  out = [NSMutableData dataWithCapacity: [d length] + 10];
+  putFrame(out, opcode, [d bytes], [d length]);
+  return out;
+}
+
+
+@interface	WebServerWebSocket (Private)
+- (void) _close: (uint16_t)code;
+- (void) _fail: (uint16_t)code;
+- (void) _frame: (uint8_t)opcode
+	    fin: (BOOL)fin
+	payload: (const uint8_t*)payload
+	 length: (NSUInteger)length
+	   into: (NSMutableArray*)messages;
+@end
+
+@implementation	WebServerWebSocket
+
+- (void) close
+{
+  [self _close: CloseNormal];
+}
+
+- (void) dealloc
+{
+  DESTROY(input);
+  DESTROY(output);
+  DESTROY(message);
+  [super dealloc];
+}
+
+- (BOOL) finished
+{
+  return finished;
+}
+
+- (id) initWithLimit: (NSUInteger)max
+{
+  if (nil != (self = [super init]))
+    {
+      input = [NSMutableData new];
+      output = [NSMutableData new];
+      limit = max;
+    }
+  return self;
+}
+
+- (BOOL) open
+{
+  return open;
+}
+
+- (NSData*) output
+{
+  NSData	*d;
+
+  if (NO == open || 0 == [output length])
+    {
+      return nil;
+    }
+  d = output;
+  output = [NSMutableData new];
+  return AUTORELEASE(d);
+}
+
+- (BOOL) ping
+{
+  if (YES == pinged || YES == closing)
+    {
+      return NO;
+    }
+  pinged = YES;
+  putFrame(output, OpPing, 0, 0);
+  return YES;
+}
+
+- (NSArray*) read: (NSData*)d
+{
+  NSMutableArray	*messages = nil;
+  const uint8_t		*b;
+  NSUInteger		length;
+  NSUInteger		pos = 0;
+
+  if (YES == finished)
+    {
+      return nil;
+    }
+  pinged = NO;
+  [input appendData: d];
+  b = (const uint8_t*)[input bytes];
+  length = [input length];
+  while (NO == finished && length - pos >= 2)
+    {
+      const uint8_t		*f = b + pos;
+      uint8_t			opcode = f[0] & 0x0f;
+      BOOL			fin = (f[0] & 0x80) ? YES : NO;
+      unsigned long long	size = f[1] & 0x7f;
+      NSUInteger		header = 2;
+      uint8_t			*p;
+      NSUInteger		i;
+
+      if ((f[0] & 0x70) != 0 || (f[1] & 0x80) == 0)
+	{
+	  /* No extensions are negotiated, and the client must mask.
+	   */
+	  [self _fail: CloseProtocol];
+	  break;
+	}
+      if (126 == size)
+	{
+	  if (length - pos < 4)
+	    {
+	      break;	// Need more data
+	    }
+	  size = ((unsigned long long)f[2] << 8) | f[3];
+	  header = 4;
+	}
+      else if (127 == size)
+	{
+	  if (length - pos < 10)
+	    {
+	      break;	// Need more data
+	    }
+	  size = 0;
+	  for (i = 2; i < 10; i++)
+	    {
+	      size = (size << 8) | f[i];
+	    }
+	  header = 10;
+	}
+      if ((opcode & 0x08) && (NO == fin || size > 125))
+	{
+	  [self _fail: CloseProtocol];	// Control frames are small
+	  break;
+	}
+      if (size > limit
+	|| (0 == (opcode & 0x08) && [message length] + size > limit))
+	{
+	  [self _fail: CloseTooBig];
+	  break;
+	}
+      if (length - pos - header < 4 + size)
+	{
+	  break;	// Need more data
+	}
+
+      /* Unmask the payload in place (we have finished with the mask
+       * once it has been applied).
+       */
+      p = (uint8_t*)[input mutableBytes] + pos + header + 4;
+      for (i = 0; i < size; i++)
+	{
+	  p[i] ^= b[pos + header + (i & 3)];
+	}
+      pos += header + 4 + size;
+      if (nil == messages)
+	{
+	  messages = [NSMutableArray array];
+	}
+      [self _frame: opcode
+	       fin: fin
+	   payload: p
+	    length: (NSUInteger)size
+	      into: messages];
+    }
+  [input replaceBytesInRange: NSMakeRange(0, pos) withBytes: 0 length: 0];
+  return messages;
+}
+
+- (void) send: (NSData*)frame
+{
+  if (NO == closing)
+    {
+      [output appendData: frame];
+    }
+}
+
+- (void) setOpen
+{
+  open = YES;
+}
+
+@end
+
+@implementation	WebServerWebSocket (Private)
+
+/* Starts the closing handshake (unless it has already started).
+ */
+- (void) _close: (uint16_t)code
+{
+  if (NO == closing)
+    {
+      uint8_t	b[2];
+
+      b[0] = (uint8_t)(code >> 8);
+      b[1] = (uint8_t)code;
+      putFrame(output, OpClose, b, 2);
+      closing = YES;
+    }
+}
+
+/* Closes because the client broke the protocol.  We don't wait for the
+ * client to reply, and nothing more is read.
+ */
+- (void) _fail: (uint16_t)code
+{
+  [self _close: code];
+  finished = YES;
+}
+
+- (void) _frame: (uint8_t)opcode
+	    fin: (BOOL)fin
+	payload: (const uint8_t*)payload
+	 length: (NSUInteger)length
+	   into: (NSMutableArray*)messages
+{
+  switch (opcode)
+    {
+      case OpContinuation:
+	if (nil == message)
+	  {
+	    [self _fail: CloseProtocol];
+	    return;
+	  }
+	[message appendBytes: payload length: length];
+	break;
+
+      case OpText:
+      case OpBinary:
+	if (nil != message)
+	  {
+	    [self _fail: CloseProtocol];	// Interleaved messages
+	    return;
+	  }
+	message = [[NSMutableData alloc] initWithBytes: payload length: length];
+	type = opcode;
+	break;
+
+      case OpClose:
+	{
+	  uint16_t	code = CloseNormal;
+
+	  if (1 == length)
+	    {
+	      [self _fail: CloseProtocol];
+	      return;
+	    }
+	  if (length >= 2)
+	    {
+	      code = ((uint16_t)payload[0] << 8) | payload[1];
+	      if (code < 1000 || 1004 == code || CloseNoStatus == code
+		|| CloseAbnormal == code || (code > 1011 && code < 3000)
+		|| code > 4999)
+		{
+		  code = CloseProtocol;
+		}
+	    }
+	  /* Echo the status (if we have not already sent a close) and
+	   * end the connection once that's written.
+	   */
+	  [self _close: code];
+	  finished = YES;
+	}
+	return;
+
+      case OpPing:
+	if (NO == closing)
+	  {
+	    putFrame(output, OpPong, payload, length);
+	  }
+	return;
+
+      case OpPong:
+	return;		// Just shows the client is alive
+
+      default:
+	[self _fail: CloseProtocol];
+	return;
+    }
+
+  if (YES == fin)
+    {
+      id	m;
+
+      if (OpText == type)
+	{
+	  m = [[NSString alloc] initWithData: message
+				    encoding: NSUTF8StringEncoding];
+	  if (nil == m)
+	    {
+	      [self _fail: CloseInvalid];
+	      return;
+	    }
+	}
+      else
+	{
+	  m = [message copy];
+	}
+      DESTROY(message);
+      if (NO == closing)
+	{
+	  [messages addObject: m];
+	}
+      [m release];
+    }
+}
+
+@end